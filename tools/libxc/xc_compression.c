@@ -0,0 +1,403 @@
+/******************************************************************************
+ * xc_compression.c
+ *
+ * Page compression for the save/restore stream.
+ *
+ * Each page goes out with a one byte tag saying how it was encoded: raw,
+ * run-length encoded, or as a run-length encoded XOR against the copy of
+ * the page we sent last time.  Guest memory is full of zeroes, and pages
+ * which are dirtied again during live migration rarely change much, so
+ * both encodings mostly come down to skipping runs of zero bytes.
+ *
+ * The run-length encoding is a sequence of (uint16_t zeroes, uint16_t
+ * literals, literal bytes) until the page is covered.
+ *
+ * The receiver applies deltas to the page already in guest memory, so the
+ * sender only keeps copies of pages it sends verbatim: not page tables,
+ * which are rewritten on both sides.  To keep memory bounded, copies are
+ * kept for the pages sent most recently, and only once a page has been
+ * sent twice (in the first pass everything goes through once).
+ *
+ * Pages which are all zeroes never get here: they are flagged in the
+ * batch's zero map instead (XC_SAVE_ID_ZERO_PAGES).
+ *
+ * Pages may be compressed from several threads at once; the cache is
+ * protected by a lock, the encoding itself runs outside it.
+ */
+
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xg_private.h"
+#include "xg_save_restore.h"
+
+#define TAG_RAW    0
+#define TAG_RLE    1
+#define TAG_DELTA  2
+
+/* Don't end a literal for fewer zeroes than a run header costs. */
+#define MIN_ZERO_RUN 4
+
+#define NOT_SENT    -1
+#define NOT_CACHED  -2
+#define INVALID_PFN (~0UL)
+
+struct xc_compression_ctx {
+    pthread_mutex_t lock;
+    unsigned long p2m_size;
+
+    /* Cache of copies of pages: pfn -> slot (or NOT_SENT / NOT_CACHED),
+     * and slot -> pfn (or INVALID_PFN). */
+    int *slot_of_pfn;
+    unsigned long *pfn_of_slot;
+    char *referenced;
+    char *copies;
+    unsigned int nr_slots, nr_used, hand;
+
+    /* Statistics. */
+    unsigned long nr_raw, nr_rle, nr_delta;
+    unsigned long long bytes_out;
+};
+
+struct xc_compression_ctx *xc_compression_create(unsigned long p2m_size,
+                                                 unsigned long cache_pages)
+{
+    struct xc_compression_ctx *ctx;
+    unsigned long i;
+
+    if ( cache_pages > p2m_size )
+        cache_pages = p2m_size;
+
+    if ( (ctx = calloc(1, sizeof(*ctx))) == NULL )
+        return NULL;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->p2m_size = p2m_size;
+    ctx->nr_slots = cache_pages;
+    ctx->slot_of_pfn = malloc(p2m_size * sizeof(*ctx->slot_of_pfn));
+    ctx->pfn_of_slot = malloc(cache_pages * sizeof(*ctx->pfn_of_slot));
+    ctx->referenced = calloc(cache_pages, 1);
+    ctx->copies = malloc(cache_pages * PAGE_SIZE);
+    if ( !ctx->slot_of_pfn || !ctx->pfn_of_slot ||
+         !ctx->referenced || (cache_pages && !ctx->copies) )
+    {
+        xc_compression_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for ( i = 0; i < p2m_size; i++ )
+        ctx->slot_of_pfn[i] = NOT_SENT;
+
+    return ctx;
+}
+
+void xc_compression_free(struct xc_compression_ctx *ctx)
+{
+    if ( !ctx )
+        return;
+
+    free(ctx->slot_of_pfn);
+    free(ctx->pfn_of_slot);
+    free(ctx->referenced);
+    free(ctx->copies);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+static inline void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static inline unsigned int get16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline int zero_run_starts(const unsigned char *p, unsigned int left)
+{
+    uint32_t w;
+
+    if ( left < MIN_ZERO_RUN )
+        return 0;
+    memcpy(&w, p, sizeof(w));
+    return w == 0;
+}
+
+/* Returns the encoded length, or -1 if it would exceed limit. */
+static int rle_encode(const unsigned char *src, unsigned char *out,
+                      unsigned int limit)
+{
+    unsigned int i = 0, o = 0, zeroes, lits;
+
+    while ( i < PAGE_SIZE )
+    {
+        zeroes = 0;
+        while ( !((i + zeroes) & (sizeof(long) - 1)) &&
+                (i + zeroes + sizeof(long) <= PAGE_SIZE) &&
+                !*(const unsigned long *)(src + i + zeroes) )
+            zeroes += sizeof(long);
+        while ( (i + zeroes < PAGE_SIZE) && !src[i + zeroes] )
+            zeroes++;
+        i += zeroes;
+
+        lits = 0;
+        while ( (i + lits < PAGE_SIZE) &&
+                !zero_run_starts(src + i + lits, PAGE_SIZE - i - lits) )
+            lits++;
+
+        if ( o + 4 + lits > limit )
+            return -1;
+
+        put16(out + o, zeroes);
+        put16(out + o + 2, lits);
+        memcpy(out + o + 4, src + i, lits);
+        o += 4 + lits;
+        i += lits;
+    }
+
+    return o;
+}
+
+static int rle_decode(const unsigned char *in, unsigned long len,
+                      unsigned char *dst)
+{
+    unsigned int i = 0, o = 0, zeroes, lits;
+
+    while ( o < PAGE_SIZE )
+    {
+        if ( i + 4 > len )
+            return -1;
+
+        zeroes = get16(in + i);
+        lits = get16(in + i + 2);
+        i += 4;
+
+        if ( (o + zeroes + lits > PAGE_SIZE) || (i + lits > len) )
+            return -1;
+
+        memset(dst + o, 0, zeroes);
+        o += zeroes;
+        memcpy(dst + o, in + i, lits);
+        o += lits;
+        i += lits;
+    }
+
+    return i;
+}
+
+static void xor_page(unsigned long *dst, const unsigned long *a,
+                     const unsigned long *b)
+{
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(long); i++ )
+        dst[i] = a[i] ^ b[i];
+}
+
+static char *slot_page(struct xc_compression_ctx *ctx, int slot)
+{
+    return ctx->copies + (unsigned long)slot * PAGE_SIZE;
+}
+
+/* Find a slot for pfn, evicting the least recently used copy (by clock). */
+static int cache_insert(struct xc_compression_ctx *ctx, unsigned long pfn)
+{
+    int slot;
+
+    if ( ctx->nr_slots == 0 )
+        return -1;
+
+    if ( ctx->nr_used < ctx->nr_slots )
+        slot = ctx->nr_used++;
+    else
+    {
+        while ( ctx->referenced[ctx->hand] )
+        {
+            ctx->referenced[ctx->hand] = 0;
+            ctx->hand = (ctx->hand + 1) % ctx->nr_slots;
+        }
+        slot = ctx->hand;
+        ctx->hand = (ctx->hand + 1) % ctx->nr_slots;
+        if ( ctx->pfn_of_slot[slot] != INVALID_PFN )
+            ctx->slot_of_pfn[ctx->pfn_of_slot[slot]] = NOT_CACHED;
+    }
+
+    ctx->slot_of_pfn[pfn] = slot;
+    ctx->pfn_of_slot[slot] = pfn;
+    ctx->referenced[slot] = 1;
+    return slot;
+}
+
+int xc_compress_page(struct xc_compression_ctx *ctx, unsigned long pfn,
+                     int cacheable, const void *page, char *out)
+{
+    unsigned long copy[PAGE_SIZE / sizeof(long)];
+    unsigned long delta[PAGE_SIZE / sizeof(long)];
+    unsigned char *uout = (unsigned char *)out;
+    int slot, len, have_delta = 0;
+
+    /* The guest may be scribbling on it: work from one snapshot. */
+    memcpy(copy, page, PAGE_SIZE);
+
+    pthread_mutex_lock(&ctx->lock);
+    if ( pfn < ctx->p2m_size )
+    {
+        slot = ctx->slot_of_pfn[pfn];
+
+        if ( !cacheable )
+        {
+            /* The receiver rewrites it, so a delta would be wrong. */
+            if ( slot >= 0 )
+            {
+                ctx->pfn_of_slot[slot] = INVALID_PFN;
+                ctx->referenced[slot] = 0;
+            }
+            ctx->slot_of_pfn[pfn] = NOT_CACHED;
+        }
+        else if ( slot >= 0 )
+        {
+            xor_page(delta, copy, (unsigned long *)slot_page(ctx, slot));
+            memcpy(slot_page(ctx, slot), copy, PAGE_SIZE);
+            ctx->referenced[slot] = 1;
+            have_delta = 1;
+        }
+        else if ( slot == NOT_CACHED )
+        {
+            if ( (slot = cache_insert(ctx, pfn)) >= 0 )
+                memcpy(slot_page(ctx, slot), copy, PAGE_SIZE);
+        }
+        else
+            ctx->slot_of_pfn[pfn] = NOT_CACHED;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if ( have_delta &&
+         (len = rle_encode((unsigned char *)delta, uout + 1,
+                           PAGE_SIZE - 1)) >= 0 )
+        uout[0] = TAG_DELTA;
+    else if ( (len = rle_encode((unsigned char *)copy, uout + 1,
+                                PAGE_SIZE - 1)) >= 0 )
+        uout[0] = TAG_RLE;
+    else
+    {
+        uout[0] = TAG_RAW;
+        memcpy(uout + 1, copy, PAGE_SIZE);
+        len = PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if ( uout[0] == TAG_DELTA )
+        ctx->nr_delta++;
+    else if ( uout[0] == TAG_RLE )
+        ctx->nr_rle++;
+    else
+        ctx->nr_raw++;
+    ctx->bytes_out += len + 1;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return len + 1;
+}
+
+void xc_compress_zero_page(struct xc_compression_ctx *ctx, unsigned long pfn)
+{
+    int slot;
+
+    if ( pfn >= ctx->p2m_size )
+        return;
+
+    pthread_mutex_lock(&ctx->lock);
+    slot = ctx->slot_of_pfn[pfn];
+    if ( slot >= 0 )
+        memset(slot_page(ctx, slot), 0, PAGE_SIZE);
+    else
+        ctx->slot_of_pfn[pfn] = NOT_CACHED;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void xc_compression_report(struct xc_compression_ctx *ctx)
+{
+    unsigned long pages = ctx->nr_raw + ctx->nr_rle + ctx->nr_delta;
+
+    if ( !pages )
+        return;
+
+    DPRINTF("Compression: %lu pages (%lu raw, %lu rle, %lu delta) "
+            "sent in %llu bytes, ratio %.2f\n",
+            pages, ctx->nr_raw, ctx->nr_rle, ctx->nr_delta, ctx->bytes_out,
+            (double)pages * PAGE_SIZE / ctx->bytes_out);
+}
+
+int xc_uncompress_page(const char *in, unsigned long len, void *page,
+                       int *delta)
+{
+    const unsigned char *uin = (const unsigned char *)in;
+    int rc;
+
+    if ( len < 1 )
+        return -1;
+
+    *delta = 0;
+
+    switch ( uin[0] )
+    {
+    case TAG_RAW:
+        if ( len < PAGE_SIZE + 1 )
+            return -1;
+        memcpy(page, uin + 1, PAGE_SIZE);
+        return PAGE_SIZE + 1;
+
+    case TAG_DELTA:
+        *delta = 1;
+        /* fall through */
+    case TAG_RLE:
+        rc = rle_decode(uin + 1, len - 1, page);
+        return (rc < 0) ? -1 : rc + 1;
+    }
+
+    return -1;
+}
+
+int xc_page_is_zero(const void *page)
+{
+#ifdef __SSE2__
+    const __m128i *p = page;
+    __m128i v;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+    {
+        v = _mm_or_si128(_mm_or_si128(_mm_or_si128(p[i], p[i + 1]),
+                                      _mm_or_si128(p[i + 2], p[i + 3])),
+                         _mm_or_si128(_mm_or_si128(p[i + 4], p[i + 5]),
+                                      _mm_or_si128(p[i + 6], p[i + 7])));
+        if ( _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) !=
+             0xffff )
+            return 0;
+    }
+#else
+    const unsigned long *p = page;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return 0;
+#endif
+
+    return 1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -398,6 +398,34 @@ int xc_shadow_control(int xc_handle,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_shadow_control_range(int xc_handle,
+                            uint32_t domid,
+                            unsigned int sop,
+                            unsigned long start_pfn,
+                            unsigned long *dirty_bitmap,
+                            unsigned long pages,
+                            xc_shadow_op_stats_t *stats)
+{
+    int rc;
+    DECLARE_DOMCTL;
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = (domid_t)domid;
+    domctl.u.shadow_op.op        = sop;
+    domctl.u.shadow_op.mode      = 0;
+    domctl.u.shadow_op.start_pfn = start_pfn;
+    domctl.u.shadow_op.pages     = pages;
+    set_xen_guest_handle(domctl.u.shadow_op.dirty_bitmap,
+                         (uint8_t *)dirty_bitmap);
+
+    rc = do_domctl(xc_handle, &domctl);
+
+    if ( stats )
+        memcpy(stats, &domctl.u.shadow_op.stats,
+               sizeof(xc_shadow_op_stats_t));
+
+    return (rc == 0) ? domctl.u.shadow_op.pages : rc;
+}
+
 int xc_domain_setmaxmem(int xc_handle,
                         uint32_t domid,
                         unsigned int max_memkb)
@@ -976,6 +976,11 @@ static void tailbuf_free(tailbuf_t *buf)
         tailbuf_free_pv(&buf->u.pv);
 }
 
+/* How a page in the buffer is applied to the guest's copy. */
+#define PAGE_DATA  0   /* copied in */
+#define PAGE_DELTA 1   /* XORed on (compressed batches) */
+#define PAGE_ZERO  2   /* not sent: the page is cleared */
+
 typedef struct {
     void* pages;
     /* pages is of length nr_physpages, pfn_types is of length nr_pages */
@@ -984,8 +989,20 @@ typedef struct {
     /* Types of the pfns in the current region */
     unsigned long* pfn_types;
 
+    /* How each of pages is to be applied */
+    char* kinds;
+
     int verify;
 
+    /* Is the next batch compressed?  And totals for those that were. */
+    int compressed;
+    unsigned long compressed_pages;
+    unsigned long long compressed_bytes;
+
+    /* Does the next batch have a zero map?  And how many were zero. */
+    int zeroes;
+    unsigned long zero_pages;
+
     int new_ctxt_format;
     int max_vcpu_id;
     uint64_t vcpumap;
@@ -1009,11 +1026,97 @@ static void pagebuf_free(pagebuf_t* buf)
         free(buf->pfn_types);
         buf->pfn_types = NULL;
     }
+    if (buf->kinds) {
+        free(buf->kinds);
+        buf->kinds = NULL;
+    }
+}
+
+/* Read a compressed batch's pages into buf->pages from index first on. */
+static int pagebuf_get_compressed(pagebuf_t* buf, int fd, unsigned int first,
+                                  unsigned int count)
+{
+    uint32_t len;
+    unsigned long off = 0;
+    unsigned int i;
+    char* cbuf;
+    int rc;
+
+    if ( read_exact(fd, &len, sizeof(len)) ||
+         len > count * XC_COMPRESS_MAX_PAGE )
+    {
+        ERROR("Error when reading compressed batch size");
+        return -1;
+    }
+
+    if ( !(cbuf = malloc(len ? len : 1)) )
+    {
+        ERROR("Could not allocate compressed page buffer");
+        return -1;
+    }
+    if ( read_exact(fd, cbuf, len) )
+    {
+        ERROR("Error when reading compressed pages");
+        free(cbuf);
+        return -1;
+    }
+
+    for ( i = first; i < first + count; i++ )
+    {
+        int delta;
+
+        if ( buf->kinds[i] == PAGE_ZERO )
+            continue;
+
+        rc = xc_uncompress_page(cbuf + off, len - off,
+                                (char *)buf->pages + i * PAGE_SIZE, &delta);
+        if ( rc < 0 )
+        {
+            ERROR("Corrupt compressed page");
+            free(cbuf);
+            return -1;
+        }
+        buf->kinds[i] = delta ? PAGE_DELTA : PAGE_DATA;
+        buf->compressed_pages++;
+        off += rc;
+    }
+    free(cbuf);
+
+    buf->compressed_bytes += len;
+    return 0;
+}
+
+/* Read the pages of an uncompressed batch, leaving out the zero pages. */
+static int pagebuf_get_pages(pagebuf_t* buf, int fd, unsigned int first,
+                             unsigned int count)
+{
+    unsigned int i, run;
+
+    for ( i = first; i < first + count; i += run )
+    {
+        if ( buf->kinds[i] == PAGE_ZERO )
+        {
+            run = 1;
+            continue;
+        }
+
+        for ( run = 1; (i + run < first + count) &&
+                  (buf->kinds[i + run] != PAGE_ZERO); run++ )
+            ;
+        if ( read_exact(fd, buf->pages + i * PAGE_SIZE, run * PAGE_SIZE) )
+        {
+            ERROR("Error when reading pages");
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
 static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
 {
-    int count, countpages, oldcount, i;
+    int count, countpages, oldcount, i, j;
+    uint8_t zero_map[XC_ZERO_MAP_SIZE(MAX_BATCH_SIZE)];
     void* ptmp;
 
     if ( read_exact(fd, &count, sizeof(count)) )
@@ -1027,11 +1130,17 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
     if (!count) {
         // DPRINTF("Last batch read\n");
         return 0;
-    } else if (count == -1) {
+    } else if (count == XC_SAVE_ID_COMPRESSED_BATCH) {
+        buf->compressed = 1;
+        return pagebuf_get_one(buf, fd, xch, dom);
+    } else if (count == XC_SAVE_ID_ZERO_PAGES) {
+        buf->zeroes = 1;
+        return pagebuf_get_one(buf, fd, xch, dom);
+    } else if (count == XC_SAVE_ID_ENABLE_VERIFY_MODE) {
         DPRINTF("Entering page verify mode\n");
         buf->verify = 1;
         return pagebuf_get_one(buf, fd, xch, dom);
-    } else if (count == -2) {
+    } else if (count == XC_SAVE_ID_VCPU_INFO) {
         buf->new_ctxt_format = 1;
         if ( read_exact(fd, &buf->max_vcpu_id, sizeof(buf->max_vcpu_id)) ||
              buf->max_vcpu_id >= 64 || read_exact(fd, &buf->vcpumap,
@@ -1041,7 +1150,7 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
         }
         // DPRINTF("Max VCPU ID: %d, vcpumap: %llx\n", buf->max_vcpu_id, buf->vcpumap);
         return pagebuf_get_one(buf, fd, xch, dom);
-    } else if (count == -3) {
+    } else if (count == XC_SAVE_ID_HVM_IDENT_PT) {
         /* Skip padding 4 bytes then read the EPT identity PT location. */
         if ( read_exact(fd, &buf->identpt, sizeof(uint32_t)) ||
              read_exact(fd, &buf->identpt, sizeof(uint64_t)) )
@@ -1051,7 +1160,7 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
         }
         // DPRINTF("EPT identity map address: %llx\n", buf->identpt);
         return pagebuf_get_one(buf, fd, xch, dom);
-    } else if ( count == -4 )  {
+    } else if ( count == XC_SAVE_ID_HVM_VM86_TSS )  {
         /* Skip padding 4 bytes then read the vm86 TSS location. */
         if ( read_exact(fd, &buf->vm86_tss, sizeof(uint32_t)) ||
              read_exact(fd, &buf->vm86_tss, sizeof(uint64_t)) )
@@ -1061,7 +1170,7 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
         }
         // DPRINTF("VM86 TSS location: %llx\n", buf->vm86_tss);
         return pagebuf_get_one(buf, fd, xch, dom);
-    } else if ( count == -5 ) {
+    } else if ( count == XC_SAVE_ID_TMEM ) {
         DPRINTF("xc_domain_restore start tmem\n");
         if ( xc_tmem_restore(xch, dom, fd) ) {
             ERROR("error reading/restoring tmem");
@@ -1069,13 +1178,13 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
         }
         return pagebuf_get_one(buf, fd, xch, dom);
     }
-    else if ( count == -6 ) {
+    else if ( count == XC_SAVE_ID_TMEM_EXTRA ) {
         if ( xc_tmem_restore_extra(xch, dom, fd) ) {
             ERROR("error reading/restoring tmem extra");
             return -1;
         }
         return pagebuf_get_one(buf, fd, xch, dom);
-    } else if ( count == -7 ) {
+    } else if ( count == XC_SAVE_ID_TSC_INFO ) {
         uint32_t tsc_mode, khz, incarn;
         uint64_t nsec;
         if ( read_exact(fd, &tsc_mode, sizeof(uint32_t)) ||
@@ -1111,13 +1220,26 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
         return -1;
     }
 
+    if (buf->zeroes) {
+        buf->zeroes = 0;
+        if ( read_exact(fd, zero_map, XC_ZERO_MAP_SIZE(count)) ) {
+            ERROR("Error when reading zero page map");
+            return -1;
+        }
+    } else
+        memset(zero_map, 0, XC_ZERO_MAP_SIZE(count));
+
     countpages = count;
     for (i = oldcount; i < buf->nr_pages; ++i)
         if ((buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) == XEN_DOMCTL_PFINFO_XTAB)
             --countpages;
 
-    if (!countpages)
+    if (!countpages) {
+        if (buf->compressed && pagebuf_get_compressed(buf, fd, 0, 0))
+            return -1;
+        buf->compressed = 0;
         return count;
+    }
 
     oldcount = buf->nr_physpages;
     buf->nr_physpages += countpages;
@@ -1133,10 +1255,32 @@ static int pagebuf_get_one(pagebuf_t* buf, int fd, int xch, uint32_t dom)
         }
         buf->pages = ptmp;
     }
-    if ( read_exact(fd, buf->pages + oldcount * PAGE_SIZE, countpages * PAGE_SIZE) ) {
-        ERROR("Error when reading pages");
+    if (!(ptmp = realloc(buf->kinds, buf->nr_physpages))) {
+        ERROR("Could not reallocate page kinds");
         return -1;
     }
+    buf->kinds = ptmp;
+
+    for (i = 0, j = oldcount; i < count; ++i) {
+        if ((buf->pfn_types[buf->nr_pages - count + i] &
+             XEN_DOMCTL_PFINFO_LTAB_MASK) == XEN_DOMCTL_PFINFO_XTAB)
+            continue;
+        if (zero_map[i / 8] & (1 << (i % 8))) {
+            buf->kinds[j++] = PAGE_ZERO;
+            buf->zero_pages++;
+        } else
+            buf->kinds[j++] = PAGE_DATA;
+    }
+
+    if (buf->compressed) {
+        buf->compressed = 0;
+        if (pagebuf_get_compressed(buf, fd, oldcount, countpages))
+            return -1;
+        return count;
+    }
+
+    if (pagebuf_get_pages(buf, fd, oldcount, countpages))
+        return -1;
 
     return count;
 }
@@ -1229,7 +1373,22 @@ static int apply_batch(int xc_handle, uint32_t dom, struct restore_ctx *ctx,
         /* In verify mode, we use a copy; otherwise we work in place */
         page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
-        memcpy(page, pagebuf->pages + (curpage + curbatch) * PAGE_SIZE, PAGE_SIZE);
+        if ( pagebuf->kinds[curpage + curbatch] == PAGE_ZERO )
+            memset(page, 0, PAGE_SIZE);
+        else if ( pagebuf->kinds[curpage + curbatch] == PAGE_DELTA )
+        {
+            /* Apply the changes to what we were sent last time */
+            unsigned long *d = (unsigned long *)
+                ((char *)pagebuf->pages + (curpage + curbatch) * PAGE_SIZE);
+            int k;
+
+            if ( page != (void *)(region_base + i*PAGE_SIZE) )
+                memcpy(page, region_base + i*PAGE_SIZE, PAGE_SIZE);
+            for ( k = 0; k < PAGE_SIZE / sizeof(unsigned long); k++ )
+                page[k] ^= d[k];
+        }
+        else
+            memcpy(page, pagebuf->pages + (curpage + curbatch) * PAGE_SIZE, PAGE_SIZE);
 
         pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
 
@@ -1588,6 +1747,14 @@ int xc_domain_restore(int xc_handle, int io_fd, uint32_t dom,
     goto loadpages;
 
   finish:
+    if ( pagebuf.zero_pages )
+        DPRINTF("%lu pages received as zero pages\n", pagebuf.zero_pages);
+    if ( pagebuf.compressed_pages )
+        DPRINTF("Compression: %lu pages received in %llu bytes, ratio %.2f\n",
+                pagebuf.compressed_pages, pagebuf.compressed_bytes,
+                (double)pagebuf.compressed_pages * PAGE_SIZE /
+                pagebuf.compressed_bytes);
+
     if ( hvm )
         goto finish_hvm;
 
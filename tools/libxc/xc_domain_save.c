@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "xc_private.h"
 #include "xc_dom.h"
@@ -30,6 +31,19 @@
 #define DEF_MAX_ITERS   29   /* limit us to 30 times round loop   */
 #define DEF_MAX_FACTOR   3   /* never send more than 3x p2m_size  */
 
+/* Copies of resent pages kept for delta compression (XCFLAGS_COMPRESS). */
+#define COMPRESS_CACHE_PAGES 16384   /* 64MB */
+
+/* Batches in flight per encoding thread (XCFLAGS_THREADS). */
+#define JOBS_PER_THREAD 2
+
+/* Iterations in a row the dirty set may fail to shrink by a tenth before
+   the downtime policy gives up waiting for it to converge. */
+#define PRECOPY_MAX_STALLS 2
+
+/* Pfns of the log-dirty bitmap fetched into to_skip at a time. */
+#define SKIP_WINDOW (MAX_BATCH_SIZE * 8)
+
 struct save_ctx {
     unsigned long hvirt_start; /* virtual starting address of the hypervisor */
     unsigned int pt_levels; /* #levels of page tables used by the current guest */
@@ -412,15 +426,36 @@ static int analysis_phase(int xc_handle, uint32_t domid, struct save_ctx *ctx,
             now = llgettimeofday();
             xc_shadow_control(xc_handle, domid, XEN_DOMCTL_SHADOW_OP_PEEK,
                               NULL, 0, NULL, 0, &stats);
-            DPRINTF("now= %lld faults= %"PRId32" dirty= %"PRId32"\n",
+            DPRINTF("now= %lld faults= %"PRId32" dirty= %"PRId32
+                    " clean= %"PRId32"us\n",
                     ((now-start)+500)/1000,
-                    stats.fault_count, stats.dirty_count);
+                    stats.fault_count, stats.dirty_count,
+                    stats.clean_time_us);
         }
     }
 
     return -1;
 }
 
+/* Fetch the part of the log-dirty bitmap from around pfn into to_skip.
+   Returns the first pfn past what was fetched, or 0 on error. */
+static unsigned long peek_to_skip(int xc_handle, uint32_t domid,
+                                  struct save_ctx *ctx,
+                                  unsigned long *to_skip, unsigned long pfn)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    unsigned long start = pfn & ~(BITS_PER_LONG - 1);
+    unsigned long pages = MIN(SKIP_WINDOW, dinfo->p2m_size - start);
+
+    if ( xc_shadow_control_range(xc_handle, domid,
+                                 XEN_DOMCTL_SHADOW_OP_PEEK_RANGE, start,
+                                 to_skip + start / BITS_PER_LONG,
+                                 pages, NULL) != pages )
+        return 0;
+
+    return start + pages;
+}
+
 static int suspend_and_state(int (*suspend)(void*), void* data,
                              int xc_handle, int io_fd, int dom,
                              xc_dominfo_t *info)
@@ -840,7 +875,7 @@ static xen_pfn_t *map_and_save_p2m_table(int xc_handle,
 /* must be done AFTER suspend_and_state() */
 static int save_tsc_info(int xc_handle, uint32_t dom, int io_fd)
 {
-    int marker = -7;
+    int marker = XC_SAVE_ID_TSC_INFO;
     uint32_t tsc_mode, khz, incarn;
     uint64_t nsec;
 
@@ -855,6 +890,498 @@ static int save_tsc_info(int xc_handle, uint32_t dom, int io_fd)
     return 0;
 }
 
+/*
+** Each batch of pages is mapped by the main loop, then encoded (zero
+** pages picked out, page tables canonicalised, pages compressed) and
+** written out.  With XCFLAGS_THREADS(n) the encoding is done by a pool of
+** n threads and the writing by one more, so that mapping, encoding and
+** transmission of successive batches overlap.  Batches are passed along a
+** ring of jobs and written in the order they were mapped: the stream is the
+** same either way.
+*/
+
+struct save_job {
+    unsigned int batch;
+    xen_pfn_t *pfn_type;    /* pfn | type of each page in the batch */
+    char *region;           /* the pages, mapped from the guest */
+    char *pt_pages;         /* canonicalised page tables, at their index */
+    char *cbuf;             /* the batch's pages, compressed */
+    uint32_t cbuf_len;
+    uint8_t *zero_map;      /* which pages are all zeroes */
+    unsigned int nr_zero;
+    int dobuf;              /* write to the outbuf (last iteration) */
+    int encoded;
+};
+
+struct save_pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Jobs from head to tail are in flight: those before encode have
+       been picked up by a worker, the one at head is next to write. */
+    struct save_job *jobs;
+    unsigned int nr_jobs;
+    unsigned long head, encode, tail;
+    int stop, error;
+
+    pthread_t *threads;
+    unsigned int nr_threads;
+
+    struct save_ctx *ctx;
+    struct xc_compression_ctx *cctx;
+    struct outbuf *ob;
+    int io_fd, live;
+};
+
+static int save_job_init(struct save_job *job, int hvm, int compress)
+{
+    memset(job, 0, sizeof(*job));
+
+    job->pfn_type = malloc(MAX_BATCH_SIZE * sizeof(*job->pfn_type));
+    job->zero_map = malloc(XC_ZERO_MAP_SIZE(MAX_BATCH_SIZE));
+    if ( !hvm )
+        job->pt_pages = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+    if ( compress )
+        job->cbuf = malloc(MAX_BATCH_SIZE * XC_COMPRESS_MAX_PAGE);
+
+    if ( !job->pfn_type || !job->zero_map || (!hvm && !job->pt_pages) ||
+         (compress && !job->cbuf) )
+        return -1;
+    return 0;
+}
+
+static void save_job_free(struct save_job *job)
+{
+    free(job->pfn_type);
+    free(job->zero_map);
+    free(job->pt_pages);
+    free(job->cbuf);
+}
+
+/* Everything done to a batch between mapping it and writing it out. */
+static int encode_batch(struct save_ctx *ctx, struct xc_compression_ctx *cctx,
+                        int live, struct save_job *job)
+{
+    unsigned int j;
+
+    job->cbuf_len = 0;
+    job->nr_zero = 0;
+    memset(job->zero_map, 0, XC_ZERO_MAP_SIZE(job->batch));
+
+    for ( j = 0; j < job->batch; j++ )
+    {
+        unsigned long pfn, pagetype;
+        char *spage = job->region + PAGE_SIZE*j;
+        int pt = 0;
+
+        pfn      = job->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = job->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        /* skip pages that aren't present */
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB )
+            continue;
+
+        /* Plain data pages which are all zeroes go in the zero map. */
+        if ( (pagetype == XEN_DOMCTL_PFINFO_NOTAB) &&
+             xc_page_is_zero(spage) )
+        {
+            job->zero_map[j / 8] |= 1 << (j % 8);
+            job->nr_zero++;
+            if ( cctx )
+                xc_compress_zero_page(cctx, pfn);
+            continue;
+        }
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+             (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
+        {
+            /* We have a pagetable page: need to rewrite it. */
+            if ( canonicalize_pagetable(ctx, pagetype, pfn, spage,
+                                        job->pt_pages + PAGE_SIZE*j) &&
+                 !live )
+            {
+                ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
+                      pagetype);
+                return -1;
+            }
+            spage = job->pt_pages + PAGE_SIZE*j;
+            pt = 1;
+        }
+
+        if ( cctx )
+            job->cbuf_len += xc_compress_page(cctx, pfn, !pt, spage,
+                                              job->cbuf + job->cbuf_len);
+    }
+
+    return 0;
+}
+
+static int write_batch(int io_fd, int live, struct outbuf *ob,
+                       struct save_job *job)
+{
+    unsigned int j, run;
+    int id;
+
+    if ( job->nr_zero )
+    {
+        id = XC_SAVE_ID_ZERO_PAGES;
+        if ( write_buffer(job->dobuf, ob, io_fd, &id, sizeof(id)) )
+        {
+            PERROR("Error when writing to state file (2)");
+            return -1;
+        }
+    }
+
+    if ( job->cbuf )
+    {
+        id = XC_SAVE_ID_COMPRESSED_BATCH;
+        if ( write_buffer(job->dobuf, ob, io_fd, &id, sizeof(id)) )
+        {
+            PERROR("Error when writing to state file (2)");
+            return -1;
+        }
+    }
+
+    if ( write_buffer(job->dobuf, ob, io_fd, &job->batch,
+                      sizeof(unsigned int)) )
+    {
+        PERROR("Error when writing to state file (2)");
+        return -1;
+    }
+
+    if ( sizeof(unsigned long) < sizeof(*job->pfn_type) )
+        for ( j = 0; j < job->batch; j++ )
+            ((unsigned long *)job->pfn_type)[j] = job->pfn_type[j];
+    if ( write_buffer(job->dobuf, ob, io_fd, job->pfn_type,
+                      sizeof(unsigned long)*job->batch) )
+    {
+        PERROR("Error when writing to state file (3)");
+        return -1;
+    }
+    if ( sizeof(unsigned long) < sizeof(*job->pfn_type) )
+        for ( j = job->batch; j-- > 0; )
+            job->pfn_type[j] = ((unsigned long *)job->pfn_type)[j];
+
+    if ( job->nr_zero &&
+         write_buffer(job->dobuf, ob, io_fd, job->zero_map,
+                      XC_ZERO_MAP_SIZE(job->batch)) )
+    {
+        PERROR("Error when writing to state file (3)");
+        return -1;
+    }
+
+    if ( job->cbuf )
+    {
+        if ( write_buffer(job->dobuf, ob, io_fd, &job->cbuf_len,
+                          sizeof(job->cbuf_len)) ||
+             (ratewrite_buffer(job->dobuf, ob, io_fd, live, job->cbuf,
+                               job->cbuf_len) != job->cbuf_len) )
+        {
+            ERROR("Error when writing to state file (4d)"
+                  " (errno %d)", errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    run = 0;
+    for ( j = 0; j < job->batch; j++ )
+    {
+        unsigned long pagetype;
+        int zero = job->zero_map[j / 8] & (1 << (j % 8));
+
+        pagetype = job->pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( (pagetype != 0) || zero )
+        {
+            /* If the page is not a normal data page, write out any
+               run of pages we may have previously acumulated */
+            if ( run )
+            {
+                if ( ratewrite_buffer(job->dobuf, ob, io_fd, live,
+                                      job->region + PAGE_SIZE*(j-run),
+                                      PAGE_SIZE*run) != PAGE_SIZE*run )
+                {
+                    ERROR("Error when writing to state file (4a)"
+                          " (errno %d)", errno);
+                    return -1;
+                }
+                run = 0;
+            }
+        }
+
+        /* skip pages that aren't present, or which are all zeroes */
+        if ( (pagetype == XEN_DOMCTL_PFINFO_XTAB) || zero )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+             (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
+        {
+            if ( ratewrite_buffer(job->dobuf, ob, io_fd, live,
+                                  job->pt_pages + PAGE_SIZE*j,
+                                  PAGE_SIZE) != PAGE_SIZE )
+            {
+                ERROR("Error when writing to state file (4b)"
+                      " (errno %d)", errno);
+                return -1;
+            }
+        }
+        else
+        {
+            /* We have a normal page: accumulate it for writing. */
+            run++;
+        }
+    }
+
+    if ( run )
+    {
+        /* write out the last accumulated run of pages */
+        if ( ratewrite_buffer(job->dobuf, ob, io_fd, live,
+                              job->region + PAGE_SIZE*(j-run),
+                              PAGE_SIZE*run) != PAGE_SIZE*run )
+        {
+            ERROR("Error when writing to state file (4c)"
+                  " (errno %d)", errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *save_encoder(void *arg)
+{
+    struct save_pipeline *p = arg;
+    struct save_job *job;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        while ( !p->stop && (p->encode == p->tail) )
+            pthread_cond_wait(&p->cond, &p->lock);
+        if ( p->stop )
+            break;
+
+        job = &p->jobs[p->encode++ % p->nr_jobs];
+        pthread_mutex_unlock(&p->lock);
+
+        rc = encode_batch(p->ctx, p->cctx, p->live, job);
+
+        pthread_mutex_lock(&p->lock);
+        if ( rc )
+            p->error = p->stop = 1;
+        job->encoded = 1;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void *save_writer(void *arg)
+{
+    struct save_pipeline *p = arg;
+    struct save_job *job;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        while ( !p->stop && ((p->head == p->tail) ||
+                             !p->jobs[p->head % p->nr_jobs].encoded) )
+            pthread_cond_wait(&p->cond, &p->lock);
+        if ( p->stop )
+            break;
+
+        job = &p->jobs[p->head % p->nr_jobs];
+        pthread_mutex_unlock(&p->lock);
+
+        rc = write_batch(p->io_fd, p->live, p->ob, job);
+        munmap(job->region, job->batch * PAGE_SIZE);
+
+        pthread_mutex_lock(&p->lock);
+        if ( rc )
+            p->error = p->stop = 1;
+        job->encoded = 0;
+        p->head++;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void save_pipeline_destroy(struct save_pipeline *p)
+{
+    unsigned int i;
+
+    if ( !p )
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0; i < p->nr_threads; i++ )
+        pthread_join(p->threads[i], NULL);
+
+    /* Batches that were never written. */
+    for ( ; p->head != p->tail; p->head++ )
+    {
+        struct save_job *job = &p->jobs[p->head % p->nr_jobs];
+        munmap(job->region, job->batch * PAGE_SIZE);
+    }
+
+    if ( p->jobs )
+        for ( i = 0; i < p->nr_jobs; i++ )
+            save_job_free(&p->jobs[i]);
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p->jobs);
+    free(p->threads);
+    free(p);
+}
+
+static struct save_pipeline *save_pipeline_create(
+    unsigned int nr_encoders, struct save_ctx *ctx,
+    struct xc_compression_ctx *cctx, struct outbuf *ob, int io_fd,
+    int live, int hvm)
+{
+    struct save_pipeline *p;
+    unsigned int i;
+
+    if ( (p = calloc(1, sizeof(*p))) == NULL )
+        return NULL;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->ctx = ctx;
+    p->cctx = cctx;
+    p->ob = ob;
+    p->io_fd = io_fd;
+    p->live = live;
+
+    /* One being mapped and one being written, besides the encoders'. */
+    p->nr_jobs = nr_encoders * JOBS_PER_THREAD + 2;
+    p->jobs = calloc(p->nr_jobs, sizeof(*p->jobs));
+    p->threads = calloc(nr_encoders + 1, sizeof(*p->threads));
+    if ( !p->jobs || !p->threads )
+        goto err;
+
+    for ( i = 0; i < p->nr_jobs; i++ )
+        if ( save_job_init(&p->jobs[i], hvm, cctx != NULL) )
+            goto err;
+
+    for ( ; p->nr_threads <= nr_encoders; p->nr_threads++ )
+        if ( pthread_create(&p->threads[p->nr_threads], NULL,
+                            (p->nr_threads == nr_encoders) ?
+                            save_writer : save_encoder, p) )
+            goto err;
+
+    return p;
+
+ err:
+    save_pipeline_destroy(p);
+    return NULL;
+}
+
+/* The next free job to map a batch into: NULL if the pipeline failed. */
+static struct save_job *save_pipeline_get(struct save_pipeline *p)
+{
+    struct save_job *job = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    while ( !p->error && (p->tail - p->head == p->nr_jobs) )
+        pthread_cond_wait(&p->cond, &p->lock);
+    if ( !p->error )
+        job = &p->jobs[p->tail % p->nr_jobs];
+    pthread_mutex_unlock(&p->lock);
+
+    return job;
+}
+
+/* Hand on the job from save_pipeline_get() */
+static void save_pipeline_put(struct save_pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->tail++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait for all the batches handed on to be written out. */
+static int save_pipeline_drain(struct save_pipeline *p)
+{
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    while ( !p->error && (p->head != p->tail) )
+        pthread_cond_wait(&p->cond, &p->lock);
+    rc = p->error ? -1 : 0;
+    pthread_mutex_unlock(&p->lock);
+
+    return rc;
+}
+
+/*
+** After each pre-copy iteration of a live save, we decide whether to go
+** round again or to suspend the domain and send what is left.  What is
+** left is roughly what was dirtied during the iteration just done, and it
+** should go about as fast as that iteration went: which predicts the
+** downtime if we stopped now.
+*/
+static void precopy_stats(struct save_iter_stats *s, unsigned int iter,
+                          unsigned long sent, unsigned long skipped,
+                          unsigned long dirtied, unsigned long total_sent,
+                          uint64_t time_us)
+{
+    double secs = time_us ? time_us / 1000000.0 : 1e-6;
+
+    s->iter = iter;
+    s->sent = sent;
+    s->skipped = skipped;
+    s->dirtied = dirtied;
+    s->total_sent = total_sent;
+    s->time_us = time_us;
+    s->send_rate = sent / secs;
+    s->dirty_rate = dirtied / secs;
+
+    if ( dirtied == 0 )
+        s->downtime_us = 0;
+    else if ( sent == 0 )
+        s->downtime_us = ~0ULL;
+    else
+        s->downtime_us = (uint64_t)dirtied * time_us / sent;
+}
+
+/* The built-in policy: should we stop now? */
+static int precopy_policy(const struct save_iter_stats *s,
+                          const struct save_iter_stats *last,
+                          unsigned int max_downtime_ms, int *stalls)
+{
+    if ( !max_downtime_ms )
+        return ((s->sent > last->sent) && RATE_IS_MAX()) ||
+               (s->sent + s->skipped < 50);
+
+    if ( s->downtime_us <= max_downtime_ms * 1000ULL )
+        return 1;
+
+    /* The guest dirties as fast as we send: more rounds won't help. */
+    if ( s->dirtied * 10ULL >= last->dirtied * 9ULL )
+        (*stalls)++;
+    else
+        *stalls = 0;
+
+    return *stalls >= PRECOPY_MAX_STALLS;
+}
+
 int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
                    struct save_callbacks* callbacks,
@@ -866,7 +1393,10 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
     int rc = 1, frc, i, j, last_iter = 0, iter = 0;
     int live  = (flags & XCFLAGS_LIVE);
     int debug = (flags & XCFLAGS_DEBUG);
-    int race = 0, sent_last_iter, skip_this_iter;
+    int compress = (flags & XCFLAGS_COMPRESS);
+    unsigned int nr_threads =
+        (flags & XCFLAGS_THREADS_MASK) >> XCFLAGS_THREADS_SHIFT;
+    int skip_this_iter;
     int tmem_saved = 0;
 
     /* The new domain's shared-info frame number. */
@@ -883,6 +1413,13 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
     /* A copy of one frame of guest memory. */
     char page[PAGE_SIZE];
 
+    /* Compressed stream: encoder state. */
+    struct xc_compression_ctx *cctx = NULL;
+
+    /* The batch being encoded and written, or a pipeline doing that. */
+    struct save_job single_job = { 0 }, *job;
+    struct save_pipeline *pipeline = NULL;
+
     /* Live mapping of shared info structure */
     shared_info_any_t *live_shinfo = NULL;
 
@@ -900,6 +1437,17 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
     unsigned long needed_to_fix = 0;
     unsigned long total_sent    = 0;
 
+    /* pre-copy convergence: the last iteration's figures, and how long
+       they have failed to improve. */
+    struct save_iter_stats last_istats = { 0 };
+    uint64_t iter_start;
+    int precopy_stalls = 0;
+
+    /* to_skip is valid below skip_end.  Without the range peek (older
+       hypervisors) the whole of it is fetched for each batch. */
+    unsigned long skip_end = 0;
+    int peek_range = 1;
+
     uint64_t vcpumap = 1ULL;
 
     /* HVM: a buffer for holding HVM context */
@@ -1008,8 +1556,8 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
 
     last_iter = !live;
 
-    /* pretend we sent all the pages last iteration */
-    sent_last_iter = dinfo->p2m_size;
+    /* pretend we sent (and the guest dirtied) all the pages last iteration */
+    last_istats.sent = last_istats.dirtied = dinfo->p2m_size;
 
     /* Setup to_send / to_fix and to_skip bitmaps */
     to_send = xc_memalign(PAGE_SIZE, ROUNDUP(BITMAP_SIZE, PAGE_SHIFT)); 
@@ -1069,6 +1617,22 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
     memset(pfn_type, 0,
            ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
 
+    if ( compress &&
+         !(cctx = xc_compression_create(dinfo->p2m_size,
+                                        COMPRESS_CACHE_PAGES)) )
+    {
+        ERROR("failed to alloc memory for page compression");
+        errno = ENOMEM;
+        goto out;
+    }
+
+    if ( save_job_init(&single_job, hvm, compress) )
+    {
+        ERROR("failed to alloc memory for page batches");
+        errno = ENOMEM;
+        goto out;
+    }
+
     if ( lock_pages(pfn_type, MAX_BATCH_SIZE * sizeof(*pfn_type)) )
     {
         ERROR("Unable to lock pfn_type array");
@@ -1120,7 +1684,7 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
 
     print_stats(xc_handle, dom, 0, &stats, 0);
 
-    tmem_saved = xc_tmem_save(xc_handle, dom, io_fd, live, -5);
+    tmem_saved = xc_tmem_save(xc_handle, dom, io_fd, live, XC_SAVE_ID_TMEM);
     if ( tmem_saved == -1 )
     {
         ERROR("Error when writing to state file (tmem)");
@@ -1133,6 +1697,14 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
         goto out;
     }
 
+    if ( nr_threads &&
+         !(pipeline = save_pipeline_create(nr_threads, ctx, cctx, &ob,
+                                           io_fd, live, hvm)) )
+    {
+        ERROR("Couldn't start %u page encoding threads", nr_threads);
+        goto out;
+    }
+
   copypages:
 #define write_exact(fd, buf, len) write_buffer(last_iter, &ob, (fd), (buf), (len))
 #ifdef ratewrite
@@ -1143,9 +1715,10 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
-        unsigned int prev_pc, sent_this_iter, N, batch, run;
+        unsigned int prev_pc, sent_this_iter, N, batch;
 
         iter++;
+        iter_start = llgettimeofday();
         sent_this_iter = 0;
         skip_this_iter = 0;
         prev_pc = 0;
@@ -1163,10 +1736,11 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
                 prev_pc = this_pc;
             }
 
-            if ( !last_iter )
+            /* Pages dirtied since they were last looked at are skipped;
+               fetch that part of the bitmap again as the batch gets to it. */
+            skip_end = 0;
+            if ( !last_iter && !peek_range )
             {
-                /* Slightly wasteful to peek the whole array evey time,
-                   but this is fast enough for the moment. */
                 frc = xc_shadow_control(
                     xc_handle, dom, XEN_DOMCTL_SHADOW_OP_PEEK, to_skip, 
                     dinfo->p2m_size, NULL, 0, NULL);
@@ -1175,6 +1749,7 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
                     ERROR("Error peeking shadow bitmap");
                     goto out;
                 }
+                skip_end = dinfo->p2m_size;
             }
 
             /* load pfn_type[] with the mfn of all the pages we're doing in
@@ -1218,6 +1793,28 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
                 }
                 else
                 {
+                    if ( !last_iter && (N >= skip_end) &&
+                         test_bit(n, to_send) )
+                    {
+                        skip_end = peek_to_skip(xc_handle, dom, ctx,
+                                                to_skip, N);
+                        if ( skip_end == 0 && peek_range )
+                        {
+                            DPRINTF("No range peek, fetching whole bitmap\n");
+                            peek_range = 0;
+                            frc = xc_shadow_control(
+                                xc_handle, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                                to_skip, dinfo->p2m_size, NULL, 0, NULL);
+                            if ( frc == dinfo->p2m_size )
+                                skip_end = dinfo->p2m_size;
+                        }
+                        if ( skip_end == 0 )
+                        {
+                            ERROR("Error peeking shadow bitmap");
+                            goto out;
+                        }
+                    }
+
                     if ( !last_iter &&
                          test_bit(n, to_send) &&
                          test_bit(n, to_skip) )
@@ -1274,6 +1871,13 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
             if ( batch == 0 )
                 goto skip; /* vanishingly unlikely... */
 
+            job = pipeline ? save_pipeline_get(pipeline) : &single_job;
+            if ( job == NULL )
+            {
+                ERROR("Error when writing to state file (pipeline)");
+                goto out;
+            }
+
             region_base = xc_map_foreign_bulk(
                 xc_handle, dom, PROT_READ, pfn_type, pfn_err, batch);
             if ( region_base == NULL )
@@ -1334,107 +1938,34 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
                 }
             }
 
-            if ( write_exact(io_fd, &batch, sizeof(unsigned int)) )
-            {
-                PERROR("Error when writing to state file (2)");
-                goto out;
-            }
-
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                for ( j = 0; j < batch; j++ )
-                    ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( write_exact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
-            {
-                PERROR("Error when writing to state file (3)");
-                goto out;
-            }
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                while ( --j >= 0 )
-                    pfn_type[j] = ((unsigned long *)pfn_type)[j];
-
-            /* entering this loop, pfn_type is now in pfns (Not mfns) */
-            run = 0;
-            for ( j = 0; j < batch; j++ )
-            {
-                unsigned long pfn, pagetype;
-                void *spage = (char *)region_base + (PAGE_SIZE*j);
-
-                pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
-                pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
-
-                if ( pagetype != 0 )
-                {
-                    /* If the page is not a normal data page, write out any
-                       run of pages we may have previously acumulated */
-                    if ( run )
-                    {
-                        if ( ratewrite(io_fd, live, 
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
-                        {
-                            ERROR("Error when writing to state file (4a)"
-                                  " (errno %d)", errno);
-                            goto out;
-                        }                        
-                        run = 0;
-                    }
-                }
-
-                /* skip pages that aren't present */
-                if ( pagetype == XEN_DOMCTL_PFINFO_XTAB )
-                    continue;
+            job->batch = batch;
+            job->region = (char *)region_base;
+            job->dobuf = last_iter;
+            memcpy(job->pfn_type, pfn_type, batch * sizeof(*pfn_type));
 
-                pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
-
-                if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
-                     (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
-                {
-                    /* We have a pagetable page: need to rewrite it. */
-                    race = 
-                        canonicalize_pagetable(ctx, pagetype, pfn, spage, page); 
-
-                    if ( race && !live )
-                    {
-                        ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
-                              pagetype);
-                        goto out;
-                    }
-
-                    if ( ratewrite(io_fd, live, page, PAGE_SIZE) != PAGE_SIZE )
-                    {
-                        ERROR("Error when writing to state file (4b)"
-                              " (errno %d)", errno);
-                        goto out;
-                    }
-                }
-                else
-                {
-                    /* We have a normal page: accumulate it for writing. */
-                    run++;
-                }
-            } /* end of the write out for this batch */
-
-            if ( run )
+            if ( pipeline )
+                save_pipeline_put(pipeline);
+            else
             {
-                /* write out the last accumulated run of pages */
-                if ( ratewrite(io_fd, live, 
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
-                {
-                    ERROR("Error when writing to state file (4c)"
-                          " (errno %d)", errno);
+                frc = encode_batch(ctx, cctx, live, job) ||
+                      write_batch(io_fd, live, &ob, job);
+                munmap(region_base, batch*PAGE_SIZE);
+                if ( frc )
                     goto out;
-                }                        
             }
 
             sent_this_iter += batch;
 
-            munmap(region_base, batch*PAGE_SIZE);
-
         } /* end of this while loop for this iteration */
 
       skip:
 
+        if ( pipeline && save_pipeline_drain(pipeline) )
+        {
+            ERROR("Error when writing to state file (pipeline)");
+            goto out;
+        }
+
         total_sent += sent_this_iter;
 
         DPRINTF("\r %d: sent %d, skipped %d, ",
@@ -1447,11 +1978,13 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
             DPRINTF("Total pages sent= %ld (%.2fx)\n",
                     total_sent, ((float)total_sent)/dinfo->p2m_size );
             DPRINTF("(of which %ld were fixups)\n", needed_to_fix  );
+            if ( compress )
+                xc_compression_report(cctx);
         }
 
         if ( last_iter && debug )
         {
-            int minusone = -1;
+            int minusone = XC_SAVE_ID_ENABLE_VERIFY_MODE;
             memset(to_send, 0xff, BITMAP_SIZE);
             debug = 0;
             DPRINTF("Entering debug resend-all mode\n");
@@ -1471,9 +2004,39 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
 
         if ( live )
         {
-            if ( ((sent_this_iter > sent_last_iter) && RATE_IS_MAX()) ||
+            xc_shadow_op_stats_t dirty;
+            struct save_iter_stats istats;
+            int decision;
+
+            /* How much was dirtied while we were sending? */
+            if ( xc_shadow_control(xc_handle, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                                   NULL, 0, NULL, 0, &dirty) < 0 )
+            {
+                ERROR("Error peeking shadow stats");
+                goto out;
+            }
+
+            precopy_stats(&istats, iter, sent_this_iter, skip_this_iter,
+                          dirty.dirty_count, total_sent,
+                          llgettimeofday() - iter_start);
+
+            decision = XC_PRECOPY_DEFAULT;
+            if ( callbacks->precopy )
+                decision = callbacks->precopy(&istats, callbacks->data);
+            if ( decision == XC_PRECOPY_DEFAULT )
+                decision = precopy_policy(&istats, &last_istats,
+                                          callbacks->max_downtime_ms,
+                                          &precopy_stalls) ?
+                    XC_PRECOPY_STOP : XC_PRECOPY_CONTINUE;
+
+            DPRINTF("precopy: iter %u sent %lu dirtied %lu in %"PRIu64"ms, "
+                    "predicted downtime %"PRIu64"ms\n", istats.iter,
+                    istats.sent, istats.dirtied, istats.time_us / 1000,
+                    istats.downtime_us / 1000);
+            last_istats = istats;
+
+            if ( (decision == XC_PRECOPY_STOP) ||
                  (iter >= max_iters) ||
-                 (sent_this_iter+skip_this_iter < 50) ||
                  (total_sent > dinfo->p2m_size*max_factor) )
             {
                 DPRINTF("Start last iteration\n");
@@ -1488,7 +2051,7 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
 
                 DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
                 if ( (tmem_saved > 0) &&
-                     (xc_tmem_save_extra(xc_handle,dom,io_fd,-6) == -1) )
+                     (xc_tmem_save_extra(xc_handle,dom,io_fd,XC_SAVE_ID_TMEM_EXTRA) == -1) )
                 {
                         ERROR("Error when writing to state file (tmem)");
                         goto out;
@@ -1511,8 +2074,6 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
                 goto out;
             }
 
-            sent_last_iter = sent_this_iter;
-
             print_stats(xc_handle, dom, sent_this_iter, &stats, 1);
 
         }
@@ -1522,10 +2083,10 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
 
     {
         struct {
-            int minustwo;
+            int id;
             int max_vcpu_id;
             uint64_t vcpumap;
-        } chunk = { -2, info.max_vcpu_id };
+        } chunk = { XC_SAVE_ID_VCPU_INFO, info.max_vcpu_id };
 
         if ( info.max_vcpu_id >= 64 )
         {
@@ -1557,7 +2118,7 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
             uint64_t data;
         } chunk = { 0, };
 
-        chunk.id = -3;
+        chunk.id = XC_SAVE_ID_HVM_IDENT_PT;
         xc_get_hvm_param(xc_handle, dom, HVM_PARAM_IDENT_PT,
                          (unsigned long *)&chunk.data);
 
@@ -1568,7 +2129,7 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
             goto out;
         }
 
-        chunk.id = -4;
+        chunk.id = XC_SAVE_ID_HVM_VM86_TSS;
         xc_get_hvm_param(xc_handle, dom, HVM_PARAM_VM86_TSS,
                          (unsigned long *)&chunk.data);
 
@@ -1777,6 +2338,13 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
  out:
     completed = 1;
 
+    if ( rc )
+    {
+        /* Stop writing before flushing what was written. */
+        save_pipeline_destroy(pipeline);
+        pipeline = NULL;
+    }
+
     if ( !rc && callbacks->postcopy )
         callbacks->postcopy(callbacks->data);
 
@@ -1841,6 +2409,9 @@ int xc_domain_save(int xc_handle, int io_fd, uint32_t dom, uint32_t max_iters,
     free(pfn_type);
     free(pfn_batch);
     free(pfn_err);
+    save_pipeline_destroy(pipeline);
+    save_job_free(&single_job);
+    xc_compression_free(cctx);
     free(to_send);
     free(to_fix);
     free(to_skip);
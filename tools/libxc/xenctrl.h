@@ -446,6 +446,9 @@ int xc_domain_sethandle(int xc_handle, uint32_t domid,
                         xen_domain_handle_t handle);
 
 typedef xen_domctl_shadow_op_stats_t xc_shadow_op_stats_t;
+/* For XEN_DOMCTL_SHADOW_OP_{OFF,PEEK,CLEAN}, a non-zero mode is the
+ * stats->generation returned when the caller enabled log-dirty mode, and
+ * the op fails with ESTALE if it has since been turned off or re-enabled. */
 int xc_shadow_control(int xc_handle,
                       uint32_t domid,
                       unsigned int sop,
@@ -455,6 +458,16 @@ int xc_shadow_control(int xc_handle,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+/* XEN_DOMCTL_SHADOW_OP_{PEEK,CLEAN}_RANGE: bit 0 of dirty_bitmap is
+ * start_pfn, which must be a multiple of 8. */
+int xc_shadow_control_range(int xc_handle,
+                            uint32_t domid,
+                            unsigned int sop,
+                            unsigned long start_pfn,
+                            unsigned long *dirty_bitmap,
+                            unsigned long pages,
+                            xc_shadow_op_stats_t *stats);
+
 int xc_sedf_domain_set(int xc_handle,
                        uint32_t domid,
                        uint64_t period, uint64_t slice,
@@ -475,6 +488,14 @@ int xc_sched_credit_domain_get(int xc_handle,
                                uint32_t domid,
                                struct xen_domctl_sched_credit *sdom);
 
+int xc_sched_credit2_domain_set(int xc_handle,
+                                uint32_t domid,
+                                struct xen_domctl_sched_credit2 *sdom);
+
+int xc_sched_credit2_domain_get(int xc_handle,
+                                uint32_t domid,
+                                struct xen_domctl_sched_credit2 *sdom);
+
 /**
  * This function sends a trigger to a domain.
  *
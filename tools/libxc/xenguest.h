@@ -13,9 +13,33 @@
 #define XCFLAGS_DEBUG     2
 #define XCFLAGS_HVM       4
 #define XCFLAGS_STDVGA    8
+#define XCFLAGS_COMPRESS 16
+
+/* Number of threads encoding pages for xc_domain_save (0: don't fork any). */
+#define XCFLAGS_THREADS_SHIFT 8
+#define XCFLAGS_THREADS_MASK  (0xffU << XCFLAGS_THREADS_SHIFT)
+#define XCFLAGS_THREADS(n)    (((n) << XCFLAGS_THREADS_SHIFT) & XCFLAGS_THREADS_MASK)
+
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
 
+/* What one pre-copy iteration of a live save looked like. */
+struct save_iter_stats {
+    unsigned int iter;
+    unsigned long sent;         /* pages sent */
+    unsigned long skipped;      /* pages not sent as they were dirty again */
+    unsigned long dirtied;      /* pages dirtied while sending */
+    unsigned long total_sent;   /* in all iterations so far */
+    uint64_t time_us;
+    double send_rate;           /* pages per second */
+    double dirty_rate;          /* pages per second */
+    uint64_t downtime_us;       /* predicted, if we suspended now */
+};
+
+#define XC_PRECOPY_DEFAULT  0   /* leave it to the built-in policy */
+#define XC_PRECOPY_CONTINUE 1   /* go round again */
+#define XC_PRECOPY_STOP     2   /* suspend the domain for the last round */
+
 /* callbacks provided by xc_domain_save */
 struct save_callbacks {
     int (*suspend)(void* data);
@@ -25,6 +49,13 @@ struct save_callbacks {
      * 0: terminate checkpointing gracefully
      * 1: take another checkpoint */
     int (*checkpoint)(void* data);
+    /* called after each pre-copy iteration of a live save, returns
+     * XC_PRECOPY_xxx.  max_iters and max_factor are enforced regardless. */
+    int (*precopy)(const struct save_iter_stats *stats, void* data);
+
+    /* For the built-in policy: suspend once the predicted downtime is
+     * below this.  0 keeps the old fixed heuristic. */
+    unsigned int max_downtime_ms;
 
     /* to be provided as the first argument to each callback function */
     void* data;
@@ -18,6 +18,63 @@
 /* When pinning page tables at the end of restore, we also use batching. */
 #define MAX_PIN_BATCH  1024
 
+/*
+** A negative batch count in the page stream introduces a record other
+** than a batch of pages.
+*/
+#define XC_SAVE_ID_ENABLE_VERIFY_MODE -1 /* Switch to validation phase. */
+#define XC_SAVE_ID_VCPU_INFO          -2 /* Additional VCPU info */
+#define XC_SAVE_ID_HVM_IDENT_PT       -3 /* (HVM-only) */
+#define XC_SAVE_ID_HVM_VM86_TSS       -4 /* (HVM-only) */
+#define XC_SAVE_ID_TMEM               -5
+#define XC_SAVE_ID_TMEM_EXTRA         -6
+#define XC_SAVE_ID_TSC_INFO           -7
+#define XC_SAVE_ID_COMPRESSED_BATCH   -8 /* Next batch's pages compressed. */
+#define XC_SAVE_ID_ZERO_PAGES         -9 /* Next batch has all-zero pages. */
+
+/*
+** A batch with zero pages has a bitmap, one bit per pfn type (bit j in
+** byte j / 8, least significant first), after its pfn types.  Pages with
+** their bit set are all zeroes and their contents are not sent.
+*/
+#define XC_ZERO_MAP_SIZE(_batch) (((_batch) + 7) / 8)
+
+/* Are the contents of this (page aligned) page all zeroes? */
+int xc_page_is_zero(const void *page);
+
+/*
+** Compressed batches (XCFLAGS_COMPRESS): the batch count and pfn types
+** are as usual, but the pages of the batch follow as a uint32_t byte
+** count and that many bytes of encoded pages; see xc_compression.c.
+*/
+#define XC_COMPRESS_MAX_PAGE (PAGE_SIZE + 1)  /* Worst case for one page. */
+
+struct xc_compression_ctx;
+
+struct xc_compression_ctx *xc_compression_create(unsigned long p2m_size,
+                                                 unsigned long cache_pages);
+void xc_compression_free(struct xc_compression_ctx *ctx);
+
+/* Encode a page into out, which has room for XC_COMPRESS_MAX_PAGE bytes.
+ * Pages which are cacheable (not page tables, which get rewritten on the
+ * way in) may be sent as a delta against what we sent last time.  Returns
+ * the number of bytes used. */
+int xc_compress_page(struct xc_compression_ctx *ctx, unsigned long pfn,
+                     int cacheable, const void *page, char *out);
+
+/* Note that pfn was sent as a zero page instead. */
+void xc_compress_zero_page(struct xc_compression_ctx *ctx, unsigned long pfn);
+
+/* Log how well we did. */
+void xc_compression_report(struct xc_compression_ctx *ctx);
+
+/* Decode a page encoded by xc_compress_page(), taking no more than len
+ * bytes.  If *delta is set on return, page is to be XORed onto the copy of
+ * the page the receiver already has.  Returns the number of bytes used, or
+ * -1 if the input is corrupt. */
+int xc_uncompress_page(const char *in, unsigned long len, void *page,
+                       int *delta);
+
 
 
 /*
@@ -345,9 +345,11 @@ int libxl_domain_suspend(struct libxl_ctx *ctx, libxl_domain_suspend_info *info,
 {
     int hvm = is_hvm(ctx, domid);
     int live = info != NULL && info->flags & XL_SUSPEND_LIVE;
-    int debug = info != NULL && info->flags & XL_SUSPEND_LIVE;
+    int debug = info != NULL && info->flags & XL_SUSPEND_DEBUG;
+    int threads = info != NULL ? info->threads : 0;
+    unsigned int max_downtime_ms = info != NULL ? info->max_downtime_ms : 0;
 
-    core_suspend(ctx, domid, fd, hvm, live, debug);
+    core_suspend(ctx, domid, fd, hvm, live, debug, threads, max_downtime_ms);
     if (hvm)
         save_device_model(ctx, domid, fd);
     return 0;
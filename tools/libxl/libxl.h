@@ -109,6 +109,8 @@ typedef struct {
 #define XL_SUSPEND_DEBUG 1
 #define XL_SUSPEND_LIVE 2
     int flags;
+    int threads; /* for encoding pages, 0 to do it inline */
+    unsigned int max_downtime_ms; /* live: stop pre-copy below this */
     int (*suspend_callback)(void *, int);
 } libxl_domain_suspend_info;
 
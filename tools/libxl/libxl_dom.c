@@ -280,16 +280,18 @@ static int core_suspend_callback(void *data)
 }
 
 int core_suspend(struct libxl_ctx *ctx, uint32_t domid, int fd,
-		int hvm, int live, int debug)
+		int hvm, int live, int debug, int threads,
+		unsigned int max_downtime_ms)
 {
     int flags;
     int port;
     struct save_callbacks callbacks;
     struct suspendinfo si;
 
-    flags = (live) ? XCFLAGS_LIVE : 0
-          | (debug) ? XCFLAGS_DEBUG : 0
-          | (hvm) ? XCFLAGS_HVM : 0;
+    flags = ((live) ? XCFLAGS_LIVE : 0)
+          | ((debug) ? XCFLAGS_DEBUG : 0)
+          | ((hvm) ? XCFLAGS_HVM : 0)
+          | XCFLAGS_THREADS(threads);
 
     si.domid = domid;
     si.flags = flags;
@@ -316,6 +318,7 @@ int core_suspend(struct libxl_ctx *ctx, uint32_t domid, int fd,
 
     memset(&callbacks, 0, sizeof(callbacks));
     callbacks.suspend = core_suspend_callback;
+    callbacks.max_downtime_ms = max_downtime_ms;
     callbacks.data = &si;
 
     xc_domain_save(ctx->xch, fd, domid, 0, 0, flags,
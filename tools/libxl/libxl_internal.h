@@ -131,7 +131,7 @@ int build_hvm(struct libxl_ctx *ctx, uint32_t domid,
 
 int restore_common(struct libxl_ctx *ctx, uint32_t domid,
                    libxl_domain_build_info *info, libxl_domain_build_state *state, int fd);
-int core_suspend(struct libxl_ctx *ctx, uint32_t domid, int fd, int hvm, int live, int debug);
+int core_suspend(struct libxl_ctx *ctx, uint32_t domid, int fd, int hvm, int live, int debug, int threads, unsigned int max_downtime_ms);
 int save_device_model(struct libxl_ctx *ctx, uint32_t domid, int fd);
 
 /* from xl_device */
@@ -907,6 +907,7 @@ static void help(char *command)
         printf("Options:\n\n");
         printf("-h                     Print this help.\n");
         printf("-c                     Leave domain running after creating the snapshot.\n");
+        printf("-t THREADS             Encode pages on THREADS threads while writing.\n");
     } else if(!strcmp(command, "restore")) {
         printf("Usage: xl restore [options] <ConfigFile> <CheckpointFile>\n\n");
         printf("Restore a domain from a saved state.\n\n");
@@ -1415,9 +1416,10 @@ void list_vm(void)
     free(info);
 }
 
-int save_domain(char *p, char *filename, int checkpoint)
+int save_domain(char *p, char *filename, int checkpoint, int threads)
 {
     struct libxl_ctx ctx;
+    libxl_domain_suspend_info info;
     uint32_t domid;
     int fd;
 
@@ -1436,7 +1438,9 @@ int save_domain(char *p, char *filename, int checkpoint)
         fprintf(stderr, "Failed to open temp file %s for writing\n", filename);
         exit(2);
     }
-    libxl_domain_suspend(&ctx, NULL, domid, fd);
+    memset(&info, 0, sizeof(info));
+    info.threads = threads;
+    libxl_domain_suspend(&ctx, &info, domid, fd);
     close(fd);
 
     if (checkpoint)
@@ -1488,14 +1492,17 @@ int main_restore(int argc, char **argv)
 int main_save(int argc, char **argv)
 {
     char *filename = NULL, *p = NULL;
-    int checkpoint = 0;
+    int checkpoint = 0, threads = 0;
     int opt;
 
-    while ((opt = getopt(argc, argv, "hc")) != -1) {
+    while ((opt = getopt(argc, argv, "hct:")) != -1) {
         switch (opt) {
         case 'c':
             checkpoint = 1;
             break;
+        case 't':
+            threads = atoi(optarg);
+            break;
         case 'h':
             help("save");
             exit(0);
@@ -1512,7 +1519,7 @@ int main_save(int argc, char **argv)
 
     p = argv[optind];
     filename = argv[optind + 1];
-    save_domain(p, filename, checkpoint);
+    save_domain(p, filename, checkpoint, threads);
     exit(0);
 }
 
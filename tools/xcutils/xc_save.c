@@ -161,6 +161,20 @@ static void switch_qemu_logdirty(int domid, unsigned int enable)
     free(ret_str);
 }
 
+/**
+ * Log the figures for each pre-copy iteration, leaving the decision to
+ * libxc's policy. */
+static int precopy(const struct save_iter_stats *stats, void *data)
+{
+    fprintf(stderr, "precopy iter=%u sent=%lu skipped=%lu dirtied=%lu "
+            "total_sent=%lu time_us=%llu send_rate=%.0f dirty_rate=%.0f "
+            "downtime_us=%llu\n", stats->iter, stats->sent, stats->skipped,
+            stats->dirtied, stats->total_sent,
+            (unsigned long long)stats->time_us, stats->send_rate,
+            stats->dirty_rate, (unsigned long long)stats->downtime_us);
+    return XC_PRECOPY_DEFAULT;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -168,8 +182,9 @@ main(int argc, char **argv)
     int io_fd, ret, port;
     struct save_callbacks callbacks;
 
-    if (argc != 6)
-        errx(1, "usage: %s iofd domid maxit maxf flags", argv[0]);
+    if (argc != 6 && argc != 7)
+        errx(1, "usage: %s iofd domid maxit maxf flags [max_downtime_ms]",
+             argv[0]);
 
     si.xc_fd = xc_interface_open();
     if (si.xc_fd < 0)
@@ -205,6 +220,9 @@ main(int argc, char **argv)
     }
     memset(&callbacks, 0, sizeof(callbacks));
     callbacks.suspend = suspend;
+    callbacks.precopy = precopy;
+    if (argc == 7)
+        callbacks.max_downtime_ms = atoi(argv[6]);
     ret = xc_domain_save(si.xc_fd, io_fd, si.domid, maxit, max_f, si.flags, 
                          &callbacks, !!(si.flags & XCFLAGS_HVM),
                          &switch_qemu_logdirty);
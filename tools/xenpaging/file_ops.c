@@ -28,48 +28,51 @@
 #define page_offset(_pfn)     (((off_t)(_pfn)) << PAGE_SHIFT)
 
 
-static int file_op(int fd, void *page, int i,
-                   ssize_t (*fn)(int, const void *, size_t))
+/* Transfer nr pages between the buffer at page and the paging file, page j
+ * of the buffer going to or from slot slots[j].  Consecutive slots are done
+ * with a single positioned read or write, so a batch laid out in
+ * consecutive slots costs one system call. */
+static int file_op(int fd, void *page, const int *slots, int nr,
+                   ssize_t (*fn)(int, void *, size_t, off_t))
 {
-    off_t seek_ret;
-    int total;
-    int bytes;
-    int ret;
+    size_t total, len;
+    ssize_t bytes;
+    int i, run;
 
-    seek_ret = lseek(fd, i << PAGE_SHIFT, SEEK_SET);
-
-    total = 0;
-    while ( total < PAGE_SIZE )
+    for ( i = 0; i < nr; i += run )
     {
-        bytes = fn(fd, page + total, PAGE_SIZE - total);
-        if ( bytes <= 0 )
+        for ( run = 1; (i + run < nr) && (slots[i + run] == slots[i] + run);
+              run++ )
+            continue;
+
+        len = (size_t)run << PAGE_SHIFT;
+        for ( total = 0; total < len; total += bytes )
         {
-            ret = -errno;
-            goto err;
+            bytes = fn(fd, page + total, len - total,
+                       page_offset(slots[i]) + total);
+            if ( bytes <= 0 )
+                return bytes ? -errno : -EIO;
         }
 
-        total += bytes;
+        page += len;
     }
 
     return 0;
-
- err:
-    return ret;
 }
 
-static ssize_t my_read(int fd, const void *buf, size_t count)
+static ssize_t my_write(int fd, void *buf, size_t count, off_t offset)
 {
-    return read(fd, (void *)buf, count);
+    return pwrite(fd, buf, count, offset);
 }
 
-int read_page(int fd, void *page, int i)
+int read_pages(int fd, void *page, const int *slots, int nr)
 {
-    return file_op(fd, page, i, &my_read);
+    return file_op(fd, page, slots, nr, &pread);
 }
 
-int write_page(int fd, void *page, int i)
+int write_pages(int fd, void *page, const int *slots, int nr)
 {
-    return file_op(fd, page, i, &write);
+    return file_op(fd, page, slots, nr, &my_write);
 }
 
 
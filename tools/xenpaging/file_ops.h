@@ -25,8 +25,8 @@
 #define __FILE_OPS_H__
 
 
-int read_page(int fd, void *page, int i);
-int write_page(int fd, void *page, int i);
+int read_pages(int fd, void *page, const int *slots, int nr);
+int write_pages(int fd, void *page, const int *slots, int nr);
 
 
 #endif
@@ -29,8 +29,10 @@
 
 
 int policy_init(xenpaging_t *paging);
-int policy_choose_victim(xenpaging_t *paging, domid_t domain_id,
-                         xenpaging_victim_t *victim);
+void policy_teardown(xenpaging_t *paging);
+/* Fill in up to nr victims, returning how many */
+int policy_choose_victims(xenpaging_t *paging, domid_t domain_id,
+                          xenpaging_victim_t *victims, int nr);
 void policy_notify_paged_out(domid_t domain_id, unsigned long gfn);
 void policy_notify_paged_in(domid_t domain_id, unsigned long gfn);
 
@@ -21,6 +21,8 @@
  */
 
 
+#include <sys/time.h>
+
 #include "bitops.h"
 #include "xc.h"
 #include "policy.h"
@@ -28,14 +30,38 @@
 
 #define MRU_SIZE 1024
 
+/* The working set is sampled through log-dirty mode: every SAMPLE_MS the
+ * dirty bitmap is fetched and cleaned, and each page's age counts the
+ * samples since it was last written.  Victims are found by a clock sweep
+ * over the gfns, taking pages at least COLD_AGE samples old, and younger
+ * ones only when a whole sweep doesn't find enough.
+ *
+ * Log-dirty mode belongs to migration or to the device model's VRAM
+ * tracking whenever they want it.  It is only used here if nobody has it
+ * already, and every op on it carries the generation it was enabled at,
+ * so that once somebody else turns it off or re-enables it, it is never
+ * cleaned or turned off from here again. */
+#define SAMPLE_MS 1000
+#define COLD_AGE  4
+#define AGE_MAX   255
+
 
 static unsigned long mru[MRU_SIZE];
 static unsigned int i_mru = 0;
 static unsigned long *bitmap;
 
+static int logdirty;
+static uint32_t logdirty_gen;
+static unsigned long max_pages;
+static unsigned long *dirty;
+static uint8_t *age;
+static unsigned long hand;
+static struct timeval last_sample;
+
 
 int policy_init(xenpaging_t *paging)
 {
+    xc_shadow_op_stats_t stats;
     int i;
     int rc;
 
@@ -51,28 +77,154 @@ int policy_init(xenpaging_t *paging)
     /* Don't page out page 0 */
     set_bit(0, bitmap);
 
+    /* Sample the working set if we can have log-dirty mode to ourselves;
+     * otherwise fall back to choosing victims at random. */
+    max_pages = paging->domain_info->max_pages;
+    rc = alloc_bitmap(&dirty, paging->bitmap_size);
+    if ( rc != 0 )
+        goto out;
+    age = calloc(max_pages, sizeof(*age));
+    if ( age == NULL )
+    {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    if ( lock_pages(dirty, paging->bitmap_size / 8) == 0 )
+    {
+        /* A successful peek means log-dirty mode is already in use, and
+         * enabling it would take it away from the VRAM tracking. */
+        if ( (xc_shadow_control(paging->xc_handle,
+                                paging->mem_event.domain_id,
+                                XEN_DOMCTL_SHADOW_OP_PEEK, dirty, max_pages,
+                                NULL, 0, NULL) < 0) &&
+             (xc_shadow_control(paging->xc_handle,
+                                paging->mem_event.domain_id,
+                                XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY,
+                                NULL, 0, NULL, 0, &stats) == 0) )
+        {
+            logdirty = 1;
+            logdirty_gen = stats.generation;
+        }
+        else
+            unlock_pages(dirty, paging->bitmap_size / 8);
+    }
+    if ( !logdirty )
+        DPRINTF("No log-dirty mode, victims will be chosen at random\n");
+
     rc = 0;
 
  out:
     return rc;
 }
 
-int policy_choose_victim(xenpaging_t *paging, domid_t domain_id,
-                         xenpaging_victim_t *victim)
+static void policy_release_logdirty(xenpaging_t *paging)
+{
+    unlock_pages(dirty, paging->bitmap_size / 8);
+    logdirty = 0;
+}
+
+void policy_teardown(xenpaging_t *paging)
 {
-    ASSERT(victim != NULL);
+    if ( !logdirty )
+        return;
 
-    /* Domain to pick on */
-    victim->domain_id = domain_id;
-    
-    do
+    /* Fails harmlessly if somebody else has taken log-dirty mode over */
+    xc_shadow_control(paging->xc_handle, paging->mem_event.domain_id,
+                      XEN_DOMCTL_SHADOW_OP_OFF, NULL, 0, NULL,
+                      logdirty_gen, NULL);
+    policy_release_logdirty(paging);
+}
+
+static void policy_sample(xenpaging_t *paging)
+{
+    struct timeval now;
+    unsigned long gfn;
+
+    gettimeofday(&now, NULL);
+    if ( ((now.tv_sec - last_sample.tv_sec) * 1000 +
+          (now.tv_usec - last_sample.tv_usec) / 1000) < SAMPLE_MS )
+        return;
+    last_sample = now;
+
+    if ( xc_shadow_control(paging->xc_handle, paging->mem_event.domain_id,
+                           XEN_DOMCTL_SHADOW_OP_CLEAN, dirty, max_pages,
+                           NULL, logdirty_gen, NULL) < 0 )
     {
-        /* Randomly choose a gfn to evict */
-        victim->gfn = rand() % paging->domain_info->max_pages;
+        if ( errno != ESTALE )
+        {
+            ERROR("Error sampling the working set");
+            return;
+        }
+
+        DPRINTF("Log-dirty mode taken over, victims will now be chosen "
+                "at random\n");
+        policy_release_logdirty(paging);
+        return;
     }
-    while ( test_bit(victim->gfn, bitmap) );
 
-    return 0;
+    for ( gfn = 0; gfn < max_pages; gfn++ )
+    {
+        if ( test_bit(gfn, dirty) )
+            age[gfn] = 0;
+        else if ( age[gfn] < AGE_MAX )
+            age[gfn]++;
+    }
+}
+
+int policy_choose_victims(xenpaging_t *paging, domid_t domain_id,
+                          xenpaging_victim_t *victims, int nr)
+{
+    unsigned long scanned;
+    int threshold;
+    int i;
+
+    ASSERT(victims != NULL);
+
+    if ( logdirty )
+        policy_sample(paging);
+
+    if ( !logdirty )
+    {
+        for ( i = 0; i < nr; i++ )
+        {
+            /* Domain to pick on */
+            victims[i].domain_id = domain_id;
+
+            do
+            {
+                /* Randomly choose a gfn to evict */
+                victims[i].gfn = rand() % max_pages;
+            }
+            while ( test_bit(victims[i].gfn, bitmap) );
+        }
+
+        return nr;
+    }
+
+    /* Sweeping on from where the last batch stopped tends to pick runs of
+     * neighbouring gfns, which then sit together in the paging file. */
+    i = 0;
+    for ( threshold = COLD_AGE; (i < nr) && (threshold >= 0); threshold-- )
+    {
+        for ( scanned = 0; (i < nr) && (scanned < max_pages); scanned++ )
+        {
+            if ( ++hand >= max_pages )
+                hand = 0;
+
+            /* Passes after the first only add the next youngest pages */
+            if ( test_bit(hand, bitmap) ||
+                 ((threshold == COLD_AGE) ? (age[hand] < threshold)
+                                          : (age[hand] != threshold)) )
+                continue;
+
+            victims[i].domain_id = domain_id;
+            victims[i].gfn = hand;
+            i++;
+        }
+    }
+
+    return i;
 }
 
 void policy_notify_paged_out(domid_t domain_id, unsigned long gfn)
@@ -89,6 +241,10 @@ void policy_notify_paged_in(domid_t domain_id, unsigned long gfn)
     
     mru[i_mru & (MRU_SIZE - 1)] = gfn;
     i_mru++;
+
+    /* Whatever faulted it in was using it */
+    if ( age != NULL )
+        age[gfn] = 0;
 }
 
 
@@ -41,6 +41,12 @@
 #endif
 
 
+/* Victims are nominated, written out and evicted in batches of up to
+ * EVICT_BATCH, and a fault brings in up to READAHEAD_PAGES pages. */
+#define EVICT_BATCH     32
+#define READAHEAD_PAGES 8
+
+
 static void *init_page(void)
 {
     void *buffer;
@@ -215,6 +221,9 @@ int xenpaging_teardown(xenpaging_t *paging)
     if ( paging == NULL )
         return 0;
 
+    /* Stop sampling the working set */
+    policy_teardown(paging);
+
     /* Tear down domain paging in Xen */
     rc = xc_mem_event_disable(paging->xc_handle, paging->mem_event.domain_id);
     if ( rc != 0 )
@@ -302,50 +311,59 @@ static int put_response(mem_event_t *mem_event, mem_event_response_t *rsp)
     return 0;
 }
 
-int xenpaging_evict_page(xenpaging_t *paging, xenpaging_victim_t *victim, int fd, int i)
+/* Write out and evict the nr nominated victims, into the given slots of the
+ * paging file */
+int xenpaging_evict_pages(xenpaging_t *paging, xenpaging_victim_t *victims,
+                          int fd, const int *slots, int nr)
 {
+    unsigned long gfns[EVICT_BATCH];
     void *page;
-    unsigned long gfn;
+    int i;
     int ret;
 
-    DECLARE_DOMCTL;
+    ASSERT(nr <= EVICT_BATCH);
 
-    /* Map page */
-    gfn = victim->gfn;
+    /* Map pages */
+    for ( i = 0; i < nr; i++ )
+        gfns[i] = victims[i].gfn;
     ret = -EFAULT;
-    page = xc_map_foreign_pages(paging->xc_handle, victim->domain_id,
-                                PROT_READ | PROT_WRITE, &gfn, 1);
+    page = xc_map_foreign_pages(paging->xc_handle, paging->mem_event.domain_id,
+                                PROT_READ | PROT_WRITE, gfns, nr);
     if ( page == NULL )
     {
-        ERROR("Error mapping page");
+        ERROR("Error mapping pages");
         goto out;
     }
 
-    /* Copy page */
-    ret = write_page(fd, page, i);
+    /* Copy pages */
+    ret = write_pages(fd, page, slots, nr);
     if ( ret != 0 )
     {
-        munmap(page, PAGE_SIZE);
-        ERROR("Error copying page");
+        munmap(page, nr << PAGE_SHIFT);
+        ERROR("Error copying pages");
         goto out;
     }
 
-    /* Clear page */
-    memset(page, 0, PAGE_SIZE);
+    /* Clear pages */
+    memset(page, 0, nr << PAGE_SHIFT);
 
-    munmap(page, PAGE_SIZE);
+    munmap(page, nr << PAGE_SHIFT);
 
-    /* Tell Xen to evict page */
-    ret = xc_mem_paging_evict(paging->xc_handle, paging->mem_event.domain_id,
-                              victim->gfn);
-    if ( ret != 0 )
+    for ( i = 0; i < nr; i++ )
     {
-        ERROR("Error evicting page");
-        goto out;
-    }
+        /* Tell Xen to evict page */
+        ret = xc_mem_paging_evict(paging->xc_handle,
+                                  paging->mem_event.domain_id,
+                                  victims[i].gfn);
+        if ( ret != 0 )
+        {
+            ERROR("Error evicting page");
+            goto out;
+        }
 
-    /* Notify policy of page being paged in */
-    policy_notify_paged_in(paging->mem_event.domain_id, victim->gfn);
+        /* Notify policy of page being paged out */
+        policy_notify_paged_out(paging->mem_event.domain_id, victims[i].gfn);
+    }
 
  out:
     return ret;
@@ -373,76 +391,106 @@ int xenpaging_resume_page(xenpaging_t *paging, mem_event_response_t *rsp)
     return ret;
 }
 
-int xenpaging_populate_page(xenpaging_t *paging, unsigned long *gfn, int fd, int i)
+/* Bring gfns[0..nr) back from the given slots of the paging file.  Returns
+ * how many were brought in, which is fewer than nr if Xen ran out of memory
+ * for the ones after the first, or < 0 on error. */
+int xenpaging_populate_pages(xenpaging_t *paging, unsigned long *gfns,
+                             int fd, const int *slots, int nr)
 {
     void *page;
+    int i;
     int ret;
 
-    /* Tell Xen to allocate a page for the domain */
-    ret = xc_mem_paging_prep(paging->xc_handle, paging->mem_event.domain_id,
-                             *gfn);
-    if ( ret != 0 )
+    /* Tell Xen to allocate pages for the domain */
+    for ( i = 0; i < nr; i++ )
+    {
+        ret = xc_mem_paging_prep(paging->xc_handle,
+                                 paging->mem_event.domain_id, gfns[i]);
+        if ( ret != 0 )
+            break;
+    }
+    if ( i == 0 )
     {
         ERROR("Error preparing for page in");
         goto out_map;
     }
+    nr = i;
 
-    /* Map page */
+    /* Map pages */
     ret = -EFAULT;
     page = xc_map_foreign_pages(paging->xc_handle, paging->mem_event.domain_id,
-                                PROT_READ | PROT_WRITE, gfn, 1);
+                                PROT_READ | PROT_WRITE, gfns, nr);
     if ( page == NULL )
     {
         ERROR("Error mapping page: page is null");
         goto out_map;
     }
 
-    /* Read page */
-    ret = read_page(fd, page, i);
+    /* Read pages */
+    ret = read_pages(fd, page, slots, nr);
     if ( ret != 0 )
     {
         ERROR("Error reading page");
         goto out;
     }
 
+    ret = nr;
+
  out:
-    munmap(page, PAGE_SIZE);
+    munmap(page, nr << PAGE_SHIFT);
  out_map:
     return ret;
 }
 
-static int evict_victim(xenpaging_t *paging, domid_t domain_id,
-                        xenpaging_victim_t *victim, int fd, int i)
+/* Page out nr more pages, into the given slots of the paging file */
+static int evict_victims(xenpaging_t *paging, domid_t domain_id,
+                         xenpaging_victim_t *victims, int *slot_of_gfn,
+                         int fd, const int *slots, int nr)
 {
+    xenpaging_victim_t batch[EVICT_BATCH];
     int j = 0;
-    int ret;
+    int done, i, n, k;
+    int ret = 0;
 
-    do
+    for ( done = 0; done < nr; done += k )
     {
-        ret = policy_choose_victim(paging, domain_id, victim);
-        if ( ret != 0 )
+        n = policy_choose_victims(paging, domain_id, batch,
+                                  (nr - done < EVICT_BATCH) ?
+                                  nr - done : EVICT_BATCH);
+        if ( n <= 0 )
         {
-            ERROR("Error choosing victim");
+            ERROR("Error choosing victims");
+            ret = -1;
             goto out;
         }
 
-        ret = xc_mem_paging_nominate(paging->xc_handle,
-                                     paging->mem_event.domain_id, victim->gfn);
-        if ( ret == 0 )
-            ret = xenpaging_evict_page(paging, victim, fd, i);
-        else
+        /* Keep the victims Xen lets us have */
+        for ( i = k = 0; i < n; i++ )
         {
-            if ( j++ % 1000 == 0 )
+            ret = xc_mem_paging_nominate(paging->xc_handle,
+                                         paging->mem_event.domain_id,
+                                         batch[i].gfn);
+            if ( ret == 0 )
+                batch[k++] = batch[i];
+            else if ( j++ % 1000 == 0 )
                 if ( xc_mem_paging_flush_ioemu_cache(domain_id) )
                     ERROR("Error flushing ioemu cache");
         }
-    }
-    while ( ret );
+        if ( k == 0 )
+            continue;
 
-    if ( test_and_set_bit(victim->gfn, paging->bitmap) )
-        ERROR("Page has been evicted before");
+        ret = xenpaging_evict_pages(paging, batch, fd, slots + done, k);
+        if ( ret != 0 )
+            goto out;
 
-    ret = 0;
+        for ( i = 0; i < k; i++ )
+        {
+            if ( test_and_set_bit(batch[i].gfn, paging->bitmap) )
+                ERROR("Page has been evicted before");
+            victims[slots[done + i]] = batch[i];
+            slot_of_gfn[batch[i].gfn] = slots[done + i];
+        }
+    }
 
  out:
     return ret;
@@ -454,9 +502,13 @@ int main(int argc, char *argv[])
     int num_pages;
     xenpaging_t *paging;
     xenpaging_victim_t *victims;
+    int *slot_of_gfn = NULL;
+    unsigned long *prefetched = NULL;
     mem_event_request_t req;
     mem_event_response_t rsp;
-    int i;
+    unsigned long gfns[READAHEAD_PAGES];
+    int slots[EVICT_BATCH]; /* READAHEAD_PAGES <= EVICT_BATCH */
+    int i, nr;
     int rc = -1;
     int rc1;
 
@@ -496,13 +548,30 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* Where in the paging file each gfn is, and which gfns were read ahead
+     * of being asked for */
+    slot_of_gfn = malloc(paging->bitmap_size * sizeof(*slot_of_gfn));
+    if ( (slot_of_gfn == NULL) ||
+         (alloc_bitmap(&prefetched, paging->bitmap_size) != 0) )
+    {
+        ERROR("Error allocating memory");
+        goto out;
+    }
+    memset(slot_of_gfn, 0xff, paging->bitmap_size * sizeof(*slot_of_gfn));
+
     /* Evict pages */
     memset(victims, 0, sizeof(xenpaging_victim_t) * num_pages);
-    for ( i = 0; i < num_pages; i++ )
+    for ( i = 0; i < num_pages; i += nr )
     {
-        evict_victim(paging, domain_id, &victims[i], fd, i);
-        if ( i % 100 == 0 )
-            DPRINTF("%d pages evicted\n", i);
+        nr = (num_pages - i < EVICT_BATCH) ? num_pages - i : EVICT_BATCH;
+        for ( rc = 0; rc < nr; rc++ )
+            slots[rc] = i + rc;
+        rc = evict_victims(paging, domain_id, victims, slot_of_gfn, fd,
+                           slots, nr);
+        if ( rc != 0 )
+            goto out;
+        if ( (i / 100) != ((i + nr) / 100) )
+            DPRINTF("%d pages evicted\n", i + nr);
     }
 
     DPRINTF("pages evicted\n");
@@ -532,28 +601,36 @@ int main(int argc, char *argv[])
             }
 
             /* Check if the page has already been paged in */
-            if ( test_and_clear_bit(req.gfn, paging->bitmap) )
+            if ( test_bit(req.gfn, paging->bitmap) )
             {
-                /* Find where in the paging file to read from */
-                for ( i = 0; i < num_pages; i++ )
+                /* Read ahead the paged out gfns following it: they are
+                 * likely to be wanted next, and to sit next to it in the
+                 * paging file.  Xen leaves them prepped until the guest
+                 * touches them, when we need only resume them. */
+                for ( nr = 0; nr < READAHEAD_PAGES; nr++ )
                 {
-                    if ( (victims[i].domain_id == paging->mem_event.domain_id) &&
-                         (victims[i].gfn == req.gfn) )
+                    gfns[nr] = req.gfn + nr;
+                    if ( (gfns[nr] >= paging->bitmap_size) ||
+                         !test_bit(gfns[nr], paging->bitmap) )
                         break;
+                    slots[nr] = slot_of_gfn[gfns[nr]];
                 }
-    
-                if ( i >= num_pages )
+
+                /* Populate the pages */
+                rc = xenpaging_populate_pages(paging, gfns, fd, slots, nr);
+                if ( rc <= 0 )
                 {
-                    DPRINTF("Couldn't find page %lx\n", req.gfn);
+                    ERROR("Error populating page");
                     goto out;
                 }
-                
-                /* Populate the page */
-                rc = xenpaging_populate_page(paging, &req.gfn, fd, i);
-                if ( rc != 0 )
+                nr = rc;
+
+                for ( i = 0; i < nr; i++ )
                 {
-                    ERROR("Error populating page");
-                    goto out;
+                    clear_bit(gfns[i], paging->bitmap);
+                    slot_of_gfn[gfns[i]] = -1;
+                    if ( i != 0 )
+                        set_bit(gfns[i], prefetched);
                 }
 
                 /* Prepare the response */
@@ -569,8 +646,11 @@ int main(int argc, char *argv[])
                     goto out;
                 }
 
-                /* Evict a new page to replace the one we just paged in */
-                evict_victim(paging, domain_id, &victims[i], fd, i);
+                /* Evict new pages to replace the ones we just paged in */
+                rc = evict_victims(paging, domain_id, victims, slot_of_gfn,
+                                   fd, slots, nr);
+                if ( rc != 0 )
+                    goto out;
             }
             else
             {
@@ -579,9 +659,11 @@ int main(int argc, char *argv[])
                         paging->mem_event.domain_id, req.vcpu_id,
                         req.gfn, req.flags & MEM_EVENT_FLAG_VCPU_PAUSED);
 
-                /* Tell Xen to resume the vcpu */
+                /* Tell Xen to resume the vcpu, and to finish paging in a
+                 * page that was read ahead */
                 /* XXX: Maybe just check if the vcpu was paused? */
-                if ( req.flags & MEM_EVENT_FLAG_VCPU_PAUSED )
+                if ( test_and_clear_bit(req.gfn, prefetched) ||
+                     (req.flags & MEM_EVENT_FLAG_VCPU_PAUSED) )
                 {
                     /* Prepare the response */
                     rsp.gfn = req.gfn;
@@ -602,6 +684,8 @@ int main(int argc, char *argv[])
 
  out:
     free(victims);
+    free(slot_of_gfn);
+    free(prefetched);
 
     /* Tear down domain paging */
     rc1 = xenpaging_teardown(paging);
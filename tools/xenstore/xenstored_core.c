@@ -20,7 +20,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/un.h>
 #include <sys/time.h>
 #include <time.h>
@@ -38,6 +38,9 @@
 #include <signal.h>
 #include <assert.h>
 #include <setjmp.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
 
 #include "utils.h"
 #include "list.h"
@@ -63,6 +66,8 @@ static int reopen_log_pipe[2];
 static char *tracefile = NULL;
 static TDB_CONTEXT *tdb_ctx;
 
+uint64_t generation;
+
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
@@ -80,23 +85,6 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (rename(newname, xs_daemon_tdb()) != 0)
-		return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
-}
-
 static char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	switch (type) {
@@ -195,7 +183,7 @@ void trace_destroy(const void *data, const char *type)
 /**
  * Signal handler for SIGHUP, which requests that the trace log is reopened
  * (in the main loop).  A single byte is written to reopen_log_pipe, to awaken
- * the select() in the main loop.
+ * the main loop.
  */
 static void trigger_reopen_log(int signal __attribute__((unused)))
 {
@@ -205,6 +193,19 @@ static void trigger_reopen_log(int signal __attribute__((unused)))
 }
 
 
+/*
+ * SIGTERM and SIGINT wake the main loop the same way, to write back the
+ * store before we go.
+ */
+static void trigger_exit(int signal __attribute__((unused)))
+{
+	char c = 'Q';
+	ssize_t dummy;
+	dummy = write(reopen_log_pipe[1], &c, 1);
+	(void)dummy;
+}
+
+
 static void reopen_log(void)
 {
 	if (tracefile) {
@@ -221,6 +222,246 @@ static void reopen_log(void)
 }
 
 
+/*
+ * The main loop keeps its file descriptors registered with the kernel for
+ * their whole lifetime, rather than rebuilding the set on every iteration:
+ * epoll where we have it, a persistent pollfd array elsewhere.
+ */
+#define IO_IN	1
+#define IO_OUT	2
+#define IO_EDGE	4	/* Report readiness once; the owner drains the fd. */
+
+struct io_event {
+	void *ptr;
+	unsigned int flags;
+};
+
+/* Maximum number of events handled per wakeup. */
+#define IO_BATCH 64
+
+/* Events from the last io_wait() not yet handled, see io_del(). */
+static struct io_event *pending_events;
+static int nr_pending_events;
+
+#if defined(__linux__)
+
+static int epoll_fd = -1;
+
+static void io_init(void)
+{
+	epoll_fd = epoll_create(IO_BATCH);
+	if (epoll_fd < 0)
+		barf_perror("Could not create epoll instance");
+}
+
+static int io_ctl(int op, int fd, void *ptr, unsigned int flags)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = ptr;
+	if (flags & IO_IN)
+		ev.events |= EPOLLIN;
+	if (flags & IO_OUT)
+		ev.events |= EPOLLOUT;
+	if (flags & IO_EDGE)
+		ev.events |= EPOLLET;
+
+	return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+static int io_add(int fd, void *ptr, unsigned int flags)
+{
+	return io_ctl(EPOLL_CTL_ADD, fd, ptr, flags);
+}
+
+static int io_mod(int fd, void *ptr, unsigned int flags)
+{
+	return io_ctl(EPOLL_CTL_MOD, fd, ptr, flags);
+}
+
+static void io_remove(int fd)
+{
+	struct epoll_event ev;
+
+	/* Pre-2.6.9 kernels insist on a non-NULL event. */
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+static int io_poll(struct io_event *events, int max, int timeout)
+{
+	struct epoll_event ev[IO_BATCH];
+	int i, nr;
+
+	if (max > IO_BATCH)
+		max = IO_BATCH;
+
+	nr = epoll_wait(epoll_fd, ev, max, timeout);
+	for (i = 0; i < nr; i++) {
+		events[i].ptr = ev[i].data.ptr;
+		events[i].flags = 0;
+		if (ev[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+			events[i].flags |= IO_IN;
+		if (ev[i].events & EPOLLOUT)
+			events[i].flags |= IO_OUT;
+	}
+
+	return nr;
+}
+
+#else /* !__linux__ */
+
+static struct pollfd *poll_fds;
+static void **poll_ptrs;
+static unsigned int nr_poll_fds, max_poll_fds, next_poll_fd;
+
+static void io_init(void)
+{
+}
+
+static int io_find(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_poll_fds; i++)
+		if (poll_fds[i].fd == fd)
+			return i;
+	return -1;
+}
+
+static int io_mod(int fd, void *ptr, unsigned int flags)
+{
+	int i = io_find(fd);
+
+	if (i < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* poll() is level-triggered only, which is fine for draining. */
+	poll_fds[i].events = 0;
+	if (flags & IO_IN)
+		poll_fds[i].events |= POLLIN;
+	if (flags & IO_OUT)
+		poll_fds[i].events |= POLLOUT;
+	poll_ptrs[i] = ptr;
+
+	return 0;
+}
+
+static int io_add(int fd, void *ptr, unsigned int flags)
+{
+	if (nr_poll_fds == max_poll_fds) {
+		unsigned int max = max_poll_fds ? max_poll_fds * 2 : 16;
+		struct pollfd *fds;
+		void **ptrs;
+
+		fds = talloc_realloc(talloc_autofree_context(), poll_fds,
+				     struct pollfd, max);
+		if (!fds)
+			return -1;
+		poll_fds = fds;
+		ptrs = talloc_realloc(talloc_autofree_context(), poll_ptrs,
+				      void *, max);
+		if (!ptrs)
+			return -1;
+		poll_ptrs = ptrs;
+		max_poll_fds = max;
+	}
+
+	poll_fds[nr_poll_fds].fd = fd;
+	poll_fds[nr_poll_fds].events = 0;
+	poll_fds[nr_poll_fds].revents = 0;
+	poll_ptrs[nr_poll_fds] = ptr;
+	nr_poll_fds++;
+
+	return io_mod(fd, ptr, flags);
+}
+
+static void io_remove(int fd)
+{
+	int i = io_find(fd);
+
+	if (i < 0)
+		return;
+
+	nr_poll_fds--;
+	poll_fds[i] = poll_fds[nr_poll_fds];
+	poll_ptrs[i] = poll_ptrs[nr_poll_fds];
+}
+
+static int io_poll(struct io_event *events, int max, int timeout)
+{
+	unsigned int i, n;
+	int nr = 0;
+
+	if (poll(poll_fds, nr_poll_fds, timeout) < 0)
+		return -1;
+
+	/* Start where we stopped last time so nobody starves. */
+	for (n = 0; n < nr_poll_fds && nr < max; n++) {
+		i = (next_poll_fd + n) % nr_poll_fds;
+		if (!poll_fds[i].revents)
+			continue;
+		events[nr].ptr = poll_ptrs[i];
+		events[nr].flags = 0;
+		if (poll_fds[i].revents & (POLLIN|POLLHUP|POLLERR|POLLNVAL))
+			events[nr].flags |= IO_IN;
+		if (poll_fds[i].revents & POLLOUT)
+			events[nr].flags |= IO_OUT;
+		nr++;
+	}
+	if (nr_poll_fds)
+		next_poll_fd = (next_poll_fd + n) % nr_poll_fds;
+
+	return nr;
+}
+
+#endif /* !__linux__ */
+
+/* Stop watching fd, and forget any events for it we haven't handled yet. */
+static void io_del(int fd, void *ptr)
+{
+	int i;
+
+	io_remove(fd);
+
+	for (i = 0; i < nr_pending_events; i++)
+		if (pending_events[i].ptr == ptr)
+			pending_events[i].ptr = NULL;
+}
+
+static int io_wait(struct io_event *events, int max, int timeout)
+{
+	int nr = io_poll(events, max, timeout);
+
+	pending_events = events;
+	nr_pending_events = nr < 0 ? 0 : nr;
+
+	return nr;
+}
+
+/* Connections with input to process or output to flush, see conn_set_ready. */
+static LIST_HEAD(ready_conns);
+
+void conn_set_ready(struct connection *conn)
+{
+	if (list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_conns);
+}
+
+/* Only ask to hear about a writable socket while we have output queued. */
+static void conn_poll_output(struct connection *conn)
+{
+	bool out = !list_empty(&conn->out_list);
+
+	if (out == conn->poll_out)
+		return;
+
+	if (io_mod(conn->fd, conn, IO_IN | (out ? IO_OUT : 0)) == 0)
+		conn->poll_out = out;
+}
+
 static bool write_messages(struct connection *conn)
 {
 	int ret;
@@ -247,10 +488,6 @@ static bool write_messages(struct connection *conn)
 
 		out->inhdr = false;
 		out->used = 0;
-
-		/* Second write might block if non-zero. */
-		if (out->hdr.msg.len && !conn->domain)
-			return true;
 	}
 
 	ret = conn->write(conn, out->buffer + out->used,
@@ -276,19 +513,16 @@ static int destroy_conn(void *_conn)
 
 	/* Flush outgoing if possible, but don't block. */
 	if (!conn->domain) {
-		fd_set set;
-		struct timeval none;
-
-		FD_ZERO(&set);
-		FD_SET(conn->fd, &set);
-		none.tv_sec = none.tv_usec = 0;
+		struct pollfd pfd = { .fd = conn->fd, .events = POLLOUT };
 
 		while (!list_empty(&conn->out_list)
-		       && select(conn->fd+1, NULL, &set, NULL, &none) == 1)
+		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		io_del(conn->fd, conn);
 		close(conn->fd);
 	}
+	list_del(&conn->ready_list);
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
@@ -297,110 +531,453 @@ static int destroy_conn(void *_conn)
 }
 
 
-static void set_fd(int fd, fd_set *set, int *max)
+static int destroy_fd(void *_fd)
 {
-	if (fd < 0)
-		return;
-	FD_SET(fd, set);
-	if (fd > *max)
-		*max = fd;
+	int *fd = _fd;
+	close(*fd);
+	return 0;
 }
 
+/* Is child a subnode of parent, or equal? */
+bool is_child(const char *child, const char *parent)
+{
+	unsigned int len = strlen(parent);
 
-static int initialize_set(fd_set *inset, fd_set *outset, int sock, int ro_sock,
-			  struct timeval **ptimeout)
+	/* / should really be "" for this algorithm to work, but that's a
+	 * usability nightmare. */
+	if (streq(parent, "/"))
+		return true;
+
+	if (strncmp(child, parent, len) != 0)
+		return false;
+
+	return child[len] == '/' || child[len] == '\0';
+}
+
+/*
+ * The store: every node's record, hashed by name and kept in memory.  The
+ * TDB is written back behind it: never (PERSIST_OFF), every persist_interval
+ * seconds (PERSIST_PERIODIC) or on every change (PERSIST_SYNC).
+ */
+enum persist_mode {
+	PERSIST_OFF,
+	PERSIST_PERIODIC,
+	PERSIST_SYNC,
+};
+
+static enum persist_mode persist = PERSIST_PERIODIC;
+static unsigned int persist_interval = 5;
+
+struct stored_node {
+	/* List of all records, and of those not yet written back. */
+	struct list_head list;
+	struct list_head dirty_list;
+
+	char *name;
+
+	/* The record: dptr is NULL if deleted but still in the TDB. */
+	TDB_DATA data;
+};
+
+static struct hashtable *store;
+static LIST_HEAD(stored_nodes);
+static LIST_HEAD(dirty_nodes);
+
+/* When the dirty nodes are next due to be written back, in seconds of
+ * flush_clock(). */
+static time_t flush_due;
+
+/* Setting the wall clock must not hold back or hurry a flush. */
+static time_t flush_clock(void)
 {
-	static struct timeval zero_timeout = { 0 };
-	struct connection *conn;
-	int max = -1;
+	struct timespec ts;
 
-	*ptimeout = NULL;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		barf_perror("Could not read the monotonic clock");
+	return ts.tv_sec;
+}
 
-	FD_ZERO(inset);
-	FD_ZERO(outset);
+static struct stored_node *find_stored(const char *name)
+{
+	return hashtable_search(store, (void *)name);
+}
 
-	set_fd(sock,               inset, &max);
-	set_fd(ro_sock,            inset, &max);
-	set_fd(reopen_log_pipe[0], inset, &max);
+static struct stored_node *new_stored(const char *name)
+{
+	struct stored_node *sn;
+	char *hkey;
 
-	if (xce_handle != -1)
-		set_fd(xc_evtchn_fd(xce_handle), inset, &max);
+	sn = talloc_zero(talloc_autofree_context(), struct stored_node);
+	hkey = strdup(name);
+	if (!sn || !hkey || !(sn->name = talloc_strdup(sn, name)) ||
+	    !hashtable_insert(store, hkey, sn)) {
+		free(hkey);
+		talloc_free(sn);
+		errno = ENOMEM;
+		return NULL;
+	}
+	INIT_LIST_HEAD(&sn->dirty_list);
+	list_add_tail(&sn->list, &stored_nodes);
+	return sn;
+}
 
-	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = &zero_timeout;
-		} else {
-			set_fd(conn->fd, inset, &max);
-			if (!list_empty(&conn->out_list))
-				FD_SET(conn->fd, outset);
-		}
+static void free_stored(struct stored_node *sn)
+{
+	hashtable_remove(store, sn->name);
+	list_del(&sn->list);
+	list_del(&sn->dirty_list);
+	talloc_free(sn);
+}
+
+/* Copy a record to the TDB, or remove it from there if data.dptr is NULL. */
+static bool write_back(const char *name, TDB_DATA data)
+{
+	TDB_DATA key;
+
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+
+	/* TDB should set errno, but doesn't even set ecode AFAICT. */
+	if (data.dptr ? tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0
+		      : (tdb_delete(tdb_ctx, key) != 0 &&
+			 tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)) {
+		log("TDB error writing back %s: %s", name,
+		    tdb_errorstr(tdb_ctx));
+		errno = EIO;
+		return false;
 	}
+	return true;
+}
 
-	return max;
+static void mark_dirty(struct stored_node *sn)
+{
+	if (list_empty(&dirty_nodes))
+		flush_due = flush_clock() + persist_interval;
+	if (list_empty(&sn->dirty_list))
+		list_add_tail(&sn->dirty_list, &dirty_nodes);
 }
 
-static int destroy_fd(void *_fd)
+bool store_fetch(const char *name, TDB_DATA *data)
 {
-	int *fd = _fd;
-	close(*fd);
-	return 0;
+	struct stored_node *sn = find_stored(name);
+
+	if (!sn || !sn->data.dptr)
+		return false;
+
+	*data = sn->data;
+	return true;
 }
 
-/* Is child a subnode of parent, or equal? */
-bool is_child(const char *child, const char *parent)
+bool store_write(const char *name, TDB_DATA data)
 {
-	unsigned int len = strlen(parent);
+	struct stored_node *sn;
 
-	/* / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare. */
-	if (streq(parent, "/"))
-		return true;
+	if (persist == PERSIST_SYNC && !write_back(name, data))
+		return false;
 
-	if (strncmp(child, parent, len) != 0)
+	sn = find_stored(name);
+	if (!sn && !(sn = new_stored(name)))
 		return false;
 
-	return child[len] == '/' || child[len] == '\0';
+	talloc_free(sn->data.dptr);
+	sn->data = data;
+	talloc_steal(sn, data.dptr);
+
+	if (persist == PERSIST_PERIODIC)
+		mark_dirty(sn);
+	return true;
+}
+
+bool store_delete(const char *name)
+{
+	struct stored_node *sn = find_stored(name);
+	TDB_DATA none = { NULL, 0 };
+
+	if (!sn || !sn->data.dptr) {
+		errno = ENOENT;
+		return false;
+	}
+
+	if (persist == PERSIST_SYNC && !write_back(name, none))
+		return false;
+
+	talloc_free(sn->data.dptr);
+	sn->data = none;
+
+	/* Keep it until the TDB has forgotten it too. */
+	if (persist == PERSIST_PERIODIC)
+		mark_dirty(sn);
+	else
+		free_stored(sn);
+	return true;
+}
+
+bool store_write_all(struct store_change *changes, unsigned int nr)
+{
+	struct stored_node **sn;
+	bool *created;
+	TDB_DATA none = { NULL, 0 };
+	unsigned int i, done;
+
+	sn = talloc_zero_array(NULL, struct stored_node *, nr);
+	created = talloc_zero_array(sn, bool, nr);
+	if (!sn || !created) {
+		talloc_free(sn);
+		errno = ENOMEM;
+		return false;
+	}
+
+	/* Allocate first: a new node stays invisible while its data is NULL. */
+	for (i = 0; i < nr; i++) {
+		sn[i] = find_stored(changes[i].name);
+		if (sn[i] || !changes[i].data.dptr)
+			continue;
+		if (!(sn[i] = new_stored(changes[i].name)))
+			goto undo;
+		created[i] = true;
+	}
+
+	/*
+	 * The TDB has no transactions, so if a write back fails we put back
+	 * what was there.  Whatever can't be put back is left dirty for the
+	 * next flush, as the memory copy stays as it was.
+	 */
+	if (persist == PERSIST_SYNC) {
+		if (tdb_lockall(tdb_ctx) != 0) {
+			log("TDB lock failed: %s", tdb_errorstr(tdb_ctx));
+			errno = EIO;
+			goto undo;
+		}
+		for (done = 0; done < nr; done++)
+			if (!write_back(changes[done].name, changes[done].data))
+				break;
+		if (done < nr) {
+			while (done-- > 0)
+				if (!write_back(changes[done].name,
+						sn[done] ? sn[done]->data : none)
+				    && sn[done])
+					mark_dirty(sn[done]);
+			tdb_unlockall(tdb_ctx);
+			errno = EIO;
+			goto undo;
+		}
+		tdb_unlockall(tdb_ctx);
+	}
+
+	/* Nothing can fail from here on. */
+	for (i = 0; i < nr; i++) {
+		if (!sn[i])
+			continue;
+		talloc_free(sn[i]->data.dptr);
+		sn[i]->data = changes[i].data;
+		if (sn[i]->data.dptr)
+			talloc_steal(sn[i], sn[i]->data.dptr);
+		if (persist == PERSIST_PERIODIC)
+			mark_dirty(sn[i]);
+		else if (!sn[i]->data.dptr && list_empty(&sn[i]->dirty_list))
+			free_stored(sn[i]);
+	}
+
+	talloc_free(sn);
+	return true;
+
+ undo:
+	for (i = 0; i < nr; i++)
+		if (created[i] && list_empty(&sn[i]->dirty_list))
+			free_stored(sn[i]);
+	talloc_free(sn);
+	return false;
+}
+
+/* Write back everything changed since the last flush.  We hold the whole
+ * TDB locked meanwhile, so anyone reading the file sees it all or none. */
+static void flush_store(void)
+{
+	struct stored_node *sn, *tmp;
+
+	if (tdb_lockall(tdb_ctx) != 0) {
+		log("TDB lock failed: %s", tdb_errorstr(tdb_ctx));
+		flush_due = flush_clock() + persist_interval;
+		return;
+	}
+
+	list_for_each_entry_safe(sn, tmp, &dirty_nodes, dirty_list) {
+		/* Leave it dirty, and try again next time. */
+		if (!write_back(sn->name, sn->data))
+			continue;
+
+		list_del_init(&sn->dirty_list);
+		if (!sn->data.dptr)
+			free_stored(sn);
+	}
+
+	tdb_unlockall(tdb_ctx);
+
+	if (!list_empty(&dirty_nodes))
+		flush_due = flush_clock() + persist_interval;
+}
+
+/* Orderly exit: nothing written since the last flush may be lost. */
+static void shutdown_store(void)
+{
+	if (!list_empty(&dirty_nodes))
+		flush_store();
+	if (tdb_ctx)
+		tdb_close(tdb_ctx);
+	exit(0);
+}
+
+/* Milliseconds until the next write back is due, or -1 if none is. */
+static int flush_timeout(void)
+{
+	time_t now;
+
+	if (list_empty(&dirty_nodes))
+		return -1;
+
+	now = flush_clock();
+	return flush_due > now ? (flush_due - now) * 1000 : 0;
+}
+
+static bool is_format_key(TDB_DATA key)
+{
+	return key.dsize == strlen(TDB_FORMAT_KEY) &&
+		memcmp(key.dptr, TDB_FORMAT_KEY, key.dsize) == 0;
+}
+
+/* Does the TDB hold records in the layout we use? */
+static bool check_format(void)
+{
+	TDB_DATA key, data;
+	struct xs_tdb_format *fmt;
+	bool ok;
+
+	key.dptr = TDB_FORMAT_KEY;
+	key.dsize = strlen(TDB_FORMAT_KEY);
+	data = tdb_fetch(tdb_ctx, key);
+	fmt = (void *)data.dptr;
+	ok = fmt && data.dsize == sizeof(*fmt) &&
+		fmt->magic == TDB_FORMAT_MAGIC &&
+		fmt->version == TDB_FORMAT_VERSION;
+	talloc_free(data.dptr);
+	return ok;
+}
+
+/* Stamp a new TDB with the layout of its records. */
+static void write_format(void)
+{
+	TDB_DATA key, data;
+	struct xs_tdb_format fmt = {
+		.magic = TDB_FORMAT_MAGIC,
+		.version = TDB_FORMAT_VERSION,
+	};
+
+	key.dptr = TDB_FORMAT_KEY;
+	key.dsize = strlen(TDB_FORMAT_KEY);
+	data.dptr = (void *)&fmt;
+	data.dsize = sizeof(fmt);
+	if (tdb_store(tdb_ctx, key, data, TDB_REPLACE) != 0)
+		barf("Could not write the TDB format record: %s",
+		     tdb_errorstr(tdb_ctx));
+}
+
+static int load_node(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		     void *private)
+{
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+	struct stored_node *sn;
+	char *name;
+
+	if (is_format_key(key))
+		return 0;
+
+	if (val.dsize < sizeof(*hdr)) {
+		log("load_store: record too short, dropping it");
+		return 0;
+	}
+
+	/* read_node() trusts the lengths, and that children end in a nul. */
+	if (val.dsize != sizeof(*hdr)
+	    + (uint64_t)hdr->num_perms * sizeof(hdr->perms[0])
+	    + (uint64_t)hdr->datalen + hdr->childlen ||
+	    (hdr->childlen && val.dptr[val.dsize - 1] != '\0')) {
+		log("load_store: bad record for %.*s, dropping it",
+		    (int)key.dsize, key.dptr);
+		return 0;
+	}
+
+	name = talloc_strndup(NULL, key.dptr, key.dsize);
+	sn = name ? new_stored(name) : NULL;
+	if (!sn || !(sn->data.dptr = talloc_memdup(sn, val.dptr, val.dsize)))
+		barf("Out of memory loading the store");
+	sn->data.dsize = val.dsize;
+	talloc_free(name);
+
+	/* Nodes changed from now on must look changed. */
+	if (hdr->generation != NO_GENERATION && hdr->generation >= generation)
+		generation = hdr->generation + 1;
+	return 0;
+}
+
+/* Read the whole TDB into memory. */
+static void load_store(void)
+{
+	if (tdb_traverse(tdb_ctx, load_node, NULL) < 0)
+		barf("Could not read the store from the TDB: %s",
+		     tdb_errorstr(tdb_ctx));
 }
 
 /* If it fails, returns NULL and sets errno. */
 static struct node *read_node(struct connection *conn, const char *name)
 {
 	TDB_DATA key, data;
-	uint32_t *p;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
+	struct transaction *trans = conn ? conn->transaction : NULL;
 
 	key.dptr = (void *)name;
 	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
+	/* Nodes written in a transaction are only visible inside it. */
+	if (trans && transaction_fetch(trans, key, &data)) {
+		if (data.dptr == NULL) {
 			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
+			return NULL;
+		}
+	} else {
+		if (!store_fetch(name, &data)) {
+			if (trans)
+				transaction_access(trans, name, NO_GENERATION);
+			errno = ENOENT;
+			return NULL;
+		}
+		if (trans)
+			transaction_access(trans, name,
+				((struct xs_tdb_record_hdr *)data.dptr)->generation);
+
+		/* Callers may change the node in place. */
+		data.dptr = talloc_memdup(NULL, data.dptr, data.dsize);
+		if (!data.dptr) {
+			errno = ENOMEM;
+			return NULL;
 		}
-		return NULL;
 	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = trans;
 	talloc_steal(node, data.dptr);
 
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	/* Generation, datalen, childlen, number of permissions */
+	hdr = (void *)data.dptr;
+	node->generation = hdr->generation;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -409,31 +986,47 @@ static struct node *read_node(struct connection *conn, const char *name)
 	return node;
 }
 
-static bool write_node(struct connection *conn, const struct node *node)
+uint64_t get_node_generation(const char *name)
+{
+	TDB_DATA data;
+
+	if (!store_fetch(name, &data))
+		return NO_GENERATION;
+
+	return ((struct xs_tdb_record_hdr *)data.dptr)->generation;
+}
+
+static bool write_node(struct connection *conn, struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
 	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
 		goto error;
 
+	/* Transactions get their generation when they commit. */
+	if (!conn || !conn->transaction)
+		node->generation = generation++;
+
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = node->generation;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -441,8 +1034,13 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (conn && conn->transaction) {
+		if (!transaction_store(conn->transaction, key, data))
+			goto error;
+		return true;
+	}
+
+	if (!store_write(node->name, data)) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -619,6 +1217,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_set_ready(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -750,14 +1349,22 @@ static void do_read(struct connection *conn, const char *name)
 	send_reply(conn, XS_READ, node->data, node->datalen);
 }
 
-static void delete_node_single(struct connection *conn, struct node *node)
+/* Remove a node from the store, or from the transaction's view of it. */
+static bool remove_node(struct transaction *trans, const char *name)
 {
-	TDB_DATA key;
+	TDB_DATA key, data = { NULL, 0 };
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	key.dptr = (void *)name;
+	key.dsize = strlen(name);
+
+	if (trans)
+		return transaction_store(trans, key, data);
+	return store_delete(name);
+}
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+static void delete_node_single(struct connection *conn, struct node *node)
+{
+	if (!remove_node(conn ? conn->transaction : NULL, node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -798,7 +1405,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn ? conn->transaction : NULL;
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except domains own what they create */
@@ -819,15 +1426,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	remove_node(node->trans, node->name);
 	return 0;
 }
 
@@ -1150,6 +1753,13 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "stats")) {
+		char *stats = transaction_stats(in);
+
+		send_reply(conn, XS_DEBUG, stats, strlen(stats) + 1);
+		return;
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
@@ -1313,10 +1923,81 @@ bad_client:
 	talloc_free(conn);
 }
 
+/* Write as much as the other end will take right now. */
 static void handle_output(struct connection *conn)
 {
-	if (!write_messages(conn))
-		talloc_free(conn);
+	struct buffered_data *out;
+	unsigned int used;
+	bool inhdr;
+
+	while ((out = list_top(&conn->out_list, struct buffered_data, list))) {
+		used = out->used;
+		inhdr = out->inhdr;
+
+		if (!write_messages(conn)) {
+			talloc_free(conn);
+			return;
+		}
+
+		/* No progress: socket buffer or ring is full. */
+		if (list_top(&conn->out_list, struct buffered_data, list) == out
+		    && out->used == used && out->inhdr == inhdr)
+			break;
+	}
+}
+
+/* A socket connection's fd is readable or writable. */
+static void handle_fd_event(struct connection *conn, unsigned int flags)
+{
+	if (flags & IO_OUT)
+		conn_set_ready(conn);
+	if (flags & IO_IN)
+		handle_input(conn);
+}
+
+/*
+ * Service each connection on the ready list once.  Anything still left to do
+ * afterwards goes back on the list for the next round, after we've checked
+ * for new events, so one busy connection can't starve the others.
+ */
+static void handle_ready_conns(void)
+{
+	struct connection *conn;
+	LIST_HEAD(batch);
+
+	list_splice_init(&ready_conns, &batch);
+
+	while ((conn = list_top(&batch, struct connection, ready_list))) {
+		list_del_init(&conn->ready_list);
+
+		/* Handling may free this or any other connection. */
+		talloc_increase_ref_count(conn);
+
+		if (conn->domain) {
+			if (domain_can_read(conn))
+				handle_input(conn);
+			if (talloc_free(conn) == 0)
+				continue;
+
+			talloc_increase_ref_count(conn);
+			if (domain_can_write(conn) &&
+			    !list_empty(&conn->out_list))
+				handle_output(conn);
+			if (talloc_free(conn) == 0)
+				continue;
+
+			if (domain_can_read(conn) ||
+			    (domain_can_write(conn) &&
+			     !list_empty(&conn->out_list)))
+				conn_set_ready(conn);
+		} else {
+			handle_output(conn);
+			if (talloc_free(conn) == 0)
+				continue;
+
+			conn_poll_output(conn);
+		}
+	}
 }
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
@@ -1333,6 +2014,7 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 	new->can_write = true;
 	new->transaction_started = 0;
 	INIT_LIST_HEAD(&new->out_list);
+	INIT_LIST_HEAD(&new->ready_list);
 	INIT_LIST_HEAD(&new->watches);
 	INIT_LIST_HEAD(&new->transaction_list);
 
@@ -1369,10 +2051,9 @@ static int readfd(struct connection *conn, void *data, unsigned int len)
 	int rc;
 
 	while ((rc = read(conn->fd, data, len)) < 0) {
-		if (errno == EAGAIN) {
-			rc = 0;
-			break;
-		}
+		/* Spurious wakeup: nothing to read after all. */
+		if (errno == EAGAIN)
+			return 0;
 		if (errno != EINTR)
 			break;
 	}
@@ -1395,10 +2076,18 @@ static void accept_connection(int sock, bool canwrite)
 	if (fd < 0)
 		return;
 
+	/* We only write when there's room, but never block the daemon. */
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		close(fd);
+		return;
+	}
+
 	conn = new_connection(writefd, readfd);
 	if (conn) {
 		conn->fd = fd;
 		conn->can_write = canwrite;
+		if (io_add(fd, conn, IO_IN) < 0)
+			talloc_free(conn);
 	} else
 		close(fd);
 }
@@ -1428,7 +2117,21 @@ static void setup_structure(void)
 {
 	char *tdbname;
 	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	tdb_ctx = tdb_open(tdbname, 0, TDB_FLAGS, O_RDWR, 0);
+
+	store = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	if (!store)
+		barf_perror("Could not create store");
+
+	/* Without persistence we start from scratch every time. */
+	if (persist != PERSIST_OFF)
+		tdb_ctx = tdb_open(tdbname, 0, TDB_FLAGS, O_RDWR, 0);
+
+	/* Records in another layout would be misread: start afresh. */
+	if (tdb_ctx && !check_format()) {
+		log("%s is not in the current format, recreating it", tdbname);
+		tdb_close(tdb_ctx);
+		tdb_ctx = NULL;
+	}
 
 	if (tdb_ctx) {
 		/* XXX When we make xenstored able to restart, this will have
@@ -1447,6 +2150,7 @@ static void setup_structure(void)
 		*/
 		char *tlocal = talloc_strdup(NULL, "/local");
 
+		load_store();
 		check_store();
 
 		if (remove_local) {
@@ -1459,10 +2163,14 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, TDB_FLAGS, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
+		if (persist != PERSIST_OFF) {
+			tdb_ctx = tdb_open(tdbname, 7919, TDB_FLAGS,
+					   O_RDWR|O_CREAT|O_TRUNC, 0640);
+			if (!tdb_ctx)
+				barf_perror("Could not create tdb file %s",
+					    tdbname);
+			write_format();
+		}
 
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
@@ -1470,10 +2178,14 @@ static void setup_structure(void)
 
 		check_store();
 	}
+
+	/* Start with the file on disk up to date. */
+	if (!list_empty(&dirty_nodes))
+		flush_store();
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1486,7 +2198,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1587,35 +2299,22 @@ static void check_store_(const char *name, struct hashtable *reachable)
 }
 
 
-/**
- * Helper to clean_store below.
- */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
-{
-	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
-
-	if (!hashtable_search(reachable, name)) {
-		log("clean_store: '%s' is orphaned!", name);
-		if (recovery) {
-			tdb_delete(tdb, key);
-		}
-	}
-
-	talloc_free(name);
-
-	return 0;
-}
-
-
 /**
  * Given the list of reachable nodes, iterate over the whole store, and
  * remove any that were not reached.
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	struct stored_node *sn, *tmp;
+
+	list_for_each_entry_safe(sn, tmp, &stored_nodes, list) {
+		if (!sn->data.dptr || hashtable_search(reachable, sn->name))
+			continue;
+
+		log("clean_store: '%s' is orphaned!", sn->name);
+		if (recovery)
+			store_delete(sn->name);
+	}
 }
 
 
@@ -1724,6 +2423,10 @@ static void usage(void)
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
+"  --persist <mode>    how to keep the tdb file up to date: off, periodic\n"
+"                      (the default) or sync,\n"
+"  --persist-interval <secs>\n"
+"                      how often to write changes back in periodic mode,\n"
 "  --verbose           to request verbose execution.\n");
 }
 
@@ -1740,6 +2443,8 @@ static struct option options[] = {
 	{ "transaction", 1, NULL, 't' },
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
+	{ "persist", 1, NULL, 'M' },
+	{ "persist-interval", 1, NULL, 'I' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1748,18 +2453,15 @@ extern void dump_conn(struct connection *conn);
 
 int main(int argc, char *argv[])
 {
-	int opt, *sock, *ro_sock, max;
+	int opt, *sock, *ro_sock;
 	struct sockaddr_un addr;
-	fd_set inset, outset;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
-	int evtchn_fd = -1;
-	struct timeval *timeout;
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
-				  NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "DE:F:HI:M:NPS:t:T:RLVW:",
+				  options, NULL)) != -1) {
 		switch (opt) {
 		case 'D':
 			no_domain_init = true;
@@ -1773,6 +2475,20 @@ int main(int argc, char *argv[])
 		case 'H':
 			usage();
 			return 0;
+		case 'I':
+			persist_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'M':
+			if (streq(optarg, "off"))
+				persist = PERSIST_OFF;
+			else if (streq(optarg, "periodic"))
+				persist = PERSIST_PERIODIC;
+			else if (streq(optarg, "sync"))
+				persist = PERSIST_SYNC;
+			else
+				barf("%s: Unknown persist mode %s", argv[0],
+				     optarg);
+			break;
 		case 'N':
 			dofork = false;
 			break;
@@ -1900,81 +2616,71 @@ int main(int argc, char *argv[])
 	}
 
 	signal(SIGHUP, trigger_reopen_log);
-
-	if (xce_handle != -1)
-		evtchn_fd = xc_evtchn_fd(xce_handle);
+	signal(SIGTERM, trigger_exit);
+	signal(SIGINT, trigger_exit);
 
 	/* Get ready to listen to the tools. */
-	max = initialize_set(&inset, &outset, *sock, *ro_sock, &timeout);
+	io_init();
+	if (io_add(*sock, sock, IO_IN) < 0
+	    || io_add(*ro_sock, ro_sock, IO_IN) < 0
+	    || io_add(reopen_log_pipe[0], reopen_log_pipe, IO_IN) < 0)
+		barf_perror("Could not poll sockets");
+
+	/* handle_event() drains the event channel until it would block. */
+	if (xce_handle != -1) {
+		int evtchn_fd = xc_evtchn_fd(xce_handle);
+
+		if (fcntl(evtchn_fd, F_SETFL,
+			  fcntl(evtchn_fd, F_GETFL) | O_NONBLOCK) < 0
+		    || io_add(evtchn_fd, &xce_handle, IO_IN | IO_EDGE) < 0)
+			barf_perror("Could not poll event channel");
+	}
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
+		struct io_event events[IO_BATCH];
+		int i, nr;
 
-		if (select(max+1, &inset, &outset, NULL, timeout) < 0) {
+		/* Don't sleep while connections still have work queued. */
+		nr = io_wait(events, IO_BATCH,
+			     list_empty(&ready_conns) ? flush_timeout() : 0);
+		if (nr < 0) {
 			if (errno == EINTR)
 				continue;
-			barf_perror("Select failed");
+			barf_perror("Poll failed");
 		}
 
-		if (FD_ISSET(reopen_log_pipe[0], &inset)) {
-			char c;
-			if (read(reopen_log_pipe[0], &c, 1) != 1)
-				barf_perror("read failed");
-			reopen_log();
-		}
+		for (i = 0; i < nr; i++) {
+			void *ptr = events[i].ptr;
 
-		if (FD_ISSET(*sock, &inset))
-			accept_connection(*sock, true);
-
-		if (FD_ISSET(*ro_sock, &inset))
-			accept_connection(*ro_sock, false);
-
-		if (evtchn_fd != -1 && FD_ISSET(evtchn_fd, &inset))
-			handle_event();
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (FD_ISSET(conn->fd, &inset))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (FD_ISSET(conn->fd, &outset))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			}
+			if (ptr == NULL)
+				continue;
+
+			if (ptr == reopen_log_pipe) {
+				char c;
+				if (read(reopen_log_pipe[0], &c, 1) != 1)
+					barf_perror("read failed");
+				if (c == 'Q')
+					shutdown_store();
+				reopen_log();
+			} else if (ptr == sock)
+				accept_connection(*sock, true);
+			else if (ptr == ro_sock)
+				accept_connection(*ro_sock, false);
+			else if (ptr == &xce_handle)
+				handle_event();
+			else
+				handle_fd_event(ptr, events[i].flags);
 		}
+		nr_pending_events = 0;
+
+		handle_ready_conns();
 
-		max = initialize_set(&inset, &outset, *sock, *ro_sock,
-				     &timeout);
+		if (flush_timeout() == 0)
+			flush_store();
 	}
 }
 
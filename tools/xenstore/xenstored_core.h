@@ -73,6 +73,12 @@ struct connection
 	/* Buffered output data */
 	struct list_head out_list;
 
+	/* On the main loop's list of connections with work to do. */
+	struct list_head ready_list;
+
+	/* Is the main loop waiting for the fd to become writable? */
+	bool poll_out;
+
 	/* Transaction context for current request (NULL if none). */
 	struct transaction *transaction;
 
@@ -99,8 +105,11 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL if read from the store itself). */
+	struct transaction *trans;
+
+	/* Generation count when the node was last written. */
+	uint64_t generation;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -118,6 +127,38 @@ struct node {
 	char *children;
 };
 
+/* Records in the TDB: this header, then the permissions, the data and
+ * the nul-separated children. */
+struct xs_tdb_record_hdr {
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
+/* The TDB also holds this record, under TDB_FORMAT_KEY (not a valid node
+ * name), saying which layout the node records are in.  A TDB without it,
+ * or in another layout, is not read. */
+#define TDB_FORMAT_KEY "#xenstored-format"
+#define TDB_FORMAT_MAGIC 0x78737464	/* "xstd" */
+#define TDB_FORMAT_VERSION 2		/* records carry a generation */
+
+struct xs_tdb_format {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* Generation of a node which does not exist. */
+#define NO_GENERATION ~((uint64_t)0)
+
+/* Bumped on every change to the store, and used to stamp changed nodes. */
+extern uint64_t generation;
+
+/* Generation of a node in the store (ignoring transactions), or
+ * NO_GENERATION if it doesn't exist. */
+uint64_t get_node_generation(const char *name);
+
 /* Break input into vectors, return the number, fill in up to num of them. */
 unsigned int get_strings(struct buffered_data *data,
 			 char *vec[], unsigned int num);
@@ -145,17 +186,40 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* The store itself lives in memory, as records in TDB format; the TDB file
+ * is only a copy, written back according to the --persist mode. */
+
+/* Find a node's record.  data->dptr points into the store: copy it before
+ * changing anything.  Returns false if there is no such node. */
+bool store_fetch(const char *name, TDB_DATA *data);
 
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* Replace a node's record.  The store takes over data.dptr (talloc'd). */
+bool store_write(const char *name, TDB_DATA data);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Remove a node's record.  Sets errno to ENOENT if there is none. */
+bool store_delete(const char *name);
+
+/* One change in a store_write_all() batch; data.dptr NULL deletes. */
+struct store_change {
+	const char *name;
+	TDB_DATA data;
+};
+
+/* Apply a batch of changes all or nothing.  The store takes over each
+ * data.dptr (talloc'd) only if it succeeds. */
+bool store_write_all(struct store_change *changes, unsigned int nr);
+
+/* Hashtable helpers for nul-terminated string keys. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
+/* Queue a connection for the main loop to service.  Domain connections
+ * have no fd to poll, so the domain code calls this when their event
+ * channel fires. */
+void conn_set_ready(struct connection *conn);
+
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
@@ -22,6 +22,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
 
 #include "utils.h"
 #include "talloc.h"
@@ -76,6 +78,39 @@ struct domain
 
 static LIST_HEAD(domains);
 
+/* Domains indexed by our local event channel port, for handle_event(). */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
+static int set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	if (port >= nr_port_domains) {
+		unsigned int nr = nr_port_domains ? nr_port_domains : 64;
+		struct domain **map;
+
+		if (!domain)
+			return 0;
+		while (nr <= port)
+			nr *= 2;
+		map = talloc_realloc(talloc_autofree_context(), port_domains,
+				     struct domain *, nr);
+		if (!map)
+			return -1;
+		memset(map + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*map));
+		port_domains = map;
+		nr_port_domains = nr;
+	}
+
+	port_domains[port] = domain;
+	return 0;
+}
+
+static struct domain *find_domain_by_port(evtchn_port_t port)
+{
+	return port < nr_port_domains ? port_domains[port] : NULL;
+}
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -169,6 +204,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xc_evtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -207,19 +243,28 @@ static void domain_cleanup(void)
 		fire_watches(NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+/* The event fd is non-blocking and edge-triggered: read every pending port,
+ * queueing the connection it belongs to, until it runs dry. */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
-	if ((port = xc_evtchn_pending(xce_handle)) == -1)
-		barf_perror("Failed to read from event fd");
+	for (;;) {
+		if ((port = xc_evtchn_pending(xce_handle)) == -1) {
+			if (errno == EAGAIN)
+				break;
+			barf_perror("Failed to read from event fd");
+		}
 
-	if (port == virq_port)
-		domain_cleanup();
+		if (port == virq_port)
+			domain_cleanup();
+		else if ((domain = find_domain_by_port(port)) && domain->conn)
+			conn_set_ready(domain->conn);
 
-	if (xc_evtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+		if (xc_evtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	}
 }
 
 bool domain_can_read(struct connection *conn)
@@ -264,11 +309,16 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	if (rc == -1)
 	    return NULL;
 	domain->port = rc;
+	if (set_port_domain(domain->port, domain) == -1)
+		return NULL;
 
 	domain->conn = new_connection(writechn, readchn);
 	domain->conn->domain = domain;
 	domain->conn->id = domid;
 
+	/* Pick up anything the guest queued before we bound the port. */
+	conn_set_ready(domain->conn);
+
 	domain->remote_port = port;
 	domain->nbentry = 0;
 	domain->nbwatch = 0;
@@ -366,11 +416,17 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xc_evtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xc_evtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
 		domain->remote_port = port;
+		if (domain->port && set_port_domain(domain->port, domain) == -1) {
+			xc_evtchn_unbind(xce_handle, domain->port);
+			domain->port = 0;
+		}
 	} else {
 		send_error(conn, EINVAL);
 		return;
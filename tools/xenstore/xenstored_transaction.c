@@ -33,6 +33,7 @@
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "hashtable.h"
 #include "xs_lib.h"
 #include "utils.h"
 
@@ -60,6 +61,24 @@ struct changed_domain
 	int nbentry;
 };
 
+struct accessed_node
+{
+	/* List of all nodes read or written in this transaction, in order. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Generation of the node in the store when we first looked at it
+	 * (NO_GENERATION if it didn't exist then). */
+	uint64_t generation;
+
+	/* Has the transaction written it?  If so, its new contents:
+	 * dptr is NULL if it was deleted. */
+	bool modified;
+	TDB_DATA data;
+};
+
 struct transaction
 {
 	/* List of all transactions active on this connection. */
@@ -68,12 +87,13 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
+	/* Nodes this transaction depends on, with any it wrote, not yet
+	 * visible outside it: listed in access order, and hashed by name. */
+	struct list_head accessed;
+	struct hashtable *accessed_hash;
 
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* Did we fail to record a node we looked at (out of memory)? */
+	bool untracked;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +103,154 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Transaction statistics, reported by the "stats" debug command. */
+static unsigned long trans_started, trans_committed;
+static unsigned long trans_aborted, trans_conflicts;
+
+static struct accessed_node *find_accessed(struct transaction *trans,
+					   const char *name)
+{
+	return hashtable_search(trans->accessed_hash, (void *)name);
+}
+
+static struct accessed_node *add_accessed(struct transaction *trans,
+					  const char *name,
+					  uint64_t generation)
+{
+	struct accessed_node *an;
+	char *hkey;
+
+	an = talloc_zero(trans, struct accessed_node);
+	hkey = strdup(name);
+	if (!an || !hkey || !hashtable_insert(trans->accessed_hash, hkey, an)) {
+		free(hkey);
+		talloc_free(an);
+		errno = ENOMEM;
+		return NULL;
+	}
+	an->node = talloc_strdup(an, name);
+	an->generation = generation;
+	list_add_tail(&an->list, &trans->accessed);
+	return an;
+}
+
+void transaction_access(struct transaction *trans, const char *name,
+			uint64_t generation)
+{
+	/* We could miss a conflict now, so the commit has to fail. */
+	if (!find_accessed(trans, name) &&
+	    !add_accessed(trans, name, generation))
+		trans->untracked = true;
+}
+
+bool transaction_fetch(struct transaction *trans, TDB_DATA key,
+		       TDB_DATA *data)
+{
+	struct accessed_node *an;
+	char *name;
+
+	name = talloc_strndup(trans, key.dptr, key.dsize);
+	an = find_accessed(trans, name);
+	talloc_free(name);
+	if (!an || !an->modified)
+		return false;
+
+	data->dsize = an->data.dsize;
+	data->dptr = NULL;
+	if (an->data.dptr)
+		data->dptr = talloc_memdup(NULL, an->data.dptr,
+					   an->data.dsize);
+	return true;
+}
+
+bool transaction_store(struct transaction *trans, TDB_DATA key,
+		       TDB_DATA data)
+{
+	struct accessed_node *an;
+	char *name;
+
+	name = talloc_strndup(trans, key.dptr, key.dsize);
+	an = find_accessed(trans, name);
+	if (!an)
+		an = add_accessed(trans, name, get_node_generation(name));
+	talloc_free(name);
+	if (!an)
+		return false;
+
+	talloc_free(an->data.dptr);
+	an->modified = true;
+	an->data.dsize = data.dsize;
+	an->data.dptr = NULL;
+	if (data.dptr)
+		an->data.dptr = talloc_memdup(an, data.dptr, data.dsize);
+	return true;
+}
+
+/* Has anything this transaction looked at changed underneath it? */
+static bool transaction_conflicts(struct transaction *trans)
 {
-	return trans->tdb;
+	struct accessed_node *an;
+
+	list_for_each_entry(an, &trans->accessed, list)
+		if (get_node_generation(an->node) != an->generation)
+			return true;
+	return false;
+}
+
+/* Make everything this transaction wrote visible in the store, all at
+ * once or not at all. */
+static bool commit_nodes(struct transaction *trans)
+{
+	struct xs_tdb_record_hdr *hdr;
+	struct accessed_node *an;
+	struct store_change *changes;
+	unsigned int nr = 0;
+
+	list_for_each_entry(an, &trans->accessed, list)
+		if (an->modified)
+			nr++;
+	if (nr == 0)
+		return true;
+
+	changes = talloc_array(trans, struct store_change, nr);
+	if (!changes) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	nr = 0;
+	list_for_each_entry(an, &trans->accessed, list) {
+		if (!an->modified)
+			continue;
+		if (an->data.dptr) {
+			hdr = (void *)an->data.dptr;
+			hdr->generation = generation++;
+		}
+		changes[nr].name = an->node;
+		changes[nr].data = an->data;
+		nr++;
+	}
+
+	if (!store_write_all(changes, nr))
+		return false;
+
+	/* The store took the records over. */
+	list_for_each_entry(an, &trans->accessed, list)
+		if (an->modified)
+			an->data.dptr = NULL;
+	return true;
+}
+
+char *transaction_stats(const void *ctx)
+{
+	return talloc_asprintf(ctx,
+			       "transactions started: %lu\n"
+			       "transactions committed: %lu\n"
+			       "transactions aborted: %lu\n"
+			       "transactions failed with EAGAIN: %lu\n",
+			       trans_started, trans_committed,
+			       trans_aborted, trans_conflicts);
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +259,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Outside a transaction the store's node generations say it all. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -118,9 +278,9 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	/* The nodes themselves are talloc children of the transaction. */
+	if (trans->accessed_hash)
+		hashtable_destroy(trans->accessed_hash, 0);
 	return 0;
 }
 
@@ -156,18 +316,17 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->untracked = false;
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	if (!trans->accessed_hash) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
+	talloc_set_destructor(trans, destroy_transaction);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -178,8 +337,8 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	/* Now we own it. */
 	list_add_tail(&trans->list, &conn->transaction_list);
 	talloc_steal(conn, trans);
-	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
+	trans_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
@@ -209,17 +368,20 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		/* Only changes to nodes we actually looked at conflict. */
+		if (trans->untracked) {
+			send_error(conn, ENOMEM);
+			return;
+		}
+		if (transaction_conflicts(trans)) {
+			trans_conflicts++;
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
+		if (!commit_nodes(trans)) {
 			send_error(conn, errno);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,8 +390,9 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
-	}
+		trans_committed++;
+	} else
+		trans_aborted++;
 	send_ack(conn, XS_TRANSACTION_END);
 }
 
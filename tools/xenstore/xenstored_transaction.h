@@ -35,9 +35,26 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Remember the generation a node had in the store (NO_GENERATION if it
+ * did not exist) when the transaction first read it: if it has changed by
+ * the time the transaction ends, the transaction fails with EAGAIN. */
+void transaction_access(struct transaction *trans, const char *name,
+			uint64_t generation);
+
+/* If the transaction has written this node, set data to a (talloc'ed)
+ * copy of its contents, with dptr NULL if it was deleted, and return true.
+ * Return false if the node must be read from the store. */
+bool transaction_fetch(struct transaction *trans, TDB_DATA key,
+		       TDB_DATA *data);
+
+/* Record new contents for a node (or its deletion, if data.dptr is NULL)
+ * in the transaction.  Nothing reaches the store until it commits. */
+bool transaction_store(struct transaction *trans, TDB_DATA key,
+		       TDB_DATA data);
 
 void conn_delete_all_transactions(struct connection *conn);
 
+/* Counters of started, committed, aborted and conflicting transactions. */
+char *transaction_stats(const void *ctx);
+
 #endif /* _XENSTORED_TRANSACTION_H */
@@ -30,14 +30,46 @@
 #include "xs_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
+#include "hashtable.h"
 
 extern int quota_nb_watch_per_domain;
 
+/* Watches are indexed by the path they watch, so a change only has to look
+ * at the watches on its own path, its ancestors and (for rm) its
+ * descendants, not at every watch of every connection.  Each indexed path
+ * has a parent one component shorter ("@" event paths hang off "/"), so
+ * the index is a tree; entries stay as long as something is watched at or
+ * below them, and are found by name through watch_paths. */
+struct watch_path
+{
+	/* Paths with the same parent. */
+	struct list_head list;
+
+	struct watch_path *parent;
+
+	/* Indexed paths one component below this one. */
+	struct list_head children;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+
+	char *path;
+};
+
+static struct hashtable *watch_paths;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, and that path's index entry. */
+	struct list_head path_list;
+	struct watch_path *path;
+
+	/* Connection which owns this watch. */
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -86,29 +118,129 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+/* Index entry for the parent of this path, or NULL for "/". */
+static char *watch_parent_path(const void *ctx, const char *path)
+{
+	char *slash = strrchr(path, '/');
+
+	if (streq(path, "/"))
+		return NULL;
+	if (!slash || slash == path)
+		return talloc_strdup(ctx, "/");
+	return talloc_strndup(ctx, path, slash - path);
+}
+
+static struct watch_path *get_watch_path(const char *path)
+{
+	struct watch_path *wp, *parent = NULL;
+	char *parent_path, *key;
+
+	if (!watch_paths) {
+		watch_paths = create_hashtable(64, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_paths)
+			return NULL;
+	}
+
+	wp = hashtable_search(watch_paths, (void *)path);
+	if (wp)
+		return wp;
+
+	parent_path = watch_parent_path(NULL, path);
+	if (parent_path) {
+		parent = get_watch_path(parent_path);
+		talloc_free(parent_path);
+		if (!parent)
+			return NULL;
+	}
+
+	wp = talloc(talloc_autofree_context(), struct watch_path);
+	key = strdup(path);
+	if (!wp || !key || !hashtable_insert(watch_paths, key, wp)) {
+		free(key);
+		talloc_free(wp);
+		return NULL;
+	}
+	wp->path = talloc_strdup(wp, path);
+	wp->parent = parent;
+	INIT_LIST_HEAD(&wp->children);
+	INIT_LIST_HEAD(&wp->watches);
+	if (parent)
+		list_add_tail(&wp->list, &parent->children);
+	else
+		INIT_LIST_HEAD(&wp->list);
+	return wp;
+}
+
+/* Drop index entries which no longer lead to any watch. */
+static void put_watch_path(struct watch_path *wp)
+{
+	struct watch_path *parent;
+
+	while (wp && list_empty(&wp->watches) && list_empty(&wp->children)) {
+		parent = wp->parent;
+		hashtable_remove(watch_paths, wp->path);
+		list_del(&wp->list);
+		talloc_free(wp);
+		wp = parent;
+	}
+}
+
+/* Watches anywhere strictly below this path see it as their own node. */
+static void fire_watches_below(struct watch_path *wp)
+{
+	struct watch_path *child;
+	struct watch *watch;
+
+	list_for_each_entry(child, &wp->children, list) {
+		list_for_each_entry(watch, &child->watches, path_list)
+			add_event(watch->conn, watch, watch->node);
+		fire_watches_below(child);
+	}
+}
+
 void fire_watches(struct connection *conn, const char *name, bool recurse)
 {
-	struct connection *i;
+	struct watch_path *wp;
 	struct watch *watch;
+	char *path;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	if (!watch_paths)
+		return;
+
+	/* Find the longest indexed prefix of the path. */
+	path = talloc_strdup(NULL, name);
+	while (!(wp = hashtable_search(watch_paths, path))) {
+		char *parent = watch_parent_path(NULL, path);
+
+		talloc_free(path);
+		path = parent;
+		if (!path)
+			break;
 	}
+
+	/* Create an event for each watch on the path or above it... */
+	if (wp && streq(wp->path, name) && recurse)
+		fire_watches_below(wp);
+	for (; wp; wp = wp->parent)
+		list_for_each_entry(watch, &wp->watches, path_list)
+			add_event(watch->conn, watch, name);
+	talloc_free(path);
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+
+	trace_destroy(watch, "watch");
+	if (watch->path) {
+		list_del(&watch->path_list);
+		put_watch_path(watch->path);
+	}
 	return 0;
 }
 
@@ -156,6 +288,7 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	watch = talloc(conn, struct watch);
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
+	watch->conn = conn;
 	if (relative)
 		watch->relative_path = get_implicit_path(conn);
 	else
@@ -163,6 +296,14 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 
 	INIT_LIST_HEAD(&watch->events);
 
+	watch->path = get_watch_path(watch->node);
+	if (!watch->path) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	list_add_tail(&watch->path_list, &watch->path->watches);
+
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
 	trace_create(watch, "watch");
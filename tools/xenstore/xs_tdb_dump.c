@@ -10,13 +10,24 @@
 #include "talloc.h"
 #include "utils.h"
 
+/* Must match struct xs_tdb_record_hdr in xenstored_core.h. */
 struct record_hdr {
+	uint64_t generation;
 	uint32_t num_perms;
 	uint32_t datalen;
 	uint32_t childlen;
 	struct xs_permissions perms[0];
 };
 
+/* Must match TDB_FORMAT_* and struct xs_tdb_format in xenstored_core.h. */
+#define FORMAT_KEY "#xenstored-format"
+#define FORMAT_MAGIC 0x78737464
+
+struct format {
+	uint32_t magic;
+	uint32_t version;
+};
+
 static uint32_t total_size(struct record_hdr *hdr)
 {
 	return sizeof(*hdr) + hdr->num_perms * sizeof(struct xs_permissions) 
@@ -51,7 +62,18 @@ int main(int argc, char *argv[])
 
 		data = tdb_fetch(tdb, key);
 		hdr = (void *)data.dptr;
-		if (data.dsize < sizeof(*hdr))
+		if (key.dsize == strlen(FORMAT_KEY) &&
+		    memcmp(key.dptr, FORMAT_KEY, key.dsize) == 0) {
+			struct format *fmt = (void *)data.dptr;
+
+			if (data.dsize != sizeof(*fmt) ||
+			    fmt->magic != FORMAT_MAGIC)
+				fprintf(stderr, "%s: BAD format record\n",
+					FORMAT_KEY);
+			else
+				printf("%s: version %u\n", FORMAT_KEY,
+				       fmt->version);
+		} else if (data.dsize < sizeof(*hdr))
 			fprintf(stderr, "%.*s: BAD truncated\n",
 				(int)key.dsize, key.dptr);
 		else if (data.dsize != total_size(hdr))
@@ -0,0 +1,94 @@
+/* Measure xenstored write throughput against the number of watches. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "xs.h"
+#include "utils.h"
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Spread nr_watches over the connections, none of them on the written
+ * node, then time nr_writes writes. */
+static double bench(struct xs_handle **xsh, unsigned int nr_conns,
+		    unsigned int nr_watches, unsigned int nr_writes)
+{
+	char path[64], token[16];
+	unsigned int i;
+	double start;
+
+	for (i = 0; i < nr_watches; i++) {
+		snprintf(path, sizeof(path), "/bench/watch/%u/%u",
+			 i % nr_conns, i);
+		snprintf(token, sizeof(token), "%u", i);
+		if (!xs_watch(xsh[i % nr_conns], path, token))
+			barf_perror("Could not watch %s", path);
+	}
+
+	start = now();
+	for (i = 0; i < nr_writes; i++) {
+		snprintf(path, sizeof(path), "%u", i);
+		if (!xs_write(xsh[0], XBT_NULL, "/bench/data/node",
+			      path, strlen(path)))
+			barf_perror("Could not write /bench/data/node");
+	}
+	return nr_writes / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	struct xs_handle **xsh;
+	unsigned int nr_conns = 16, nr_writes = 10000, i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_conns = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nr_writes = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			barf("Usage: xs_watch_bench [-c conns] [-n writes] "
+			     "watches...");
+		}
+	}
+	if (optind == argc || nr_conns == 0)
+		barf("Usage: xs_watch_bench [-c conns] [-n writes] "
+		     "watches...");
+
+	xsh = calloc(nr_conns, sizeof(*xsh));
+	if (!xsh)
+		barf("Out of memory");
+
+	for (i = optind; i < argc; i++) {
+		unsigned int nr_watches = strtoul(argv[i], NULL, 10);
+
+		/* Closing the connections drops their watches again. */
+		for (j = 0; j < nr_conns; j++)
+			if (!(xsh[j] = xs_daemon_open()))
+				barf_perror("Could not contact xenstored");
+
+		printf("%u watches: %.0f writes/sec\n", nr_watches,
+		       bench(xsh, nr_conns, nr_watches, nr_writes));
+
+		for (j = 0; j < nr_conns; j++)
+			xs_daemon_close(xsh[j]);
+	}
+
+	if (!(xsh[0] = xs_daemon_open()))
+		barf_perror("Could not contact xenstored");
+	xs_rm(xsh[0], XBT_NULL, "/bench");
+	xs_daemon_close(xsh[0]);
+	return 0;
+}
@@ -361,7 +361,8 @@ static void continue_cpu_idle_loop(void)
 	    irq_stat[cpu].idle_timestamp = jiffies;
 #endif
 	    while ( !softirq_pending(cpu) )
-	        default_idle();
+	        if ( !scrub_free_pages() )
+	            default_idle();
 	    raise_softirq(SCHEDULE_SOFTIRQ);
 	    do_softirq();
 	    if (!cpu_online(cpu))
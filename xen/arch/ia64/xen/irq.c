@@ -458,13 +458,12 @@ int pirq_guest_eoi(struct domain *d, int irq)
 int pirq_guest_unmask(struct domain *d)
 {
     int            irq;
-    shared_info_t *s = d->shared_info;
 
     for ( irq = find_first_bit(d->pirq_mask, NR_IRQS);
           irq < NR_IRQS;
           irq = find_next_bit(d->pirq_mask, NR_IRQS, irq+1) )
     {
-        if ( !test_bit(d->pirq_to_evtchn[irq], &s->evtchn_mask[0]) )
+        if ( !evtchn_port_is_masked(d, d->pirq_to_evtchn[irq]) )
             pirq_guest_eoi(d, irq);
 
     }
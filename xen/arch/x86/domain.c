@@ -122,7 +122,9 @@ void idle_loop(void)
     {
         if ( cpu_is_offline(smp_processor_id()) )
             play_dead();
-        (*pm_idle)();
+        /* Scrub freed pages before going to sleep. */
+        if ( !scrub_free_pages() )
+            (*pm_idle)();
         do_softirq();
     }
 }
@@ -303,8 +303,8 @@ static void hvm_destroy_ioreq_page(
     spin_unlock(&iorp->lock);
 }
 
-static int hvm_set_ioreq_page(
-    struct domain *d, struct hvm_ioreq_page *iorp, unsigned long gmfn)
+static int hvm_map_ioreq_gmfn(
+    struct domain *d, unsigned long gmfn, struct page_info **ppage, void **pva)
 {
     struct page_info *page;
     p2m_type_t p2mt;
@@ -334,13 +334,34 @@ static int hvm_set_ioreq_page(
         return -ENOMEM;
     }
 
+    *ppage = page;
+    *pva = va;
+
+    return 0;
+}
+
+static void hvm_unmap_ioreq_gmfn(struct page_info *page, void *va)
+{
+    unmap_domain_page_global(va);
+    put_page_and_type(page);
+}
+
+static int hvm_set_ioreq_page(
+    struct domain *d, struct hvm_ioreq_page *iorp, unsigned long gmfn)
+{
+    struct page_info *page;
+    void *va;
+    int rc;
+
+    if ( (rc = hvm_map_ioreq_gmfn(d, gmfn, &page, &va)) != 0 )
+        return rc;
+
     spin_lock(&iorp->lock);
 
     if ( (iorp->va != NULL) || d->is_dying )
     {
         spin_unlock(&iorp->lock);
-        unmap_domain_page_global(va);
-        put_page_and_type(mfn_to_page(mfn));
+        hvm_unmap_ioreq_gmfn(page, va);
         return -EINVAL;
     }
 
@@ -354,6 +375,106 @@ static int hvm_set_ioreq_page(
     return 0;
 }
 
+static void hvm_init_bufioreq_ring(struct domain *d)
+{
+    struct hvm_bufioreq_ring *r = &d->arch.hvm_domain.bufioreq_ring;
+
+    memset(r, 0, sizeof(*r));
+    spin_lock_init(&r->lock);
+}
+
+static void hvm_destroy_bufioreq_ring(struct domain *d)
+{
+    struct hvm_bufioreq_ring *r = &d->arch.hvm_domain.bufioreq_ring;
+    unsigned int i;
+    bool_t active;
+
+    spin_lock(&r->lock);
+
+    ASSERT(d->is_dying);
+
+    /* Once nr_slots is clear nothing else touches the ring pages. */
+    active = (r->nr_slots != 0);
+    r->nr_slots = 0;
+
+    spin_unlock(&r->lock);
+
+    if ( !active )
+        return;
+
+    kill_timer(&r->timer);
+
+    for ( i = 0; i <= r->nr_pages; i++ )
+        hvm_unmap_ioreq_gmfn(r->page[i], r->va[i]);
+    r->nr_pages = 0;
+}
+
+/*
+ * Map the extended buffered ioreq ring: the header page at @gmfn and
+ * HVM_PARAM_BUFIOREQ_RING_PAGES pages of slots following it.
+ */
+static int hvm_set_bufioreq_ring(struct domain *d, unsigned long gmfn)
+{
+    struct hvm_bufioreq_ring *r = &d->arch.hvm_domain.bufioreq_ring;
+    unsigned int i, nr = d->arch.hvm_domain.params[HVM_PARAM_BUFIOREQ_RING_PAGES];
+    struct page_info *page[BUF_IOREQ_EXT_MAX_PAGES + 1];
+    void *va[BUF_IOREQ_EXT_MAX_PAGES + 1];
+    buffered_iopage_ext_t *hdr;
+    int port, rc = 0;
+
+    if ( (nr == 0) || (d->vcpu == NULL) || (d->vcpu[0] == NULL) )
+        return -EINVAL;
+
+    for ( i = 0; i <= nr; i++ )
+        if ( (rc = hvm_map_ioreq_gmfn(d, gmfn + i, &page[i], &va[i])) != 0 )
+            goto fail;
+
+    port = alloc_unbound_xen_event_channel(
+        d->vcpu[0], d->arch.hvm_domain.params[HVM_PARAM_DM_DOMAIN]);
+    if ( port < 0 )
+    {
+        rc = port;
+        goto fail;
+    }
+
+    spin_lock(&r->lock);
+
+    if ( (r->nr_slots != 0) || d->is_dying )
+    {
+        spin_unlock(&r->lock);
+        free_xen_event_channel(d->vcpu[0], port);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    memcpy(r->page, page, sizeof(page));
+    memcpy(r->va, va, sizeof(va));
+    r->nr_pages = nr;
+    r->write_pointer = r->notified = 0;
+    r->port = port;
+    r->timer_armed = 0;
+    init_timer(&r->timer, hvm_bufioreq_ring_timer_fn, d,
+               d->vcpu[0]->processor);
+
+    hdr = r->va[0];
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->nr_slots = nr * BUF_IOREQ_EXT_PER_PAGE;
+
+    /* Publish the ring to hvm_buffered_io_send() only once it is set up. */
+    wmb();
+    r->nr_slots = hdr->nr_slots;
+    d->arch.hvm_domain.params[HVM_PARAM_BUFIOREQ_EVTCHN] = port;
+
+    spin_unlock(&r->lock);
+
+    return 0;
+
+ fail:
+    while ( i-- > 0 )
+        hvm_unmap_ioreq_gmfn(page[i], va[i]);
+    return rc;
+}
+
 static int hvm_print_line(
     int dir, uint32_t port, uint32_t bytes, uint32_t *val)
 {
@@ -422,6 +543,7 @@ int hvm_domain_initialise(struct domain *d)
 
     hvm_init_ioreq_page(d, &d->arch.hvm_domain.ioreq);
     hvm_init_ioreq_page(d, &d->arch.hvm_domain.buf_ioreq);
+    hvm_init_bufioreq_ring(d);
 
     register_portio_handler(d, 0xe9, 1, hvm_print_line);
 
@@ -446,6 +568,7 @@ void hvm_domain_relinquish_resources(struct domain *d)
 {
     hvm_destroy_ioreq_page(d, &d->arch.hvm_domain.ioreq);
     hvm_destroy_ioreq_page(d, &d->arch.hvm_domain.buf_ioreq);
+    hvm_destroy_bufioreq_ring(d);
 
     msixtbl_pt_cleanup(d);
 
@@ -845,7 +968,10 @@ void hvm_vcpu_destroy(struct vcpu *v)
     hvm_funcs.vcpu_destroy(v);
     xfree(v->arch.hvm_vcpu.xsave_area);
 
-    /* Event channel is already freed by evtchn_destroy(). */
+    /*
+     * The ioreq event channel was already closed by evtchn_destroy(), and
+     * its bucket is freed with the domain in evtchn_destroy_final().
+     */
     /*free_xen_event_channel(v, v->arch.hvm_vcpu.xen_port);*/
 }
 
@@ -896,7 +1022,7 @@ bool_t hvm_send_assist_req(struct vcpu *v)
      * prepare_wait_on_xen_event_channel() is an implicit barrier.
      */
     p->state = STATE_IOREQ_READY;
-    notify_via_xen_event_channel(v->arch.hvm_vcpu.xen_port);
+    notify_via_xen_event_channel(v->domain, v->arch.hvm_vcpu.xen_port);
 
     return 1;
 }
@@ -2796,6 +2922,19 @@ long do_hvm_op(unsigned long op, XEN_GUEST_HANDLE(void) arg)
                 iorp = &d->arch.hvm_domain.buf_ioreq;
                 rc = hvm_set_ioreq_page(d, iorp, a.value);
                 break;
+            case HVM_PARAM_BUFIOREQ_RING_PAGES:
+                /* Power of two, and fixed once the ring is mapped. */
+                if ( (a.value == 0) || (a.value > BUF_IOREQ_EXT_MAX_PAGES) ||
+                     (a.value & (a.value - 1)) ||
+                     (d->arch.hvm_domain.bufioreq_ring.nr_slots != 0) )
+                    rc = -EINVAL;
+                break;
+            case HVM_PARAM_BUFIOREQ_RING_PFN:
+                rc = hvm_set_bufioreq_ring(d, a.value);
+                break;
+            case HVM_PARAM_BUFIOREQ_EVTCHN:
+                rc = -EPERM;
+                break;
             case HVM_PARAM_CALLBACK_IRQ:
                 hvm_set_callback_via(d, a.value);
                 hvm_latch_shinfo_size(d);
@@ -48,13 +48,55 @@ hvm_mmio_handlers[HVM_MMIO_HANDLER_NR] =
     &msixtbl_mmio_handler
 };
 
+/*
+ * Rep string I/O is carried out in chunks of up to HVM_REP_CHUNK bytes of
+ * guest memory, copying each chunk to or from the guest in one go rather
+ * than one element at a time.
+ */
+#define HVM_REP_CHUNK 256
+
+/* Guest physical address of @n rep elements starting with element @i. */
+static paddr_t hvm_rep_gpa(const ioreq_t *p, unsigned int i, unsigned int n)
+{
+    if ( p->df )
+        return p->data - (paddr_t)(i + n - 1) * p->size;
+    return p->data + (paddr_t)i * p->size;
+}
+
+/* MMIO address of rep element @i. */
+static paddr_t hvm_rep_addr(const ioreq_t *p, unsigned int i)
+{
+    if ( p->df )
+        return p->addr - (paddr_t)i * p->size;
+    return p->addr + (paddr_t)i * p->size;
+}
+
+/* Where element @k of a chunk of @n elements lives in the chunk buffer. */
+static void *hvm_rep_slot(const ioreq_t *p, uint8_t *buf,
+                          unsigned int k, unsigned int n)
+{
+    return buf + (p->df ? n - 1 - k : k) * p->size;
+}
+
+/*
+ * Of a chunk of @n elements of which only the first @k were transferred,
+ * the part of the chunk buffer holding them.
+ */
+static void *hvm_rep_done(const ioreq_t *p, uint8_t *buf,
+                          unsigned int k, unsigned int n)
+{
+    return buf + (p->df ? n - k : 0) * p->size;
+}
+
 static int hvm_mmio_access(struct vcpu *v,
                            ioreq_t *p,
                            hvm_mmio_read_t read_handler,
                            hvm_mmio_write_t write_handler)
 {
+    uint8_t buf[HVM_REP_CHUNK];
     unsigned long data;
-    int rc = X86EMUL_OKAY, i, sign = p->df ? -1 : 1;
+    unsigned int i, j, n;
+    int rc = X86EMUL_OKAY, ret = HVMCOPY_okay;
 
     if ( !p->data_is_ptr )
     {
@@ -68,46 +110,61 @@ static int hvm_mmio_access(struct vcpu *v,
         return rc;
     }
 
-    if ( p->dir == IOREQ_READ )
+    ASSERT(p->size <= sizeof(data));
+
+    for ( i = 0; i < p->count; i += j )
     {
-        for ( i = 0; i < p->count; i++ )
-        {
-            int ret;
+        n = p->count - i;
+        if ( n > HVM_REP_CHUNK / p->size )
+            n = HVM_REP_CHUNK / p->size;
 
-            rc = read_handler(v, p->addr + (sign * i * p->size), p->size,
-                              &data);
-            if ( rc != X86EMUL_OKAY )
-                break;
-            ret = hvm_copy_to_guest_phys(p->data + (sign * i * p->size),
-                                         &data,
-                                         p->size);
-            if ( (ret == HVMCOPY_gfn_paged_out) || 
-                 (ret == HVMCOPY_gfn_shared) )
+        if ( p->dir == IOREQ_READ )
+        {
+            for ( j = 0; j < n; j++ )
             {
-                rc = X86EMUL_RETRY;
-                break;
+                rc = read_handler(v, hvm_rep_addr(p, i + j),
+                                  p->size, &data);
+                if ( rc != X86EMUL_OKAY )
+                    break;
+                memcpy(hvm_rep_slot(p, buf, j, n), &data, p->size);
             }
+            if ( j == 0 )
+                break;
+            ret = hvm_copy_to_guest_phys(hvm_rep_gpa(p, i, j),
+                                         hvm_rep_done(p, buf, j, n),
+                                         j * p->size);
         }
-    }
-    else
-    {
-        for ( i = 0; i < p->count; i++ )
+        else
         {
-            int ret;
-
-            ret = hvm_copy_from_guest_phys(&data,
-                                           p->data + (sign * i * p->size),
-                                           p->size);
-            if ( (ret == HVMCOPY_gfn_paged_out) || 
+            ret = hvm_copy_from_guest_phys(buf, hvm_rep_gpa(p, i, n),
+                                           n * p->size);
+            if ( (ret == HVMCOPY_gfn_paged_out) ||
                  (ret == HVMCOPY_gfn_shared) )
             {
                 rc = X86EMUL_RETRY;
                 break;
             }
-            rc = write_handler(v, p->addr + (sign * i * p->size), p->size,
-                               data);
-            if ( rc != X86EMUL_OKAY )
-                break;
+            for ( j = 0; j < n; j++ )
+            {
+                data = 0;
+                memcpy(&data, hvm_rep_slot(p, buf, j, n), p->size);
+                rc = write_handler(v, hvm_rep_addr(p, i + j),
+                                   p->size, data);
+                if ( rc != X86EMUL_OKAY )
+                    break;
+            }
+        }
+
+        if ( (ret == HVMCOPY_gfn_paged_out) ||
+             (ret == HVMCOPY_gfn_shared) )
+        {
+            rc = X86EMUL_RETRY;
+            break;
+        }
+        if ( rc != X86EMUL_OKAY )
+        {
+            i += j;
+            break;
         }
     }
 
@@ -123,22 +180,40 @@ static int hvm_mmio_access(struct vcpu *v,
 int hvm_mmio_intercept(ioreq_t *p)
 {
     struct vcpu *v = current;
+    unsigned int hint = v->arch.hvm_vcpu.mmio_handler_hint;
     int i;
 
+    /*
+     * MMIO handlers decide for themselves which ranges they cover, and
+     * some of those ranges move, so they cannot be indexed by address.
+     * Accesses tend to come in runs to the same device though, so try
+     * the handler which claimed the last access first.
+     */
+    if ( hvm_mmio_handlers[hint]->check_handler(v, p->addr) )
+        return hvm_mmio_access(
+            v, p,
+            hvm_mmio_handlers[hint]->read_handler,
+            hvm_mmio_handlers[hint]->write_handler);
+
     for ( i = 0; i < HVM_MMIO_HANDLER_NR; i++ )
-        if ( hvm_mmio_handlers[i]->check_handler(v, p->addr) )
+        if ( (i != hint) && hvm_mmio_handlers[i]->check_handler(v, p->addr) )
+        {
+            v->arch.hvm_vcpu.mmio_handler_hint = i;
             return hvm_mmio_access(
                 v, p,
                 hvm_mmio_handlers[i]->read_handler,
                 hvm_mmio_handlers[i]->write_handler);
+        }
 
     return X86EMUL_UNHANDLEABLE;
 }
 
 static int process_portio_intercept(portio_action_t action, ioreq_t *p)
 {
-    int rc = X86EMUL_OKAY, i, sign = p->df ? -1 : 1;
+    uint8_t buf[HVM_REP_CHUNK];
     uint32_t data;
+    unsigned int i, j, n;
+    int rc = X86EMUL_OKAY;
 
     if ( !p->data_is_ptr )
     {
@@ -155,27 +230,47 @@ static int process_portio_intercept(portio_action_t action, ioreq_t *p)
         return rc;
     }
 
-    if ( p->dir == IOREQ_READ )
+    ASSERT(p->size <= sizeof(data));
+
+    for ( i = 0; i < p->count; i += j )
     {
-        for ( i = 0; i < p->count; i++ )
+        n = p->count - i;
+        if ( n > HVM_REP_CHUNK / p->size )
+            n = HVM_REP_CHUNK / p->size;
+
+        if ( p->dir == IOREQ_READ )
         {
-            rc = action(IOREQ_READ, p->addr, p->size, &data);
-            if ( rc != X86EMUL_OKAY )
-                break;
-            (void)hvm_copy_to_guest_phys(p->data + sign*i*p->size,
-                                         &data, p->size);
+            for ( j = 0; j < n; j++ )
+            {
+                rc = action(IOREQ_READ, p->addr, p->size, &data);
+                if ( rc != X86EMUL_OKAY )
+                    break;
+                memcpy(hvm_rep_slot(p, buf, j, n), &data, p->size);
+            }
+            if ( j != 0 )
+                (void)hvm_copy_to_guest_phys(hvm_rep_gpa(p, i, j),
+                                             hvm_rep_done(p, buf, j, n),
+                                             j * p->size);
         }
-    }
-    else /* p->dir == IOREQ_WRITE */
-    {
-        for ( i = 0; i < p->count; i++ )
+        else /* p->dir == IOREQ_WRITE */
         {
-            data = 0;
-            (void)hvm_copy_from_guest_phys(&data, p->data + sign*i*p->size,
-                                           p->size);
-            rc = action(IOREQ_WRITE, p->addr, p->size, &data);
-            if ( rc != X86EMUL_OKAY )
-                break;
+            memset(buf, 0, n * p->size);
+            (void)hvm_copy_from_guest_phys(buf, hvm_rep_gpa(p, i, n),
+                                           n * p->size);
+            for ( j = 0; j < n; j++ )
+            {
+                data = 0;
+                memcpy(&data, hvm_rep_slot(p, buf, j, n), p->size);
+                rc = action(IOREQ_WRITE, p->addr, p->size, &data);
+                if ( rc != X86EMUL_OKAY )
+                    break;
+            }
+        }
+
+        if ( rc != X86EMUL_OKAY )
+        {
+            i += j;
+            break;
         }
     }
 
@@ -188,6 +283,48 @@ static int process_portio_intercept(portio_action_t action, ioreq_t *p)
     return rc;
 }
 
+/*
+ * Handlers are kept sorted by type and then by address, and do not
+ * overlap, so the one covering an access, if any, is the last one that
+ * starts at or below it.
+ */
+static int io_handler_cmp(const struct io_handler *h,
+                          int type, unsigned long addr)
+{
+    if ( h->type != type )
+        return (h->type < type) ? -1 : 1;
+    if ( h->addr != addr )
+        return (h->addr < addr) ? -1 : 1;
+    return 0;
+}
+
+static struct io_handler *hvm_find_io_handler(
+    struct hvm_io_handler *handler, int type, unsigned long addr,
+    unsigned long size)
+{
+    struct io_handler *h;
+    int lo = 0, hi = handler->num_slot, mid;
+
+    /* Find the first handler starting above @addr. */
+    while ( lo < hi )
+    {
+        mid = (lo + hi) / 2;
+        if ( io_handler_cmp(&handler->hdl_list[mid], type, addr) <= 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ( lo == 0 )
+        return NULL;
+
+    h = &handler->hdl_list[lo - 1];
+    if ( (h->type != type) || ((addr + size) > (h->addr + h->size)) )
+        return NULL;
+
+    return h;
+}
+
 /*
  * Check if the request is handled inside xen
  * return value: 0 --not handled; 1 --handled
@@ -195,10 +332,7 @@ static int process_portio_intercept(portio_action_t action, ioreq_t *p)
 int hvm_io_intercept(ioreq_t *p, int type)
 {
     struct vcpu *v = current;
-    struct hvm_io_handler *handler =
-        &v->domain->arch.hvm_domain.io_handler;
-    int i;
-    unsigned long addr, size;
+    struct io_handler *h;
 
     if ( type == HVM_PORTIO )
     {
@@ -207,23 +341,14 @@ int hvm_io_intercept(ioreq_t *p, int type)
             return rc;
     }
 
-    for ( i = 0; i < handler->num_slot; i++ )
-    {
-        if ( type != handler->hdl_list[i].type )
-            continue;
-        addr = handler->hdl_list[i].addr;
-        size = handler->hdl_list[i].size;
-        if ( (p->addr >= addr) &&
-             ((p->addr + p->size) <= (addr + size)) )
-        {
-            if ( type == HVM_PORTIO )
-                return process_portio_intercept(
-                    handler->hdl_list[i].action.portio, p);
-            return handler->hdl_list[i].action.mmio(p);
-        }
-    }
+    h = hvm_find_io_handler(&v->domain->arch.hvm_domain.io_handler,
+                            type, p->addr, p->size);
+    if ( h == NULL )
+        return X86EMUL_UNHANDLEABLE;
 
-    return X86EMUL_UNHANDLEABLE;
+    if ( type == HVM_PORTIO )
+        return process_portio_intercept(h->action.portio, p);
+    return h->action.mmio(p);
 }
 
 void register_io_handler(
@@ -231,16 +356,33 @@ void register_io_handler(
     void *action, int type)
 {
     struct hvm_io_handler *handler = &d->arch.hvm_domain.io_handler;
-    int num = handler->num_slot;
+    struct io_handler *h;
+    int num = handler->num_slot, i;
 
     BUG_ON(num >= MAX_IO_HANDLER);
 
-    handler->hdl_list[num].addr = addr;
-    handler->hdl_list[num].size = size;
-    if ( (handler->hdl_list[num].type = type) == HVM_PORTIO )
-        handler->hdl_list[num].action.portio = action;
+    /* Keep the list sorted, and refuse overlapping ranges. */
+    for ( i = num; i > 0; i-- )
+    {
+        h = &handler->hdl_list[i - 1];
+        if ( io_handler_cmp(h, type, addr) < 0 )
+            break;
+        handler->hdl_list[i] = *h;
+    }
+
+    BUG_ON((i > 0) && (handler->hdl_list[i - 1].type == type) &&
+           (handler->hdl_list[i - 1].addr +
+            handler->hdl_list[i - 1].size > addr));
+    BUG_ON((i < num) && (handler->hdl_list[i + 1].type == type) &&
+           (addr + size > handler->hdl_list[i + 1].addr));
+
+    h = &handler->hdl_list[i];
+    h->addr = addr;
+    h->size = size;
+    if ( (h->type = type) == HVM_PORTIO )
+        h->action.portio = action;
     else
-        handler->hdl_list[num].action.mmio = action;
+        h->action.mmio = action;
     handler->num_slot++;
 }
 
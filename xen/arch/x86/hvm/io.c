@@ -46,6 +46,102 @@
 #include <xen/iocap.h>
 #include <public/hvm/ioreq.h>
 
+/*
+ * How long posts to the extended buffered ioreq ring may sit unsignalled
+ * when they do not fill a quarter of the ring.
+ */
+static unsigned int bufioreq_notify_us = 500;
+integer_param("bufioreq_notify_us", bufioreq_notify_us);
+
+static void hvm_bufioreq_ring_notify(
+    struct domain *d, struct hvm_bufioreq_ring *r)
+{
+    if ( r->notified == r->write_pointer )
+        return;
+    r->notified = r->write_pointer;
+    notify_via_xen_event_channel(d, r->port);
+}
+
+void hvm_bufioreq_ring_timer_fn(void *data)
+{
+    struct domain *d = data;
+    struct hvm_bufioreq_ring *r = &d->arch.hvm_domain.bufioreq_ring;
+
+    spin_lock(&r->lock);
+    r->timer_armed = 0;
+    if ( r->nr_slots != 0 )
+        hvm_bufioreq_ring_notify(d, r);
+    spin_unlock(&r->lock);
+}
+
+static int hvm_bufioreq_ring_send(struct domain *d, ioreq_t *p, int size)
+{
+    struct hvm_bufioreq_ring *r = &d->arch.hvm_domain.bufioreq_ring;
+    buffered_iopage_ext_t *hdr;
+    buf_ioreq_ext_t bp, *slot;
+    uint32_t idx;
+    int i, nr = (size == 3) ? 2 : 1;
+
+    /*
+     * Addresses are 64 bits wide and a repeated write of a single value
+     * is posted as one entry, but guest memory buffers must still be
+     * accessed synchronously.
+     */
+    if ( p->data_is_ptr || (p->count == 0) || (p->count > 0xffff) )
+        return 0;
+
+    memset(&bp, 0, sizeof(bp));
+    bp.type  = p->type;
+    bp.dir   = p->dir;
+    bp.df    = p->df;
+    bp.size  = size;
+    bp.count = p->count;
+    bp.addr  = p->addr;
+    bp.data  = p->data;
+
+    spin_lock(&r->lock);
+
+    if ( r->nr_slots == 0 )
+    {
+        spin_unlock(&r->lock);
+        return 0;
+    }
+
+    hdr = r->va[0];
+    if ( (r->write_pointer - hdr->read_pointer) > (r->nr_slots - nr) )
+    {
+        /* The ring is full: kick the device model, then go synchronous. */
+        hvm_bufioreq_ring_notify(d, r);
+        spin_unlock(&r->lock);
+        return 0;
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        idx = (r->write_pointer + i) & (r->nr_slots - 1);
+        slot = (buf_ioreq_ext_t *)r->va[1 + idx / BUF_IOREQ_EXT_PER_PAGE];
+        slot[idx % BUF_IOREQ_EXT_PER_PAGE] = bp;
+        bp.data = p->data >> 32;
+    }
+
+    /* Make the entries visible /before/ write_pointer. */
+    wmb();
+    r->write_pointer += nr;
+    hdr->write_pointer = r->write_pointer;
+
+    if ( (r->write_pointer - r->notified) >= (r->nr_slots / 4) )
+        hvm_bufioreq_ring_notify(d, r);
+    else if ( !r->timer_armed )
+    {
+        r->timer_armed = 1;
+        set_timer(&r->timer, NOW() + MICROSECS(bufioreq_notify_us));
+    }
+
+    spin_unlock(&r->lock);
+
+    return 1;
+}
+
 int hvm_buffered_io_send(ioreq_t *p)
 {
     struct vcpu *v = current;
@@ -53,44 +149,49 @@ int hvm_buffered_io_send(ioreq_t *p)
     buffered_iopage_t *pg = iorp->va;
     buf_ioreq_t bp;
     /* Timeoffset sends 64b data, but no address. Use two consecutive slots. */
-    int qw = 0;
+    int qw = 0, size;
 
     /* Ensure buffered_iopage fits in a page */
     BUILD_BUG_ON(sizeof(buffered_iopage_t) > PAGE_SIZE);
 
-    /*
-     * Return 0 for the cases we can't deal with:
-     *  - 'addr' is only a 20-bit field, so we cannot address beyond 1MB
-     *  - we cannot buffer accesses to guest memory buffers, as the guest
-     *    may expect the memory buffer to be synchronously accessed
-     *  - the count field is usually used with data_is_ptr and since we don't
-     *    support data_is_ptr we do not waste space for the count field either
-     */
-    if ( (p->addr > 0xffffful) || p->data_is_ptr || (p->count != 1) )
-        return 0;
-
-    bp.type = p->type;
-    bp.dir  = p->dir;
     switch ( p->size )
     {
     case 1:
-        bp.size = 0;
+        size = 0;
         break;
     case 2:
-        bp.size = 1;
+        size = 1;
         break;
     case 4:
-        bp.size = 2;
+        size = 2;
         break;
     case 8:
-        bp.size = 3;
+        size = 3;
         qw = 1;
         break;
     default:
         gdprintk(XENLOG_WARNING, "unexpected ioreq size: %u\n", p->size);
         return 0;
     }
-    
+
+    /* The device model set up the extended ring: use it exclusively. */
+    if ( v->domain->arch.hvm_domain.bufioreq_ring.nr_slots != 0 )
+        return hvm_bufioreq_ring_send(v->domain, p, size);
+
+    /*
+     * Return 0 for the cases we can't deal with:
+     *  - 'addr' is only a 20-bit field, so we cannot address beyond 1MB
+     *  - we cannot buffer accesses to guest memory buffers, as the guest
+     *    may expect the memory buffer to be synchronously accessed
+     *  - the count field is usually used with data_is_ptr and since we don't
+     *    support data_is_ptr we do not waste space for the count field either
+     */
+    if ( (p->addr > 0xffffful) || p->data_is_ptr || (p->count != 1) )
+        return 0;
+
+    bp.type = p->type;
+    bp.dir  = p->dir;
+    bp.size = size;
     bp.data = p->data;
     bp.addr = p->addr;
     
@@ -1035,7 +1035,7 @@ int pirq_guest_unmask(struct domain *d)
           irq < nr;
           irq = find_next_bit(d->pirq_mask, nr, irq+1) )
     {
-        if ( !test_bit(d->pirq_to_evtchn[irq], &shared_info(d, evtchn_mask)) )
+        if ( !evtchn_port_is_masked(d, d->pirq_to_evtchn[irq]) )
             __pirq_guest_eoi(d, irq);
     }
 
@@ -1619,15 +1619,13 @@ static void dump_irqs(unsigned char key)
                 pirq = domain_irq_to_pirq(d, irq);
                 printk("%u:%3d(%c%c%c%c)",
                        d->domain_id, pirq,
-                       (test_bit(d->pirq_to_evtchn[pirq],
-                                 &shared_info(d, evtchn_pending)) ?
+                       (evtchn_port_is_pending(d, d->pirq_to_evtchn[pirq]) ?
                         'P' : '-'),
                        (test_bit(d->pirq_to_evtchn[pirq] /
                                  BITS_PER_EVTCHN_WORD(d),
                                  &vcpu_info(d->vcpu[0], evtchn_pending_sel)) ?
                         'S' : '-'),
-                       (test_bit(d->pirq_to_evtchn[pirq],
-                                 &shared_info(d, evtchn_mask)) ?
+                       (evtchn_port_is_masked(d, d->pirq_to_evtchn[pirq]) ?
                         'M' : '-'),
                        (test_bit(pirq, d->pirq_mask) ?
                         'M' : '-'));
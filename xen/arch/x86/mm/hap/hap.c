@@ -115,7 +115,7 @@ static void hap_vram_tracking_init(struct domain *d)
 {
     paging_log_dirty_init(d, hap_enable_vram_tracking,
                           hap_disable_vram_tracking,
-                          hap_clean_vram_tracking);
+                          hap_clean_vram_tracking, NULL);
 }
 
 int hap_track_dirty_vram(struct domain *d,
@@ -199,6 +199,8 @@ static int hap_enable_log_dirty(struct domain *d)
     d->arch.paging.mode |= PG_log_dirty;
     hap_unlock(d);
 
+    p2m_track_logdirty_splits(d);
+
     /* set l1e entries of P2M table to be read-only. */
     p2m_change_entry_type_global(d, p2m_ram_rw, p2m_ram_logdirty);
     flush_tlb_mask(&d->domain_dirty_cpumask);
@@ -213,6 +215,9 @@ static int hap_disable_log_dirty(struct domain *d)
 
     /* set l1e entries of P2M table with normal mode */
     p2m_change_entry_type_global(d, p2m_ram_logdirty, p2m_ram_rw);
+
+    /* and give back the superpages that tracking split */
+    p2m_coalesce_logdirty_splits(d);
     return 0;
 }
 
@@ -223,6 +228,14 @@ static void hap_clean_dirty_bitmap(struct domain *d)
     flush_tlb_mask(&d->domain_dirty_cpumask);
 }
 
+static void hap_clean_dirty_range(struct domain *d, unsigned long pfn,
+                                  const unsigned long *bitmap,
+                                  unsigned int nr)
+{
+    /* set just the dirtied l1e entries of P2M table to be read-only. */
+    p2m_change_type_bitmap(d, pfn, bitmap, nr, p2m_ram_rw, p2m_ram_logdirty);
+}
+
 void hap_logdirty_init(struct domain *d)
 {
     struct sh_dirty_vram *dirty_vram = d->arch.hvm_domain.dirty_vram;
@@ -236,7 +249,8 @@ void hap_logdirty_init(struct domain *d)
     /* Reinitialize logdirty mechanism */
     paging_log_dirty_init(d, hap_enable_log_dirty,
                           hap_disable_log_dirty,
-                          hap_clean_dirty_bitmap);
+                          hap_clean_dirty_bitmap,
+                          hap_clean_dirty_range);
 }
 
 /************************************************/
@@ -797,7 +811,12 @@ hap_write_p2m_entry(struct vcpu *v, unsigned long gfn, l1_pgentry_t *p,
     safe_write_pte(p, new);
     if ( (old_flags & _PAGE_PRESENT)
          && (level == 1 || (level == 2 && (old_flags & _PAGE_PSE))) )
-             flush_tlb_mask(&v->domain->domain_dirty_cpumask);
+    {
+        if ( v->domain->arch.p2m->defer_flush )
+            v->domain->arch.p2m->flush_pending = 1;
+        else
+            flush_tlb_mask(&v->domain->domain_dirty_cpumask);
+    }
 
 #if CONFIG_PAGING_LEVELS == 3
     /* install P2M in monitor table for PAE Xen */
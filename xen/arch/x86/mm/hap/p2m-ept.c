@@ -187,6 +187,7 @@ ept_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
     int direct_mmio = (p2mt == p2m_mmio_direct);
     uint8_t ipat = 0;
     int need_modify_vtd_table = 1;
+    struct page_info *old_table = NULL;
 
     /* We only support 4k and 2m pages now */
     BUG_ON(order && order != EPT_TABLE_ORDER);
@@ -226,6 +227,11 @@ ept_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
         if ( mfn_valid(mfn_x(mfn)) || direct_mmio || p2m_is_paged(p2mt) ||
              (p2mt == p2m_ram_paging_in_start) )
         {
+            /* 4k pages replaced by a 2meg one: their table goes once the
+             * EPT has been synced. */
+            if ( order && !ept_entry->sp_avail && (ept_entry->epte & 0x7) )
+                old_table = mfn_to_page(ept_entry->mfn);
+
             ept_entry->emt = epte_get_entry_emt(d, gfn, mfn, &ipat,
                                                 direct_mmio);
             ept_entry->ipat = ipat;
@@ -320,6 +326,7 @@ ept_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
 
         unmap_domain_page(split_table);
         *ept_entry = l2_ept_entry;
+        p2m_note_logdirty_split(d, gfn);
     }
 
     /* Track the highest gfn for which we have ever had a valid mapping */
@@ -333,7 +340,16 @@ ept_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
 out:
     unmap_domain_page(table);
 
-    ept_sync_domain(d);
+    if ( d->arch.p2m->defer_flush && (old_table == NULL) )
+        d->arch.p2m->flush_pending = 1;
+    else
+        ept_sync_domain(d);
+
+    if ( old_table != NULL )
+    {
+        page_list_del(old_table, &d->arch.p2m->pages);
+        d->arch.p2m->free_page(d, old_table);
+    }
 
     /* Now the p2m table is not shared with vt-d page table */
     if ( iommu_enabled && need_iommu(d) && need_modify_vtd_table )
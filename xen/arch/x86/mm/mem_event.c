@@ -38,7 +38,7 @@
 static void mem_event_notify(struct domain *d)
 {
     prepare_wait_on_xen_event_channel(d->mem_event.xen_port);
-    notify_via_xen_event_channel(d->mem_event.xen_port);
+    notify_via_xen_event_channel(d, d->mem_event.xen_port);
 }
 
 
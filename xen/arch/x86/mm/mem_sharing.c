@@ -711,7 +711,10 @@ private_page_found:
         atomic_dec(&nr_saved_mfns);
     shr_unlock();
 
-    if(p2m_change_type(d, gfn, p2m_ram_shared, p2m_ram_rw) != 
+    /* Keep log-dirty tracking this gfn, as guest_physmap_add_entry() does */
+    if(p2m_change_type(d, gfn, p2m_ram_shared,
+                       paging_mode_log_dirty(d) ? p2m_ram_logdirty
+                                                : p2m_ram_rw) != 
                                                 p2m_ram_shared) 
     {
         printk("Could not change p2m type.\n");
@@ -34,6 +34,7 @@
 #include <public/mem_event.h>
 #include <asm/mem_sharing.h>
 #include <xen/event.h>
+#include <xen/rangeset.h>
 
 /* Debugging and auditing of the P2M code? */
 #define P2M_AUDIT     0
@@ -220,6 +221,7 @@ p2m_next_level(struct domain *d, mfn_t *table_mfn, void **table,
                                  __PAGE_HYPERVISOR|_PAGE_USER);
         paging_write_p2m_entry(d, gfn,
                                p2m_entry, *table_mfn, new_entry, 2);
+        p2m_note_logdirty_split(d, gfn);
     }
 
     *table_mfn = _mfn(l1e_get_pfn(*p2m_entry));
@@ -1095,7 +1097,10 @@ p2m_pod_demand_populate(struct domain *d, unsigned long gfn,
 
     gfn_aligned = (gfn >> order) << order;
 
-    set_p2m_entry(d, gfn_aligned, mfn, order, p2m_ram_rw);
+    /* Under log-dirty the first write must fault, or a range clean that
+     * only re-arms dirtied pfns will never see this one. */
+    set_p2m_entry(d, gfn_aligned, mfn, order,
+                  paging_mode_log_dirty(d) ? p2m_ram_logdirty : p2m_ram_rw);
 
     for( i = 0 ; i < (1UL << order) ; i++ )
         set_gpfn_from_mfn(mfn_x(mfn) + i, gfn_aligned + i);
@@ -1196,6 +1201,7 @@ p2m_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
     l1_pgentry_t *p2m_entry;
     l1_pgentry_t entry_content;
     l2_pgentry_t l2e_content;
+    struct page_info *old_table = NULL;
     int rv=0;
 
     if ( tb_init_done )
@@ -1262,14 +1268,11 @@ p2m_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
                                    L2_PAGETABLE_ENTRIES);
         ASSERT(p2m_entry);
         
-        /* FIXME: Deal with 4k replaced by 2meg pages */
+        /* 4k pages replaced by a 2meg one: their table goes once the
+         * TLBs can no longer be using it. */
         if ( (l1e_get_flags(*p2m_entry) & _PAGE_PRESENT) &&
              !(l1e_get_flags(*p2m_entry) & _PAGE_PSE) )
-        {
-            P2M_ERROR("configure P2M table 4KB L2 entry with large page\n");
-            domain_crash(d);
-            goto out;
-        }
+            old_table = mfn_to_page(_mfn(l1e_get_pfn(*p2m_entry)));
         
         if ( mfn_valid(mfn) || p2m_is_magic(p2mt) )
             l2e_content = l2e_from_pfn(mfn_x(mfn),
@@ -1279,6 +1282,13 @@ p2m_set_entry(struct domain *d, unsigned long gfn, mfn_t mfn,
         
         entry_content.l1 = l2e_content.l2;
         paging_write_p2m_entry(d, gfn, p2m_entry, table_mfn, entry_content, 2);
+
+        if ( old_table != NULL )
+        {
+            flush_tlb_mask(&d->domain_dirty_cpumask);
+            page_list_del(old_table, &d->arch.p2m->pages);
+            d->arch.p2m->free_page(d, old_table);
+        }
     }
 
     /* Track the highest gfn for which we have ever had a valid mapping */
@@ -2354,6 +2364,123 @@ p2m_type_t p2m_change_type(struct domain *d, unsigned long gfn,
     return pt;
 }
 
+/* Used by log-dirty clean to re-protect just the pages which were dirtied.
+ * Nothing else can update the p2m while we hold its lock, so the flushes
+ * for the individual entries can all be left to the end. */
+void p2m_change_type_bitmap(struct domain *d, unsigned long gfn,
+                            const unsigned long *bitmap, unsigned int nr,
+                            p2m_type_t ot, p2m_type_t nt)
+{
+    struct p2m_domain *p2m = d->arch.p2m;
+    p2m_type_t pt;
+    mfn_t mfn;
+    unsigned int i;
+
+    BUG_ON(p2m_is_grant(ot) || p2m_is_grant(nt));
+
+    p2m_lock(p2m);
+    p2m->defer_flush = 1;
+
+    for ( i = find_first_bit(bitmap, nr); i < nr;
+          i = find_next_bit(bitmap, nr, i + 1) )
+    {
+        mfn = gfn_to_mfn_query(d, gfn + i, &pt);
+        if ( pt == ot )
+            set_p2m_entry(d, gfn + i, mfn, 0, nt);
+    }
+
+    p2m->defer_flush = 0;
+    if ( p2m->flush_pending )
+    {
+        p2m->flush_pending = 0;
+        if ( p2m->set_entry == p2m_set_entry )
+            flush_tlb_mask(&d->domain_dirty_cpumask);
+        else
+            ept_sync_domain(d);
+    }
+
+    p2m_unlock(p2m);
+}
+
+/* Log-dirty tracking splits superpages to write-protect their 4k pages
+ * one at a time, so note which 2MB frames were split to coalesce them again
+ * when it is turned off. */
+void p2m_track_logdirty_splits(struct domain *d)
+{
+    struct p2m_domain *p2m = d->arch.p2m;
+    struct rangeset *r;
+
+    r = rangeset_new(d, "log-dirty splits", RANGESETF_prettyprint_hex);
+    if ( r == NULL )
+        return;
+
+    p2m_lock(p2m);
+    if ( p2m->logdirty_splits == NULL )
+    {
+        p2m->logdirty_splits = r;
+        r = NULL;
+    }
+    p2m_unlock(p2m);
+
+    if ( r != NULL )
+        rangeset_destroy(r);
+}
+
+/* Called with the p2m lock held when the superpage at gfn is split. */
+void p2m_note_logdirty_split(struct domain *d, unsigned long gfn)
+{
+    struct rangeset *r = d->arch.p2m->logdirty_splits;
+
+    /* Losing track of one only loses us coalescing it again. */
+    if ( (r != NULL) && rangeset_add_singleton(r, gfn >> 9) )
+        P2M_DEBUG("dom%d: split of %#lx not tracked\n", d->domain_id, gfn);
+}
+
+static int p2m_coalesce_superpages(unsigned long s, unsigned long e,
+                                   void *ctxt)
+{
+    struct domain *d = ctxt;
+    unsigned long gfn, i;
+    p2m_type_t t0, t;
+    mfn_t mfn0, mfn;
+
+    for ( ; s <= e; s++ )
+    {
+        gfn = s << 9;
+        mfn0 = gfn_to_mfn_query(d, gfn, &t0);
+        if ( (t0 != p2m_ram_rw) || !superpage_aligned(mfn_x(mfn0)) )
+            continue;
+
+        for ( i = 1; i < SUPERPAGE_PAGES; i++ )
+        {
+            mfn = gfn_to_mfn_query(d, gfn + i, &t);
+            if ( (t != p2m_ram_rw) || (mfn_x(mfn) != mfn_x(mfn0) + i) )
+                break;
+        }
+
+        if ( i == SUPERPAGE_PAGES )
+            set_p2m_entry(d, gfn, mfn0, 9, p2m_ram_rw);
+    }
+
+    return 0;
+}
+
+void p2m_coalesce_logdirty_splits(struct domain *d)
+{
+    struct p2m_domain *p2m = d->arch.p2m;
+    struct rangeset *r;
+
+    p2m_lock(p2m);
+    r = p2m->logdirty_splits;
+    p2m->logdirty_splits = NULL;
+    if ( r != NULL )
+        rangeset_report_ranges(r, 0, ~0UL, p2m_coalesce_superpages, d);
+    p2m_unlock(p2m);
+
+    if ( r != NULL )
+        rangeset_destroy(r);
+}
+
 int
 set_mmio_p2m_entry(struct domain *d, unsigned long gfn, mfn_t mfn)
 {
@@ -2530,8 +2657,10 @@ void p2m_mem_paging_populate(struct domain *d, unsigned long gfn)
     /* Fix p2m mapping */
     /* XXX: It seems inefficient to have this here, as it's only needed
      *      in one case (ept guest accessing paging out page) */
+    /* A page still paging out keeps its mfn, and so does one the pager has
+     * already prepped (perhaps reading it ahead of the guest's access). */
     gfn_to_mfn(d, gfn, &p2mt);
-    if ( p2mt != p2m_ram_paging_out )
+    if ( p2mt == p2m_ram_paged )
     {
         p2m_lock(d->arch.p2m);
         set_p2m_entry(d, gfn, _mfn(PAGING_MFN), 0, p2m_ram_paging_in_start);
@@ -2579,10 +2708,12 @@ void p2m_mem_paging_resume(struct domain *d)
     /* Pull the response off the ring */
     mem_event_get_response(d, &rsp);
 
-    /* Fix p2m entry */
+    /* Fix p2m entry, keeping the page write-protected if dirty pages are
+     * being logged (the pager samples its working set that way) */
     mfn = gfn_to_mfn(d, rsp.gfn, &p2mt);
     p2m_lock(d->arch.p2m);
-    set_p2m_entry(d, rsp.gfn, mfn, 0, p2m_ram_rw);
+    set_p2m_entry(d, rsp.gfn, mfn, 0,
+                  paging_mode_log_dirty(d) ? p2m_ram_logdirty : p2m_ram_rw);
     p2m_unlock(d->arch.p2m);
 
     /* Unpause domain */
@@ -158,15 +158,12 @@ static void paging_free_log_dirty_page(struct domain *d, mfn_t mfn)
     free_domheap_page(mfn_to_page(mfn));
 }    
 
-void paging_free_log_dirty_bitmap(struct domain *d)
+static void paging_free_log_dirty_trie(struct domain *d, mfn_t top)
 {
     mfn_t *l4, *l3, *l2;
     int i4, i3, i2;
 
-    if ( !mfn_valid(d->arch.paging.log_dirty.top) )
-        return;
-
-    l4 = map_domain_page(mfn_x(d->arch.paging.log_dirty.top));
+    l4 = map_domain_page(mfn_x(top));
 
     for ( i4 = 0; i4 < LOGDIRTY_NODE_ENTRIES; i4++ )
     {
@@ -195,7 +192,15 @@ void paging_free_log_dirty_bitmap(struct domain *d)
     }
 
     unmap_domain_page(l4);
-    paging_free_log_dirty_page(d, d->arch.paging.log_dirty.top);
+    paging_free_log_dirty_page(d, top);
+}
+
+void paging_free_log_dirty_bitmap(struct domain *d)
+{
+    if ( !mfn_valid(d->arch.paging.log_dirty.top) )
+        return;
+
+    paging_free_log_dirty_trie(d, d->arch.paging.log_dirty.top);
 
     d->arch.paging.log_dirty.top = _mfn(INVALID_MFN);
     ASSERT(d->arch.paging.log_dirty.allocs == 0);
@@ -226,6 +231,8 @@ int paging_log_dirty_enable(struct domain *d)
 
     /* Safe because the domain is paused. */
     ret = d->arch.paging.log_dirty.enable_log_dirty(d);
+    if ( (ret == 0) && (++d->arch.paging.log_dirty.generation == 0) )
+        d->arch.paging.log_dirty.generation = 1;
 
     /* Possibility of leaving the bitmap allocated here but it'll be
      * tidied on domain teardown. */
@@ -335,20 +342,223 @@ void paging_mark_dirty(struct domain *d, unsigned long guest_mfn)
     log_dirty_unlock(d);
 }
 
+/* Map the snapshot trie node at *slot, allocating it if need be. */
+static mfn_t *paging_log_dirty_snapshot_node(struct domain *d, mfn_t *slot)
+{
+    mfn_t *node;
+
+    if ( mfn_valid(*slot) )
+        return map_domain_page(mfn_x(*slot));
+
+    *slot = paging_new_log_dirty_node(d, &node);
+    if ( mfn_valid(*slot) )
+        return node;
+    /* No dirty bit was lost: the caller cleans the old way instead. */
+    d->arch.paging.log_dirty.failed_allocs--;
+    return NULL;
+}
+
+/* A clean copies the bits it clears from the leaf l1, which holds the bits
+ * from pfn, into a second trie at *snap; once the log-dirty lock has been
+ * dropped, paging_log_dirty_rearm() hands them to the paging mode's
+ * clean_dirty_range() so that only the pfns which were dirtied get their
+ * traps re-armed.  Copies bytes [offset, offset + bytes) of l1, if any of
+ * them is set.  Returns 0 if a page for the snapshot couldn't be had, when
+ * the caller must fall back to clean_dirty_bitmap(). */
+static int paging_log_dirty_snapshot(struct domain *d, mfn_t *snap,
+                                     unsigned long pfn,
+                                     const unsigned long *l1,
+                                     unsigned int offset, unsigned int bytes)
+{
+    mfn_t *l4, *l3, *l2, *slot;
+    unsigned long *s1;
+
+    if ( find_next_bit(l1, (offset + bytes) << 3, offset << 3) >=
+         ((offset + bytes) << 3) )
+        return 1;
+
+    if ( (l4 = paging_log_dirty_snapshot_node(d, snap)) == NULL )
+        return 0;
+    l3 = paging_log_dirty_snapshot_node(d, &l4[L4_LOGDIRTY_IDX(pfn)]);
+    unmap_domain_page(l4);
+    if ( l3 == NULL )
+        return 0;
+    l2 = paging_log_dirty_snapshot_node(d, &l3[L3_LOGDIRTY_IDX(pfn)]);
+    unmap_domain_page(l3);
+    if ( l2 == NULL )
+        return 0;
+
+    slot = &l2[L2_LOGDIRTY_IDX(pfn)];
+    if ( mfn_valid(*slot) )
+        s1 = map_domain_page(mfn_x(*slot));
+    else if ( !mfn_valid(*slot = paging_new_log_dirty_leaf(d, &s1)) )
+    {
+        d->arch.paging.log_dirty.failed_allocs--;
+        unmap_domain_page(l2);
+        return 0;
+    }
+    unmap_domain_page(l2);
+
+    memcpy((uint8_t *)s1 + offset, (const uint8_t *)l1 + offset, bytes);
+    unmap_domain_page(s1);
+    return 1;
+}
+
+/* Re-arm the traps for the pfns a clean took out of the bitmap: just those
+ * in the snapshot, or everything if it is incomplete.  Called without the
+ * log-dirty lock, with the domain paused.  Frees the snapshot. */
+static void paging_log_dirty_rearm(struct domain *d, mfn_t snap, int all)
+{
+    mfn_t *l4, *l3, *l2;
+    unsigned long *l1;
+    int i4, i3, i2;
+    s_time_t start = NOW();
+
+    if ( all )
+        d->arch.paging.log_dirty.clean_dirty_bitmap(d);
+    else if ( mfn_valid(snap) )
+    {
+        l4 = map_domain_page(mfn_x(snap));
+        for ( i4 = 0; i4 < LOGDIRTY_NODE_ENTRIES; i4++ )
+        {
+            if ( !mfn_valid(l4[i4]) )
+                continue;
+            l3 = map_domain_page(mfn_x(l4[i4]));
+            for ( i3 = 0; i3 < LOGDIRTY_NODE_ENTRIES; i3++ )
+            {
+                if ( !mfn_valid(l3[i3]) )
+                    continue;
+                l2 = map_domain_page(mfn_x(l3[i3]));
+                for ( i2 = 0; i2 < LOGDIRTY_NODE_ENTRIES; i2++ )
+                {
+                    if ( !mfn_valid(l2[i2]) )
+                        continue;
+                    l1 = map_domain_page(mfn_x(l2[i2]));
+                    d->arch.paging.log_dirty.clean_dirty_range(
+                        d, ((((unsigned long)i4 * LOGDIRTY_NODE_ENTRIES + i3) *
+                             LOGDIRTY_NODE_ENTRIES + i2) << (PAGE_SHIFT + 3)),
+                        l1, PAGE_SIZE << 3);
+                    unmap_domain_page(l1);
+                }
+                unmap_domain_page(l2);
+            }
+            unmap_domain_page(l3);
+        }
+        unmap_domain_page(l4);
+    }
+
+    d->arch.paging.log_dirty.clean_time_us = (NOW() - start) / 1000;
+
+    if ( mfn_valid(snap) )
+    {
+        log_dirty_lock(d);
+        paging_free_log_dirty_trie(d, snap);
+        log_dirty_unlock(d);
+    }
+}
+
+/* The walk for OP_PEEK_RANGE and OP_CLEAN_RANGE: only the leaves covering
+ * the range are visited.  Called with the log-dirty lock held.  Sets *all
+ * if a CLEAN_RANGE couldn't snapshot what it cleared. */
+static int paging_log_dirty_op_range(struct domain *d,
+                                     struct xen_domctl_shadow_op *sc,
+                                     int peek, int clean,
+                                     mfn_t *snap, int *all)
+{
+    static unsigned long zeroes[PAGE_SIZE/BYTES_PER_LONG];
+    unsigned long pfn, done, max_pfn = domain_get_maximum_gpfn(d) + 1;
+    unsigned int offset, bytes;
+    mfn_t mfn, *l4, *l3, *l2;
+    unsigned long *l1;
+    int rv = 0;
+
+    /* Stay within the guest, which also bounds the time spent here. */
+    if ( sc->start_pfn >= max_pfn )
+        return -EINVAL;
+    if ( sc->pages > max_pfn - sc->start_pfn )
+        sc->pages = max_pfn - sc->start_pfn;
+
+    l4 = map_domain_page(mfn_x(d->arch.paging.log_dirty.top));
+
+    for ( done = 0; done < sc->pages; done += bytes << 3 )
+    {
+        pfn = sc->start_pfn + done;
+        offset = L1_LOGDIRTY_IDX(pfn) >> 3;
+        bytes = PAGE_SIZE - offset;
+        if ( ((sc->pages - done + 7) >> 3) < bytes )
+            bytes = (unsigned int)((sc->pages - done + 7) >> 3);
+
+        l1 = zeroes;
+        mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+        if ( mfn_valid(mfn) )
+        {
+            l3 = map_domain_page(mfn_x(mfn));
+            mfn = l3[L3_LOGDIRTY_IDX(pfn)];
+            unmap_domain_page(l3);
+            if ( mfn_valid(mfn) )
+            {
+                l2 = map_domain_page(mfn_x(mfn));
+                mfn = l2[L2_LOGDIRTY_IDX(pfn)];
+                unmap_domain_page(l2);
+                if ( mfn_valid(mfn) )
+                    l1 = map_domain_page(mfn_x(mfn));
+            }
+        }
+
+        if ( peek &&
+             copy_to_guest_offset(sc->dirty_bitmap, done >> 3,
+                                  (uint8_t *)l1 + offset, bytes) != 0 )
+            rv = -EFAULT;
+        else if ( clean && l1 != zeroes )
+        {
+            if ( !*all &&
+                 !paging_log_dirty_snapshot(d, snap, pfn - (offset << 3), l1,
+                                            offset, bytes) )
+                *all = 1;
+            memset((uint8_t *)l1 + offset, 0, bytes);
+        }
+
+        if ( l1 != zeroes )
+            unmap_domain_page(l1);
+        if ( rv )
+            break;
+    }
+
+    unmap_domain_page(l4);
+
+    if ( done < sc->pages )
+        sc->pages = done;
+
+    return rv;
+}
+
 /* Read a domain's log-dirty bitmap and stats.  If the operation is a CLEAN,
  * clear the bitmap and stats as well. */
 int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
 {
-    int rv = 0, clean = 0, peek = 1;
+    int rv = 0, clean = 0, peek = 1, range = 0, pause, all;
     unsigned long pages = 0;
+    mfn_t snap = _mfn(INVALID_MFN);
     mfn_t *l4, *l3, *l2;
     unsigned long *l1;
     int i4, i3, i2;
 
-    domain_pause(d);
-    log_dirty_lock(d);
+    clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN) ||
+            (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE);
+    range = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE) ||
+            (sc->op == XEN_DOMCTL_SHADOW_OP_PEEK_RANGE);
+
+    if ( range && (sc->start_pfn & 7) )
+        return -EINVAL;
 
-    clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN);
+    /* Without a clean_dirty_range() hook every clean re-arms everything. */
+    all = !d->arch.paging.log_dirty.clean_dirty_range;
+
+    /* Just reading (part of) the bitmap only needs the log-dirty lock. */
+    pause = clean || !range;
+    if ( pause )
+        domain_pause(d);
+    log_dirty_lock(d);
 
     PAGING_DEBUG(LOGDIRTY, "log-dirty %s: dom %u faults=%u dirty=%u\n",
                  (clean) ? "clean" : "peek",
@@ -358,8 +568,10 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
 
     sc->stats.fault_count = d->arch.paging.log_dirty.fault_count;
     sc->stats.dirty_count = d->arch.paging.log_dirty.dirty_count;
+    sc->stats.clean_time_us = d->arch.paging.log_dirty.clean_time_us;
+    sc->stats.generation = d->arch.paging.log_dirty.generation;
 
-    if ( clean )
+    if ( clean && !range )
     {
         d->arch.paging.log_dirty.fault_count = 0;
         d->arch.paging.log_dirty.dirty_count = 0;
@@ -369,7 +581,8 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
         /* caller may have wanted just to clean the state or access stats. */
         peek = 0;
 
-    if ( (peek || clean) && !mfn_valid(d->arch.paging.log_dirty.top) )
+    if ( (peek || clean || range) &&
+         !mfn_valid(d->arch.paging.log_dirty.top) )
     {
         rv = -EINVAL; /* perhaps should be ENOMEM? */
         goto out;
@@ -382,6 +595,14 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
         goto out;
     }
 
+    if ( range )
+    {
+        if ( (rv = paging_log_dirty_op_range(d, sc, peek, clean,
+                                             &snap, &all)) != 0 )
+            goto out;
+        goto done;
+    }
+
     pages = 0;
     l4 = (mfn_valid(d->arch.paging.log_dirty.top) ?
           map_domain_page(mfn_x(d->arch.paging.log_dirty.top)) : NULL);
@@ -417,7 +638,13 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
                     }
                 }
                 if ( clean && l1 != zeroes )
+                {
+                    if ( !all &&
+                         !paging_log_dirty_snapshot(d, &snap, pages, l1,
+                                                    0, PAGE_SIZE) )
+                        all = 1;
                     clear_page(l1);
+                }
                 pages += bytes << 3;
                 if ( l1 != zeroes )
                     unmap_domain_page(l1);
@@ -434,20 +661,27 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     if ( pages < sc->pages )
         sc->pages = pages;
 
+ done:
     log_dirty_unlock(d);
 
     if ( clean )
     {
-        /* We need to further call clean_dirty_bitmap() functions of specific
-         * paging modes (shadow or hap).  Safe because the domain is paused. */
-        d->arch.paging.log_dirty.clean_dirty_bitmap(d);
+        /* We need to further call the clean functions of specific paging
+         * modes (shadow or hap).  Safe because the domain is paused. */
+        paging_log_dirty_rearm(d, snap, all);
+        sc->stats.clean_time_us = d->arch.paging.log_dirty.clean_time_us;
     }
-    domain_unpause(d);
+    if ( pause )
+        domain_unpause(d);
     return rv;
 
  out:
     log_dirty_unlock(d);
-    domain_unpause(d);
+    /* A walk that failed part way through has still cleared some bits. */
+    if ( mfn_valid(snap) )
+        paging_log_dirty_rearm(d, snap, 0);
+    if ( pause )
+        domain_unpause(d);
     return rv;
 }
 
@@ -603,8 +837,9 @@ int paging_log_dirty_range(struct domain *d,
     return rv;
 }
 
-/* Note that this function takes three function pointers. Callers must supply
- * these functions for log dirty code to call. This function usually is
+/* Note that this function takes four function pointers. Callers must supply
+ * the first three for log dirty code to call; clean_dirty_range may be NULL,
+ * when every clean goes through clean_dirty_bitmap. This function usually is
  * invoked when paging is enabled. Check shadow_enable() and hap_enable() for
  * reference.
  *
@@ -613,7 +848,11 @@ int paging_log_dirty_range(struct domain *d,
 void paging_log_dirty_init(struct domain *d,
                            int    (*enable_log_dirty)(struct domain *d),
                            int    (*disable_log_dirty)(struct domain *d),
-                           void   (*clean_dirty_bitmap)(struct domain *d))
+                           void   (*clean_dirty_bitmap)(struct domain *d),
+                           void   (*clean_dirty_range)(struct domain *d,
+                                                       unsigned long pfn,
+                                                       const unsigned long *bitmap,
+                                                       unsigned int nr))
 {
     /* We initialize log dirty lock first */
     log_dirty_lock_init(d);
@@ -621,6 +860,7 @@ void paging_log_dirty_init(struct domain *d,
     d->arch.paging.log_dirty.enable_log_dirty = enable_log_dirty;
     d->arch.paging.log_dirty.disable_log_dirty = disable_log_dirty;
     d->arch.paging.log_dirty.clean_dirty_bitmap = clean_dirty_bitmap;
+    d->arch.paging.log_dirty.clean_dirty_range = clean_dirty_range;
     d->arch.paging.log_dirty.top = _mfn(INVALID_MFN);
 }
 
@@ -664,6 +904,26 @@ void paging_vcpu_init(struct vcpu *v)
 }
 
 
+/* Has log-dirty mode been turned off or re-enabled since the caller, which
+ * passed the generation it enabled it at in mode, did so?  Serialised
+ * against other users of the domctl by the domctl lock. */
+static int paging_log_dirty_stale(struct domain *d, xen_domctl_shadow_op_t *sc)
+{
+    switch ( sc->op )
+    {
+    case XEN_DOMCTL_SHADOW_OP_OFF:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_PEEK:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_RANGE:
+        return ( (sc->mode != 0) &&
+                 (!paging_mode_log_dirty(d) ||
+                  (sc->mode != d->arch.paging.log_dirty.generation)) );
+    }
+
+    return 0;
+}
+
 int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
                   XEN_GUEST_HANDLE(void) u_domctl)
 {
@@ -693,6 +953,9 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
     if ( rc )
         return rc;
 
+    if ( paging_log_dirty_stale(d, sc) )
+        return -ESTALE;
+
     /* Code to handle log-dirty. Note that some log dirty operations
      * piggy-back on shadow operations. For example, when
      * XEN_DOMCTL_SHADOW_OP_OFF is called, it first checks whether log dirty
@@ -705,14 +968,18 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
         if ( hap_enabled(d) )
             hap_logdirty_init(d);
-        return paging_log_dirty_enable(d);
+        rc = paging_log_dirty_enable(d);
+        sc->stats.generation = d->arch.paging.log_dirty.generation;
+        return rc;
 
     case XEN_DOMCTL_SHADOW_OP_ENABLE:
         if ( sc->mode & XEN_DOMCTL_SHADOW_ENABLE_LOG_DIRTY )
         {
             if ( hap_enabled(d) )
                 hap_logdirty_init(d);
-            return paging_log_dirty_enable(d);
+            rc = paging_log_dirty_enable(d);
+            sc->stats.generation = d->arch.paging.log_dirty.generation;
+            return rc;
         }
 
     case XEN_DOMCTL_SHADOW_OP_OFF:
@@ -722,6 +989,8 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
 
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_RANGE:
         return paging_log_dirty_op(d, sc);
     }
 
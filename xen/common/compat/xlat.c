@@ -54,6 +54,10 @@ CHECK_evtchn_op;
 #undef xen_evtchn_status
 #undef xen_evtchn_unmask
 
+#define xen_evtchn_register_3level evtchn_register_3level
+CHECK_evtchn_register_3level;
+#undef xen_evtchn_register_3level
+
 #define xen_mmu_update mmu_update
 CHECK_mmu_update;
 #undef xen_mmu_update
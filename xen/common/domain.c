@@ -269,7 +269,7 @@ struct domain *domain_create(
         else
             d->nr_pirqs = nr_irqs_gsi + extra_dom0_irqs;
 
-        d->pirq_to_evtchn = xmalloc_array(u16, d->nr_pirqs);
+        d->pirq_to_evtchn = xmalloc_array(evtchn_port_t, d->nr_pirqs);
         d->pirq_mask = xmalloc_array(
             unsigned long, BITS_TO_LONGS(d->nr_pirqs));
         if ( (d->pirq_to_evtchn == NULL) || (d->pirq_mask == NULL) )
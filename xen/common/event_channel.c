@@ -26,6 +26,8 @@
 #include <xen/compat.h>
 #include <xen/guest_access.h>
 #include <xen/keyhandler.h>
+#include <xen/domain_page.h>
+#include <xen/paging.h>
 #include <asm/current.h>
 
 #include <public/xen.h>
@@ -33,7 +35,7 @@
 #include <xsm/xsm.h>
 
 #define bucket_from_port(d,p) \
-    ((d)->evtchn[(p)/EVTCHNS_PER_BUCKET])
+    evtchn_bucket(d, (p)/EVTCHNS_PER_BUCKET)
 #define port_is_valid(d,p)    \
     (((p) >= 0) && ((p) < MAX_EVTCHNS(d)) && \
      (bucket_from_port(d,p) != NULL))
@@ -59,6 +61,71 @@
 
 static int evtchn_set_pending(struct vcpu *v, int port);
 
+/*
+ * Updates to a channel's binding (state, consumer_is_xen, notify_vcpu_id
+ * and u) are made under the domain's event_lock, bracketed by
+ * evtchn_write_begin/end().  This lets evtchn_send() take a consistent
+ * snapshot of a binding with no lock held, retrying while it races with
+ * an update.
+ */
+static inline void evtchn_write_begin(struct evtchn *chn)
+{
+    chn->seq++;
+    smp_wmb();
+}
+
+static inline void evtchn_write_end(struct evtchn *chn)
+{
+    smp_wmb();
+    chn->seq++;
+}
+
+static inline u32 evtchn_read_begin(const struct evtchn *chn)
+{
+    u32 seq;
+
+    while ( (seq = *(volatile u32 *)&chn->seq) & 1 )
+        cpu_relax();
+    smp_rmb();
+
+    return seq;
+}
+
+static inline int evtchn_read_retry(const struct evtchn *chn, u32 seq)
+{
+    smp_rmb();
+    return *(volatile u32 *)&chn->seq != seq;
+}
+
+/*
+ * With the 3-level ABI the pending and mask bitmaps, and each VCPU's
+ * second-level selector, live in guest frames which we keep mapped.
+ * Senders use this without holding any lock, so it is only freed after
+ * an RCU grace period.
+ */
+#define EVTCHNS_PER_PAGE    (PAGE_SIZE * 8)
+#define EVTCHN_3L_NR_FRAMES (2 * EVTCHN_3L_NR_PAGES + EVTCHN_3L_NR_L2SEL_PAGES)
+
+/*
+ * Ports beyond the 2-level limit cost the domain xenheap for their
+ * buckets, so cap how many a guest may enable with the 3-level ABI.
+ */
+static unsigned int __read_mostly evtchn_3l_max_ports = 32768;
+integer_param("evtchn_3l_max_ports", evtchn_3l_max_ports);
+
+struct evtchn_3level {
+    struct rcu_head rcu;
+    unsigned int    nr_frames;
+    unsigned long   mfn[EVTCHN_3L_NR_FRAMES];
+    void           *va[EVTCHN_3L_NR_FRAMES];
+    unsigned long  *pending[EVTCHN_3L_NR_PAGES];
+    unsigned long  *mask[EVTCHN_3L_NR_PAGES];
+    unsigned long  *l2sel[];    /* Indexed by vcpu_id. */
+};
+
+#define l3_bit_op(op, l3, map, port) \
+    op((port) % EVTCHNS_PER_PAGE, (l3)->map[(port) / EVTCHNS_PER_PAGE])
+
 static int virq_is_global(int virq)
 {
     int rc;
@@ -84,6 +151,13 @@ static int virq_is_global(int virq)
 }
 
 
+/*
+ * Free ports are kept on a list threaded through the channels themselves,
+ * so that finding one does not mean scanning the whole port space.  Port 0
+ * is reserved by evtchn_init() and so never on the list, which lets 0 mark
+ * its end.  get_free_port() only peeks at the head; callers take the port
+ * off with claim_free_port() once they are committed to binding it.
+ */
 static int get_free_port(struct domain *d)
 {
     struct evtchn *chn;
@@ -93,18 +167,19 @@ static int get_free_port(struct domain *d)
     if ( d->is_dying )
         return -EINVAL;
 
-    for ( port = 0; port_is_valid(d, port); port++ )
-        if ( evtchn_from_port(d, port)->state == ECS_FREE )
-            return port;
+    if ( d->evtchn_free_head != 0 )
+        return d->evtchn_free_head;
+
+    for ( port = 0; port_is_valid(d, port); port += EVTCHNS_PER_BUCKET )
+        continue;
 
-    if ( port == MAX_EVTCHNS(d) )
+    if ( port >= MAX_EVTCHNS(d) )
         return -ENOSPC;
 
     chn = xmalloc_array(struct evtchn, EVTCHNS_PER_BUCKET);
     if ( unlikely(chn == NULL) )
         return -ENOMEM;
     memset(chn, 0, EVTCHNS_PER_BUCKET * sizeof(*chn));
-    bucket_from_port(d, port) = chn;
 
     for ( i = 0; i < EVTCHNS_PER_BUCKET; i++ )
     {
@@ -117,9 +192,36 @@ static int get_free_port(struct domain *d)
         }
     }
 
+    for ( i = EVTCHNS_PER_BUCKET - 1; i >= 0; i-- )
+    {
+        if ( port + i == 0 )
+            break;
+        chn[i].u.free.next = d->evtchn_free_head;
+        d->evtchn_free_head = port + i;
+    }
+
+    /* evtchn_send() may look at the bucket as soon as it is visible. */
+    smp_wmb();
+    bucket_from_port(d, port) = chn;
+
     return port;
 }
 
+static void claim_free_port(struct domain *d, int port)
+{
+    ASSERT(d->evtchn_free_head == port);
+    d->evtchn_free_head = evtchn_from_port(d, port)->u.free.next;
+}
+
+static void put_free_port(struct domain *d, int port)
+{
+    struct evtchn *chn = evtchn_from_port(d, port);
+
+    ASSERT(chn->state == ECS_FREE);
+    chn->u.free.next = d->evtchn_free_head;
+    d->evtchn_free_head = port;
+}
+
 
 static long evtchn_alloc_unbound(evtchn_alloc_unbound_t *alloc)
 {
@@ -143,9 +245,12 @@ static long evtchn_alloc_unbound(evtchn_alloc_unbound_t *alloc)
     if ( rc )
         goto out;
 
+    claim_free_port(d, port);
+    evtchn_write_begin(chn);
     chn->state = ECS_UNBOUND;
     if ( (chn->u.unbound.remote_domid = alloc->remote_dom) == DOMID_SELF )
         chn->u.unbound.remote_domid = current->domain->domain_id;
+    evtchn_write_end(chn);
 
     alloc->port = port;
 
@@ -199,13 +304,18 @@ static long evtchn_bind_interdomain(evtchn_bind_interdomain_t *bind)
     if ( rc )
         goto out;
 
+    claim_free_port(ld, lport);
+    evtchn_write_begin(lchn);
     lchn->u.interdomain.remote_dom  = rd;
-    lchn->u.interdomain.remote_port = (u16)rport;
+    lchn->u.interdomain.remote_port = rport;
     lchn->state                     = ECS_INTERDOMAIN;
+    evtchn_write_end(lchn);
     
+    evtchn_write_begin(rchn);
     rchn->u.interdomain.remote_dom  = ld;
-    rchn->u.interdomain.remote_port = (u16)lport;
+    rchn->u.interdomain.remote_port = lport;
     rchn->state                     = ECS_INTERDOMAIN;
+    evtchn_write_end(rchn);
 
     /*
      * We may have lost notifications on the remote unbound port. Fix that up
@@ -253,9 +363,12 @@ static long evtchn_bind_virq(evtchn_bind_virq_t *bind)
         ERROR_EXIT(port);
 
     chn = evtchn_from_port(d, port);
+    claim_free_port(d, port);
+    evtchn_write_begin(chn);
     chn->state          = ECS_VIRQ;
     chn->notify_vcpu_id = vcpu;
     chn->u.virq         = virq;
+    evtchn_write_end(chn);
 
     v->virq_to_evtchn[virq] = bind->port = port;
 
@@ -283,8 +396,11 @@ static long evtchn_bind_ipi(evtchn_bind_ipi_t *bind)
         ERROR_EXIT(port);
 
     chn = evtchn_from_port(d, port);
+    claim_free_port(d, port);
+    evtchn_write_begin(chn);
     chn->state          = ECS_IPI;
     chn->notify_vcpu_id = vcpu;
+    evtchn_write_end(chn);
 
     bind->port = port;
 
@@ -327,8 +443,11 @@ static long evtchn_bind_pirq(evtchn_bind_pirq_t *bind)
         goto out;
     }
 
+    claim_free_port(d, port);
+    evtchn_write_begin(chn);
     chn->state  = ECS_PIRQ;
     chn->u.pirq = pirq;
+    evtchn_write_end(chn);
 
     bind->port = port;
 
@@ -433,8 +552,10 @@ static long __evtchn_close(struct domain *d1, int port1)
         BUG_ON(chn2->state != ECS_INTERDOMAIN);
         BUG_ON(chn2->u.interdomain.remote_dom != d1);
 
+        evtchn_write_begin(chn2);
         chn2->state = ECS_UNBOUND;
         chn2->u.unbound.remote_domid = d1->domain_id;
+        evtchn_write_end(chn2);
         break;
 
     default:
@@ -442,11 +563,17 @@ static long __evtchn_close(struct domain *d1, int port1)
     }
 
     /* Clear pending event to avoid unexpected behavior on re-bind. */
-    clear_bit(port1, &shared_info(d1, evtchn_pending));
+    if ( d1->evtchn_3l != NULL )
+        l3_bit_op(clear_bit, d1->evtchn_3l, pending, port1);
+    else
+        clear_bit(port1, &shared_info(d1, evtchn_pending));
 
     /* Reset binding to vcpu0 when the channel is freed. */
+    evtchn_write_begin(chn1);
     chn1->state          = ECS_FREE;
     chn1->notify_vcpu_id = 0;
+    put_free_port(d1, port1);
+    evtchn_write_end(chn1);
 
     xsm_evtchn_close_post(chn1);
 
@@ -469,6 +596,84 @@ static long evtchn_close(evtchn_close_t *close)
     return __evtchn_close(current->domain, close->port);
 }
 
+/*
+ * Send on an established interdomain or IPI binding without taking
+ * event_lock.  Returns -EAGAIN if the binding is anything else, leaving
+ * evtchn_send() to do it the slow way.
+ *
+ * The remote domain's channels and vcpus are only freed once the domain
+ * structure goes, after an RCU grace period.  A send racing with a close
+ * may therefore still hit the old remote port; that is no different from
+ * the notification arriving just before the close.
+ */
+static int evtchn_send_fast(struct domain *ld, unsigned int lport)
+{
+    struct evtchn *lchn, *rchn;
+    struct domain *rd = NULL;
+    struct vcpu   *rvcpu;
+    int            rport = 0, ret;
+    u8             state, rconsumer_is_xen;
+    u16            notify_vcpu_id;
+    u32            seq;
+
+    lchn = evtchn_from_port(ld, lport);
+
+    rcu_read_lock(&domlist_read_lock);
+
+    do {
+        seq = evtchn_read_begin(lchn);
+        state = lchn->state;
+        if ( lchn->consumer_is_xen )
+            state = ECS_FREE;
+        notify_vcpu_id = lchn->notify_vcpu_id;
+        if ( state == ECS_INTERDOMAIN )
+        {
+            rd    = lchn->u.interdomain.remote_dom;
+            rport = lchn->u.interdomain.remote_port;
+        }
+    } while ( evtchn_read_retry(lchn, seq) );
+
+    if ( (state != ECS_INTERDOMAIN) && (state != ECS_IPI) )
+    {
+        ret = -EAGAIN;
+        goto out;
+    }
+
+    ret = xsm_evtchn_send(ld, lchn);
+    if ( ret )
+        goto out;
+
+    if ( state == ECS_IPI )
+    {
+        evtchn_set_pending(ld->vcpu[notify_vcpu_id], lport);
+        goto out;
+    }
+
+    rchn = evtchn_from_port(rd, rport);
+    do {
+        seq = evtchn_read_begin(rchn);
+        rconsumer_is_xen = rchn->consumer_is_xen;
+        notify_vcpu_id   = rchn->notify_vcpu_id;
+    } while ( evtchn_read_retry(rchn, seq) );
+
+    rvcpu = rd->vcpu[notify_vcpu_id];
+    if ( rconsumer_is_xen )
+    {
+        /* Xen consumers need notification only if they are blocked. */
+        if ( test_and_clear_bit(_VPF_blocked_in_xen, &rvcpu->pause_flags) )
+            vcpu_wake(rvcpu);
+    }
+    else
+    {
+        evtchn_set_pending(rvcpu, rport);
+    }
+
+ out:
+    rcu_read_unlock(&domlist_read_lock);
+
+    return ret;
+}
+
 int evtchn_send(struct domain *d, unsigned int lport)
 {
     struct evtchn *lchn, *rchn;
@@ -476,6 +681,14 @@ int evtchn_send(struct domain *d, unsigned int lport)
     struct vcpu   *rvcpu;
     int            rport, ret = 0;
 
+    if ( likely(port_is_valid(ld, lport)) )
+    {
+        ret = evtchn_send_fast(ld, lport);
+        if ( ret != -EAGAIN )
+            return ret;
+        ret = 0;
+    }
+
     spin_lock(&ld->event_lock);
 
     if ( unlikely(!port_is_valid(ld, lport)) )
@@ -532,9 +745,29 @@ out:
     return ret;
 }
 
+static int evtchn_set_pending_3l(
+    struct vcpu *v, struct evtchn_3level *l3, int port)
+{
+    unsigned int bits = BITS_PER_EVTCHN_WORD(v->domain);
+
+    if ( l3_bit_op(test_and_set_bit, l3, pending, port) )
+        return 1;
+
+    if ( !l3_bit_op(test_bit, l3, mask, port) &&
+         !test_and_set_bit(port / bits, l3->l2sel[v->vcpu_id]) &&
+         !test_and_set_bit(port / (bits * bits),
+                           &vcpu_info(v, evtchn_pending_sel)) )
+    {
+        vcpu_mark_events_pending(v);
+    }
+
+    return 0;
+}
+
 static int evtchn_set_pending(struct vcpu *v, int port)
 {
     struct domain *d = v->domain;
+    struct evtchn_3level *l3 = d->evtchn_3l;
     int vcpuid;
 
     /*
@@ -544,14 +777,32 @@ static int evtchn_set_pending(struct vcpu *v, int port)
      * others may require explicit memory barriers.
      */
 
-    if ( test_and_set_bit(port, &shared_info(d, evtchn_pending)) )
-        return 1;
-
-    if ( !test_bit        (port, &shared_info(d, evtchn_mask)) &&
-         !test_and_set_bit(port / BITS_PER_EVTCHN_WORD(d),
-                           &vcpu_info(v, evtchn_pending_sel)) )
+    if ( l3 != NULL )
     {
-        vcpu_mark_events_pending(v);
+        if ( evtchn_set_pending_3l(v, l3, port) )
+            return 1;
+    }
+    else
+    {
+        /* Late senders to a dying domain may still hold 3-level ports. */
+        if ( unlikely(port >= MAX_EVTCHNS_2L(d)) )
+            return 1;
+
+        if ( test_and_set_bit(port, &shared_info(d, evtchn_pending)) )
+            return 1;
+
+        /* Raced with evtchn_register_3level(): it may have missed our bit. */
+        if ( unlikely((l3 = d->evtchn_3l) != NULL) )
+        {
+            if ( evtchn_set_pending_3l(v, l3, port) )
+                return 1;
+        }
+        else if ( !test_bit        (port, &shared_info(d, evtchn_mask)) &&
+                  !test_and_set_bit(port / BITS_PER_EVTCHN_WORD(d),
+                                    &vcpu_info(v, evtchn_pending_sel)) )
+        {
+            vcpu_mark_events_pending(v);
+        }
     }
     
     /* Check if some VCPU might be polling for this event. */
@@ -741,14 +992,20 @@ long evtchn_bind_vcpu(unsigned int port, unsigned int vcpu_id)
     {
     case ECS_VIRQ:
         if ( virq_is_global(chn->u.virq) )
+        {
+            evtchn_write_begin(chn);
             chn->notify_vcpu_id = vcpu_id;
+            evtchn_write_end(chn);
+        }
         else
             rc = -EINVAL;
         break;
     case ECS_UNBOUND:
     case ECS_INTERDOMAIN:
     case ECS_PIRQ:
+        evtchn_write_begin(chn);
         chn->notify_vcpu_id = vcpu_id;
+        evtchn_write_end(chn);
         break;
     default:
         rc = -EINVAL;
@@ -781,17 +1038,202 @@ int evtchn_unmask(unsigned int port)
      * These operations must happen in strict order. Based on
      * include/xen/event.h:evtchn_set_pending(). 
      */
-    if ( test_and_clear_bit(port, &shared_info(d, evtchn_mask)) &&
-         test_bit          (port, &shared_info(d, evtchn_pending)) &&
-         !test_and_set_bit (port / BITS_PER_EVTCHN_WORD(d),
-                            &vcpu_info(v, evtchn_pending_sel)) )
+    if ( d->evtchn_3l != NULL )
+    {
+        struct evtchn_3level *l3 = d->evtchn_3l;
+        unsigned int bits = BITS_PER_EVTCHN_WORD(d);
+
+        if ( l3_bit_op(test_and_clear_bit, l3, mask, port) &&
+             l3_bit_op(test_bit, l3, pending, port) &&
+             !test_and_set_bit(port / bits, l3->l2sel[v->vcpu_id]) &&
+             !test_and_set_bit(port / (bits * bits),
+                               &vcpu_info(v, evtchn_pending_sel)) )
+        {
+            vcpu_mark_events_pending(v);
+        }
+    }
+    else if ( test_and_clear_bit(port, &shared_info(d, evtchn_mask)) &&
+              test_bit          (port, &shared_info(d, evtchn_pending)) &&
+              !test_and_set_bit (port / BITS_PER_EVTCHN_WORD(d),
+                                 &vcpu_info(v, evtchn_pending_sel)) )
+    {
+        vcpu_mark_events_pending(v);
+    }
+
+    spin_unlock(&d->event_lock);
+
+    return 0;
+}
+
+
+int evtchn_port_is_pending(struct domain *d, int port)
+{
+    struct evtchn_3level *l3 = d->evtchn_3l;
+
+    if ( l3 != NULL )
+        return l3_bit_op(test_bit, l3, pending, port);
+
+    return ((port < MAX_EVTCHNS_2L(d)) &&
+            test_bit(port, &shared_info(d, evtchn_pending)));
+}
+
+
+int evtchn_port_is_masked(struct domain *d, int port)
+{
+    struct evtchn_3level *l3 = d->evtchn_3l;
+
+    if ( l3 != NULL )
+        return l3_bit_op(test_bit, l3, mask, port);
+
+    return ((port >= MAX_EVTCHNS_2L(d)) ||
+            test_bit(port, &shared_info(d, evtchn_mask)));
+}
+
+
+static void *evtchn_3l_map(
+    struct domain *d, struct evtchn_3level *l3, unsigned long gfn)
+{
+    unsigned long mfn = gmfn_to_mfn(d, gfn);
+    void *va;
+
+    if ( !mfn_valid(mfn) ||
+         !get_page_and_type(mfn_to_page(mfn), d, PGT_writable_page) )
+        return NULL;
+
+    va = map_domain_page_global(mfn);
+    if ( va == NULL )
+    {
+        put_page_and_type(mfn_to_page(mfn));
+        return NULL;
+    }
+
+    l3->mfn[l3->nr_frames] = mfn;
+    l3->va[l3->nr_frames++] = va;
+
+    return va;
+}
+
+static void evtchn_3l_unmap(struct evtchn_3level *l3)
+{
+    unsigned int i;
+
+    for ( i = 0; i < l3->nr_frames; i++ )
+    {
+        unmap_domain_page_global(l3->va[i]);
+        put_page_and_type(mfn_to_page(l3->mfn[i]));
+    }
+    xfree(l3);
+}
+
+static void evtchn_3l_free(struct rcu_head *head)
+{
+    evtchn_3l_unmap(container_of(head, struct evtchn_3level, rcu));
+}
+
+static long evtchn_register_3level(evtchn_register_3level_t *reg)
+{
+    struct domain *d = current->domain;
+    struct evtchn_3level *l3;
+    struct evtchn **ext = NULL;
+    struct vcpu   *v;
+    void          *l2sel_va[EVTCHN_3L_NR_L2SEL_PAGES];
+    unsigned int   bits = BITS_PER_EVTCHN_WORD(d);
+    unsigned int   l2sel_size = bits * bits / 8;
+    unsigned int   per_page = PAGE_SIZE / l2sel_size;
+    unsigned int   nr_ports, i;
+    long           rc;
+
+    if ( (reg->nr_pages == 0) ||
+         (reg->nr_pages > EVTCHN_3L_NR_PAGES) ||
+         ((reg->nr_pages - 1) * EVTCHNS_PER_PAGE >= MAX_EVTCHNS_3L(d)) ||
+         (reg->nr_l2sel_pages > EVTCHN_3L_NR_L2SEL_PAGES) ||
+         (reg->nr_l2sel_pages * per_page < d->max_vcpus) )
+        return -EINVAL;
+
+    nr_ports = min_t(unsigned int, reg->nr_pages * EVTCHNS_PER_PAGE,
+                     MAX_EVTCHNS_3L(d));
+    nr_ports = min_t(unsigned int, nr_ports,
+                     max_t(unsigned int, MAX_EVTCHNS_2L(d),
+                           evtchn_3l_max_ports & ~(EVTCHNS_PER_BUCKET - 1)));
+
+    l3 = xmalloc_bytes(sizeof(*l3) + d->max_vcpus * sizeof(l3->l2sel[0]));
+    if ( l3 == NULL )
+        return -ENOMEM;
+    memset(l3, 0, sizeof(*l3) + d->max_vcpus * sizeof(l3->l2sel[0]));
+
+    rc = -ENOMEM;
+    if ( nr_ports > NR_EVENT_CHANNELS )
+    {
+        i = (nr_ports - NR_EVENT_CHANNELS) / EVTCHNS_PER_BUCKET;
+        if ( (ext = xmalloc_array(struct evtchn *, i)) == NULL )
+            goto out;
+        memset(ext, 0, i * sizeof(*ext));
+    }
+
+    rc = -EINVAL;
+    for ( i = 0; i < reg->nr_pages; i++ )
+    {
+        if ( (l3->pending[i] = evtchn_3l_map(d, l3,
+                                             reg->pending_gfn[i])) == NULL ||
+             (l3->mask[i] = evtchn_3l_map(d, l3, reg->mask_gfn[i])) == NULL )
+            goto out;
+    }
+    for ( i = 0; i < reg->nr_l2sel_pages; i++ )
+        if ( (l2sel_va[i] = evtchn_3l_map(d, l3, reg->l2sel_gfn[i])) == NULL )
+            goto out;
+    for_each_vcpu ( d, v )
+        l3->l2sel[v->vcpu_id] = l2sel_va[v->vcpu_id / per_page] +
+            (v->vcpu_id % per_page) * l2sel_size;
+
+    spin_lock(&d->event_lock);
+
+    rc = -EEXIST;
+    if ( d->evtchn_3l != NULL )
+    {
+        spin_unlock(&d->event_lock);
+        goto out;
+    }
+
+    memcpy(l3->pending[0], &shared_info(d, evtchn_pending),
+           MAX_EVTCHNS_2L(d) / 8);
+    memcpy(l3->mask[0], &shared_info(d, evtchn_mask),
+           MAX_EVTCHNS_2L(d) / 8);
+
+    /* New buckets before the ports they cover become valid. */
+    if ( ext != NULL )
+        d->evtchn_ext = ext;
+    smp_wmb();
+    d->max_evtchns = nr_ports;
+    d->evtchn_3l = l3;
+    smp_mb();
+
+    /*
+     * A sender which had not yet seen evtchn_3l may have set a bit in the
+     * old bitmap after the copy above.  It either looks at evtchn_3l again
+     * after setting the bit, or the bit is set before the barrier and we
+     * pick it up here.
+     */
+    for ( i = 0; i < MAX_EVTCHNS_2L(d); i++ )
+        if ( test_bit(i, &shared_info(d, evtchn_pending)) )
+            l3_bit_op(set_bit, l3, pending, i);
+
+    /* Mark everything pending, so that nothing gets lost in the switch. */
+    for_each_vcpu ( d, v )
     {
+        for ( i = 0; i < bits; i++ )
+            set_bit(i, l3->l2sel[v->vcpu_id]);
+        set_bit(0, &vcpu_info(v, evtchn_pending_sel));
         vcpu_mark_events_pending(v);
     }
 
     spin_unlock(&d->event_lock);
 
     return 0;
+
+ out:
+    xfree(ext);
+    evtchn_3l_unmap(l3);
+    return rc;
 }
 
 
@@ -927,6 +1369,14 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE(void) arg)
         break;
     }
 
+    case EVTCHNOP_register_3level: {
+        struct evtchn_register_3level reg;
+        if ( copy_from_guest(&reg, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_register_3level(&reg);
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
@@ -949,10 +1399,13 @@ int alloc_unbound_xen_event_channel(
         goto out;
     chn = evtchn_from_port(d, port);
 
+    claim_free_port(d, port);
+    evtchn_write_begin(chn);
     chn->state = ECS_UNBOUND;
     chn->consumer_is_xen = 1;
     chn->notify_vcpu_id = local_vcpu->vcpu_id;
     chn->u.unbound.remote_domid = remote_domid;
+    evtchn_write_end(chn);
 
  out:
     spin_unlock(&d->event_lock);
@@ -978,7 +1431,9 @@ void free_xen_event_channel(
     BUG_ON(!port_is_valid(d, port));
     chn = evtchn_from_port(d, port);
     BUG_ON(!chn->consumer_is_xen);
+    evtchn_write_begin(chn);
     chn->consumer_is_xen = 0;
+    evtchn_write_end(chn);
 
     spin_unlock(&d->event_lock);
 
@@ -986,10 +1441,10 @@ void free_xen_event_channel(
 }
 
 
-void notify_via_xen_event_channel(int lport)
+void notify_via_xen_event_channel(struct domain *ld, int lport)
 {
     struct evtchn *lchn, *rchn;
-    struct domain *ld = current->domain, *rd;
+    struct domain *rd;
     int            rport;
 
     spin_lock(&ld->event_lock);
@@ -1030,6 +1485,7 @@ int evtchn_init(struct domain *d)
 
 void evtchn_destroy(struct domain *d)
 {
+    struct evtchn_3level *l3;
     int i;
 
     /* After this barrier no new event-channel allocations can occur. */
@@ -1039,24 +1495,52 @@ void evtchn_destroy(struct domain *d)
     /* Close all existing event channels. */
     for ( i = 0; port_is_valid(d, i); i++ )
     {
-        evtchn_from_port(d, i)->consumer_is_xen = 0;
+        struct evtchn *chn = evtchn_from_port(d, i);
+
+        evtchn_write_begin(chn);
+        chn->consumer_is_xen = 0;
+        evtchn_write_end(chn);
         (void)__evtchn_close(d, i);
     }
 
-    /* Free all event-channel buckets. */
+    /* Give the 3-level frames back, so that the domain's memory can go. */
     spin_lock(&d->event_lock);
+    l3 = d->evtchn_3l;
+    d->evtchn_3l = NULL;
+    spin_unlock(&d->event_lock);
+    if ( l3 != NULL )
+        call_rcu(&l3->rcu, evtchn_3l_free);
+}
+
+
+void evtchn_destroy_final(struct domain *d)
+{
+    int i;
+
+    /*
+     * Free all event-channel buckets.  This waits until the domain
+     * structure is freed because evtchn_send() looks at a remote domain's
+     * channels without holding its event_lock.
+     */
     for ( i = 0; i < NR_EVTCHN_BUCKETS; i++ )
     {
         xsm_free_security_evtchn(d->evtchn[i]);
         xfree(d->evtchn[i]);
         d->evtchn[i] = NULL;
     }
-    spin_unlock(&d->event_lock);
-}
 
+    if ( d->evtchn_ext != NULL )
+    {
+        for ( i = NR_EVTCHN_BUCKETS;
+              i < d->max_evtchns / EVTCHNS_PER_BUCKET; i++ )
+        {
+            xsm_free_security_evtchn(evtchn_bucket(d, i));
+            xfree(evtchn_bucket(d, i));
+        }
+        xfree(d->evtchn_ext);
+        d->evtchn_ext = NULL;
+    }
 
-void evtchn_destroy_final(struct domain *d)
-{
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     xfree(d->poll_mask);
     d->poll_mask = NULL;
@@ -1091,8 +1575,8 @@ static void domain_dump_evtchn_info(struct domain *d)
 
         printk("    %4u [%d/%d]: s=%d n=%d",
                port,
-               !!test_bit(port, &shared_info(d, evtchn_pending)),
-               !!test_bit(port, &shared_info(d, evtchn_mask)),
+               !!evtchn_port_is_pending(d, port),
+               !!evtchn_port_is_masked(d, port),
                chn->state, chn->notify_vcpu_id);
         switch ( chn->state )
         {
@@ -36,6 +36,7 @@
 #include <xen/iommu.h>
 #include <xen/paging.h>
 #include <xen/keyhandler.h>
+#include <xen/perfc.h>
 #include <xsm/xsm.h>
 
 #ifndef max_nr_grant_frames
@@ -43,6 +44,14 @@ unsigned int max_nr_grant_frames = DEFAULT_MAX_NR_GRANT_FRAMES;
 integer_param("gnttab_max_nr_frames", max_nr_grant_frames);
 #endif
 
+/*
+ * Keep grants pinned and frames mapped across the ops of a GNTTABOP_copy
+ * batch.  "no-gnttab_copy_batch" releases everything after each op, as a
+ * baseline for measuring that.
+ */
+static int __read_mostly opt_gnttab_copy_batch = 1;
+boolean_param("gnttab_copy_batch", opt_gnttab_copy_batch);
+
 /* The maximum number of grant mappings is defined as a multiplier of the
  * maximum number of grant table entries. This defines the multiplier used.
  * Pretty arbitrary. [POLICY]
@@ -68,12 +77,14 @@ struct gnttab_unmap_common {
     uint64_t dev_bus_addr;
     uint64_t new_addr;
     grant_handle_t handle;
+    int deferred;
 
     /* Return */
     int16_t status;
 
     /* Shared state beteen *_unmap and *_unmap_complete */
     u16 flags;
+    u32 pin;
     unsigned long frame;
     struct grant_mapping *map;
     struct domain *rd;
@@ -82,6 +93,13 @@ struct gnttab_unmap_common {
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/* Number of deferred unmaps a domain may have outstanding before we flush. */
+#define GNTTAB_DEFERRED_UNMAPS 128
+
+static void gnttab_flush_deferred_unmaps(struct domain *ld);
+static void gnttab_flush_deferred_ref(struct domain *ld, struct domain *rd,
+                                      grant_ref_t ref);
+
 
 #define PIN_FAIL(_lbl, _rc, _f, _a...)          \
     do {                                        \
@@ -454,7 +472,19 @@ __gnttab_map_grant_ref(
         return;
     }
 
-    if ( unlikely((handle = get_maptrack_handle(ld->grant_table)) == -1) )
+    /* An outstanding deferred unmap of this grant must be completed first. */
+    if ( unlikely(ld->grant_table->nr_deferred != 0) )
+        gnttab_flush_deferred_ref(ld, rd, op->ref);
+
+    handle = get_maptrack_handle(ld->grant_table);
+    if ( unlikely(handle == -1) && (ld->grant_table->nr_deferred != 0) )
+    {
+        /* Deferred unmaps hold on to their maptrack handles until flushed. */
+        gnttab_flush_deferred_unmaps(ld);
+        handle = get_maptrack_handle(ld->grant_table);
+    }
+
+    if ( unlikely(handle == -1) )
     {
         rcu_unlock_domain(rd);
         gdprintk(XENLOG_INFO, "Failed to obtain maptrack handle.\n");
@@ -687,6 +717,21 @@ gnttab_map_grant_ref(
     return 0;
 }
 
+/*
+ * A deferred unmap keeps its pin until __gnttab_unmap_common_complete(),
+ * after the TLB flush.  Until then nobody can clear GTF_reading/GTF_writing
+ * or let the grant be reused under stale mappings of its frame.
+ */
+static inline void
+gnttab_unmap_drop_pin(
+    struct gnttab_unmap_common *op, struct active_grant_entry *act, u32 inc)
+{
+    if ( op->deferred )
+        op->pin += inc;
+    else
+        act->pin -= inc;
+}
+
 static void
 __gnttab_unmap_common(
     struct gnttab_unmap_common *op)
@@ -700,6 +745,7 @@ __gnttab_unmap_common(
     ld = current->domain;
 
     op->frame = (unsigned long)(op->dev_bus_addr >> PAGE_SHIFT);
+    op->pin = 0;
 
     if ( unlikely(op->handle >= ld->grant_table->maptrack_limit) )
     {
@@ -758,9 +804,9 @@ __gnttab_unmap_common(
             ASSERT(act->pin & (GNTPIN_devw_mask | GNTPIN_devr_mask));
             op->map->flags &= ~GNTMAP_device_map;
             if ( op->flags & GNTMAP_readonly )
-                act->pin -= GNTPIN_devr_inc;
+                gnttab_unmap_drop_pin(op, act, GNTPIN_devr_inc);
             else
-                act->pin -= GNTPIN_devw_inc;
+                gnttab_unmap_drop_pin(op, act, GNTPIN_devw_inc);
         }
     }
 
@@ -774,9 +820,9 @@ __gnttab_unmap_common(
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         op->map->flags &= ~GNTMAP_host_map;
         if ( op->flags & GNTMAP_readonly )
-            act->pin -= GNTPIN_hstr_inc;
+            gnttab_unmap_drop_pin(op, act, GNTPIN_hstr_inc);
         else
-            act->pin -= GNTPIN_hstw_inc;
+            gnttab_unmap_drop_pin(op, act, GNTPIN_hstw_inc);
     }
 
     if ( (!is_hvm_domain(ld) && need_iommu(ld)) &&
@@ -802,9 +848,10 @@ __gnttab_unmap_common(
 }
 
 static void
-__gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
+__gnttab_unmap_common_complete(
+    struct domain *ld, struct gnttab_unmap_common *op)
 {
-    struct domain   *ld, *rd;
+    struct domain   *rd;
     struct active_grant_entry *act;
     grant_entry_header_t *sha;
     struct page_info *pg;
@@ -822,8 +869,6 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
         return;
     }
 
-    ld = current->domain;
-
     rcu_lock_domain(rd);
     spin_lock(&rd->grant_table->lock);
 
@@ -838,6 +883,16 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
     else
         status = &status_entry(rd->grant_table, op->map->ref);
 
+    if ( op->pin != 0 )
+    {
+        /*
+         * The pin held by a deferred unmap kept the grant from being reused,
+         * so the frame we took references on must still be the granted one.
+         */
+        BUG_ON(op->frame != act->frame);
+        act->pin -= op->pin;
+    }
+
     if ( unlikely(op->frame != act->frame) ) 
     {
         /*
@@ -900,11 +955,13 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
 static void
 __gnttab_unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
-    struct gnttab_unmap_common *common)
+    struct gnttab_unmap_common *common,
+    int deferred)
 {
 	common->host_addr = op->host_addr;
     common->dev_bus_addr = op->dev_bus_addr;
     common->handle = op->handle;
+    common->deferred = deferred;
 
     /* Intialise these in case common contains old state */
     common->new_addr = 0;
@@ -932,7 +989,7 @@ gnttab_unmap_grant_ref(
         {
             if ( unlikely(__copy_from_guest_offset(&op, uop, done+i, 1)) )
                 goto fault;
-            __gnttab_unmap_grant_ref(&op, &(common[i]));
+            __gnttab_unmap_grant_ref(&op, &(common[i]), 0);
             ++partial_done;
             if ( unlikely(__copy_to_guest_offset(uop, done+i, &op, 1)) )
                 goto fault;
@@ -941,7 +998,7 @@ gnttab_unmap_grant_ref(
         flush_tlb_mask(&current->domain->domain_dirty_cpumask);
 
         for ( i = 0; i < partial_done; i++ )
-            __gnttab_unmap_common_complete(&(common[i]));
+            __gnttab_unmap_common_complete(current->domain, &(common[i]));
 
         count -= c;
         done += c;
@@ -956,7 +1013,7 @@ fault:
     flush_tlb_mask(&current->domain->domain_dirty_cpumask);
 
     for ( i = 0; i < partial_done; i++ )
-        __gnttab_unmap_common_complete(&(common[i]));
+        __gnttab_unmap_common_complete(current->domain, &(common[i]));
     return -EFAULT;
 }
 
@@ -968,6 +1025,7 @@ __gnttab_unmap_and_replace(
 	common->host_addr = op->host_addr;
 	common->new_addr = op->new_addr;
 	common->handle = op->handle;
+    common->deferred = 0;
     
     /* Intialise these in case common contains old state */
     common->dev_bus_addr = 0;
@@ -1003,7 +1061,7 @@ gnttab_unmap_and_replace(
         flush_tlb_mask(&current->domain->domain_dirty_cpumask);
         
         for ( i = 0; i < partial_done; i++ )
-            __gnttab_unmap_common_complete(&(common[i]));
+            __gnttab_unmap_common_complete(current->domain, &(common[i]));
 
         count -= c;
         done += c;
@@ -1018,10 +1076,128 @@ fault:
     flush_tlb_mask(&current->domain->domain_dirty_cpumask);
 
     for ( i = 0; i < partial_done; i++ )
-        __gnttab_unmap_common_complete(&(common[i]));
+        __gnttab_unmap_common_complete(current->domain, &(common[i]));
     return -EFAULT;    
 }
 
+/*
+ * Complete the deferred unmaps of ld, after the TLB flush which they are
+ * waiting for.  Caller must hold ld's deferred_lock.
+ */
+static void
+__gnttab_flush_deferred_unmaps(struct domain *ld)
+{
+    struct grant_table *gt = ld->grant_table;
+    unsigned int i;
+
+    if ( gt->nr_deferred == 0 )
+        return;
+
+    perfc_incr(gnttab_unmap_flush);
+    flush_tlb_mask(&ld->domain_dirty_cpumask);
+
+    for ( i = 0; i < gt->nr_deferred; i++ )
+        __gnttab_unmap_common_complete(ld, &gt->deferred[i]);
+    gt->nr_deferred = 0;
+}
+
+static void
+gnttab_flush_deferred_unmaps(struct domain *ld)
+{
+    spin_lock(&ld->grant_table->deferred_lock);
+    __gnttab_flush_deferred_unmaps(ld);
+    spin_unlock(&ld->grant_table->deferred_lock);
+}
+
+/* Flush ld's deferred unmaps if one of them is of rd's grant ref. */
+static void
+gnttab_flush_deferred_ref(struct domain *ld, struct domain *rd,
+                          grant_ref_t ref)
+{
+    struct grant_table *gt = ld->grant_table;
+    unsigned int i;
+
+    spin_lock(&gt->deferred_lock);
+    for ( i = 0; i < gt->nr_deferred; i++ )
+    {
+        if ( (gt->deferred[i].rd == rd) && (gt->deferred[i].map->ref == ref) )
+        {
+            __gnttab_flush_deferred_unmaps(ld);
+            break;
+        }
+    }
+    spin_unlock(&gt->deferred_lock);
+}
+
+/*
+ * Queue an unmap which has been through __gnttab_unmap_common until its
+ * TLB flush.  Returns 0 if there is nowhere to queue it, in which case the
+ * caller must flush and complete it itself.
+ */
+static int
+gnttab_defer_unmap(struct domain *ld, struct gnttab_unmap_common *op)
+{
+    struct grant_table *gt = ld->grant_table;
+
+    spin_lock(&gt->deferred_lock);
+
+    if ( unlikely(gt->deferred == NULL) &&
+         (gt->deferred = xmalloc_array(struct gnttab_unmap_common,
+                                       GNTTAB_DEFERRED_UNMAPS)) == NULL )
+    {
+        spin_unlock(&gt->deferred_lock);
+        return 0;
+    }
+
+    if ( gt->nr_deferred == GNTTAB_DEFERRED_UNMAPS )
+        __gnttab_flush_deferred_unmaps(ld);
+
+    gt->deferred[gt->nr_deferred++] = *op;
+    perfc_incr(gnttab_unmap_deferred);
+
+    spin_unlock(&gt->deferred_lock);
+    return 1;
+}
+
+static long
+gnttab_unmap_grant_ref_deferred(
+    XEN_GUEST_HANDLE(gnttab_unmap_grant_ref_t) uop, unsigned int count)
+{
+    struct domain *ld = current->domain;
+    struct gnttab_unmap_grant_ref op;
+    struct gnttab_unmap_common common;
+    int i, deferred;
+
+    /*
+     * The IOMMU mapping is torn down when the last writable pin goes, which
+     * a deferred unmap does not drop until it completes.
+     */
+    deferred = is_hvm_domain(ld) || !need_iommu(ld);
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( i && hypercall_preempt_check() )
+            return i;
+
+        if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
+            return -EFAULT;
+
+        __gnttab_unmap_grant_ref(&op, &common, deferred);
+
+        if ( (common.rd != NULL) &&
+             (!deferred || !gnttab_defer_unmap(ld, &common)) )
+        {
+            flush_tlb_mask(&ld->domain_dirty_cpumask);
+            __gnttab_unmap_common_complete(ld, &common);
+        }
+
+        if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
+            return -EFAULT;
+    }
+
+    return 0;
+}
+
 static int
 gnttab_populate_status_frames(struct domain *d, struct grant_table *gt)
 {
@@ -1830,164 +2006,260 @@ __acquire_grant_for_copy(
     return rc;
 }
 
+/*
+ * One side of a grant copy.  A batch of copies keeps the domain locked,
+ * and the grant pinned, the frame referenced and mapped, for as long as
+ * consecutive ops name the same domain and grant (or frame).
+ */
+struct gnttab_copy_buf {
+    /* What the guest asked for. */
+    domid_t domid;
+    unsigned long ref;          /* Grant reference, or gmfn. */
+    int is_gref;
+    int read_only;
+
+    /* The domain named by domid, and the owner of the frame. */
+    struct domain *domain;
+    struct domain *owner;
+
+    /* The frame, and the part of it the grant covers. */
+    unsigned long frame;
+    unsigned int off, len;
+    void *virt;
+
+    int have_grant, have_ref;
+};
+
 static void
-__gnttab_copy(
-    struct gnttab_copy *op)
+gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
 {
-    struct domain *sd = NULL, *dd = NULL;
-    struct domain *source_domain = NULL, *dest_domain = NULL;
-    unsigned long s_frame, d_frame;
-    char *sp, *dp;
-    s16 rc = GNTST_okay;
-    int have_d_grant = 0, have_s_grant = 0, have_s_ref = 0;
-    int src_is_gref, dest_is_gref;
+    if ( buf->virt )
+    {
+        unmap_domain_page(buf->virt);
+        buf->virt = NULL;
+    }
+    if ( buf->have_ref )
+    {
+        if ( buf->read_only )
+            put_page(mfn_to_page(buf->frame));
+        else
+            put_page_and_type(mfn_to_page(buf->frame));
+        buf->have_ref = 0;
+    }
+    if ( buf->have_grant )
+    {
+        __release_grant_for_copy(buf->domain, buf->ref, buf->read_only);
+        buf->have_grant = 0;
+    }
+}
 
-    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
-         ((op->dest.offset + op->len) > PAGE_SIZE) )
-        PIN_FAIL(error_out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+static void
+gnttab_copy_unlock_domains(
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    if ( src->domain )
+    {
+        rcu_unlock_domain(src->domain);
+        src->domain = NULL;
+    }
+    if ( dest->domain )
+    {
+        rcu_unlock_domain(dest->domain);
+        dest->domain = NULL;
+    }
+}
 
-    src_is_gref = op->flags & GNTCOPY_source_gref;
-    dest_is_gref = op->flags & GNTCOPY_dest_gref;
+static s16
+gnttab_copy_lock_domain(domid_t domid, struct gnttab_copy_buf *buf)
+{
+    s16 rc = GNTST_okay;
 
-    if ( (op->source.domid != DOMID_SELF && !src_is_gref ) ||
-         (op->dest.domid   != DOMID_SELF && !dest_is_gref)   )
-        PIN_FAIL(error_out, GNTST_permission_denied,
-                 "only allow copy-by-mfn for DOMID_SELF.\n");
+    if ( domid == DOMID_SELF )
+        buf->domain = rcu_lock_current_domain();
+    else if ( (buf->domain = rcu_lock_domain_by_id(domid)) == NULL )
+        PIN_FAIL(out, GNTST_bad_domain, "couldn't find %d\n", domid);
 
-    if ( op->source.domid == DOMID_SELF )
-        sd = rcu_lock_current_domain();
-    else if ( (sd = rcu_lock_domain_by_id(op->source.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->source.domid);
+    buf->domid = domid;
+ out:
+    return rc;
+}
 
-    if ( op->dest.domid == DOMID_SELF )
-        dd = rcu_lock_current_domain();
-    else if ( (dd = rcu_lock_domain_by_id(op->dest.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->dest.domid);
+static s16
+gnttab_copy_lock_domains(
+    const struct gnttab_copy *op,
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    s16 rc;
 
-    rc = xsm_grant_copy(sd, dd);
-    if ( rc )
+    if ( (rc = gnttab_copy_lock_domain(op->source.domid, src)) ||
+         (rc = gnttab_copy_lock_domain(op->dest.domid, dest)) )
+        goto error_out;
+
+    if ( xsm_grant_copy(src->domain, dest->domain) )
     {
         rc = GNTST_permission_denied;
         goto error_out;
     }
 
-    if ( src_is_gref )
+    return GNTST_okay;
+
+ error_out:
+    gnttab_copy_unlock_domains(src, dest);
+    return rc;
+}
+
+/* Pin the grant (or look up the gmfn) and get, reference and map the
+   frame for one side of a copy.  The buffer's domain is locked. */
+static s16
+gnttab_copy_claim_buf(
+    struct gnttab_copy_buf *buf, unsigned long ref, int is_gref,
+    int read_only)
+{
+    s16 rc = GNTST_okay;
+
+    buf->ref = ref;
+    buf->is_gref = is_gref;
+    buf->read_only = read_only;
+
+    if ( is_gref )
     {
-        unsigned source_off, source_len;
-        rc = __acquire_grant_for_copy(sd, op->source.u.ref, current->domain, 1,
-                                      &s_frame, &source_off, &source_len, 1,
-                                      &source_domain);
+        rc = __acquire_grant_for_copy(buf->domain, ref, current->domain,
+                                      read_only, &buf->frame, &buf->off,
+                                      &buf->len, 1, &buf->owner);
         if ( rc != GNTST_okay )
             goto error_out;
-        have_s_grant = 1;
-        if ( op->source.offset < source_off ||
-             op->len > source_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy source out of bounds: %d < %d || %d > %d\n",
-                     op->source.offset, source_off,
-                     op->len, source_len);
+        buf->have_grant = 1;
     }
     else
     {
 #ifdef CONFIG_X86
         p2m_type_t p2mt;
-        s_frame = mfn_x(gfn_to_mfn(sd, op->source.u.gmfn, &p2mt));
+        buf->frame = read_only ?
+            mfn_x(gfn_to_mfn(buf->domain, ref, &p2mt)) :
+            mfn_x(gfn_to_mfn_unshare(buf->domain, ref, &p2mt, 1));
         if ( !p2m_is_valid(p2mt) )
-          s_frame = INVALID_MFN;
+          buf->frame = INVALID_MFN;
         if ( p2m_is_paging(p2mt) )
         {
-            p2m_mem_paging_populate(sd, op->source.u.gmfn);
+            p2m_mem_paging_populate(buf->domain, ref);
             rc = -ENOENT;
             goto error_out;
         }
 #else
-        s_frame = gmfn_to_mfn(sd, op->source.u.gmfn);        
+        buf->frame = gmfn_to_mfn(buf->domain, ref);
 #endif
-        source_domain = sd;
+        buf->owner = buf->domain;
+        buf->off = 0;
+        buf->len = PAGE_SIZE;
     }
-    if ( unlikely(!mfn_valid(s_frame)) )
-        PIN_FAIL(error_out, GNTST_general_error,
-                 "source frame %lx invalid.\n", s_frame);
-    if ( !get_page(mfn_to_page(s_frame), source_domain) )
+
+    if ( unlikely(!mfn_valid(buf->frame)) )
+        PIN_FAIL(error_out, GNTST_general_error, "%s frame %lx invalid.\n",
+                 read_only ? "source" : "destination", buf->frame);
+    if ( read_only ?
+         !get_page(mfn_to_page(buf->frame), buf->owner) :
+         !get_page_and_type(mfn_to_page(buf->frame), buf->owner,
+                            PGT_writable_page) )
     {
-        if ( !sd->is_dying )
-            gdprintk(XENLOG_WARNING, "Could not get src frame %lx\n", s_frame);
+        if ( !buf->domain->is_dying )
+            gdprintk(XENLOG_WARNING, "Could not get %s frame %lx\n",
+                     read_only ? "src" : "dst", buf->frame);
         rc = GNTST_general_error;
         goto error_out;
     }
-    have_s_ref = 1;
+    buf->have_ref = 1;
+
+    buf->virt = map_domain_page(buf->frame);
+    perfc_incr(gnttab_copy_claim);
+
+ error_out:
+    return rc;
+}
+
+static int
+gnttab_copy_buf_valid(
+    const struct gnttab_copy_buf *buf, unsigned long ref, int is_gref)
+{
+    return buf->have_ref && (buf->ref == ref) && (buf->is_gref == is_gref);
+}
+
+static s16
+__gnttab_copy(
+    const struct gnttab_copy *op,
+    struct gnttab_copy_buf *src, struct gnttab_copy_buf *dest)
+{
+    s16 rc = GNTST_okay;
+    int src_is_gref, dest_is_gref;
+    unsigned long src_ref, dest_ref;
+
+    perfc_incr(gnttab_copy_op);
+
+    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
+         ((op->dest.offset + op->len) > PAGE_SIZE) )
+        PIN_FAIL(error_out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+
+    src_is_gref = !!(op->flags & GNTCOPY_source_gref);
+    dest_is_gref = !!(op->flags & GNTCOPY_dest_gref);
+    src_ref = src_is_gref ? op->source.u.ref : op->source.u.gmfn;
+    dest_ref = dest_is_gref ? op->dest.u.ref : op->dest.u.gmfn;
+
+    if ( (op->source.domid != DOMID_SELF && !src_is_gref ) ||
+         (op->dest.domid   != DOMID_SELF && !dest_is_gref)   )
+        PIN_FAIL(error_out, GNTST_permission_denied,
+                 "only allow copy-by-mfn for DOMID_SELF.\n");
 
-    if ( dest_is_gref )
+    if ( !src->domain || (src->domid != op->source.domid) ||
+         !dest->domain || (dest->domid != op->dest.domid) )
     {
-        unsigned dest_off, dest_len;
-        rc = __acquire_grant_for_copy(dd, op->dest.u.ref, current->domain, 0,
-                                      &d_frame, &dest_off, &dest_len, 1,
-                                      &dest_domain);
-        if ( rc != GNTST_okay )
+        gnttab_copy_release_buf(src);
+        gnttab_copy_release_buf(dest);
+        gnttab_copy_unlock_domains(src, dest);
+        if ( (rc = gnttab_copy_lock_domains(op, src, dest)) != GNTST_okay )
             goto error_out;
-        have_d_grant = 1;
-        if ( op->dest.offset < dest_off ||
-             op->len > dest_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy dest out of bounds: %d < %d || %d > %d\n",
-                     op->dest.offset, dest_off,
-                     op->len, dest_len);
     }
-    else
+
+    if ( !gnttab_copy_buf_valid(src, src_ref, src_is_gref) )
     {
-#ifdef CONFIG_X86
-        p2m_type_t p2mt;
-        d_frame = mfn_x(gfn_to_mfn_unshare(dd, op->dest.u.gmfn, &p2mt, 1));
-        if ( !p2m_is_valid(p2mt) )
-          d_frame = INVALID_MFN;
-        if ( p2m_is_paging(p2mt) )
-        {
-            p2m_mem_paging_populate(dd, op->dest.u.gmfn);
-            rc = -ENOENT;
+        gnttab_copy_release_buf(src);
+        if ( (rc = gnttab_copy_claim_buf(src, src_ref, src_is_gref,
+                                         1)) != GNTST_okay )
             goto error_out;
-        }
-#else
-        d_frame = gmfn_to_mfn(dd, op->dest.u.gmfn);
-#endif
-        dest_domain = dd;
     }
-    if ( unlikely(!mfn_valid(d_frame)) )
+    if ( op->source.offset < src->off ||
+         op->len > src->len )
         PIN_FAIL(error_out, GNTST_general_error,
-                 "destination frame %lx invalid.\n", d_frame);
-    if ( !get_page_and_type(mfn_to_page(d_frame), dest_domain,
-                            PGT_writable_page) )
+                 "copy source out of bounds: %d < %d || %d > %d\n",
+                 op->source.offset, src->off,
+                 op->len, src->len);
+
+    if ( !gnttab_copy_buf_valid(dest, dest_ref, dest_is_gref) )
     {
-        if ( !dd->is_dying )
-            gdprintk(XENLOG_WARNING, "Could not get dst frame %lx\n", d_frame);
-        rc = GNTST_general_error;
-        goto error_out;
+        gnttab_copy_release_buf(dest);
+        if ( (rc = gnttab_copy_claim_buf(dest, dest_ref, dest_is_gref,
+                                         0)) != GNTST_okay )
+            goto error_out;
     }
+    if ( op->dest.offset < dest->off ||
+         op->len > dest->len )
+        PIN_FAIL(error_out, GNTST_general_error,
+                 "copy dest out of bounds: %d < %d || %d > %d\n",
+                 op->dest.offset, dest->off,
+                 op->len, dest->len);
 
-    sp = map_domain_page(s_frame);
-    dp = map_domain_page(d_frame);
-
-    memcpy(dp + op->dest.offset, sp + op->source.offset, op->len);
+    memcpy((char *)dest->virt + op->dest.offset,
+           (char *)src->virt + op->source.offset, op->len);
 
-    unmap_domain_page(dp);
-    unmap_domain_page(sp);
+    gnttab_mark_dirty(dest->domain, dest->frame);
 
-    gnttab_mark_dirty(dd, d_frame);
+    if ( opt_gnttab_copy_batch )
+        return GNTST_okay;
 
-    put_page_and_type(mfn_to_page(d_frame));
  error_out:
-    if ( have_s_ref )
-        put_page(mfn_to_page(s_frame));
-    if ( have_s_grant )
-        __release_grant_for_copy(sd, op->source.u.ref, 1);
-    if ( have_d_grant )
-        __release_grant_for_copy(dd, op->dest.u.ref, 0);
-    if ( sd )
-        rcu_unlock_domain(sd);
-    if ( dd )
-        rcu_unlock_domain(dd);
-    op->status = rc;
+    gnttab_copy_release_buf(src);
+    gnttab_copy_release_buf(dest);
+    if ( !opt_gnttab_copy_batch )
+        gnttab_copy_unlock_domains(src, dest);
+    return rc;
 }
 
 static long
@@ -1995,19 +2267,35 @@ gnttab_copy(
     XEN_GUEST_HANDLE(gnttab_copy_t) uop, unsigned int count)
 {
     int i;
+    long rc = 0;
     struct gnttab_copy op;
+    struct gnttab_copy_buf src = { 0 }, dest = { 0 };
 
     for ( i = 0; i < count; i++ )
     {
         if (i && hypercall_preempt_check())
-            return i;
+        {
+            rc = i;
+            break;
+        }
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
-        __gnttab_copy(&op);
+        {
+            rc = -EFAULT;
+            break;
+        }
+        op.status = __gnttab_copy(&op, &src, &dest);
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
     }
-    return 0;
+
+    gnttab_copy_release_buf(&src);
+    gnttab_copy_release_buf(&dest);
+    gnttab_copy_unlock_domains(&src, &dest);
+
+    return rc;
 }
 
 static long
@@ -2223,6 +2511,26 @@ do_grant_table_op(
         }
         break;
     }
+    case GNTTABOP_unmap_grant_ref_deferred:
+    {
+        XEN_GUEST_HANDLE(gnttab_unmap_grant_ref_t) unmap =
+            guest_handle_cast(uop, gnttab_unmap_grant_ref_t);
+        if ( unlikely(!guest_handle_okay(unmap, count)) )
+            goto out;
+        rc = gnttab_unmap_grant_ref_deferred(unmap, count);
+        if ( rc > 0 )
+        {
+            guest_handle_add_offset(unmap, rc);
+            uop = guest_handle_cast(unmap, void);
+        }
+        break;
+    }
+    case GNTTABOP_unmap_flush:
+    {
+        gnttab_flush_deferred_unmaps(d);
+        rc = 0;
+        break;
+    }
     case GNTTABOP_unmap_and_replace:
     {
         XEN_GUEST_HANDLE(gnttab_unmap_and_replace_t) unmap =
@@ -2340,6 +2648,7 @@ grant_table_create(
     /* Simple stuff. */
     memset(t, 0, sizeof(*t));
     spin_lock_init(&t->lock);
+    spin_lock_init(&t->deferred_lock);
     t->nr_grant_frames = INITIAL_NR_GRANT_FRAMES;
 
     /* Active grant table. */
@@ -2428,6 +2737,9 @@ gnttab_release_mappings(
 
     BUG_ON(!d->is_dying);
 
+    /* Deferred unmaps have already dropped their maptrack flags. */
+    gnttab_flush_deferred_unmaps(d);
+
     for ( handle = 0; handle < gt->maptrack_limit; handle++ )
     {
         map = &maptrack_entry(gt, handle);
@@ -2543,6 +2855,9 @@ grant_table_destroy(
         free_xenheap_page(t->status[i]);
     xfree(t->status);
 
+    ASSERT(t->nr_deferred == 0);
+    xfree(t->deferred);
+
     xfree(t);
     d->grant_table = NULL;
 }
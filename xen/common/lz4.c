@@ -0,0 +1,223 @@
+/*
+ *  lz4.c -- LZ4 block format compressor and decompressor
+ *
+ *  The block format is that of LZ4 by Yann Collet: a sequence is a token
+ *  byte holding a literal length and a match length (less the minimum
+ *  match of 4) in its high and low nibbles, a length of 15 being extended
+ *  by following bytes up to and including the first that isn't 255, then
+ *  the literals, then a 16-bit little endian match offset.  The final
+ *  sequence has literals only.
+ *
+ *  This implementation only handles inputs of less than 64KB, which is
+ *  all tmem needs, so positions in the match finder's hash table fit in
+ *  16 bits and no offset can be out of range.
+ */
+
+#include <xen/types.h>
+#include <xen/string.h>
+#include <xen/lz4.h>
+
+#define get_unaligned(_p) (*(_p))
+
+#define MIN_MATCH     4
+#define MFLIMIT       12  /* no match may start in the last MFLIMIT bytes */
+#define LAST_LITERALS 5   /* and the last LAST_LITERALS are always literals */
+#define SKIP_TRIGGER  6   /* search faster through incompressible data */
+
+#define RUN_MASK      15
+#define ML_MASK       15
+
+static inline unsigned int lz4_hash(const unsigned char *p)
+{
+    return (get_unaligned((const u32 *)p) * 2654435761U) >>
+           (32 - LZ4_HASH_LOG);
+}
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+    for ( ; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+                 unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+    u16 *table = wrkmem;
+    const unsigned char *ip = src, *anchor = src;
+    const unsigned char *const iend = src + src_len;
+    const unsigned char *const mflimit = iend - MFLIMIT;
+    const unsigned char *const matchlimit = iend - LAST_LITERALS;
+    const unsigned char *match, *mstart;
+    unsigned char *op = dst, *token;
+    unsigned int h, searched;
+    size_t len;
+
+    if ( src_len > LZ4_MAX_INPUT_SIZE )
+        return LZ4_E_ERROR;
+    if ( src_len < MFLIMIT + 1 )
+        goto last_literals;
+
+    memset(table, 0, LZ4_MEM_COMPRESS);
+    table[lz4_hash(ip)] = 0;
+    ip++;
+
+    for ( ; ; )
+    {
+        /* find a match, stepping further the longer we fail to */
+        for ( searched = 1 << SKIP_TRIGGER; ; ip += searched++ >> SKIP_TRIGGER )
+        {
+            if ( ip > mflimit )
+                goto last_literals;
+            h = lz4_hash(ip);
+            match = src + table[h];
+            table[h] = ip - src;
+            if ( get_unaligned((const u32 *)match) ==
+                 get_unaligned((const u32 *)ip) )
+                break;
+        }
+
+        /* extend it backwards into the literals */
+        while ( (ip > anchor) && (match > src) && (ip[-1] == match[-1]) )
+        {
+            ip--;
+            match--;
+        }
+
+        len = ip - anchor;
+        token = op++;
+        if ( len >= RUN_MASK )
+        {
+            *token = RUN_MASK << 4;
+            op = lz4_put_length(op, len - RUN_MASK);
+        }
+        else
+            *token = len << 4;
+        memcpy(op, anchor, len);
+        op += len;
+
+        for ( ; ; )
+        {
+            len = ip - match;
+            *op++ = len;
+            *op++ = len >> 8;
+
+            mstart = ip;
+            ip += MIN_MATCH;
+            match += MIN_MATCH;
+            while ( (ip < matchlimit) && (*ip == *match) )
+            {
+                ip++;
+                match++;
+            }
+            len = ip - mstart - MIN_MATCH;
+            if ( len >= ML_MASK )
+            {
+                *token += ML_MASK;
+                op = lz4_put_length(op, len - ML_MASK);
+            }
+            else
+                *token += len;
+
+            anchor = ip;
+            if ( ip > mflimit )
+                goto last_literals;
+
+            /* is there another match right here? */
+            table[lz4_hash(ip - 2)] = ip - 2 - src;
+            h = lz4_hash(ip);
+            match = src + table[h];
+            table[h] = ip - src;
+            if ( get_unaligned((const u32 *)match) !=
+                 get_unaligned((const u32 *)ip) )
+                break;
+            token = op++;
+            *token = 0;
+        }
+        ip++;
+    }
+
+ last_literals:
+    len = iend - anchor;
+    if ( len >= RUN_MASK )
+    {
+        *op++ = RUN_MASK << 4;
+        op = lz4_put_length(op, len - RUN_MASK);
+    }
+    else
+        *op++ = len << 4;
+    memcpy(op, anchor, len);
+    op += len;
+
+    *dst_len = op - dst;
+    return LZ4_E_OK;
+}
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+                        unsigned char *dst, size_t *dst_len)
+{
+    const unsigned char *ip = src;
+    const unsigned char *const iend = src + src_len;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + *dst_len;
+    const unsigned char *match;
+    unsigned int token, s;
+    size_t len, offset;
+
+    while ( ip < iend )
+    {
+        token = *ip++;
+
+        len = token >> 4;
+        if ( len == RUN_MASK )
+            do {
+                if ( ip >= iend )
+                    return LZ4_E_INPUT_OVERRUN;
+                len += s = *ip++;
+            } while ( s == 255 );
+        if ( len > (size_t)(iend - ip) )
+            return LZ4_E_INPUT_OVERRUN;
+        if ( len > (size_t)(oend - op) )
+            return LZ4_E_OUTPUT_OVERRUN;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* the last sequence has no match */
+        if ( ip == iend )
+            break;
+
+        if ( (iend - ip) < 2 )
+            return LZ4_E_INPUT_OVERRUN;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ( (offset == 0) || (offset > (size_t)(op - dst)) )
+            return LZ4_E_LOOKBEHIND_OVERRUN;
+
+        len = token & ML_MASK;
+        if ( len == ML_MASK )
+            do {
+                if ( ip >= iend )
+                    return LZ4_E_INPUT_OVERRUN;
+                len += s = *ip++;
+            } while ( s == 255 );
+        len += MIN_MATCH;
+        if ( len > (size_t)(oend - op) )
+            return LZ4_E_OUTPUT_OVERRUN;
+
+        match = op - offset;
+        if ( offset >= len )
+        {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else
+            /* overlapping, so the copy repeats the last offset bytes */
+            while ( len-- )
+                *op++ = *match++;
+    }
+
+    *dst_len = op - dst;
+    return LZ4_E_OK;
+}
@@ -51,7 +51,7 @@ string_param("badpage", opt_badpage);
 /*
  * no-bootscrub -> Free pages are not zeroed during boot.
  */
-static int opt_bootscrub __initdata = 1;
+static int opt_bootscrub __read_mostly = 1;
 boolean_param("bootscrub", opt_bootscrub);
 
 /*
@@ -224,12 +224,52 @@ static heap_by_zone_and_order_t *_heap[MAX_NUMNODES];
 static unsigned long *avail[MAX_NUMNODES];
 static long total_avail_pages;
 
+/*
+ * Free pages which still hold a previous owner's data.  Such pages are
+ * kept in chunks of their own, at the tail of the free lists, and are
+ * scrubbed by idle CPUs of their node or, failing that, when allocated.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* Pages an idle CPU scrubs in one go, with the heap unlocked. */
+#define SCRUB_CHUNK_ORDER 8
+
 /* TMEM: Reserve a fraction of memory for mid-size (0<order<9) allocations.*/
 static long midsize_alloc_zone_pages;
 #define MIDSIZE_ALLOC_FRAC 128
 
 static DEFINE_SPINLOCK(heap_lock);
 
+/* Take heap_lock, counting how often somebody else already held it. */
+#define lock_heap() do {                        \
+    if ( !spin_trylock(&heap_lock) )            \
+    {                                           \
+        perfc_incr(heap_lock_contended);        \
+        spin_lock(&heap_lock);                  \
+    }                                           \
+    perfc_incr(heap_lock_acquired);             \
+} while ( 0 )
+
+/*
+ * Per-CPU caches of free order-0 pages, so that single page allocations
+ * and frees take heap_lock once per PAGE_CACHE_BATCH pages.  Cached pages
+ * are clean, of the CPU's node and not in MEMZONE_XEN.  They are accounted
+ * as allocated in avail[], and are marked in use so that the buddy
+ * allocator leaves them alone.  A cache's lock nests outside heap_lock.
+ */
+#define PAGE_CACHE_HIGH  64
+#define PAGE_CACHE_BATCH 16
+
+struct page_cache {
+    spinlock_t lock;
+    unsigned int count;
+    struct page_list_head list;
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache) = {
+    .lock = SPIN_LOCK_UNLOCKED
+};
+
 static unsigned long init_node_heap(int node, unsigned long mfn,
                                     unsigned long nr, bool_t *use_tail)
 {
@@ -292,16 +332,87 @@ static unsigned long init_node_heap(int node, unsigned long mfn,
     return needed;
 }
 
+/* Put a free chunk on its list: clean chunks first, to be allocated first. */
+static void page_list_add_free(struct page_info *pg, unsigned int node,
+                               unsigned int zone, unsigned int order)
+{
+    PFN_ORDER(pg) = order;
+    if ( pg->u.free.need_scrub )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/*
+ * Take a free chunk of 2^@order pages of @node off the heap, preferring
+ * chunks which need no scrubbing.  Called with the heap lock held.
+ */
+static struct page_info *take_free_chunk(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int node, unsigned int order, bool_t *need_scrub)
+{
+    unsigned int j, zone = zone_hi;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    do {
+        /* Check if target node can support the allocation. */
+        if ( !avail[node] || (avail[node][zone] < request) )
+            continue;
+
+        /* Find smallest order which can satisfy the request. */
+        for ( j = order; j <= MAX_ORDER; j++ )
+            if ( !page_list_empty(&heap(node, zone, j)) &&
+                 !page_list_first(&heap(node, zone, j))->u.free.need_scrub )
+                goto found;
+        for ( j = order; j <= MAX_ORDER; j++ )
+            if ( !page_list_empty(&heap(node, zone, j)) )
+                goto found;
+    } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+    return NULL;
+
+ found: 
+    pg = page_list_remove_head(&heap(node, zone, j));
+    *need_scrub = pg->u.free.need_scrub;
+
+    /* We may have to halve the chunk a number of times. */
+    while ( j != order )
+    {
+        page_list_add_free(pg, node, zone, --j);
+        pg += 1 << j;
+    }
+
+    ASSERT(avail[node][zone] >= request);
+    avail[node][zone] -= request;
+    total_avail_pages -= request;
+    ASSERT(total_avail_pages >= 0);
+
+    if ( *need_scrub )
+    {
+        ASSERT(node_need_scrub[node] >= request);
+        node_need_scrub[node] -= request;
+    }
+
+    return pg;
+}
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int node);
+static int page_cache_drain_all(void);
+
 /* Allocate 2^@order contiguous pages. */
 static struct page_info *alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int node, unsigned int order, unsigned int memflags)
 {
-    unsigned int i, j, zone = 0;
+    unsigned int i;
     unsigned int num_nodes = num_online_nodes();
-    unsigned long request = 1UL << order;
     cpumask_t extra_cpus_mask, mask;
     struct page_info *pg;
+    bool_t need_scrub = 0, cached = 0, drained = 0;
 
     if ( node == NUMA_NO_NODE )
         node = cpu_to_node(smp_processor_id());
@@ -313,7 +424,15 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
-    spin_lock(&heap_lock);
+    if ( (order == 0) &&
+         ((pg = page_cache_alloc(zone_lo, zone_hi, node)) != NULL) )
+    {
+        cached = 1;
+        goto out;
+    }
+
+ retry:
+    lock_heap();
 
     /*
      * TMEM: When available memory is scarce, allow only mid-size allocations
@@ -330,17 +449,9 @@ static struct page_info *alloc_heap_pages(
      */
     for ( i = 0; i < num_nodes; i++ )
     {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+        if ( (pg = take_free_chunk(zone_lo, zone_hi, node, order,
+                                   &need_scrub)) != NULL )
+            goto found;
 
         /* Pick next node, wrapping around if needed. */
         node = next_node(node, node_online_map);
@@ -348,6 +459,16 @@ static struct page_info *alloc_heap_pages(
             node = first_node(node_online_map);
     }
 
+    /* Pages may be sitting in the per-CPU caches: return them and retry. */
+    if ( !drained )
+    {
+        spin_unlock(&heap_lock);
+        drained = 1;
+        if ( page_cache_drain_all() )
+            goto retry;
+        lock_heap();
+    }
+
  try_tmem:
     /* Try to free memory from tmem */
     if ( (pg = tmem_relinquish_pages(order,memflags)) != NULL )
@@ -362,28 +483,24 @@ static struct page_info *alloc_heap_pages(
     return NULL;
 
  found: 
-    /* We may have to halve the chunk a number of times. */
-    while ( j != order )
-    {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
-    }
-
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
-
     spin_unlock(&heap_lock);
 
+ out:
     cpus_clear(mask);
 
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        if ( cached )
+            BUG_ON((pg[i].count_info & PGC_count_mask) != 0);
+        else
+        {
+            BUG_ON(pg[i].count_info != PGC_state_free);
+            pg[i].count_info = PGC_state_inuse;
+        }
+
+        if ( need_scrub )
+            scrub_one_page(&pg[i]);
 
         if ( pg[i].u.free.need_tlbflush )
         {
@@ -455,8 +572,7 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_free(cur_head, node, zone, cur_order);
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -472,6 +588,9 @@ static int reserve_offlined_page(struct page_info *head)
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
 
+        if ( cur_head->u.free.need_scrub )
+            node_need_scrub[node]--;
+
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
@@ -482,48 +601,24 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Return 2^@order free pages to the heap, merging them with free buddies
+ * in the same scrub state.  Called with the heap lock held.
+ */
+static void merge_free_pages(
+    struct page_info *pg, unsigned int order, unsigned int tainted)
 {
     unsigned long mask;
-    unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
+    unsigned int node = phys_to_nid(page_to_maddr(pg));
     unsigned int zone = page_to_zone(pg);
+    bool_t need_scrub = pg->u.free.need_scrub;
 
-    ASSERT(order <= MAX_ORDER);
-    ASSERT(node >= 0);
-
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        /*
-         * Cannot assume that count_info == 0, as there are some corner cases
-         * where it isn't the case and yet it isn't a bug:
-         *  1. page_get_owner() is NULL
-         *  2. page_get_owner() is a domain that was never accessible by
-         *     its domid (e.g., failed to fully construct the domain).
-         *  3. page was never addressable by the guest (e.g., it's an
-         *     auto-translate-physmap guest and the page was never included
-         *     in its pseudophysical address space).
-         * In all the above cases there can be no guest mappings of this page.
-         */
-        ASSERT(!page_state_is(&pg[i], offlined));
-        pg[i].count_info =
-            ((pg[i].count_info & PGC_broken) |
-             (page_state_is(&pg[i], offlining)
-              ? PGC_state_offlined : PGC_state_free));
-        if ( page_state_is(&pg[i], offlined) )
-            tainted = 1;
-
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-    }
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     avail[node][zone] += 1 << order;
     total_avail_pages += 1 << order;
+    if ( need_scrub )
+        node_need_scrub[node] += 1 << order;
 
     if ( opt_tmem )
         midsize_alloc_zone_pages = max(
@@ -539,7 +634,8 @@ static void free_heap_pages(
             /* Merge with predecessor block? */
             if ( !mfn_valid(page_to_mfn(pg-mask)) ||
                  !page_state_is(pg-mask, free) ||
-                 (PFN_ORDER(pg-mask) != order) )
+                 (PFN_ORDER(pg-mask) != order) ||
+                 ((pg-mask)->u.free.need_scrub != need_scrub) )
                 break;
             pg -= mask;
             page_list_del(pg, &heap(node, zone, order));
@@ -549,7 +645,8 @@ static void free_heap_pages(
             /* Merge with successor block? */
             if ( !mfn_valid(page_to_mfn(pg+mask)) ||
                  !page_state_is(pg+mask, free) ||
-                 (PFN_ORDER(pg+mask) != order) )
+                 (PFN_ORDER(pg+mask) != order) ||
+                 ((pg+mask)->u.free.need_scrub != need_scrub) )
                 break;
             page_list_del(pg + mask, &heap(node, zone, order));
         }
@@ -560,15 +657,338 @@ static void free_heap_pages(
         ASSERT(phys_to_nid(page_to_maddr(pg)) == node);
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    page_list_add_free(pg, node, zone, order);
 
     if ( tainted )
         reserve_offlined_page(pg);
+}
+
+/* Hand a cached page back to the heap.  Called with the heap lock held. */
+static void page_cache_return(struct page_info *pg)
+{
+    unsigned int tainted = page_state_is(pg, offlining);
 
+    ASSERT(spin_is_locked(&heap_lock));
+
+    pg->count_info = ((pg->count_info & PGC_broken) |
+                      (tainted ? PGC_state_offlined : PGC_state_free));
+    merge_free_pages(pg, 0, tainted);
+}
+
+/* Return the @nr coldest pages of a cache to the heap.  Cache locked. */
+static void page_cache_drain(struct page_cache *pc, unsigned int nr)
+{
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    if ( pc->count == 0 )
+        return;
+
+    perfc_incr(page_cache_drain);
+
+    lock_heap();
+    while ( nr-- && pc->count )
+    {
+        pg = page_list_last(&pc->list);
+        page_list_del(pg, &pc->list);
+        pc->count--;
+        page_cache_return(pg);
+    }
     spin_unlock(&heap_lock);
 }
 
+/* Return every CPU's cached pages to the heap.  Returns how many. */
+static int page_cache_drain_all(void)
+{
+    struct page_cache *pc;
+    unsigned int cpu;
+    int nr = 0;
+
+    for_each_cpu_mask ( cpu, cpu_possible_map )
+    {
+        pc = &per_cpu(page_cache, cpu);
+        if ( pc->count == 0 )
+            continue;
+        spin_lock(&pc->lock);
+        nr += pc->count;
+        page_cache_drain(pc, pc->count);
+        spin_unlock(&pc->lock);
+    }
+
+    return nr;
+}
+
+/* Fill this CPU's cache with up to PAGE_CACHE_BATCH pages.  Cache locked. */
+static void page_cache_refill(struct page_cache *pc, unsigned int zone_lo,
+                              unsigned int zone_hi, unsigned int node)
+{
+    PAGE_LIST_HEAD(dirty);
+    struct page_info *pg;
+    unsigned int i;
+    bool_t need_scrub;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    perfc_incr(page_cache_refill);
+
+    lock_heap();
+    for ( i = 0; i < PAGE_CACHE_BATCH; i++ )
+    {
+        if ( opt_tmem && (total_avail_pages <= midsize_alloc_zone_pages) )
+            break;
+        pg = take_free_chunk(zone_lo, zone_hi, node, 0, &need_scrub);
+        if ( pg == NULL )
+            break;
+        BUG_ON(pg->count_info != PGC_state_free);
+        pg->count_info = PGC_state_inuse;
+        pg->u.free.need_scrub = 0;
+        page_list_add(pg, need_scrub ? &dirty : &pc->list);
+        pc->count++;
+    }
+    spin_unlock(&heap_lock);
+
+    while ( (pg = page_list_remove_head(&dirty)) != NULL )
+    {
+        scrub_one_page(pg);
+        page_list_add_tail(pg, &pc->list);
+    }
+}
+
+/* Allocate a page from this CPU's cache, refilling it if empty. */
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int node)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+    struct page_info *pg = NULL;
+    unsigned int zone;
+
+    if ( (node != cpu_to_node(smp_processor_id())) ||
+         (zone_hi == MEMZONE_XEN) )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+    if ( pc->count == 0 )
+    {
+        INIT_PAGE_LIST_HEAD(&pc->list);
+        page_cache_refill(pc, max_t(unsigned int, zone_lo, MEMZONE_XEN + 1),
+                          zone_hi, node);
+    }
+
+    while ( pc->count )
+    {
+        pg = page_list_first(&pc->list);
+        zone = page_to_zone(pg);
+        if ( (zone < zone_lo) || (zone > zone_hi) )
+        {
+            pg = NULL;
+            break;
+        }
+
+        page_list_del(pg, &pc->list);
+        pc->count--;
+
+        /* Offlined while cached: it goes to the heap, not to the caller. */
+        if ( likely(!page_state_is(pg, offlining)) )
+            break;
+        lock_heap();
+        page_cache_return(pg);
+        spin_unlock(&heap_lock);
+        pg = NULL;
+    }
+
+    spin_unlock(&pc->lock);
+
+    if ( pg != NULL )
+        perfc_incr(page_cache_hit);
+
+    return pg;
+}
+
+/*
+ * Keep a page just freed (and so a free, clean order-0 page) in this CPU's
+ * cache if it is suitable.  Returns zero if it belongs to the heap.
+ */
+static int page_cache_free(struct page_info *pg)
+{
+    struct page_cache *pc = &this_cpu(page_cache);
+
+    if ( !page_state_is(pg, free) ||
+         (page_to_zone(pg) == MEMZONE_XEN) ||
+         (phys_to_nid(page_to_maddr(pg)) !=
+          cpu_to_node(smp_processor_id())) )
+        return 0;
+
+    pg->count_info = PGC_state_inuse;
+
+    spin_lock(&pc->lock);
+
+    if ( pc->count == 0 )
+        INIT_PAGE_LIST_HEAD(&pc->list);
+    page_list_add(pg, &pc->list);
+    if ( ++pc->count > PAGE_CACHE_HIGH )
+        page_cache_drain(pc, PAGE_CACHE_BATCH);
+
+    spin_unlock(&pc->lock);
+
+    perfc_incr(page_cache_free);
+
+    return 1;
+}
+
+/* Pages in the per-CPU caches, free though not on the heap. */
+static unsigned long page_cache_pages(void)
+{
+    unsigned long pages = 0;
+    unsigned int cpu;
+
+    for_each_cpu_mask ( cpu, cpu_possible_map )
+        pages += per_cpu(page_cache, cpu).count;
+
+    return pages;
+}
+
+/* Free 2^@order set of pages, which still hold data if @need_scrub. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned int i, tainted = 0;
+
+    ASSERT(order <= MAX_ORDER);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /*
+         * Cannot assume that count_info == 0, as there are some corner cases
+         * where it isn't the case and yet it isn't a bug:
+         *  1. page_get_owner() is NULL
+         *  2. page_get_owner() is a domain that was never accessible by
+         *     its domid (e.g., failed to fully construct the domain).
+         *  3. page was never addressable by the guest (e.g., it's an
+         *     auto-translate-physmap guest and the page was never included
+         *     in its pseudophysical address space).
+         * In all the above cases there can be no guest mappings of this page.
+         */
+        ASSERT(!page_state_is(&pg[i], offlined));
+        pg[i].count_info =
+            ((pg[i].count_info & PGC_broken) |
+             (page_state_is(&pg[i], offlining)
+              ? PGC_state_offlined : PGC_state_free));
+        if ( page_state_is(&pg[i], offlined) )
+            tainted = 1;
+
+        /* If a page has no owner it will need no safety TLB flush. */
+        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
+        if ( pg[i].u.free.need_tlbflush )
+            pg[i].tlbflush_timestamp = tlbflush_current_time();
+
+        pg[i].u.free.need_scrub = need_scrub;
+    }
+
+    if ( (order == 0) && !need_scrub && page_cache_free(pg) )
+        return;
+
+    lock_heap();
+    merge_free_pages(pg, order, tainted);
+    spin_unlock(&heap_lock);
+}
+
+/*
+ * Scrub one chunk of the free pages of @node which still need it: take it
+ * off the heap, scrub it unlocked, and put it back.  Returns the number of
+ * pages scrubbed.
+ */
+static unsigned long scrub_node_pages(unsigned int node)
+{
+    struct page_info *pg;
+    unsigned int i, zone, order, tainted = 0;
+
+    if ( !node_need_scrub[node] )
+        return 0;
+
+    lock_heap();
+
+    /* Chunks which need scrubbing are at the tail of their lists. */
+    for ( zone = 0; zone < NR_ZONES; zone++ )
+        for ( order = 0; order <= MAX_ORDER; order++ )
+            if ( !page_list_empty(&heap(node, zone, order)) &&
+                 page_list_last(&heap(node, zone, order))->u.free.need_scrub )
+                goto found;
+
+    spin_unlock(&heap_lock);
+    return 0;
+
+ found:
+    pg = page_list_last(&heap(node, zone, order));
+    page_list_del(pg, &heap(node, zone, order));
+
+    while ( order > SCRUB_CHUNK_ORDER )
+    {
+        order--;
+        page_list_add_free(pg + (1 << order), node, zone, order);
+    }
+
+    avail[node][zone] -= 1 << order;
+    total_avail_pages -= 1 << order;
+    node_need_scrub[node] -= 1 << order;
+
+    /* Off the heap, the pages must not look free to merge_free_pages(). */
+    for ( i = 0; i < (1 << order); i++ )
+        pg[i].count_info = PGC_state_inuse;
+
+    spin_unlock(&heap_lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+        scrub_one_page(&pg[i]);
+
+    lock_heap();
+
+    /* Unlike free_heap_pages(), the pages' TLB flush state is kept. */
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        pg[i].count_info =
+            ((pg[i].count_info & PGC_broken) |
+             (page_state_is(&pg[i], offlining)
+              ? PGC_state_offlined : PGC_state_free));
+        if ( page_state_is(&pg[i], offlined) )
+            tainted = 1;
+        pg[i].u.free.need_scrub = 0;
+    }
+
+    merge_free_pages(pg, order, tainted);
+
+    spin_unlock(&heap_lock);
+
+    return 1UL << order;
+}
+
+/*
+ * Called by idle CPUs: scrub a chunk of free pages on this CPU's node.
+ * Returns zero if there was nothing to do.
+ */
+int scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id();
+
+    if ( softirq_pending(cpu) )
+        return 0;
+
+    return scrub_node_pages(cpu_to_node(cpu)) != 0;
+}
+
+/* Pages freed but not yet scrubbed, for XEN_SYSCTL_physinfo. */
+unsigned long scrub_pending_pages(void)
+{
+    unsigned long pages = 0;
+    unsigned int node;
+
+    for_each_online_node ( node )
+        pages += node_need_scrub[node];
+
+    return pages;
+}
+
 
 /*
  * Following possible status for a page:
@@ -667,7 +1087,7 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return -EINVAL;
     }
 
-    spin_lock(&heap_lock);
+    lock_heap();
 
     old_info = mark_page_offline(pg, broken);
 
@@ -734,7 +1154,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
 
     pg = mfn_to_page(mfn);
 
-    spin_lock(&heap_lock);
+    lock_heap();
 
     y = pg->count_info;
     do {
@@ -768,7 +1188,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
 
     return ret;
 }
@@ -784,7 +1204,7 @@ int query_page_offline(unsigned long mfn, uint32_t *status)
     }
 
     *status = 0;
-    spin_lock(&heap_lock);
+    lock_heap();
 
     pg = mfn_to_page(mfn);
 
@@ -846,7 +1266,7 @@ static void init_heap_pages(
          */
         if ( (nid_curr == nid_prev) ||
              !(page_to_mfn(pg+i) & ((1UL << MAX_ORDER) - 1)) )
-            free_heap_pages(pg+i, 0);
+            free_heap_pages(pg+i, 0, opt_bootscrub);
         else
             printk("Reserving non-aligned node boundary @ mfn %#lx\n",
                    page_to_mfn(pg+i));
@@ -876,7 +1296,7 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + page_cache_pages() - midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
@@ -922,41 +1342,33 @@ void __init end_boot_allocator(void)
 }
 
 /*
- * Scrub all unallocated pages in all heap zones. This function is more
- * convoluted than appears necessary because we do not want to continuously
- * hold the lock while scrubbing very large memory areas.
+ * Scrub all unallocated pages in all heap zones.  Free pages were marked
+ * as needing it when handed to the heap, and the other CPUs are already
+ * scrubbing their own nodes from their idle loops: help them until none
+ * are left.
  */
 void __init scrub_heap_pages(void)
 {
-    unsigned long mfn;
-    struct page_info *pg;
+    unsigned long done = 0, n;
+    unsigned int node;
 
     if ( !opt_bootscrub )
         return;
 
     printk("Scrubbing Free RAM: ");
 
-    for ( mfn = first_valid_mfn; mfn < max_page; mfn++ )
+    for_each_online_node ( node )
     {
-        process_pending_softirqs();
-
-        pg = mfn_to_page(mfn);
-
-        /* Quick lock-free check. */
-        if ( !mfn_valid(mfn) || !page_state_is(pg, free) )
-            continue;
-
-        /* Every 100MB, print a progress dot. */
-        if ( (mfn % ((100*1024*1024)/PAGE_SIZE)) == 0 )
-            printk(".");
-
-        spin_lock(&heap_lock);
-
-        /* Re-check page status with lock held. */
-        if ( page_state_is(pg, free) )
-            scrub_one_page(pg);
+        while ( (n = scrub_node_pages(node)) != 0 )
+        {
+            process_pending_softirqs();
 
-        spin_unlock(&heap_lock);
+            /* Every 100MB, print a progress dot. */
+            if ( ((done + n) / ((100*1024*1024)/PAGE_SIZE)) !=
+                 (done / ((100*1024*1024)/PAGE_SIZE)) )
+                printk(".");
+            done += n;
+        }
     }
 
     printk("done.\n");
@@ -1018,7 +1430,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1060,7 +1472,7 @@ void free_xenheap_pages(void *v, unsigned int order)
     for ( i = 0; i < (1u << order); i++ )
         pg[i].count_info &= ~PGC_xen_heap;
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1164,7 +1576,7 @@ struct page_info *alloc_domheap_pages(
 
     if ( (d != NULL) && assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1210,25 +1622,21 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
         /*
          * Normally we expect a domain to clear pages before freeing them, if 
          * it cares about the secrecy of their contents. However, after a 
-         * domain has died we assume responsibility for erasure.
+         * domain has died we assume responsibility for erasure: the pages
+         * are scrubbed in the background, or on their next allocation.
          */
-        if ( unlikely(d->is_dying) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, !!d->is_dying);
     }
     else if ( unlikely(d == dom_cow) )
     {
         ASSERT(order == 0); 
-        scrub_one_page(pg);
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, 1);
         drop_dom_ref = 0;
     }
     else
     {
         /* Freeing anonymous domain-heap pages. */
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         drop_dom_ref = 0;
     }
 
@@ -1254,7 +1662,7 @@ unsigned long avail_domheap_pages(void)
 {
     return avail_heap_pages(MEMZONE_XEN + 1,
                             NR_ZONES - 1,
-                            -1);
+                            -1) + page_cache_pages();
 }
 
 static void pagealloc_info(unsigned char key)
@@ -22,6 +22,7 @@
 #include <asm/atomic.h>
 #include <xen/errno.h>
 #include <xen/keyhandler.h>
+#include <xen/numa.h>
 
 /*
  * CSCHED_STATS
@@ -67,6 +68,18 @@
 #define CSCHED_FLAG_VCPU_PARKED 0x0001  /* VCPU over capped credits */
 
 
+/*
+ * Load balancing looks for work to steal in order of increasing distance
+ * from the stealing PCPU. There is no generic notion of the last-level
+ * cache, so a package (cpu_core_map) stands in for it.
+ */
+#define CSCHED_STEAL_SIBLING    0       /* SMT thread of the same core */
+#define CSCHED_STEAL_LLC        1       /* another core of the same package */
+#define CSCHED_STEAL_NODE       2       /* another package on the same node */
+#define CSCHED_STEAL_REMOTE     3       /* a PCPU on another NUMA node */
+#define CSCHED_STEAL_LEVELS     4
+
+
 /*
  * Useful macros
  */
@@ -108,10 +121,14 @@
  */
 struct csched_pcpu {
     struct list_head runq;
-    uint32_t runq_sort_last;
     struct timer ticker;
     unsigned int tick;
     unsigned int idle_bias;
+    spinlock_t acct_lock;           /* protects active_vcpu */
+    struct list_head active_vcpu;   /* VCPUs accounted on this PCPU */
+    uint32_t acct_runs;
+    uint64_t acct_cycles;
+    uint64_t acct_max_cycles;
 };
 
 /*
@@ -122,6 +139,7 @@ struct csched_vcpu {
     struct list_head active_vcpu_elem;
     struct csched_dom *sdom;
     struct vcpu *vcpu;
+    unsigned int active_cpu;    /* PCPU whose active list we are on */
     atomic_t credit;
     s_time_t start_time;   /* When we were scheduled (used for credit) */
     uint16_t flags;
@@ -142,28 +160,29 @@ struct csched_vcpu {
  * Domain
  */
 struct csched_dom {
-    struct list_head active_vcpu;
     struct list_head active_sdom_elem;
     struct domain *dom;
     uint16_t active_vcpu_count;
     uint16_t weight;
     uint16_t cap;
+    uint32_t share_gen;     /* csched_priv.share_gen of the shares below */
+    uint32_t credit_total;  /* domain's credits per accounting period */
+    uint32_t credit_fair;   /* per-VCPU credits per accounting period */
+    uint32_t credit_cap;    /* per-VCPU debt at which VCPUs get parked */
 };
 
 /*
  * System-wide private data
  */
 struct csched_private {
-    spinlock_t lock;
+    spinlock_t lock;        /* protects weight, credit and domain shares */
     struct list_head active_sdom;
     uint32_t ncpus;
-    struct timer  master_ticker;
-    unsigned int master;
     cpumask_t idlers;
-    uint32_t weight;
+    uint32_t weight;        /* total weight of active domains */
     uint32_t credit;
-    int credit_balance;
-    uint32_t runq_sort;
+    uint32_t share_gen;     /* bumped when all shares need recomputing */
+    uint32_t share_done;    /* share_gen the shares were last computed at */
 };
 
 
@@ -292,15 +311,15 @@ csched_pcpu_init(int cpu)
 
     /* Initialize/update system-wide config */
     csched_priv.credit += CSCHED_CREDITS_PER_ACCT;
+    csched_priv.share_gen++;
     if ( csched_priv.ncpus <= cpu )
         csched_priv.ncpus = cpu + 1;
-    if ( csched_priv.master >= csched_priv.ncpus )
-        csched_priv.master = cpu;
 
     init_timer(&spc->ticker, csched_tick, (void *)(unsigned long)cpu, cpu);
     INIT_LIST_HEAD(&spc->runq);
-    spc->runq_sort_last = csched_priv.runq_sort;
     spc->idle_bias = NR_CPUS - 1;
+    spin_lock_init(&spc->acct_lock);
+    INIT_LIST_HEAD(&spc->active_vcpu);
     per_cpu(schedule_data, cpu).sched_priv = spc;
 
     /* Start off idling... */
@@ -369,6 +388,27 @@ __csched_vcpu_is_cache_hot(struct vcpu *v)
     return hot;
 }
 
+/*
+ * Estimated cost, in microseconds, of moving a VCPU to another NUMA node:
+ * its cache footprint has to be refetched over the interconnect and its
+ * memory stays behind. A queued VCPU is only stolen across nodes once it
+ * has been waiting for longer than this.
+ */
+static unsigned int vcpu_remote_migration_cost = 1000;
+integer_param("vcpu_remote_migration_cost", vcpu_remote_migration_cost);
+
+static inline int
+__csched_vcpu_remote_migration_pays(struct vcpu *v)
+{
+    int pays = ((NOW() - v->last_run_time) >=
+                ((uint64_t)vcpu_remote_migration_cost * 1000u));
+
+    if ( !pays )
+        CSCHED_STAT_CRANK(steal_remote_costly);
+
+    return pays;
+}
+
 static inline int
 __csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu)
 {
@@ -461,49 +501,161 @@ csched_cpu_pick(struct vcpu *vc)
     return _csched_cpu_pick(vc, 1);
 }
 
+/*
+ * At most, a domain can use credits to run all its active VCPUs for one
+ * full accounting period, and no more than its cap allows.
+ */
+static inline uint32_t
+__csched_dom_peak(const struct csched_dom *sdom)
+{
+    uint32_t credit_peak = sdom->active_vcpu_count * CSCHED_CREDITS_PER_ACCT;
+    uint32_t credit_cap;
+
+    if ( sdom->cap != 0U )
+    {
+        credit_cap = ((sdom->cap * CSCHED_CREDITS_PER_ACCT) + 99) / 100;
+        if ( credit_cap < credit_peak )
+            credit_peak = credit_cap;
+    }
+
+    return credit_peak;
+}
+
+/* Split a domain's credit_total and cap between its active VCPUs. */
 static inline void
-__csched_vcpu_acct_start(struct csched_vcpu *svc)
+__csched_dom_share_vcpus(struct csched_dom *sdom)
 {
-    struct csched_dom * const sdom = svc->sdom;
+    uint32_t n = sdom->active_vcpu_count;
+    uint32_t credit_cap = 0U;
+
+    if ( sdom->cap != 0U )
+    {
+        credit_cap = ((sdom->cap * CSCHED_CREDITS_PER_ACCT) + 99) / 100;
+        credit_cap = ( credit_cap + ( n - 1 ) ) / n;
+    }
+
+    sdom->credit_fair = ( sdom->credit_total + ( n - 1 ) ) / n;
+    sdom->credit_cap = credit_cap;
+    sdom->share_gen = csched_priv.share_gen;
+}
+
+/*
+ * A domain is active while any of its VCPUs is. A change in the set of
+ * active domains, in their weights, or in the peak of a domain which its
+ * share is limited by, affects every domain's share. Any other change in
+ * the number of active VCPUs of a domain only affects how its own share
+ * is split between them.
+ *
+ * Called with csched_priv.lock held.
+ */
+static inline void
+__csched_dom_active_inc(struct csched_dom *sdom)
+{
+    if ( sdom->active_vcpu_count == 0 )
+    {
+        csched_priv.weight += sdom->weight;
+        list_add(&sdom->active_sdom_elem, &csched_priv.active_sdom);
+        csched_priv.share_gen++;
+    }
+    else if ( sdom->credit_total >= __csched_dom_peak(sdom) )
+        csched_priv.share_gen++;
+    else
+        sdom->share_gen = csched_priv.share_gen - 1;
+
+    sdom->active_vcpu_count++;
+}
+
+static inline void
+__csched_dom_active_dec(struct csched_dom *sdom)
+{
+    BUG_ON( sdom->active_vcpu_count == 0 );
+
+    if ( --sdom->active_vcpu_count == 0 )
+    {
+        BUG_ON( csched_priv.weight < sdom->weight );
+        csched_priv.weight -= sdom->weight;
+        list_del_init(&sdom->active_sdom_elem);
+        csched_priv.share_gen++;
+    }
+    else if ( sdom->credit_total > __csched_dom_peak(sdom) )
+        csched_priv.share_gen++;
+    else
+        sdom->share_gen = csched_priv.share_gen - 1;
+}
+
+static inline void
+__csched_vcpu_acct_start(struct csched_vcpu *svc, unsigned int cpu)
+{
+    struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
     unsigned long flags;
 
-    spin_lock_irqsave(&csched_priv.lock, flags);
+    spin_lock_irqsave(&spc->acct_lock, flags);
 
     if ( list_empty(&svc->active_vcpu_elem) )
     {
         CSCHED_VCPU_STAT_CRANK(svc, state_active);
         CSCHED_STAT_CRANK(acct_vcpu_active);
 
-        sdom->active_vcpu_count++;
-        list_add(&svc->active_vcpu_elem, &sdom->active_vcpu);
-        if ( list_empty(&sdom->active_sdom_elem) )
-        {
-            list_add(&sdom->active_sdom_elem, &csched_priv.active_sdom);
-            csched_priv.weight += sdom->weight;
-        }
+        list_add(&svc->active_vcpu_elem, &spc->active_vcpu);
+        svc->active_cpu = cpu;
+
+        spin_lock(&csched_priv.lock);
+        __csched_dom_active_inc(svc->sdom);
+        spin_unlock(&csched_priv.lock);
     }
 
-    spin_unlock_irqrestore(&csched_priv.lock, flags);
+    spin_unlock_irqrestore(&spc->acct_lock, flags);
 }
 
+/* Called with the acct_lock of svc->active_cpu held. */
 static inline void
 __csched_vcpu_acct_stop_locked(struct csched_vcpu *svc)
 {
-    struct csched_dom * const sdom = svc->sdom;
-
     BUG_ON( list_empty(&svc->active_vcpu_elem) );
 
     CSCHED_VCPU_STAT_CRANK(svc, state_idle);
     CSCHED_STAT_CRANK(acct_vcpu_idle);
 
-    sdom->active_vcpu_count--;
     list_del_init(&svc->active_vcpu_elem);
-    if ( list_empty(&sdom->active_vcpu) )
+
+    spin_lock(&csched_priv.lock);
+    __csched_dom_active_dec(svc->sdom);
+    spin_unlock(&csched_priv.lock);
+}
+
+/*
+ * An active VCPU is accounted on the PCPU it last ran a tick on. Move it
+ * over when it has been migrated, unless the PCPU it left has retired it
+ * in the meantime, in which case it simply becomes active again here.
+ */
+static void
+__csched_vcpu_acct_move(struct csched_vcpu *svc, unsigned int cpu)
+{
+    const unsigned int old_cpu = svc->active_cpu;
+    struct csched_pcpu *spc = CSCHED_PCPU(old_cpu);
+    unsigned long flags;
+    int active;
+
+    spin_lock_irqsave(&spc->acct_lock, flags);
+    active = !list_empty(&svc->active_vcpu_elem) &&
+             (svc->active_cpu == old_cpu);
+    if ( active )
+        list_del_init(&svc->active_vcpu_elem);
+    spin_unlock_irqrestore(&spc->acct_lock, flags);
+
+    if ( !active )
     {
-        BUG_ON( csched_priv.weight < sdom->weight );
-        list_del_init(&sdom->active_sdom_elem);
-        csched_priv.weight -= sdom->weight;
+        __csched_vcpu_acct_start(svc, cpu);
+        return;
     }
+
+    CSCHED_STAT_CRANK(acct_vcpu_move);
+
+    spc = CSCHED_PCPU(cpu);
+    spin_lock_irqsave(&spc->acct_lock, flags);
+    list_add(&svc->active_vcpu_elem, &spc->active_vcpu);
+    svc->active_cpu = cpu;
+    spin_unlock_irqrestore(&spc->acct_lock, flags);
 }
 
 static void
@@ -538,7 +690,11 @@ csched_vcpu_acct(unsigned int cpu)
      */
     if ( list_empty(&svc->active_vcpu_elem) )
     {
-        __csched_vcpu_acct_start(svc);
+        __csched_vcpu_acct_start(svc, cpu);
+    }
+    else if ( svc->active_cpu != cpu )
+    {
+        __csched_vcpu_acct_move(svc, cpu);
     }
     else if ( _csched_cpu_pick(current, 0) != cpu )
     {
@@ -590,6 +746,7 @@ csched_vcpu_destroy(struct vcpu *vc)
 {
     struct csched_vcpu * const svc = CSCHED_VCPU(vc);
     struct csched_dom * const sdom = svc->sdom;
+    struct csched_pcpu * const spc = CSCHED_PCPU(svc->active_cpu);
     unsigned long flags;
 
     CSCHED_STAT_CRANK(vcpu_destroy);
@@ -597,12 +754,12 @@ csched_vcpu_destroy(struct vcpu *vc)
     BUG_ON( sdom == NULL );
     BUG_ON( !list_empty(&svc->runq_elem) );
 
-    spin_lock_irqsave(&csched_priv.lock, flags);
+    spin_lock_irqsave(&spc->acct_lock, flags);
 
     if ( !list_empty(&svc->active_vcpu_elem) )
         __csched_vcpu_acct_stop_locked(svc);
 
-    spin_unlock_irqrestore(&csched_priv.lock, flags);
+    spin_unlock_irqrestore(&spc->acct_lock, flags);
 
     xfree(svc);
 }
@@ -698,7 +855,7 @@ csched_dom_cntl(
 
         if ( op->u.credit.weight != 0 )
         {
-            if ( !list_empty(&sdom->active_sdom_elem) )
+            if ( sdom->active_vcpu_count != 0 )
             {
                 csched_priv.weight -= sdom->weight;
                 csched_priv.weight += op->u.credit.weight;
@@ -709,6 +866,8 @@ csched_dom_cntl(
         if ( op->u.credit.cap != (uint16_t)~0U )
             sdom->cap = op->u.credit.cap;
 
+        csched_priv.share_gen++;
+
         spin_unlock_irqrestore(&csched_priv.lock, flags);
     }
 
@@ -731,12 +890,12 @@ csched_dom_init(struct domain *dom)
     memset(sdom, 0, sizeof(*sdom));
 
     /* Initialize credit and weight */
-    INIT_LIST_HEAD(&sdom->active_vcpu);
-    sdom->active_vcpu_count = 0;
     INIT_LIST_HEAD(&sdom->active_sdom_elem);
+    sdom->active_vcpu_count = 0;
     sdom->dom = dom;
     sdom->weight = CSCHED_DEFAULT_WEIGHT;
     sdom->cap = 0U;
+    sdom->share_gen = csched_priv.share_gen - 1;
     dom->sched_priv = sdom;
 
     return 0;
@@ -763,13 +922,6 @@ csched_runq_sort(unsigned int cpu)
     struct list_head *runq, *elem, *next, *last_under;
     struct csched_vcpu *svc_elem;
     unsigned long flags;
-    int sort_epoch;
-
-    sort_epoch = csched_priv.runq_sort;
-    if ( sort_epoch == spc->runq_sort_last )
-        return;
-
-    spc->runq_sort_last = sort_epoch;
 
     spin_lock_irqsave(&per_cpu(schedule_data, cpu).schedule_lock, flags);
 
@@ -799,204 +951,204 @@ csched_runq_sort(unsigned int cpu)
     spin_unlock_irqrestore(&per_cpu(schedule_data, cpu).schedule_lock, flags);
 }
 
+/*
+ * Compute the shares of all active domains by water-filling: credits are
+ * split in proportion to weight, except that a domain never gets more
+ * than its peak, and what it cannot use goes to the others, again by
+ * weight. Each pass settles the domains whose peak is below their share
+ * of what is left, which only grows the share of the rest, until none is.
+ *
+ * Called with csched_priv.lock held.
+ */
 static void
-csched_acct(void* dummy)
+csched_share_compute(void)
 {
-    unsigned long flags;
-    struct list_head *iter_vcpu, *next_vcpu;
-    struct list_head *iter_sdom, *next_sdom;
-    struct csched_vcpu *svc;
+    struct list_head *iter;
     struct csched_dom *sdom;
-    uint32_t credit_total;
-    uint32_t weight_total;
-    uint32_t weight_left;
-    uint32_t credit_fair;
+    uint32_t credit_left = csched_priv.credit;
+    uint32_t weight_left = csched_priv.weight;
     uint32_t credit_peak;
-    uint32_t credit_cap;
-    int credit_balance;
-    int credit_xtra;
-    int credit;
+    int settled;
 
+    list_for_each( iter, &csched_priv.active_sdom )
+    {
+        sdom = list_entry(iter, struct csched_dom, active_sdom_elem);
+        sdom->credit_total = 0U;
+    }
 
-    spin_lock_irqsave(&csched_priv.lock, flags);
+    do {
+        settled = 0;
+        list_for_each( iter, &csched_priv.active_sdom )
+        {
+            sdom = list_entry(iter, struct csched_dom, active_sdom_elem);
+            if ( sdom->credit_total != 0U )
+                continue;
+
+            credit_peak = __csched_dom_peak(sdom);
+            if ( (uint64_t)credit_left * sdom->weight <
+                 (uint64_t)credit_peak * weight_left )
+                continue;
+
+            sdom->credit_total = credit_peak;
+            credit_left -= credit_peak;
+            weight_left -= sdom->weight;
+            settled = 1;
+        }
+    } while ( settled && weight_left != 0U );
 
-    weight_total = csched_priv.weight;
-    credit_total = csched_priv.credit;
+    list_for_each( iter, &csched_priv.active_sdom )
+    {
+        sdom = list_entry(iter, struct csched_dom, active_sdom_elem);
+        if ( sdom->credit_total == 0U )
+            sdom->credit_total = ( ( (uint64_t)credit_left * sdom->weight ) +
+                                   ( weight_left - 1 ) ) / weight_left;
+        __csched_dom_share_vcpus(sdom);
+    }
+
+    csched_priv.share_done = csched_priv.share_gen;
+}
 
-    /* Converge balance towards 0 when it drops negative */
-    if ( csched_priv.credit_balance < 0 )
+/*
+ * Shares only change when weights, caps, the CPU count or the set of
+ * active domains or VCPUs do, so they are computed lazily, by the first
+ * PCPU to account one of the domain's VCPUs after such a change. That is
+ * O(active domains) when every share is affected, and O(1) otherwise.
+ */
+static void
+csched_dom_share(struct csched_dom *sdom, uint32_t *fair, uint32_t *cap)
+{
+    if ( unlikely(sdom->share_gen != csched_priv.share_gen) )
     {
-        credit_total -= csched_priv.credit_balance;
-        CSCHED_STAT_CRANK(acct_balance);
+        spin_lock(&csched_priv.lock);
+
+        BUG_ON( sdom->active_vcpu_count == 0 );
+        BUG_ON( sdom->weight == 0 );
+        BUG_ON( sdom->weight > csched_priv.weight );
+
+        CSCHED_STAT_CRANK(acct_share);
+
+        if ( csched_priv.share_done != csched_priv.share_gen )
+            csched_share_compute();
+        else if ( sdom->share_gen != csched_priv.share_gen )
+            __csched_dom_share_vcpus(sdom);
+
+        spin_unlock(&csched_priv.lock);
     }
 
-    if ( unlikely(weight_total == 0) )
+    *fair = sdom->credit_fair;
+    *cap = sdom->credit_cap;
+}
+
+/*
+ * Every PCPU hands out credits to the VCPUs which have been active on it,
+ * so the cost of accounting is proportional to the number of VCPUs using
+ * this PCPU rather than to the number of VCPUs in the system, and no lock
+ * is shared with other PCPUs in the common case.
+ */
+static void
+csched_pcpu_acct(unsigned int cpu)
+{
+    struct csched_pcpu * const spc = CSCHED_PCPU(cpu);
+    struct list_head *iter_vcpu, *next_vcpu;
+    struct csched_vcpu *svc;
+    struct csched_dom *sdom;
+    unsigned long flags;
+    uint32_t credit_fair;
+    uint32_t credit_cap;
+    uint64_t cycles;
+    int credit;
+
+    cycles = get_cycles();
+
+    spin_lock_irqsave(&spc->acct_lock, flags);
+
+    if ( list_empty(&spc->active_vcpu) )
     {
-        csched_priv.credit_balance = 0;
-        spin_unlock_irqrestore(&csched_priv.lock, flags);
+        spin_unlock_irqrestore(&spc->acct_lock, flags);
         CSCHED_STAT_CRANK(acct_no_work);
-        goto out;
+        return;
     }
 
     CSCHED_STAT_CRANK(acct_run);
 
-    weight_left = weight_total;
-    credit_balance = 0;
-    credit_xtra = 0;
-    credit_cap = 0U;
-
-    list_for_each_safe( iter_sdom, next_sdom, &csched_priv.active_sdom )
+    list_for_each_safe( iter_vcpu, next_vcpu, &spc->active_vcpu )
     {
-        sdom = list_entry(iter_sdom, struct csched_dom, active_sdom_elem);
+        svc = list_entry(iter_vcpu, struct csched_vcpu, active_vcpu_elem);
+        sdom = svc->sdom;
+        BUG_ON( svc->active_cpu != cpu );
 
-        BUG_ON( is_idle_domain(sdom->dom) );
-        BUG_ON( sdom->active_vcpu_count == 0 );
-        BUG_ON( sdom->weight == 0 );
-        BUG_ON( sdom->weight > weight_left );
+        csched_dom_share(sdom, &credit_fair, &credit_cap);
 
-        weight_left -= sdom->weight;
+        /* Increment credit */
+        atomic_add(credit_fair, &svc->credit);
+        credit = atomic_read(&svc->credit);
 
         /*
-         * A domain's fair share is computed using its weight in competition
-         * with that of all other active domains.
-         *
-         * At most, a domain can use credits to run all its active VCPUs
-         * for one full accounting period. We allow a domain to earn more
-         * only when the system-wide credit balance is negative.
+         * Recompute priority or, if VCPU is idling, remove it from
+         * the active list.
          */
-        credit_peak = sdom->active_vcpu_count * CSCHED_CREDITS_PER_ACCT;
-        if ( csched_priv.credit_balance < 0 )
-        {
-            credit_peak += ( ( -csched_priv.credit_balance * sdom->weight) +
-                             (weight_total - 1)
-                           ) / weight_total;
-        }
-
-        if ( sdom->cap != 0U )
+        if ( credit < 0 )
         {
-            credit_cap = ((sdom->cap * CSCHED_CREDITS_PER_ACCT) + 99) / 100;
-            if ( credit_cap < credit_peak )
-                credit_peak = credit_cap;
-
-            credit_cap = ( credit_cap + ( sdom->active_vcpu_count - 1 )
-                         ) / sdom->active_vcpu_count;
-        }
-
-        credit_fair = ( ( credit_total * sdom->weight) + (weight_total - 1)
-                      ) / weight_total;
+            svc->pri = CSCHED_PRI_TS_OVER;
 
-        if ( credit_fair < credit_peak )
-        {
-            credit_xtra = 1;
-        }
-        else
-        {
-            if ( weight_left != 0U )
+            /* Park running VCPUs of capped-out domains */
+            if ( sdom->cap != 0U &&
+                 credit < -credit_cap &&
+                 !(svc->flags & CSCHED_FLAG_VCPU_PARKED) )
             {
-                /* Give other domains a chance at unused credits */
-                credit_total += ( ( ( credit_fair - credit_peak
-                                    ) * weight_total
-                                  ) + ( weight_left - 1 )
-                                ) / weight_left;
+                CSCHED_STAT_CRANK(vcpu_park);
+                vcpu_pause_nosync(svc->vcpu);
+                svc->flags |= CSCHED_FLAG_VCPU_PARKED;
             }
 
-            if ( credit_xtra )
+            /* Lower bound on credits */
+            if ( credit < -CSCHED_CREDITS_PER_TSLICE )
             {
-                /*
-                 * Lazily keep domains with extra credits at the head of
-                 * the queue to give others a chance at them in future
-                 * accounting periods.
-                 */
-                CSCHED_STAT_CRANK(acct_reorder);
-                list_del(&sdom->active_sdom_elem);
-                list_add(&sdom->active_sdom_elem, &csched_priv.active_sdom);
+                CSCHED_STAT_CRANK(acct_min_credit);
+                credit = -CSCHED_CREDITS_PER_TSLICE;
+                atomic_set(&svc->credit, credit);
             }
-
-            credit_fair = credit_peak;
         }
-
-        /* Compute fair share per VCPU */
-        credit_fair = ( credit_fair + ( sdom->active_vcpu_count - 1 )
-                      ) / sdom->active_vcpu_count;
-
-
-        list_for_each_safe( iter_vcpu, next_vcpu, &sdom->active_vcpu )
+        else
         {
-            svc = list_entry(iter_vcpu, struct csched_vcpu, active_vcpu_elem);
-            BUG_ON( sdom != svc->sdom );
+            svc->pri = CSCHED_PRI_TS_UNDER;
 
-            /* Increment credit */
-            atomic_add(credit_fair, &svc->credit);
-            credit = atomic_read(&svc->credit);
-
-            /*
-             * Recompute priority or, if VCPU is idling, remove it from
-             * the active list.
-             */
-            if ( credit < 0 )
+            /* Unpark any capped domains whose credits go positive */
+            if ( svc->flags & CSCHED_FLAG_VCPU_PARKED)
             {
-                svc->pri = CSCHED_PRI_TS_OVER;
-
-                /* Park running VCPUs of capped-out domains */
-                if ( sdom->cap != 0U &&
-                     credit < -credit_cap &&
-                     !(svc->flags & CSCHED_FLAG_VCPU_PARKED) )
-                {
-                    CSCHED_STAT_CRANK(vcpu_park);
-                    vcpu_pause_nosync(svc->vcpu);
-                    svc->flags |= CSCHED_FLAG_VCPU_PARKED;
-                }
-
-                /* Lower bound on credits */
-                if ( credit < -CSCHED_CREDITS_PER_TSLICE )
-                {
-                    CSCHED_STAT_CRANK(acct_min_credit);
-                    credit = -CSCHED_CREDITS_PER_TSLICE;
-                    atomic_set(&svc->credit, credit);
-                }
+                /*
+                 * It's important to unset the flag AFTER the unpause()
+                 * call to make sure the VCPU's priority is not boosted
+                 * if it is woken up here.
+                 */
+                CSCHED_STAT_CRANK(vcpu_unpark);
+                vcpu_unpause(svc->vcpu);
+                svc->flags &= ~CSCHED_FLAG_VCPU_PARKED;
             }
-            else
+
+            /* Upper bound on credits means VCPU stops earning */
+            if ( credit > CSCHED_CREDITS_PER_TSLICE )
             {
-                svc->pri = CSCHED_PRI_TS_UNDER;
-
-                /* Unpark any capped domains whose credits go positive */
-                if ( svc->flags & CSCHED_FLAG_VCPU_PARKED)
-                {
-                    /*
-                     * It's important to unset the flag AFTER the unpause()
-                     * call to make sure the VCPU's priority is not boosted
-                     * if it is woken up here.
-                     */
-                    CSCHED_STAT_CRANK(vcpu_unpark);
-                    vcpu_unpause(svc->vcpu);
-                    svc->flags &= ~CSCHED_FLAG_VCPU_PARKED;
-                }
-
-                /* Upper bound on credits means VCPU stops earning */
-                if ( credit > CSCHED_CREDITS_PER_TSLICE )
-                {
-                    __csched_vcpu_acct_stop_locked(svc);
-                    credit = 0;
-                    atomic_set(&svc->credit, credit);
-                }
+                __csched_vcpu_acct_stop_locked(svc);
+                credit = 0;
+                atomic_set(&svc->credit, credit);
             }
-
-            CSCHED_VCPU_STAT_SET(svc, credit_last, credit);
-            CSCHED_VCPU_STAT_SET(svc, credit_incr, credit_fair);
-            credit_balance += credit;
         }
-    }
 
-    csched_priv.credit_balance = credit_balance;
+        CSCHED_VCPU_STAT_SET(svc, credit_last, credit);
+        CSCHED_VCPU_STAT_SET(svc, credit_incr, credit_fair);
+    }
 
-    spin_unlock_irqrestore(&csched_priv.lock, flags);
+    spin_unlock_irqrestore(&spc->acct_lock, flags);
 
-    /* Inform each CPU that its runq needs to be sorted */
-    csched_priv.runq_sort++;
+    /* Priorities have changed, so the runq needs to be sorted. */
+    csched_runq_sort(cpu);
 
-out:
-    set_timer( &csched_priv.master_ticker, NOW() +
-            MILLISECS(CSCHED_MSECS_PER_TICK) * CSCHED_TICKS_PER_ACCT );
+    cycles = get_cycles() - cycles;
+    spc->acct_runs++;
+    spc->acct_cycles += cycles;
+    if ( cycles > spc->acct_max_cycles )
+        spc->acct_max_cycles = cycles;
 }
 
 static void
@@ -1014,19 +1166,49 @@ csched_tick(void *_cpu)
         csched_vcpu_acct(cpu);
 
     /*
-     * Check if runq needs to be sorted
-     *
-     * Every physical CPU resorts the runq after the accounting master has
-     * modified priorities. This is a special O(n) sort and runs at most
-     * once per accounting period (currently 30 milliseconds).
+     * Hand out credits to VCPUs active on this PCPU, and resort the runq
+     * accordingly, once per accounting period (currently 30 milliseconds).
      */
-    csched_runq_sort(cpu);
+    if ( (spc->tick % CSCHED_TICKS_PER_ACCT) == 0 )
+        csched_pcpu_acct(cpu);
 
     set_timer(&spc->ticker, NOW() + MILLISECS(CSCHED_MSECS_PER_TICK));
 }
 
+static inline int
+csched_steal_level(int cpu, int peer_cpu)
+{
+    if ( cpu_isset(peer_cpu, per_cpu(cpu_sibling_map, cpu)) )
+        return CSCHED_STEAL_SIBLING;
+    if ( cpu_isset(peer_cpu, per_cpu(cpu_core_map, cpu)) )
+        return CSCHED_STEAL_LLC;
+    if ( cpu_to_node(peer_cpu) == cpu_to_node(cpu) )
+        return CSCHED_STEAL_NODE;
+    return CSCHED_STEAL_REMOTE;
+}
+
+static inline void
+csched_stat_steal(int level)
+{
+    switch ( level )
+    {
+    case CSCHED_STEAL_SIBLING:
+        CSCHED_STAT_CRANK(steal_sibling);
+        break;
+    case CSCHED_STEAL_LLC:
+        CSCHED_STAT_CRANK(steal_llc);
+        break;
+    case CSCHED_STEAL_NODE:
+        CSCHED_STAT_CRANK(steal_node);
+        break;
+    default:
+        CSCHED_STAT_CRANK(steal_remote);
+        break;
+    }
+}
+
 static struct csched_vcpu *
-csched_runq_steal(int peer_cpu, int cpu, int pri)
+csched_runq_steal(int peer_cpu, int cpu, int pri, int level)
 {
     const struct csched_pcpu * const peer_pcpu = CSCHED_PCPU(peer_cpu);
     const struct vcpu * const peer_vcpu = per_cpu(schedule_data, peer_cpu).curr;
@@ -1055,11 +1237,14 @@ csched_runq_steal(int peer_cpu, int cpu, int pri)
             vc = speer->vcpu;
             BUG_ON( is_idle_vcpu(vc) );
 
-            if (__csched_vcpu_is_migrateable(vc, cpu))
+            if ( __csched_vcpu_is_migrateable(vc, cpu) &&
+                 (level != CSCHED_STEAL_REMOTE ||
+                  __csched_vcpu_remote_migration_pays(vc)) )
             {
                 /* We got a candidate. Grab it! */
                 CSCHED_VCPU_STAT_CRANK(speer, migrate_q);
                 CSCHED_STAT_CRANK(migrate_queued);
+                csched_stat_steal(level);
                 WARN_ON(vc->is_urgent);
                 __runq_remove(speer);
                 vc->processor = cpu;
@@ -1077,7 +1262,8 @@ csched_load_balance(int cpu, struct csched_vcpu *snext)
 {
     struct csched_vcpu *speer;
     cpumask_t workers;
-    int peer_cpu;
+    cpumask_t peers[CSCHED_STEAL_LEVELS];
+    int peer_cpu, level;
 
     BUG_ON( cpu != snext->vcpu->processor );
 
@@ -1093,38 +1279,49 @@ csched_load_balance(int cpu, struct csched_vcpu *snext)
         CSCHED_STAT_CRANK(load_balance_other);
 
     /*
-     * Peek at non-idling CPUs in the system, starting with our
-     * immediate neighbour.
+     * Sort the non-idling CPUs in the system by their distance from us,
+     * so that work is pulled from our siblings before we go looking for
+     * it on other packages or other nodes.
      */
     cpus_andnot(workers, cpu_online_map, csched_priv.idlers);
     cpu_clear(cpu, workers);
-    peer_cpu = cpu;
 
-    while ( !cpus_empty(workers) )
+    for ( level = 0; level < CSCHED_STEAL_LEVELS; level++ )
+        cpus_clear(peers[level]);
+    for_each_cpu_mask ( peer_cpu, workers )
+        cpu_set(peer_cpu, peers[csched_steal_level(cpu, peer_cpu)]);
+
+    for ( level = 0; level < CSCHED_STEAL_LEVELS; level++ )
     {
-        peer_cpu = cycle_cpu(peer_cpu, workers);
-        cpu_clear(peer_cpu, workers);
+        /* Within a level, start with our immediate neighbour. */
+        peer_cpu = cpu;
 
-        /*
-         * Get ahold of the scheduler lock for this peer CPU.
-         *
-         * Note: We don't spin on this lock but simply try it. Spinning could
-         * cause a deadlock if the peer CPU is also load balancing and trying
-         * to lock this CPU.
-         */
-        if ( !spin_trylock(&per_cpu(schedule_data, peer_cpu).schedule_lock) )
+        while ( !cpus_empty(peers[level]) )
         {
-            CSCHED_STAT_CRANK(steal_trylock_failed);
-            continue;
-        }
+            peer_cpu = cycle_cpu(peer_cpu, peers[level]);
+            cpu_clear(peer_cpu, peers[level]);
 
-        /*
-         * Any work over there to steal?
-         */
-        speer = csched_runq_steal(peer_cpu, cpu, snext->pri);
-        spin_unlock(&per_cpu(schedule_data, peer_cpu).schedule_lock);
-        if ( speer != NULL )
-            return speer;
+            /*
+             * Get ahold of the scheduler lock for this peer CPU.
+             *
+             * Note: We don't spin on this lock but simply try it. Spinning
+             * could cause a deadlock if the peer CPU is also load balancing
+             * and trying to lock this CPU.
+             */
+            if ( !spin_trylock(&per_cpu(schedule_data, peer_cpu).schedule_lock) )
+            {
+                CSCHED_STAT_CRANK(steal_trylock_failed);
+                continue;
+            }
+
+            /*
+             * Any work over there to steal?
+             */
+            speer = csched_runq_steal(peer_cpu, cpu, snext->pri, level);
+            spin_unlock(&per_cpu(schedule_data, peer_cpu).schedule_lock);
+            if ( speer != NULL )
+                return speer;
+        }
     }
 
  out:
@@ -1249,9 +1446,21 @@ csched_dump_pcpu(int cpu)
     runq = &spc->runq;
 
     cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_sibling_map, cpu));
-    printk(" sort=%d, sibling=%s, ", spc->runq_sort_last, cpustr);
+    printk(" sibling=%s, ", cpustr);
     cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_core_map, cpu));
-    printk("core=%s\n", cpustr);
+    printk("core=%s, node=%d\n", cpustr, cpu_to_node(cpu));
+
+    /*
+     * Cost of accounting on this PCPU since the last dump, which makes
+     * repeated dumps a cheap benchmark of it.
+     */
+    printk("\tacct: runs=%u avg=%"PRIu64" max=%"PRIu64" cycles\n",
+           spc->acct_runs,
+           spc->acct_runs ? spc->acct_cycles / spc->acct_runs : 0,
+           spc->acct_max_cycles);
+    spc->acct_runs = 0;
+    spc->acct_cycles = 0;
+    spc->acct_max_cycles = 0;
 
     /* current VCPU */
     svc = CSCHED_VCPU(per_cpu(schedule_data, cpu).curr);
@@ -1277,47 +1486,49 @@ csched_dump_pcpu(int cpu)
 static void
 csched_dump(void)
 {
-    struct list_head *iter_sdom, *iter_svc;
-    int loop;
+    struct list_head *iter_svc;
+    struct csched_pcpu *spc;
+    unsigned long flags;
+    int cpu, loop;
 #define idlers_buf keyhandler_scratch
 
     printk("info:\n"
            "\tncpus              = %u\n"
-           "\tmaster             = %u\n"
            "\tcredit             = %u\n"
-           "\tcredit balance     = %d\n"
            "\tweight             = %u\n"
-           "\trunq_sort          = %u\n"
+           "\tshare generation   = %u\n"
            "\tdefault-weight     = %d\n"
            "\tmsecs per tick     = %dms\n"
            "\tcredits per msec   = %d\n"
            "\tticks per tslice   = %d\n"
            "\tticks per acct     = %d\n"
-           "\tmigration delay    = %uus\n",
+           "\tmigration delay    = %uus\n"
+           "\tremote migr. cost  = %uus\n",
            csched_priv.ncpus,
-           csched_priv.master,
            csched_priv.credit,
-           csched_priv.credit_balance,
            csched_priv.weight,
-           csched_priv.runq_sort,
+           csched_priv.share_gen,
            CSCHED_DEFAULT_WEIGHT,
            CSCHED_MSECS_PER_TICK,
            CSCHED_CREDITS_PER_MSEC,
            CSCHED_TICKS_PER_TSLICE,
            CSCHED_TICKS_PER_ACCT,
-           vcpu_migration_delay);
+           vcpu_migration_delay,
+           vcpu_remote_migration_cost);
 
     cpumask_scnprintf(idlers_buf, sizeof(idlers_buf), csched_priv.idlers);
     printk("idlers: %s\n", idlers_buf);
 
     printk("active vcpus:\n");
     loop = 0;
-    list_for_each( iter_sdom, &csched_priv.active_sdom )
+    for_each_online_cpu ( cpu )
     {
-        struct csched_dom *sdom;
-        sdom = list_entry(iter_sdom, struct csched_dom, active_sdom_elem);
+        spc = CSCHED_PCPU(cpu);
+        if ( spc == NULL )
+            continue;
 
-        list_for_each( iter_svc, &sdom->active_vcpu )
+        spin_lock_irqsave(&spc->acct_lock, flags);
+        list_for_each( iter_svc, &spc->active_vcpu )
         {
             struct csched_vcpu *svc;
             svc = list_entry(iter_svc, struct csched_vcpu, active_vcpu_elem);
@@ -1325,6 +1536,7 @@ csched_dump(void)
             printk("\t%3d: ", ++loop);
             csched_dump_vcpu(svc);
         }
+        spin_unlock_irqrestore(&spc->acct_lock, flags);
     }
 #undef idlers_buf
 }
@@ -1335,12 +1547,11 @@ csched_init(void)
     spin_lock_init(&csched_priv.lock);
     INIT_LIST_HEAD(&csched_priv.active_sdom);
     csched_priv.ncpus = 0;
-    csched_priv.master = UINT_MAX;
     cpus_clear(csched_priv.idlers);
     csched_priv.weight = 0U;
     csched_priv.credit = 0U;
-    csched_priv.credit_balance = 0;
-    csched_priv.runq_sort = 0U;
+    csched_priv.share_gen = 0U;
+    csched_priv.share_done = 0U;
 }
 
 /* Tickers cannot be kicked until SMP subsystem is alive. */
@@ -1359,12 +1570,6 @@ static __init int csched_start_tickers(void)
         set_timer(&spc->ticker, NOW() + MILLISECS(CSCHED_MSECS_PER_TICK));
     }
 
-    init_timer( &csched_priv.master_ticker, csched_acct, NULL,
-                    csched_priv.master);
-
-    set_timer( &csched_priv.master_ticker, NOW() +
-            MILLISECS(CSCHED_MSECS_PER_TICK) * CSCHED_TICKS_PER_ACCT );
-
     return 0;
 }
 __initcall(csched_start_tickers);
@@ -0,0 +1,886 @@
+/****************************************************************************
+ *
+ *        File: common/sched_credit2.c
+ *
+ * Description: Credit-based SMP CPU scheduler, revision 2
+ *
+ * Runnable VCPUs are kept on runqueues shared by all PCPUs of a package,
+ * ordered by credit in a red-black tree, rather than on one unsorted list
+ * per PCPU. A PCPU simply runs the VCPU with the most credit that is
+ * allowed to run on it, for as long as it takes for that VCPU's credit to
+ * fall to that of the next one in line.
+ *
+ * Credit is burnt at a rate inversely proportional to the domain's weight
+ * and is handed out again per runqueue, when the VCPU chosen to run has
+ * none left, so there is no global accounting and no global lock. VCPUs
+ * which block a lot (doing I/O, say) keep their credit and so preempt
+ * CPU-bound VCPUs as soon as they wake up.
+ */
+
+#include <xen/config.h>
+#include <xen/init.h>
+#include <xen/lib.h>
+#include <xen/sched.h>
+#include <xen/domain.h>
+#include <xen/delay.h>
+#include <xen/event.h>
+#include <xen/time.h>
+#include <xen/perfc.h>
+#include <xen/sched-if.h>
+#include <xen/softirq.h>
+#include <xen/errno.h>
+#include <xen/keyhandler.h>
+#include <xen/rbtree.h>
+
+
+/*
+ * Basic constants
+ */
+#define CSCHED2_DEFAULT_WEIGHT      256
+/* Credit handed out at each runqueue reset, in ns at the default weight */
+#define CSCHED2_CREDIT_INIT         MILLISECS(10)
+/* Shortest and longest time slices */
+#define CSCHED2_MIN_TIMER           MICROSECS(500)
+#define CSCHED2_MAX_TIMER           MILLISECS(2)
+/* How much more credit a waking VCPU needs to preempt a running one */
+#define CSCHED2_MIGRATE_RESIST      MICROSECS(500)
+/*
+ * How soon an idle PCPU looks again when it had to pass over runnable
+ * work, because its context was still being saved or its PCPU was busy.
+ */
+#define CSCHED2_RETRY_TIMER         MICROSECS(50)
+
+
+/*
+ * Useful macros
+ */
+#define CSCHED2_PCPU(_c)     \
+    ((struct csched2_pcpu *)per_cpu(schedule_data, _c).sched_priv)
+#define CSCHED2_VCPU(_vcpu)  ((struct csched2_vcpu *) (_vcpu)->sched_priv)
+#define CSCHED2_DOM(_dom)    ((struct csched2_dom *) (_dom)->sched_priv)
+
+
+/*
+ * Runqueue, shared by the PCPUs of a package
+ */
+struct csched2_runqueue {
+    spinlock_t lock;            /* protects everything below, and credits */
+    unsigned int id;
+    struct rb_root runq;        /* runnable VCPUs, most credit leftmost */
+    struct list_head svc;       /* every VCPU assigned to this runqueue */
+    cpumask_t active;           /* PCPUs sharing this runqueue */
+    cpumask_t idle;             /* ... and those of them currently idle */
+    uint32_t resets;
+};
+
+/*
+ * Physical CPU
+ */
+struct csched2_pcpu {
+    struct csched2_runqueue *rqd;
+    struct csched2_vcpu *running;   /* NULL when idle */
+};
+
+/*
+ * Virtual CPU
+ */
+struct csched2_vcpu {
+    struct rb_node runq_elem;
+    struct list_head rqd_elem;
+    struct csched2_runqueue *rqd;
+    struct csched2_dom *sdom;
+    struct vcpu *vcpu;
+    s_time_t credit;
+    s_time_t start_time;        /* When we were scheduled (used for credit) */
+    bool_t on_runq;
+};
+
+/*
+ * Domain
+ */
+struct csched2_dom {
+    struct domain *dom;
+    uint16_t weight;
+};
+
+/*
+ * System-wide private data
+ */
+struct csched2_private {
+    uint32_t ncpus;
+    cpumask_t idlers;
+    struct csched2_runqueue rqd[NR_CPUS];
+};
+
+
+/*
+ * Global variables
+ */
+static struct csched2_private csched2_priv;
+
+
+/*
+ * Time and credit conversions: a VCPU burns through credit at the default
+ * weight in real time, faster below it and slower above it.
+ */
+static inline s_time_t
+t2c(s_time_t time, const struct csched2_vcpu *svc)
+{
+    return time * CSCHED2_DEFAULT_WEIGHT / svc->sdom->weight;
+}
+
+static inline s_time_t
+c2t(s_time_t credit, const struct csched2_vcpu *svc)
+{
+    return credit * svc->sdom->weight / CSCHED2_DEFAULT_WEIGHT;
+}
+
+static inline struct csched2_vcpu *
+__runq_elem(struct rb_node *node)
+{
+    return rb_entry(node, struct csched2_vcpu, runq_elem);
+}
+
+static void
+__runq_insert(struct csched2_runqueue *rqd, struct csched2_vcpu *svc)
+{
+    struct rb_node **link = &rqd->runq.rb_node, *parent = NULL;
+
+    BUG_ON( svc->on_runq );
+    BUG_ON( svc->rqd != rqd );
+
+    /* VCPUs with equal credit queue up behind one another. */
+    while ( *link != NULL )
+    {
+        parent = *link;
+        if ( svc->credit > __runq_elem(parent)->credit )
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    rb_link_node(&svc->runq_elem, parent, link);
+    rb_insert_color(&svc->runq_elem, &rqd->runq);
+    svc->on_runq = 1;
+}
+
+static void
+__runq_remove(struct csched2_runqueue *rqd, struct csched2_vcpu *svc)
+{
+    BUG_ON( !svc->on_runq );
+    rb_erase(&svc->runq_elem, &rqd->runq);
+    svc->on_runq = 0;
+}
+
+static void
+burn_credits(struct csched2_vcpu *svc, s_time_t now)
+{
+    s_time_t delta;
+
+    if ( (delta = now - svc->start_time) <= 0 )
+        return;
+
+    svc->credit -= t2c(delta, svc);
+    svc->start_time = now;
+}
+
+/*
+ * Hand out credit to every VCPU of the runqueue. Unused credit is not
+ * carried over beyond one reset's worth, which keeps VCPUs that have
+ * been asleep for a long time from monopolising the runqueue when they
+ * wake. This preserves the order of the VCPUs in the tree.
+ */
+static void
+csched2_reset_credit(struct csched2_runqueue *rqd)
+{
+    struct list_head *iter;
+    struct csched2_vcpu *svc;
+
+    perfc_incr(csched2_credit_reset);
+    rqd->resets++;
+
+    list_for_each( iter, &rqd->svc )
+    {
+        svc = list_entry(iter, struct csched2_vcpu, rqd_elem);
+        svc->credit += CSCHED2_CREDIT_INIT;
+        if ( svc->credit > CSCHED2_CREDIT_INIT )
+            svc->credit = CSCHED2_CREDIT_INIT;
+    }
+}
+
+/*
+ * PCPUs are grouped into runqueues by package. There is no generic map of
+ * the last-level cache, so the package stands in for it.
+ */
+static inline unsigned int
+csched2_rqd_id(unsigned int cpu)
+{
+    unsigned int id = first_cpu(per_cpu(cpu_core_map, cpu));
+
+    return (id < NR_CPUS) ? id : cpu;
+}
+
+/*
+ * The topology of secondary CPUs is only known once they are on their way
+ * up, well after their idle VCPUs are created, so PCPUs join their
+ * runqueue lazily.
+ */
+static struct csched2_runqueue *
+csched2_cpu_rqd(unsigned int cpu)
+{
+    struct csched2_pcpu * const spc = CSCHED2_PCPU(cpu);
+    struct csched2_runqueue *rqd;
+    unsigned long flags;
+
+    if ( likely(spc->rqd != NULL) )
+        return spc->rqd;
+
+    rqd = &csched2_priv.rqd[csched2_rqd_id(cpu)];
+
+    spin_lock_irqsave(&rqd->lock, flags);
+    if ( spc->rqd == NULL )
+    {
+        cpu_set(cpu, rqd->active);
+        if ( spc->running == NULL )
+        {
+            cpu_set(cpu, rqd->idle);
+            cpu_set(cpu, csched2_priv.idlers);
+        }
+        spc->rqd = rqd;
+    }
+    spin_unlock_irqrestore(&rqd->lock, flags);
+
+    return rqd;
+}
+
+/*
+ * Move a VCPU which is neither running nor queued to another runqueue.
+ * Credit is not comparable across runqueues, so it starts afresh.
+ */
+static void
+csched2_vcpu_move(struct csched2_vcpu *svc, struct csched2_runqueue *rqd)
+{
+    struct csched2_runqueue *old = svc->rqd;
+    unsigned long flags;
+
+    BUG_ON( svc->on_runq );
+
+    spin_lock_irqsave(&old->lock, flags);
+    list_del_init(&svc->rqd_elem);
+    spin_unlock_irqrestore(&old->lock, flags);
+
+    spin_lock_irqsave(&rqd->lock, flags);
+    list_add_tail(&svc->rqd_elem, &rqd->svc);
+    svc->rqd = rqd;
+    svc->credit = CSCHED2_CREDIT_INIT;
+    spin_unlock_irqrestore(&rqd->lock, flags);
+}
+
+/*
+ * Find a PCPU for a VCPU that was just queued on its runqueue: an idle one
+ * sharing the runqueue if possible, else the one running the VCPU with the
+ * least credit, if the new VCPU has enough more to preempt it. Failing
+ * both, an idle PCPU elsewhere is woken to pull the VCPU over.
+ */
+static void
+__runq_tickle(struct csched2_runqueue *rqd, struct csched2_vcpu *new,
+              s_time_t now)
+{
+    struct vcpu * const vc = new->vcpu;
+    struct csched2_vcpu *cur, *lowest = NULL;
+    cpumask_t mask;
+    int cpu, ipid = -1;
+
+    cpus_and(mask, rqd->idle, vc->cpu_affinity);
+    cpus_and(mask, mask, cpu_online_map);
+    if ( !cpus_empty(mask) )
+    {
+        perfc_incr(csched2_tickle_idle);
+        ipid = cpu_isset(vc->processor, mask)
+               ? vc->processor : cycle_cpu(vc->processor, mask);
+        goto tickle;
+    }
+
+    cpus_and(mask, rqd->active, vc->cpu_affinity);
+    cpus_and(mask, mask, cpu_online_map);
+    for_each_cpu_mask ( cpu, mask )
+    {
+        cur = CSCHED2_PCPU(cpu)->running;
+        if ( cur == NULL )
+            continue;
+        burn_credits(cur, now);
+        if ( lowest == NULL || cur->credit < lowest->credit )
+        {
+            lowest = cur;
+            ipid = cpu;
+        }
+    }
+
+    if ( lowest != NULL &&
+         new->credit > lowest->credit + CSCHED2_MIGRATE_RESIST )
+    {
+        perfc_incr(csched2_tickle_preempt);
+        goto tickle;
+    }
+
+    cpus_and(mask, csched2_priv.idlers, vc->cpu_affinity);
+    cpus_and(mask, mask, cpu_online_map);
+    if ( cpus_empty(mask) )
+        return;
+    perfc_incr(csched2_tickle_remote);
+    ipid = cycle_cpu(vc->processor, mask);
+
+ tickle:
+    cpu_raise_softirq(ipid, SCHEDULE_SOFTIRQ);
+}
+
+static int
+csched2_pcpu_init(int cpu)
+{
+    struct csched2_pcpu *spc;
+
+    /* Allocate per-PCPU info */
+    spc = xmalloc(struct csched2_pcpu);
+    if ( spc == NULL )
+        return -1;
+    memset(spc, 0, sizeof(*spc));
+
+    BUG_ON(!is_idle_vcpu(per_cpu(schedule_data, cpu).curr));
+    per_cpu(schedule_data, cpu).sched_priv = spc;
+    csched2_priv.ncpus++;
+
+    return 0;
+}
+
+static int
+csched2_cpu_pick(struct vcpu *vc)
+{
+    const unsigned int rqd_id = csched2_rqd_id(vc->processor);
+    cpumask_t cpus, idlers;
+    int cpu;
+
+    cpus_and(cpus, cpu_online_map, vc->cpu_affinity);
+    ASSERT( !cpus_empty(cpus) );
+
+    /*
+     * Stay put if our PCPU is idle, else look for an idle PCPU, giving
+     * a preference to those sharing our runqueue and with it our cache.
+     */
+    cpus_and(idlers, cpus, csched2_priv.idlers);
+    if ( cpu_isset(vc->processor, idlers) )
+        return vc->processor;
+    for_each_cpu_mask ( cpu, idlers )
+        if ( csched2_rqd_id(cpu) == rqd_id )
+            return cpu;
+    if ( !cpus_empty(idlers) )
+        return cycle_cpu(vc->processor, idlers);
+
+    return cpu_isset(vc->processor, cpus)
+           ? vc->processor : cycle_cpu(vc->processor, cpus);
+}
+
+static int
+csched2_vcpu_init(struct vcpu *vc)
+{
+    struct domain * const dom = vc->domain;
+    struct csched2_vcpu *svc;
+    struct csched2_runqueue *rqd;
+    unsigned long flags;
+
+    perfc_incr(csched2_vcpu_init);
+
+    /* Allocate per-VCPU info */
+    svc = xmalloc(struct csched2_vcpu);
+    if ( svc == NULL )
+        return -1;
+    memset(svc, 0, sizeof(*svc));
+
+    INIT_LIST_HEAD(&svc->rqd_elem);
+    svc->sdom = CSCHED2_DOM(dom);
+    svc->vcpu = vc;
+    svc->credit = CSCHED2_CREDIT_INIT;
+    vc->sched_priv = svc;
+
+    if ( is_idle_domain(dom) )
+    {
+        /* Allocate per-PCPU info */
+        if ( unlikely(!CSCHED2_PCPU(vc->processor)) &&
+             csched2_pcpu_init(vc->processor) != 0 )
+            return -1;
+        return 0;
+    }
+
+    rqd = csched2_cpu_rqd(vc->processor);
+    spin_lock_irqsave(&rqd->lock, flags);
+    list_add_tail(&svc->rqd_elem, &rqd->svc);
+    svc->rqd = rqd;
+    spin_unlock_irqrestore(&rqd->lock, flags);
+
+    return 0;
+}
+
+static void
+csched2_vcpu_destroy(struct vcpu *vc)
+{
+    struct csched2_vcpu * const svc = CSCHED2_VCPU(vc);
+    unsigned long flags;
+
+    perfc_incr(csched2_vcpu_destroy);
+
+    BUG_ON( svc->on_runq );
+
+    if ( svc->rqd != NULL )
+    {
+        spin_lock_irqsave(&svc->rqd->lock, flags);
+        list_del_init(&svc->rqd_elem);
+        spin_unlock_irqrestore(&svc->rqd->lock, flags);
+    }
+
+    xfree(svc);
+}
+
+static void
+csched2_vcpu_sleep(struct vcpu *vc)
+{
+    struct csched2_vcpu * const svc = CSCHED2_VCPU(vc);
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    /*
+     * Whether the VCPU is queued only changes under the lock of the PCPU
+     * it is assigned to, which our caller holds.
+     */
+    if ( per_cpu(schedule_data, vc->processor).curr == vc )
+        cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+    else if ( svc->on_runq )
+    {
+        spin_lock(&svc->rqd->lock);
+        __runq_remove(svc->rqd, svc);
+        spin_unlock(&svc->rqd->lock);
+    }
+}
+
+static void
+csched2_vcpu_wake(struct vcpu *vc)
+{
+    struct csched2_vcpu * const svc = CSCHED2_VCPU(vc);
+    const unsigned int cpu = vc->processor;
+    struct csched2_runqueue *rqd;
+
+    BUG_ON( is_idle_vcpu(vc) );
+
+    if ( unlikely(per_cpu(schedule_data, cpu).curr == vc) )
+        return;
+    if ( unlikely(svc->on_runq) )
+        return;
+
+    perfc_incr(csched2_vcpu_wake);
+
+    /* We may have been migrated to a PCPU on another runqueue. */
+    rqd = csched2_cpu_rqd(cpu);
+    if ( svc->rqd != rqd )
+        csched2_vcpu_move(svc, rqd);
+
+    spin_lock(&rqd->lock);
+    __runq_insert(rqd, svc);
+    __runq_tickle(rqd, svc, NOW());
+    spin_unlock(&rqd->lock);
+}
+
+/*
+ * Take the first VCPU in the runqueue that may run on this PCPU and that
+ * has more credit than the current VCPU, if that is still runnable. A
+ * queued VCPU assigned to another PCPU is only taken if that PCPU's lock
+ * can be had without spinning, as its holder may be waiting for ours.
+ */
+static struct csched2_vcpu *
+csched2_runq_pick(struct csched2_runqueue *rqd, int cpu,
+                  struct csched2_vcpu *scurr, int *skipped)
+{
+    struct rb_node *node;
+    struct csched2_vcpu *svc;
+    struct vcpu *vc;
+    int peer_cpu;
+
+    for ( node = rb_first(&rqd->runq); node != NULL; node = rb_next(node) )
+    {
+        svc = __runq_elem(node);
+        vc = svc->vcpu;
+
+        if ( scurr != NULL && scurr->credit >= svc->credit )
+            break;
+
+        if ( !cpu_isset(cpu, vc->cpu_affinity) )
+            continue;
+
+        /* Don't pick up work that's in its old PCPU's scheduling tail. */
+        if ( vc->is_running )
+        {
+            *skipped = 1;
+            continue;
+        }
+
+        peer_cpu = vc->processor;
+        if ( peer_cpu != cpu )
+        {
+            if ( !spin_trylock(&per_cpu(schedule_data, peer_cpu).schedule_lock) )
+            {
+                *skipped = 1;
+                continue;
+            }
+            WARN_ON(vc->is_urgent);
+            vc->processor = cpu;
+            spin_unlock(&per_cpu(schedule_data, peer_cpu).schedule_lock);
+            perfc_incr(csched2_migrate);
+        }
+
+        __runq_remove(rqd, svc);
+        return svc;
+    }
+
+    return scurr;
+}
+
+/*
+ * An idle PCPU with nothing to run from its own runqueue tries the others,
+ * without spinning on their locks, and pulls over the first VCPU it can.
+ */
+static struct csched2_vcpu *
+csched2_steal(struct csched2_runqueue *rqd, int cpu, int *skipped)
+{
+    struct csched2_runqueue *peer;
+    struct csched2_vcpu *svc = NULL;
+    cpumask_t others;
+    int peer_cpu;
+
+    cpus_andnot(others, cpu_online_map, rqd->active);
+
+    while ( svc == NULL && !cpus_empty(others) )
+    {
+        peer_cpu = cycle_cpu(cpu, others);
+        peer = CSCHED2_PCPU(peer_cpu)->rqd;
+        if ( peer == NULL )
+        {
+            cpu_clear(peer_cpu, others);
+            continue;
+        }
+        cpus_andnot(others, others, peer->active);
+
+        if ( RB_EMPTY_ROOT(&peer->runq) )
+            continue;
+        if ( !spin_trylock(&peer->lock) )
+        {
+            *skipped = 1;
+            continue;
+        }
+
+        svc = csched2_runq_pick(peer, cpu, NULL, skipped);
+        if ( svc != NULL )
+        {
+            list_del_init(&svc->rqd_elem);
+            list_add_tail(&svc->rqd_elem, &rqd->svc);
+            svc->rqd = rqd;
+            svc->credit = CSCHED2_CREDIT_INIT;
+            perfc_incr(csched2_steal);
+        }
+
+        spin_unlock(&peer->lock);
+    }
+
+    return svc;
+}
+
+/*
+ * How long to run snext for: until its credit drops to that of the next
+ * VCPU in line, within bounds.
+ */
+static s_time_t
+csched2_runtime(struct csched2_runqueue *rqd, struct csched2_vcpu *snext)
+{
+    struct rb_node *node = rb_first(&rqd->runq);
+    s_time_t time, credit = snext->credit;
+
+    if ( node != NULL )
+        credit -= __runq_elem(node)->credit;
+
+    time = c2t(credit, snext);
+    if ( time < CSCHED2_MIN_TIMER )
+        time = CSCHED2_MIN_TIMER;
+    else if ( time > CSCHED2_MAX_TIMER )
+        time = CSCHED2_MAX_TIMER;
+
+    return time;
+}
+
+/*
+ * This function is in the critical path. It is designed to be simple and
+ * fast for the common case.
+ */
+static struct task_slice
+csched2_schedule(s_time_t now)
+{
+    const int cpu = smp_processor_id();
+    struct csched2_pcpu * const spc = CSCHED2_PCPU(cpu);
+    struct csched2_vcpu * const scurr = CSCHED2_VCPU(current);
+    struct csched2_vcpu *snext = NULL;
+    struct csched2_runqueue *rqd;
+    struct task_slice ret;
+    int skipped = 0;
+
+    perfc_incr(csched2_schedule);
+
+    rqd = csched2_cpu_rqd(cpu);
+    spin_lock(&rqd->lock);
+
+    if ( !is_idle_vcpu(current) )
+    {
+        BUG_ON( scurr->rqd != rqd );
+        burn_credits(scurr, now);
+        if ( vcpu_runnable(current) )
+            snext = scurr;
+    }
+
+    /* If this CPU is going offline we shouldn't pick up work. */
+    if ( likely(cpu_online(cpu)) )
+    {
+        snext = csched2_runq_pick(rqd, cpu, snext, &skipped);
+
+        /* Out of credit? Then so is everybody queued behind us. */
+        if ( snext != NULL && snext->credit <= 0 )
+            csched2_reset_credit(rqd);
+
+        if ( snext == NULL )
+            snext = csched2_steal(rqd, cpu, &skipped);
+    }
+
+    /* Requeue the current VCPU if it is still runnable but lost the CPU. */
+    if ( snext != scurr && !is_idle_vcpu(current) && vcpu_runnable(current) )
+    {
+        __runq_insert(rqd, scurr);
+        __runq_tickle(rqd, scurr, now);
+    }
+
+    /*
+     * Update idlers masks if necessary. When we're idling, other CPUs
+     * will tickle us when they get extra work.
+     */
+    spc->running = snext;
+    if ( snext == NULL )
+    {
+        cpu_set(cpu, rqd->idle);
+        if ( !cpu_isset(cpu, csched2_priv.idlers) )
+            cpu_set(cpu, csched2_priv.idlers);
+
+        ret.task = idle_vcpu[cpu];
+        ret.time = skipped ? CSCHED2_RETRY_TIMER : -1;
+    }
+    else
+    {
+        cpu_clear(cpu, rqd->idle);
+        if ( cpu_isset(cpu, csched2_priv.idlers) )
+            cpu_clear(cpu, csched2_priv.idlers);
+
+        snext->start_time = now;
+        ret.task = snext->vcpu;
+        ret.time = csched2_runtime(rqd, snext);
+    }
+
+    spin_unlock(&rqd->lock);
+
+    return ret;
+}
+
+static int
+csched2_dom_cntl(
+    struct domain *d,
+    struct xen_domctl_scheduler_op *op)
+{
+    struct csched2_dom * const sdom = CSCHED2_DOM(d);
+
+    if ( op->cmd == XEN_DOMCTL_SCHEDOP_getinfo )
+    {
+        op->u.credit2.weight = sdom->weight;
+    }
+    else
+    {
+        ASSERT(op->cmd == XEN_DOMCTL_SCHEDOP_putinfo);
+
+        if ( op->u.credit2.weight != 0 )
+            sdom->weight = op->u.credit2.weight;
+    }
+
+    return 0;
+}
+
+static int
+csched2_dom_init(struct domain *dom)
+{
+    struct csched2_dom *sdom;
+
+    perfc_incr(csched2_dom_init);
+
+    if ( is_idle_domain(dom) )
+        return 0;
+
+    sdom = xmalloc(struct csched2_dom);
+    if ( sdom == NULL )
+        return -ENOMEM;
+    memset(sdom, 0, sizeof(*sdom));
+
+    sdom->dom = dom;
+    sdom->weight = CSCHED2_DEFAULT_WEIGHT;
+    dom->sched_priv = sdom;
+
+    return 0;
+}
+
+static void
+csched2_dom_destroy(struct domain *dom)
+{
+    perfc_incr(csched2_dom_destroy);
+    xfree(CSCHED2_DOM(dom));
+}
+
+static void
+csched2_dump_vcpu(struct csched2_vcpu *svc)
+{
+    printk("[%i.%i] flags=%lx cpu=%i credit=%"PRIi64" [w=%u]\n",
+            svc->vcpu->domain->domain_id,
+            svc->vcpu->vcpu_id,
+            svc->vcpu->pause_flags,
+            svc->vcpu->processor,
+            svc->credit,
+            svc->sdom->weight);
+}
+
+static void
+csched2_dump_pcpu(int cpu)
+{
+    struct csched2_pcpu *spc;
+#define cpustr keyhandler_scratch
+
+    spc = CSCHED2_PCPU(cpu);
+
+    cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_sibling_map, cpu));
+    printk(" runq=%d, sibling=%s, ",
+           spc->rqd != NULL ? (int)spc->rqd->id : -1, cpustr);
+    cpumask_scnprintf(cpustr, sizeof(cpustr), per_cpu(cpu_core_map, cpu));
+    printk("core=%s\n", cpustr);
+
+    /* current VCPU */
+    if ( spc->running != NULL )
+    {
+        printk("\trun: ");
+        csched2_dump_vcpu(spc->running);
+    }
+#undef cpustr
+}
+
+static void
+csched2_dump(void)
+{
+    struct csched2_runqueue *rqd;
+    struct rb_node *node;
+    unsigned long flags;
+    int id, loop;
+#define cpustr keyhandler_scratch
+
+    printk("info:\n"
+           "\tncpus              = %u\n"
+           "\tdefault-weight     = %d\n"
+           "\tcredit init        = %"PRIi64"ns\n"
+           "\tmin timer          = %"PRIi64"ns\n"
+           "\tmax timer          = %"PRIi64"ns\n",
+           csched2_priv.ncpus,
+           CSCHED2_DEFAULT_WEIGHT,
+           CSCHED2_CREDIT_INIT,
+           CSCHED2_MIN_TIMER,
+           CSCHED2_MAX_TIMER);
+
+    for ( id = 0; id < NR_CPUS; id++ )
+    {
+        rqd = &csched2_priv.rqd[id];
+        if ( cpus_empty(rqd->active) )
+            continue;
+
+        spin_lock_irqsave(&rqd->lock, flags);
+
+        cpumask_scnprintf(cpustr, sizeof(cpustr), rqd->active);
+        printk("runqueue %d: cpus=%s, ", id, cpustr);
+        cpumask_scnprintf(cpustr, sizeof(cpustr), rqd->idle);
+        printk("idle=%s, resets=%u\n", cpustr, rqd->resets);
+
+        loop = 0;
+        for ( node = rb_first(&rqd->runq); node != NULL; node = rb_next(node) )
+        {
+            printk("\t%3d: ", ++loop);
+            csched2_dump_vcpu(__runq_elem(node));
+        }
+
+        spin_unlock_irqrestore(&rqd->lock, flags);
+    }
+#undef cpustr
+}
+
+static void
+csched2_init(void)
+{
+    struct csched2_runqueue *rqd;
+    int id;
+
+    csched2_priv.ncpus = 0;
+    cpus_clear(csched2_priv.idlers);
+
+    for ( id = 0; id < NR_CPUS; id++ )
+    {
+        rqd = &csched2_priv.rqd[id];
+        spin_lock_init(&rqd->lock);
+        rqd->id = id;
+        rqd->runq = RB_ROOT;
+        INIT_LIST_HEAD(&rqd->svc);
+        cpus_clear(rqd->active);
+        cpus_clear(rqd->idle);
+        rqd->resets = 0;
+    }
+}
+
+/* Runqueues cannot be populated until the SMP topology is known. */
+static __init int csched2_start_runqueues(void)
+{
+    unsigned int cpu;
+
+    /* Is the credit2 scheduler initialised? */
+    if ( csched2_priv.ncpus == 0 )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        if ( CSCHED2_PCPU(cpu) != NULL )
+            csched2_cpu_rqd(cpu);
+
+    return 0;
+}
+__initcall(csched2_start_runqueues);
+
+const struct scheduler sched_credit2_def = {
+    .name           = "SMP Credit Scheduler rev2",
+    .opt_name       = "credit2",
+    .sched_id       = XEN_SCHEDULER_CREDIT2,
+
+    .init_domain    = csched2_dom_init,
+    .destroy_domain = csched2_dom_destroy,
+
+    .init_vcpu      = csched2_vcpu_init,
+    .destroy_vcpu   = csched2_vcpu_destroy,
+
+    .sleep          = csched2_vcpu_sleep,
+    .wake           = csched2_vcpu_wake,
+
+    .adjust         = csched2_dom_cntl,
+
+    .pick_cpu       = csched2_cpu_pick,
+    .do_schedule    = csched2_schedule,
+
+    .dump_cpu_state = csched2_dump_pcpu,
+    .dump_settings  = csched2_dump,
+    .init           = csched2_init,
+};
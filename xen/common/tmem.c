@@ -117,12 +117,14 @@ struct client {
     struct list_head client_list;
     struct tm_pool *pools[MAX_POOLS_PER_DOMAIN];
     tmh_client_t *tmh;
-    struct list_head ephemeral_page_list;
-    long eph_count, eph_count_max;
+    spinlock_t eph_lists_spinlock;
+    struct list_head ephemeral_page_list; /* LRU, protected by above */
+    long eph_count, eph_count_max; /* atomicity depends on above */
     cli_id_t cli_id;
     uint32_t weight;
     uint32_t cap;
     bool_t compress;
+    unsigned int compressor; /* for new pools that don't choose one */
     bool_t frozen;
     bool_t shared_auth_required;
     /* for save/restore/migration */
@@ -138,6 +140,7 @@ struct client {
     unsigned long succ_pers_puts, succ_eph_gets, succ_pers_gets;
     /* shared pool authentication */
     uint64_t shared_auth_uuid[MAX_GLOBAL_SHARED_POOLS][2];
+    struct rcu_head rcu;
 };
 typedef struct client client_t;
 
@@ -156,10 +159,12 @@ struct tm_pool {
     bool_t persistent;
     bool_t is_dying;
     int pageshift; /* 0 == 2**12 */
+    unsigned int compressor; /* TMEM_COMPRESS_*, fixed at creation */
     struct list_head pool_list; /* FIXME do we need this anymore? */
     client_t *client;
     uint64_t uuid[2]; /* 0 for private, non-zero for shared */
     uint32_t pool_id;
+    rwlock_t pool_op_rwlock; /* read across ops, write to flush/destroy */
     rwlock_t pool_rwlock;
     struct rb_root obj_rb_root[OBJ_HASH_BUCKETS]; /* protected by pool_rwlock */
     struct list_head share_list; /* valid if shared */
@@ -180,6 +185,7 @@ struct tm_pool {
     unsigned long gets, found_gets;
     unsigned long flushs, flushs_found;
     unsigned long flush_objs, flush_objs_found;
+    struct rcu_head rcu;
     DECL_SENTINEL
 };
 typedef struct tm_pool pool_t;
@@ -212,10 +218,7 @@ struct tmem_object_node {
 typedef struct tmem_object_node objnode_t;
 
 struct tmem_page_descriptor {
-    union {
-        struct list_head global_eph_pages;
-        struct list_head client_inv_pages;
-    };
+    struct list_head client_inv_pages;
     union {
         struct list_head client_eph_pages;
         struct list_head pool_pers_pages;
@@ -230,6 +233,7 @@ struct tmem_page_descriptor {
     /* must hold pcd_tree_rwlocks[firstbyte] to use pcd pointer/siblings */
     uint16_t firstbyte; /* NON_SHAREABLE->pfp  otherwise->pcd */
     bool_t eviction_attempted;  /* CHANGE TO lifetimes? (settable) */
+    bool_t referenced; /* second chance for eviction, set by shared gets */
     struct list_head pcd_siblings;
     union {
         pfp_t *pfp;  /* page frame pointer */
@@ -263,9 +267,7 @@ typedef struct tmem_page_content_descriptor pcd_t;
 struct rb_root pcd_tree_roots[256]; /* choose based on first byte of page */
 rwlock_t pcd_tree_rwlocks[256]; /* poor man's concurrency for now */
 
-static LIST_HEAD(global_ephemeral_page_list); /* all pages in ephemeral pools */
-
-static LIST_HEAD(global_client_list);
+static LIST_HEAD(global_client_list); /* rcu, updated under tmem_rwlock */
 static LIST_HEAD(global_pool_list);
 
 static pool_t *global_shared_pools[MAX_GLOBAL_SHARED_POOLS] = { 0 };
@@ -277,9 +279,18 @@ static int tmem_initialized = 0;
 
 EXPORT DEFINE_SPINLOCK(tmem_spinlock);  /* used iff tmh_lock_all */
 EXPORT DEFINE_RWLOCK(tmem_rwlock);      /* used iff !tmh_lock_all */
-static DEFINE_SPINLOCK(eph_lists_spinlock); /* protects global AND clients */
 static DEFINE_SPINLOCK(pers_lists_spinlock);
 
+/*
+ * Puts, gets and flushes only take the pool_op_rwlock of the pool they
+ * operate on, so ops on different pools proceed in parallel.  tmem_rwlock
+ * is taken for write to create or destroy clients and pools and for control
+ * ops; these also write-lock any pool they flush or destroy.  Pools and
+ * clients are freed via RCU so that a pool pointer can be looked up, and
+ * the client list walked by tmem_evict(), without holding tmem_rwlock.
+ */
+DEFINE_RCU_READ_LOCK(tmem_rcu_lock);
+
 #define tmem_spin_lock(_l)  do {if (!tmh_lock_all) spin_lock(_l);}while(0)
 #define tmem_spin_unlock(_l)  do {if (!tmh_lock_all) spin_unlock(_l);}while(0)
 #define tmem_read_lock(_l)  do {if (!tmh_lock_all) read_lock(_l);}while(0)
@@ -293,7 +304,7 @@ static DEFINE_SPINLOCK(pers_lists_spinlock);
 #define ASSERT_WRITELOCK(_l) ASSERT(tmh_lock_all || rw_is_write_locked(_l))
 
 /* global counters (should use long_atomic_t access) */
-static long global_eph_count = 0; /* atomicity depends on eph_lists_spinlock */
+static atomic_t global_eph_count = ATOMIC_INIT(0);
 static atomic_t global_obj_count = ATOMIC_INIT(0);
 static atomic_t global_pgp_count = ATOMIC_INIT(0);
 static atomic_t global_pcd_count = ATOMIC_INIT(0);
@@ -381,7 +392,8 @@ static NOINLINE int pcd_copy_to_client(tmem_cli_mfn_t cmfn, pgp_t *pgp)
     pcd = pgp->pcd;
     if ( pgp->size < PAGE_SIZE && pgp->size != 0 &&
          pcd->size < PAGE_SIZE && pcd->size != 0 )
-        ret = tmh_decompress_to_client(cmfn, pcd->cdata, pcd->size, NULL);
+        ret = tmh_decompress_to_client(cmfn, pcd->cdata, pcd->size, NULL,
+                                       pgp->obj->pool->compressor);
     else if ( tmh_tze_enabled() && pcd->size < PAGE_SIZE )
         ret = tmh_copy_tze_to_client(cmfn, pcd->tze, pcd->size);
     else
@@ -603,9 +615,10 @@ static NOINLINE pgp_t *pgp_alloc(obj_t *obj)
     if ( (pgp = tmem_malloc(pgp_t, pool)) == NULL )
         return NULL;
     pgp->obj = obj;
-    INIT_LIST_HEAD(&pgp->global_eph_pages);
+    INIT_LIST_HEAD(&pgp->client_inv_pages);
     INIT_LIST_HEAD(&pgp->client_eph_pages);
     pgp->pfp = NULL;
+    pgp->referenced = 0;
     if ( tmh_dedup_enabled() )
     {
         pgp->firstbyte = NOT_SHAREABLE;
@@ -666,10 +679,7 @@ static NOINLINE void pgp_free(pgp_t *pgp, int from_delete)
     ASSERT(pgp->obj->pool != NULL);
     pool = pgp->obj->pool;
     if ( is_ephemeral(pool) )
-    {
-        ASSERT(list_empty(&pgp->global_eph_pages));
         ASSERT(list_empty(&pgp->client_eph_pages));
-    }
     pgp_free_data(pgp, pool);
     atomic_dec_and_assert(global_pgp_count);
     atomic_dec_and_assert(pool->pgp_count);
@@ -711,17 +721,16 @@ static void pgp_delist(pgp_t *pgp, bool_t no_eph_lock)
     if ( is_ephemeral(pgp->obj->pool) )
     {
         if ( !no_eph_lock )
-            tmem_spin_lock(&eph_lists_spinlock);
+            tmem_spin_lock(&client->eph_lists_spinlock);
         if ( !list_empty(&pgp->client_eph_pages) )
+        {
             client->eph_count--;
+            atomic_dec_and_assert(global_eph_count);
+        }
         ASSERT(client->eph_count >= 0);
         list_del_init(&pgp->client_eph_pages);
-        if ( !list_empty(&pgp->global_eph_pages) )
-            global_eph_count--;
-        ASSERT(global_eph_count >= 0);
-        list_del_init(&pgp->global_eph_pages);
         if ( !no_eph_lock )
-            tmem_spin_unlock(&eph_lists_spinlock);
+            tmem_spin_unlock(&client->eph_lists_spinlock);
     } else {
         if ( client->live_migrating )
         {
@@ -1023,6 +1032,7 @@ static pool_t * pool_alloc(void)
     INIT_LIST_HEAD(&pool->pool_list);
     INIT_LIST_HEAD(&pool->persistent_page_list);
     pool->cur_pgp = NULL;
+    rwlock_init(&pool->pool_op_rwlock);
     rwlock_init(&pool->pool_rwlock);
     pool->pgp_count_max = pool->obj_count_max = 0;
     pool->objnode_count = pool->objnode_count_max = 0;
@@ -1039,13 +1049,20 @@ static pool_t * pool_alloc(void)
     return pool;
 }
 
+static void pool_free_rcu(struct rcu_head *head)
+{
+    tmh_free_infra(container_of(head, pool_t, rcu));
+}
+
+/* ops that looked the pool up before it was unpublished may still be
+   spinning on pool_op_rwlock, so the memory goes only after they are done */
 static NOINLINE void pool_free(pool_t *pool)
 {
     ASSERT_SENTINEL(pool,POOL);
     INVERT_SENTINEL(pool,POOL);
     pool->client = NULL;
     list_del(&pool->pool_list);
-    tmh_free_infra(pool);
+    call_rcu(&pool->rcu, pool_free_rcu);
 }
 
 /* register new_client as a user of this shared pool and return new
@@ -1071,6 +1088,7 @@ static NOINLINE void shared_pool_reassign(pool_t *pool)
     sharelist_t *sl;
     int poolid;
     client_t *old_client = pool->client, *new_client;
+    pgp_t *pgp, *pgp2;
 
     ASSERT(is_shared(pool));
     if ( list_empty(&pool->share_list) )
@@ -1086,10 +1104,21 @@ static NOINLINE void shared_pool_reassign(pool_t *pool)
         if (new_client->pools[poolid] == pool)
             break;
     ASSERT(poolid != MAX_POOLS_PER_DOMAIN);
-    new_client->eph_count += _atomic_read(pool->pgp_count);
-    old_client->eph_count -= _atomic_read(pool->pgp_count);
-    list_splice_init(&old_client->ephemeral_page_list,
-                     &new_client->ephemeral_page_list);
+    /* tmem_rwlock serializes reassignments, so this can't deadlock */
+    tmem_spin_lock(&old_client->eph_lists_spinlock);
+    tmem_spin_lock(&new_client->eph_lists_spinlock);
+    list_for_each_entry_safe(pgp,pgp2,&old_client->ephemeral_page_list,
+                             client_eph_pages)
+    {
+        if ( pgp->obj->pool != pool )
+            continue;
+        list_move_tail(&pgp->client_eph_pages,
+                       &new_client->ephemeral_page_list);
+        old_client->eph_count--;
+        new_client->eph_count++;
+    }
+    tmem_spin_unlock(&new_client->eph_lists_spinlock);
+    tmem_spin_unlock(&old_client->eph_lists_spinlock);
     printk("reassigned shared pool from %s=%d to %s=%d pool_id=%d\n",
         cli_id_str, old_client->cli_id, cli_id_str, new_client->cli_id, poolid);
     pool->pool_id = poolid;
@@ -1135,10 +1164,13 @@ static NOINLINE int shared_pool_quit(pool_t *pool, cli_id_t cli_id)
 static void pool_flush(pool_t *pool, cli_id_t cli_id, bool_t destroy)
 {
     ASSERT(pool != NULL);
+    ASSERT_WRITELOCK(&tmem_rwlock);
+    tmem_write_lock(&pool->pool_op_rwlock);
     if ( (is_shared(pool)) && (shared_pool_quit(pool,cli_id) > 0) )
     {
         printk("tmem: %s=%d no longer using shared pool %d owned by %s=%d\n",
            cli_id_str, cli_id, pool->pool_id, cli_id_str,pool->client->cli_id);
+        tmem_write_unlock(&pool->pool_op_rwlock);
         return;
     }
     printk("%s %s-%s tmem pool ",destroy?"destroying":"flushing",
@@ -1149,14 +1181,15 @@ static void pool_flush(pool_t *pool, cli_id_t cli_id, bool_t destroy)
     {
         printk("can't %s pool while %s is live-migrating\n",
                destroy?"destroy":"flush", client_str);
+        tmem_write_unlock(&pool->pool_op_rwlock);
         return;
     }
     pool_destroy_objs(pool,0,CLI_ID_NULL);
     if ( destroy )
-    {
         pool->client->pools[pool->pool_id] = NULL;
+    tmem_write_unlock(&pool->pool_op_rwlock);
+    if ( destroy )
         pool_free(pool);
-    }
 }
 
 /************ CLIENT MANIPULATION OPERATIONS **************************/
@@ -1187,28 +1220,35 @@ static client_t *client_create(cli_id_t cli_id)
 #else
     client->compress = tmh_compression_enabled();
 #endif
+    client->compressor = tmh_default_compressor();
     client->shared_auth_required = tmh_shared_auth();
     for ( i = 0; i < MAX_GLOBAL_SHARED_POOLS; i++)
         client->shared_auth_uuid[i][0] =
             client->shared_auth_uuid[i][1] = -1L;
     client->frozen = 0; client->live_migrating = 0;
     client->weight = 0; client->cap = 0;
-    list_add_tail(&client->client_list, &global_client_list);
+    spin_lock_init(&client->eph_lists_spinlock);
     INIT_LIST_HEAD(&client->ephemeral_page_list);
     INIT_LIST_HEAD(&client->persistent_invalidated_list);
     client->cur_pgp = NULL;
     client->eph_count = client->eph_count_max = 0;
     client->total_cycles = 0; client->succ_pers_puts = 0;
     client->succ_eph_gets = 0; client->succ_pers_gets = 0;
+    list_add_tail_rcu(&client->client_list, &global_client_list);
     printk("ok\n");
     return client;
 }
 
+static void client_free_rcu(struct rcu_head *head)
+{
+    tmh_free_infra(container_of(head, client_t, rcu));
+}
+
 static void client_free(client_t *client)
 {
-    list_del(&client->client_list);
+    list_del_rcu(&client->client_list);
     tmh_client_destroy(client->tmh);
-    tmh_free_infra(client);
+    call_rcu(&client->rcu, client_free_rcu);
 }
 
 /* flush all data from a client and, optionally, free it */
@@ -1237,7 +1277,7 @@ static bool_t client_over_quota(client_t *client)
     if ( (total == 0) || (client->weight == 0) || 
           (client->eph_count == 0) )
         return 0;
-    return ( ((global_eph_count*100L) / client->eph_count ) >
+    return ( ((_atomic_read(global_eph_count)*100L) / client->eph_count ) >
              ((total*100L) / client->weight) );
 }
 
@@ -1248,6 +1288,8 @@ static void client_freeze(client_t *client, int freeze)
 
 /************ MEMORY REVOCATION ROUTINES *******************************/
 
+#define TMEM_EVICT_BATCH 8 /* max pages evicted per tmem_evict() */
+
 static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
 {
     obj_t *obj = pgp->obj;
@@ -1272,10 +1314,8 @@ static bool_t tmem_try_to_evict_pgp(pgp_t *pgp, bool_t *hold_pool_rwlock)
             if ( pgp->pcd->pgp_ref_count > 1 && !pgp->eviction_attempted )
             {
                 pgp->eviction_attempted++;
-                list_del(&pgp->global_eph_pages);
-                list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
-                list_del(&pgp->client_eph_pages);
-                list_add_tail(&pgp->client_eph_pages,&client->ephemeral_page_list);
+                list_move_tail(&pgp->client_eph_pages,
+                               &client->ephemeral_page_list);
                 goto pcd_unlock;
             }
         }
@@ -1294,35 +1334,14 @@ obj_unlock:
     return 0;
 }
 
-static int tmem_evict(void)
+/* called with the client's eph_lists_spinlock and the locks taken by a
+   successful tmem_try_to_evict_pgp held */
+static void tmem_evict_pgp(pgp_t *pgp, bool_t hold_pool_rwlock)
 {
-    client_t *client = tmh_client_from_current();
-    pgp_t *pgp = NULL, *pgp2, *pgp_del;
     obj_t *obj;
     pool_t *pool;
-    int ret = 0;
-    bool_t hold_pool_rwlock = 0;
+    pgp_t *pgp_del;
 
-    evict_attempts++;
-    tmem_spin_lock(&eph_lists_spinlock);
-    if ( (client != NULL) && client_over_quota(client) &&
-         !list_empty(&client->ephemeral_page_list) )
-    {
-        list_for_each_entry_safe(pgp,pgp2,&client->ephemeral_page_list,client_eph_pages)
-            if ( tmem_try_to_evict_pgp(pgp,&hold_pool_rwlock) )
-                goto found;
-    } else if ( list_empty(&global_ephemeral_page_list) ) {
-        goto out;
-    } else {
-        list_for_each_entry_safe(pgp,pgp2,&global_ephemeral_page_list,global_eph_pages)
-            if ( tmem_try_to_evict_pgp(pgp,&hold_pool_rwlock) )
-                goto found;
-    }
-
-    ret = 0;
-    goto out;
-
-found:
     ASSERT(pgp != NULL);
     ASSERT_SENTINEL(pgp,PGD);
     obj = pgp->obj;
@@ -1351,11 +1370,67 @@ found:
     if ( hold_pool_rwlock )
         tmem_write_unlock(&pool->pool_rwlock);
     evicted_pgs++;
-    ret = 1;
+}
+
+/* evict from the current client if it is over quota, else from whichever
+   client holds the most ephemeral pages */
+static client_t *tmem_evict_victim(void)
+{
+    client_t *client = tmh_client_from_current(), *c;
+
+    if ( (client != NULL) && client->eph_count && client_over_quota(client) )
+        return client;
+    client = NULL;
+    list_for_each_entry_rcu(c, &global_client_list, client_list)
+        if ( c->eph_count &&
+             ((client == NULL) || (c->eph_count > client->eph_count)) )
+            client = c;
+    return client;
+}
+
+/*
+ * Each client's ephemeral pages are kept in put order and scanned clock
+ * style from the head: a page that has been got since the hand last passed
+ * it is given a second chance at the tail, as is one that can't be locked
+ * right now.  Up to TMEM_EVICT_BATCH pages are evicted for one hold of the
+ * client's list lock.  Returns the number of pages evicted.
+ */
+static int tmem_evict(void)
+{
+    client_t *client;
+    struct list_head *list;
+    pgp_t *pgp;
+    long scan;
+    int evicted = 0;
+    bool_t hold_pool_rwlock;
+
+    evict_attempts++;
+    rcu_read_lock(&tmem_rcu_lock);
+    if ( (client = tmem_evict_victim()) == NULL )
+        goto out;
+    list = &client->ephemeral_page_list;
+    tmem_spin_lock(&client->eph_lists_spinlock);
+    for ( scan = 2 * client->eph_count; (scan > 0) && !list_empty(list);
+          scan-- )
+    {
+        pgp = list_entry(list->next, pgp_t, client_eph_pages);
+        hold_pool_rwlock = 0;
+        if ( pgp->referenced )
+            pgp->referenced = 0;
+        else if ( tmem_try_to_evict_pgp(pgp,&hold_pool_rwlock) )
+        {
+            tmem_evict_pgp(pgp,hold_pool_rwlock);
+            if ( ++evicted == TMEM_EVICT_BATCH )
+                break;
+            continue;
+        }
+        list_move_tail(&pgp->client_eph_pages, list);
+    }
+    tmem_spin_unlock(&client->eph_lists_spinlock);
 
 out:
-    tmem_spin_unlock(&eph_lists_spinlock);
-    return ret;
+    rcu_read_unlock(&tmem_rcu_lock);
+    return evicted;
 }
 
 static unsigned long tmem_relinquish_npages(unsigned long n)
@@ -1412,7 +1487,8 @@ static NOINLINE int do_tmem_put_compress(pgp_t *pgp, tmem_cli_mfn_t cmfn,
     if ( pgp->pfp != NULL )
         pgp_free_data(pgp, pgp->obj->pool);
     START_CYC_COUNTER(compress);
-    ret = tmh_compress_from_client(cmfn, &dst, &size, cva);
+    ret = tmh_compress_from_client(cmfn, &dst, &size, cva,
+                                   pgp->obj->pool->compressor);
     if ( (ret == -EFAULT) || (ret == 0) )
         goto out;
     else if ( (size == 0) || (size >= tmem_subpage_maxsize()) ) {
@@ -1614,16 +1690,13 @@ copy_uncompressed:
 insert_page:
     if ( is_ephemeral(pool) )
     {
-        tmem_spin_lock(&eph_lists_spinlock);
-        list_add_tail(&pgp->global_eph_pages,
-            &global_ephemeral_page_list);
-        if (++global_eph_count > global_eph_count_max)
-            global_eph_count_max = global_eph_count;
+        tmem_spin_lock(&client->eph_lists_spinlock);
         list_add_tail(&pgp->client_eph_pages,
             &client->ephemeral_page_list);
         if (++client->eph_count > client->eph_count_max)
             client->eph_count_max = client->eph_count;
-        tmem_spin_unlock(&eph_lists_spinlock);
+        tmem_spin_unlock(&client->eph_lists_spinlock);
+        atomic_inc_and_max(global_eph_count);
     } else { /* is_persistent */
         tmem_spin_lock(&pers_lists_spinlock);
         list_add_tail(&pgp->pool_pers_pages,
@@ -1707,8 +1780,8 @@ static NOINLINE int do_tmem_get(pool_t *pool, uint64_t oid, uint32_t index,
             goto bad_copy;
     } else if ( pgp->size != 0 ) {
         START_CYC_COUNTER(decompress);
-        if ( tmh_decompress_to_client(cmfn, pgp->cdata,
-                                      pgp->size, cva) == -EFAULT )
+        if ( tmh_decompress_to_client(cmfn, pgp->cdata, pgp->size, cva,
+                                      pool->compressor) == -EFAULT )
             goto bad_copy;
         END_CYC_COUNTER(decompress);
     } else if ( tmh_copy_to_client(cmfn, pgp->pfp, tmem_offset,
@@ -1727,12 +1800,8 @@ static NOINLINE int do_tmem_get(pool_t *pool, uint64_t oid, uint32_t index,
                 tmem_write_unlock(&pool->pool_rwlock);
             }
         } else {
-            tmem_spin_lock(&eph_lists_spinlock);
-            list_del(&pgp->global_eph_pages);
-            list_add_tail(&pgp->global_eph_pages,&global_ephemeral_page_list);
-            list_del(&pgp->client_eph_pages);
-            list_add_tail(&pgp->client_eph_pages,&client->ephemeral_page_list);
-            tmem_spin_unlock(&eph_lists_spinlock);
+            /* no list lock needed, tmem_evict() will give it a second chance */
+            pgp->referenced = 1;
             ASSERT(obj != NULL);
             obj->last_client = tmh_get_cli_id_from_current();
         }
@@ -1838,6 +1907,8 @@ static NOINLINE int do_tmem_new_pool(cli_id_t this_cli_id,
          & TMEM_POOL_PAGESIZE_MASK;
     int specversion = (flags >> TMEM_POOL_VERSION_SHIFT)
          & TMEM_POOL_VERSION_MASK;
+    unsigned int compressor = (flags >> TMEM_POOL_COMPRESS_SHIFT)
+         & TMEM_POOL_COMPRESS_MASK;
     pool_t *pool, *shpool;
     int s_poolid, first_unused_s_poolid;
     int i;
@@ -1859,6 +1930,11 @@ static NOINLINE int do_tmem_new_pool(cli_id_t this_cli_id,
         printk("failed... unsupported pagesize %d\n",1<<(pagebits+12));
         return -EPERM;
     }
+    if ( compressor && !tmh_compressor_valid(compressor) )
+    {
+        printk("failed... unsupported compressor %d\n",compressor);
+        return -EPERM;
+    }
     if ( (pool = pool_alloc()) == NULL )
     {
         printk("failed... out of memory\n");
@@ -1901,6 +1977,12 @@ static NOINLINE int do_tmem_new_pool(cli_id_t this_cli_id,
     }
     pool->shared = shared;
     pool->client = client;
+    /* pages are shared between pools by content when deduping, so they
+       must all be compressed the same way */
+    if ( !compressor || tmh_dedup_enabled() )
+        compressor = tmh_dedup_enabled() ? tmh_default_compressor()
+                                         : client->compressor;
+    pool->compressor = compressor;
     if ( shared )
     {
         first_unused_s_poolid = MAX_GLOBAL_SHARED_POOLS;
@@ -1937,13 +2019,14 @@ static NOINLINE int do_tmem_new_pool(cli_id_t this_cli_id,
             (void)shared_pool_join(pool,client);
         }
     }
-    client->pools[d_poolid] = pool;
-    if ( this_cli_id != CLI_ID_NULL )
-        tmh_client_put(client->tmh);
     list_add_tail(&pool->pool_list, &global_pool_list);
     pool->pool_id = d_poolid;
     pool->persistent = persistent;
     pool->uuid[0] = uuid_lo; pool->uuid[1] = uuid_hi;
+    /* ops look the pool up without tmem_rwlock, so publish it last */
+    rcu_assign_pointer(client->pools[d_poolid], pool);
+    if ( this_cli_id != CLI_ID_NULL )
+        tmh_client_put(client->tmh);
     printk("pool_id=%d\n",d_poolid);
     return d_poolid;
 
@@ -2108,6 +2191,8 @@ static int tmemc_list_global_perf(tmem_cli_va_t buf, int off, uint32_t len,
 {
     char info[BSIZE];
     int n = 0, sum = 0;
+    unsigned int alg;
+    struct tmh_compressor *c;
 
     n = scnprintf(info+n,BSIZE-n,"T=");
     n += SCNPRINTF_CYC_COUNTER(info+n,BSIZE-n,succ_get,"G");
@@ -2132,6 +2217,24 @@ static int tmemc_list_global_perf(tmem_cli_va_t buf, int off, uint32_t len,
         return sum;
     tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
     sum += n;
+    /* one line per compressor: ratio in percent and cycles per page */
+    for ( alg = 0; alg < TMH_NR_COMPRESSORS; alg++ )
+    {
+        if ( !tmh_compressor_valid(alg) )
+            continue;
+        c = &tmh_compressors[alg];
+        n = scnprintf(info,BSIZE,"Z=Zn:%s,Cn:%"PRIu64",Cr:%"PRIu64","
+            "Cp:%"PRIu64",Dn:%"PRIu64",Dp:%"PRIu64"\n", c->name,
+            c->compress_pages, c->compress_in_bytes ?
+              c->compress_out_bytes * 100 / c->compress_in_bytes : 0,
+            c->compress_pages ? c->compress_cycles / c->compress_pages : 0,
+            c->decompress_pages, c->decompress_pages ?
+              c->decompress_cycles / c->decompress_pages : 0);
+        if ( sum + n >= len )
+            return sum;
+        tmh_copy_to_client_buf_offset(buf,off+sum,info,n+1);
+        sum += n;
+    }
     return sum;
 }
 #else
@@ -2154,9 +2257,9 @@ static int tmemc_list_global(tmem_cli_va_t buf, int off, uint32_t len,
       total_flush_pool, use_long ? ',' : '\n');
     if (use_long)
         n += scnprintf(info+n,BSIZE-n,
-          "Ec:%ld,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
+          "Ec:%d,Em:%ld,Oc:%d,Om:%d,Nc:%d,Nm:%d,Pc:%d,Pm:%d,"
           "Fc:%d,Fm:%d,Sc:%d,Sm:%d,Ep:%lu,Gd:%lu,Zt:%lu,Gz:%lu\n",
-          global_eph_count, global_eph_count_max,
+          _atomic_read(global_eph_count), global_eph_count_max,
           _atomic_read(global_obj_count), global_obj_count_max,
           _atomic_read(global_rtree_node_count), global_rtree_node_count_max,
           _atomic_read(global_pgp_count), global_pgp_count_max,
@@ -2224,7 +2327,20 @@ static int tmemc_set_var_one(client_t *client, uint32_t subop, uint32_t arg1)
         }
         client->compress = arg1 ? 1 : 0;
         printk("tmem: compression %s for %s=%d\n",
-            arg1 ? "enabled" : "disabled",cli_id_str,cli_id);
+            arg1 ? tmh_compressors[client->compressor].name : "disabled",
+            cli_id_str,cli_id);
+        break;
+    case TMEMC_SET_COMPRESSOR:
+        if ( tmh_dedup_enabled() || !tmh_compressor_valid(arg1) )
+        {
+            printk("tmem: cannot set compressor %d for %s=%d\n",
+                   arg1,cli_id_str,cli_id);
+            return -1;
+        }
+        /* existing pools keep the compressor their pages were stored with */
+        client->compressor = arg1;
+        printk("tmem: compressor %s for %s=%d\n",
+            tmh_compressors[arg1].name,cli_id_str,cli_id);
         break;
     default:
         printk("tmem: unknown subop %d for tmemc_set_var\n",subop);
@@ -2292,6 +2408,39 @@ static NOINLINE int tmemc_shared_pool_auth(cli_id_t cli_id, uint64_t uuid_lo,
     return 1;
 }
 
+/* keep ops off all the client's pools while changing state they look at */
+static void client_pools_write_lock(client_t *client)
+{
+    int i, j;
+
+    for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
+    {
+        if ( client->pools[i] == NULL )
+            continue;
+        for ( j = 0; j < i; j++ )
+            if ( client->pools[j] == client->pools[i] )
+                break;
+        if ( j == i )
+            tmem_write_lock(&client->pools[i]->pool_op_rwlock);
+    }
+}
+
+static void client_pools_write_unlock(client_t *client)
+{
+    int i, j;
+
+    for ( i = 0; i < MAX_POOLS_PER_DOMAIN; i++ )
+    {
+        if ( client->pools[i] == NULL )
+            continue;
+        for ( j = 0; j < i; j++ )
+            if ( client->pools[j] == client->pools[i] )
+                break;
+        if ( j == i )
+            tmem_write_unlock(&client->pools[i]->pool_op_rwlock);
+    }
+}
+
 static NOINLINE int tmemc_save_subop(int cli_id, uint32_t pool_id,
                         uint32_t subop, tmem_cli_va_t buf, uint32_t arg1)
 {
@@ -2316,10 +2465,12 @@ static NOINLINE int tmemc_save_subop(int cli_id, uint32_t pool_id,
             rc = 0;
             break;
         }
+        client_pools_write_lock(client);
         client->was_frozen = client->frozen;
         client->frozen = 1;
         if ( arg1 != 0 )
             client->live_migrating = 1;
+        client_pools_write_unlock(client);
         rc = 1;
         break;
     case TMEMC_RESTORE_BEGIN:
@@ -2347,7 +2498,8 @@ static NOINLINE int tmemc_save_subop(int cli_id, uint32_t pool_id,
              break;
          rc = (pool->persistent ? TMEM_POOL_PERSIST : 0) |
               (pool->shared ? TMEM_POOL_SHARED : 0) |
-              (pool->pageshift << TMEM_POOL_PAGESIZE_SHIFT);
+              (pool->pageshift << TMEM_POOL_PAGESIZE_SHIFT) |
+              (pool->compressor << TMEM_POOL_COMPRESS_SHIFT);
         break;
     case TMEMC_SAVE_GET_POOL_NPAGES:
          if ( pool == NULL )
@@ -2362,12 +2514,14 @@ static NOINLINE int tmemc_save_subop(int cli_id, uint32_t pool_id,
         *uuid = pool->uuid[1];
         rc = 0;
     case TMEMC_SAVE_END:
+        client_pools_write_lock(client);
         client->live_migrating = 0;
         if ( !list_empty(&client->persistent_invalidated_list) )
             list_for_each_entry_safe(pgp,pgp2,
               &client->persistent_invalidated_list, client_inv_pages)
                 pgp_free_from_inv_list(client,pgp);
         client->frozen = client->was_frozen;
+        client_pools_write_unlock(client);
         rc = 0;
     }
     if ( client )
@@ -2397,6 +2551,7 @@ static NOINLINE int tmemc_save_get_next_page(int cli_id, int pool_id,
         return -ENOMEM;
     }
 
+    tmem_read_lock(&pool->pool_op_rwlock);
     tmem_spin_lock(&pers_lists_spinlock);
     if ( list_empty(&pool->persistent_page_list) )
     {
@@ -2427,6 +2582,7 @@ static NOINLINE int tmemc_save_get_next_page(int cli_id, int pool_id,
 
 out:
     tmem_spin_unlock(&pers_lists_spinlock);
+    tmem_read_unlock(&pool->pool_op_rwlock);
     tmh_client_put(client->tmh);
     return ret;
 }
@@ -2482,8 +2638,14 @@ static int tmemc_restore_put_page(int cli_id, int pool_id, uint64_t oid,
     client_t *client = tmh_client_from_cli_id(cli_id);
     pool_t *pool = (client == NULL || pool_id >= MAX_POOLS_PER_DOMAIN)
                    ? NULL : client->pools[pool_id];
-    int rc = pool ? do_tmem_put(pool,oid,index,0,0,0,bufsize,buf.p) : -1;
+    int rc = -1;
 
+    if ( pool )
+    {
+        tmem_read_lock(&pool->pool_op_rwlock);
+        rc = do_tmem_put(pool,oid,index,0,0,0,bufsize,buf.p);
+        tmem_read_unlock(&pool->pool_op_rwlock);
+    }
     if ( client )
         tmh_client_put(client->tmh);
     return rc;
@@ -2495,8 +2657,14 @@ static int tmemc_restore_flush_page(int cli_id, int pool_id, uint64_t oid,
     client_t *client = tmh_client_from_cli_id(cli_id);
     pool_t *pool = (client == NULL || pool_id >= MAX_POOLS_PER_DOMAIN)
                    ? NULL : client->pools[pool_id];
-    int rc = pool ? do_tmem_flush_page(pool, oid, index) : -1;
+    int rc = -1;
 
+    if ( pool )
+    {
+        tmem_read_lock(&pool->pool_op_rwlock);
+        rc = do_tmem_flush_page(pool, oid, index);
+        tmem_read_unlock(&pool->pool_op_rwlock);
+    }
     if ( client )
         tmh_client_put(client->tmh);
     return rc;
@@ -2530,6 +2698,7 @@ static NOINLINE int do_tmem_control(struct tmem_op *op)
     case TMEMC_SET_WEIGHT:
     case TMEMC_SET_CAP:
     case TMEMC_SET_COMPRESS:
+    case TMEMC_SET_COMPRESSOR:
         ret = tmemc_set_var(op->u.ctrl.cli_id,subop,op->u.ctrl.arg1);
         break;
     case TMEMC_QUERY_FREEABLE_MB:
@@ -2583,7 +2752,7 @@ EXPORT long do_tmem_op(tmem_cli_op_t uops)
     bool_t succ_get = 0, succ_put = 0;
     bool_t non_succ_get = 0, non_succ_put = 0;
     bool_t flush = 0, flush_obj = 0;
-    bool_t tmem_write_lock_set = 0, tmem_read_lock_set = 0;
+    bool_t tmem_write_lock_set = 0, pool_op_lock_set = 0;
     DECL_LOCAL_CYC_COUNTER(succ_get);
     DECL_LOCAL_CYC_COUNTER(succ_put);
     DECL_LOCAL_CYC_COUNTER(non_succ_get);
@@ -2667,13 +2836,19 @@ EXPORT long do_tmem_op(tmem_cli_op_t uops)
     }
     else
     {
-        if ( !tmem_write_lock_set )
+        rcu_read_lock(&tmem_rcu_lock);
+        if ( ((uint32_t)op.pool_id < MAX_POOLS_PER_DOMAIN) &&
+             ((pool = client->pools[op.pool_id]) != NULL) )
         {
-            tmem_read_lock(&tmem_rwlock);
-            tmem_read_lock_set = 1;
+            tmem_read_lock(&pool->pool_op_rwlock);
+            /* recheck, the pool may have been destroyed meanwhile */
+            if ( client->pools[op.pool_id] == pool )
+                pool_op_lock_set = 1;
+            else
+                tmem_read_unlock(&pool->pool_op_rwlock);
         }
-        if ( ((uint32_t)op.pool_id >= MAX_POOLS_PER_DOMAIN) ||
-             ((pool = client->pools[op.pool_id]) == NULL) )
+        rcu_read_unlock(&tmem_rcu_lock);
+        if ( !pool_op_lock_set )
         {
             rc = -ENODEV;
             printk("tmem: operation requested on uncreated pool\n");
@@ -2763,12 +2938,10 @@ out:
         else
             spin_unlock(&tmem_spinlock);
     } else {
+        if ( pool_op_lock_set )
+            read_unlock(&pool->pool_op_rwlock);
         if ( tmem_write_lock_set )
             write_unlock(&tmem_rwlock);
-        else if ( tmem_read_lock_set )
-            read_unlock(&tmem_rwlock);
-        else 
-            ASSERT(0);
     }
 
     return rc;
@@ -2828,7 +3001,7 @@ EXPORT void *tmem_relinquish_pages(unsigned int order, unsigned int memflags)
 {
     pfp_t *pfp;
     unsigned long evicts_per_relinq = 0;
-    int max_evictions = 10;
+    int max_evictions = 10, evicted;
 
     if (!tmh_enabled() || !tmh_freeable_pages())
         return NULL;
@@ -2845,19 +3018,15 @@ EXPORT void *tmem_relinquish_pages(unsigned int order, unsigned int memflags)
         return NULL;
     }
 
-    if ( tmh_called_from_tmem(memflags) )
-    {
-        if ( tmh_lock_all )
-            spin_lock(&tmem_spinlock);
-        else
-            read_lock(&tmem_rwlock);
-    }
+    /* tmem_evict() needs no tmem_rwlock, only the global lock if in use */
+    if ( tmh_called_from_tmem(memflags) && tmh_lock_all )
+        spin_lock(&tmem_spinlock);
 
     while ( (pfp = tmh_alloc_page(NULL,1)) == NULL )
     {
-        if ( (max_evictions-- <= 0) || !tmem_evict())
+        if ( (max_evictions-- <= 0) || !(evicted = tmem_evict()) )
             break;
-        evicts_per_relinq++;
+        evicts_per_relinq += evicted;
     }
     if ( evicts_per_relinq > max_evicts_per_relinq )
         max_evicts_per_relinq = evicts_per_relinq;
@@ -2865,13 +3034,8 @@ EXPORT void *tmem_relinquish_pages(unsigned int order, unsigned int memflags)
     if ( pfp != NULL )
         relinq_pgs++;
 
-    if ( tmh_called_from_tmem(memflags) )
-    {
-        if ( tmh_lock_all )
-            spin_unlock(&tmem_spinlock);
-        else
-            read_unlock(&tmem_rwlock);
-    }
+    if ( tmh_called_from_tmem(memflags) && tmh_lock_all )
+        spin_unlock(&tmem_spinlock);
 
     return pfp;
 }
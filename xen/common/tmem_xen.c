@@ -9,6 +9,7 @@
 #include <xen/tmem.h>
 #include <xen/tmem_xen.h>
 #include <xen/lzo.h> /* compression code */
+#include <xen/lz4.h>
 #include <xen/paging.h>
 #include <xen/domain_page.h>
 
@@ -20,6 +21,35 @@ boolean_param("tmem", opt_tmem);
 EXPORT int opt_tmem_compress = 0;
 boolean_param("tmem_compress", opt_tmem_compress);
 
+EXPORT struct tmh_compressor tmh_compressors[TMH_NR_COMPRESSORS] = {
+    [TMEM_COMPRESS_LZO] = {
+        .name = "lzo",
+        .compress = lzo1x_1_compress,
+        .decompress = lzo1x_decompress_safe,
+    },
+    [TMEM_COMPRESS_LZ4] = {
+        .name = "lz4",
+        .compress = lz4_compress,
+        .decompress = lz4_decompress_safe,
+    },
+};
+
+EXPORT unsigned int opt_tmem_compressor = TMEM_COMPRESS_LZO;
+static void __init parse_tmem_compressor(const char *s)
+{
+    unsigned int alg;
+
+    for ( alg = 0; alg < TMH_NR_COMPRESSORS; alg++ )
+        if ( tmh_compressor_valid(alg) && !strcmp(s, tmh_compressors[alg].name) )
+        {
+            opt_tmem_compressor = alg;
+            return;
+        }
+    printk("tmem: unknown compressor %s, using %s\n",
+           s, tmh_compressors[opt_tmem_compressor].name);
+}
+custom_param("tmem_compressor", parse_tmem_compressor);
+
 EXPORT int opt_tmem_dedup = 0;
 boolean_param("tmem_dedup", opt_tmem_dedup);
 
@@ -45,8 +75,10 @@ DECL_CYC_COUNTER(pg_copy);
 
 /* these are a concurrency bottleneck, could be percpu and dynamically
  * allocated iff opt_tmem_compress */
-#define LZO_WORKMEM_BYTES LZO1X_1_MEM_COMPRESS
-#define LZO_DSTMEM_PAGES 2
+#define WORKMEM_BYTES \
+    (LZO1X_1_MEM_COMPRESS > LZ4_MEM_COMPRESS ? \
+     LZO1X_1_MEM_COMPRESS : LZ4_MEM_COMPRESS)
+#define DSTMEM_PAGES 2
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, workmem);
 static DEFINE_PER_CPU_READ_MOSTLY(unsigned char *, dstmem);
 
@@ -135,19 +167,27 @@ EXPORT int tmh_copy_from_client(pfp_t *pfp,
 }
 
 EXPORT int tmh_compress_from_client(tmem_cli_mfn_t cmfn,
-    void **out_va, size_t *out_len, void *cli_va)
+    void **out_va, size_t *out_len, void *cli_va, unsigned int alg)
 {
     int ret = 0;
     unsigned char *dmem = this_cpu(dstmem);
     unsigned char *wmem = this_cpu(workmem);
+    struct tmh_compressor *c = &tmh_compressors[alg];
+    uint64_t start;
 
+    ASSERT(tmh_compressor_valid(alg));
     if ( (cli_va == NULL) && (cli_va = cli_mfn_to_va(cmfn,NULL)) == NULL)
         return -EFAULT;
     if ( dmem == NULL || wmem == NULL )
         return 0;  /* no buffer, so can't compress */
     mb();
-    ret = lzo1x_1_compress(cli_va, PAGE_SIZE, dmem, out_len, wmem);
-    ASSERT(ret == LZO_E_OK);
+    start = get_cycles();
+    ret = c->compress(cli_va, PAGE_SIZE, dmem, out_len, wmem);
+    c->compress_cycles += get_cycles() - start;
+    ASSERT(ret == 0);
+    c->compress_pages++;
+    c->compress_in_bytes += PAGE_SIZE;
+    c->compress_out_bytes += *out_len;
     *out_va = dmem;
     unmap_domain_page(cli_va);
     return 1;
@@ -182,19 +222,26 @@ EXPORT int tmh_copy_to_client(tmem_cli_mfn_t cmfn, pfp_t *pfp,
 }
 
 EXPORT int tmh_decompress_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
-                                    size_t size, void *cli_va)
+                                    size_t size, void *cli_va,
+                                    unsigned int alg)
 {
     unsigned long cli_mfn = 0;
     int mark_dirty = 1;
     size_t out_len = PAGE_SIZE;
+    struct tmh_compressor *c = &tmh_compressors[alg];
+    uint64_t start;
     int ret;
 
+    ASSERT(tmh_compressor_valid(alg));
     if ( cli_va != NULL )
         mark_dirty = 0;
     else if ( (cli_va = cli_mfn_to_va(cmfn,&cli_mfn)) == NULL)
         return -EFAULT;
-    ret = lzo1x_decompress_safe(tmem_va, size, cli_va, &out_len);
-    ASSERT(ret == LZO_E_OK);
+    start = get_cycles();
+    ret = c->decompress(tmem_va, size, cli_va, &out_len);
+    c->decompress_cycles += get_cycles() - start;
+    c->decompress_pages++;
+    ASSERT(ret == 0);
     ASSERT(out_len == PAGE_SIZE);
     if ( mark_dirty )
     {
@@ -226,6 +273,29 @@ EXPORT int tmh_copy_tze_to_client(tmem_cli_mfn_t cmfn, void *tmem_va,
     return 1;
 }
 
+/*
+ * Xen can't use the SSE registers without saving the guest's FPU state, so
+ * rather than SSE2 this ORs together a cache line of 64-bit words at a time,
+ * leaving one well predicted branch per line instead of one per word.
+ */
+EXPORT pagesize_t tmh_tze_scan(const void *va)
+{
+    const uint64_t *p = (const uint64_t *)va + PAGE_SIZE/sizeof(uint64_t);
+    pagesize_t len;
+    int i;
+
+    for ( len = PAGE_SIZE; len; len -= 8 * sizeof(uint64_t) )
+    {
+        p -= 8;
+        if ( p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7] )
+            break;
+    }
+    if ( len )
+        for ( i = 7; !p[i]; i-- )
+            len -= sizeof(uint64_t);
+    return len;
+}
+
 /******************  XEN-SPECIFIC MEMORY ALLOCATION ********************/
 
 EXPORT struct xmem_pool *tmh_mempool = 0;
@@ -359,8 +429,10 @@ EXPORT int tmh_init(void)
     if ( !tmh_mempool_init() )
         return 0;
 
-    dstmem_order = get_order_from_pages(LZO_DSTMEM_PAGES);
-    workmem_order = get_order_from_bytes(LZO1X_1_MEM_COMPRESS);
+    BUILD_BUG_ON(lzo1x_worst_compress(PAGE_SIZE) > DSTMEM_PAGES * PAGE_SIZE);
+    BUILD_BUG_ON(lz4_worst_compress(PAGE_SIZE) > DSTMEM_PAGES * PAGE_SIZE);
+    dstmem_order = get_order_from_pages(DSTMEM_PAGES);
+    workmem_order = get_order_from_bytes(WORKMEM_BYTES);
     for_each_possible_cpu ( cpu )
     {
         pi = alloc_domheap_pages(0,dstmem_order,0);
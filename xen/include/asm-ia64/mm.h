@@ -84,6 +84,8 @@ struct page_info
             u32 order;
             /* Do TLBs need flushing for safety before next page use? */
             bool_t need_tlbflush;
+            /* Does the page still hold its last owner's data? */
+            bool_t need_scrub;
         } free;
 
     } u;
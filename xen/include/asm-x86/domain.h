@@ -177,11 +177,18 @@ struct log_dirty_domain {
     /* log-dirty mode stats */
     unsigned int   fault_count;
     unsigned int   dirty_count;
+    unsigned int   clean_time_us;
+    unsigned int   generation;  /* bumped each time log-dirty is enabled */
 
     /* functions which are paging mode specific */
     int            (*enable_log_dirty   )(struct domain *d);
     int            (*disable_log_dirty  )(struct domain *d);
     void           (*clean_dirty_bitmap )(struct domain *d);
+    /* optional: re-arm the traps for just the pfns set in bitmap, bit 0
+     * being pfn, instead of for everything in clean_dirty_bitmap() */
+    void           (*clean_dirty_range  )(struct domain *d, unsigned long pfn,
+                                          const unsigned long *bitmap,
+                                          unsigned int nr);
 };
 
 struct paging_domain {
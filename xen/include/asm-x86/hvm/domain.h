@@ -41,9 +41,24 @@ struct hvm_ioreq_page {
     void *va;
 };
 
+/* Extended buffered ioreq ring; page[0]/va[0] is the header page. */
+struct hvm_bufioreq_ring {
+    spinlock_t lock;
+    unsigned int nr_pages;
+    struct page_info *page[BUF_IOREQ_EXT_MAX_PAGES + 1];
+    void *va[BUF_IOREQ_EXT_MAX_PAGES + 1];
+    uint32_t nr_slots;
+    uint32_t write_pointer;  /* Xen's own copy, not trusted from the page */
+    uint32_t notified;       /* write_pointer when last signalled */
+    int port;
+    bool_t timer_armed;
+    struct timer timer;
+};
+
 struct hvm_domain {
     struct hvm_ioreq_page  ioreq;
     struct hvm_ioreq_page  buf_ioreq;
+    struct hvm_bufioreq_ring bufioreq_ring;
 
     uint32_t               gtsc_khz; /* kHz */
     bool_t                 tsc_scaled;
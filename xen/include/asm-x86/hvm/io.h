@@ -81,6 +81,7 @@ static inline int hvm_buffered_io_intercept(ioreq_t *p)
 
 int hvm_mmio_intercept(ioreq_t *p);
 int hvm_buffered_io_send(ioreq_t *p);
+void hvm_bufioreq_ring_timer_fn(void *data);
 
 static inline void register_portio_handler(
     struct domain *d, unsigned long addr,
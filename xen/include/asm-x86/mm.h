@@ -70,6 +70,8 @@ struct page_info
         struct {
             /* Do TLBs need flushing for safety before next page use? */
             bool_t need_tlbflush;
+            /* Does the page still hold its last owner's data? */
+            bool_t need_scrub;
         } free;
 
     } u;
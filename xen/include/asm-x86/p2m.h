@@ -122,7 +122,8 @@ typedef enum {
 #define P2M_MAGIC_TYPES (p2m_to_mask(p2m_populate_on_demand))
 
 /* Pageable types */
-#define P2M_PAGEABLE_TYPES (p2m_to_mask(p2m_ram_rw))
+#define P2M_PAGEABLE_TYPES (p2m_to_mask(p2m_ram_rw)         \
+                            | p2m_to_mask(p2m_ram_logdirty))
 
 #define P2M_PAGING_TYPES (p2m_to_mask(p2m_ram_paging_out)        \
                           | p2m_to_mask(p2m_ram_paged)           \
@@ -189,6 +190,17 @@ struct p2m_domain {
     /* Highest guest frame that's ever been mapped in the p2m */
     unsigned long max_mapped_pfn;
 
+    /* While defer_flush is set, updates that would flush the TLBs set
+     * flush_pending instead, and the lock holder that set it flushes once
+     * at the end.  See p2m_change_type_bitmap(). */
+    bool_t             defer_flush;
+    bool_t             flush_pending;
+
+    /* The 2MB frames, by gfn >> 9, whose superpage mapping was split while
+     * the domain was in log-dirty mode, for p2m_coalesce_logdirty_splits().
+     * NULL when not tracking. */
+    struct rangeset   *logdirty_splits;
+
     /* Populate-on-demand variables
      * NB on locking.  {super,single,count} are
      * covered by d->page_alloc_lock, since they're almost always used in
@@ -426,6 +438,18 @@ void p2m_change_entry_type_global(struct domain *d, p2m_type_t ot, p2m_type_t nt
 p2m_type_t p2m_change_type(struct domain *d, unsigned long gfn,
                            p2m_type_t ot, p2m_type_t nt);
 
+/* Compare-exchange the types of the entries for the gfns whose bits are set
+ * in bitmap, bit 0 being gfn, with a single TLB flush */
+void p2m_change_type_bitmap(struct domain *d, unsigned long gfn,
+                            const unsigned long *bitmap, unsigned int nr,
+                            p2m_type_t ot, p2m_type_t nt);
+
+/* Track superpage splits while in log-dirty mode, and map the split frames
+ * as superpages again where they are still contiguous RAM */
+void p2m_track_logdirty_splits(struct domain *d);
+void p2m_note_logdirty_split(struct domain *d, unsigned long gfn);
+void p2m_coalesce_logdirty_splits(struct domain *d);
+
 /* Set mmio addresses in the p2m table (for pass-through) */
 int set_mmio_p2m_entry(struct domain *d, unsigned long gfn, mfn_t mfn);
 int clear_mmio_p2m_entry(struct domain *d, unsigned long gfn);
@@ -35,7 +35,7 @@
 #include "xen.h"
 #include "grant_table.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x00000006
+#define XEN_DOMCTL_INTERFACE_VERSION 0x00000007
 
 struct xenctl_cpumap {
     XEN_GUEST_HANDLE_64(uint8) bitmap;
@@ -186,6 +186,15 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * As CLEAN and PEEK, for the pages pfns from start_pfn (a multiple of 8)
+  * only: bit 0 of the bitmap is start_pfn.  The bitmap is handled in whole
+  * bytes.  CLEAN_RANGE leaves the stats alone, and PEEK_RANGE does not
+  * pause the domain.  The range is cut short at the guest's highest pfn,
+  * and pages is updated to the number of pages actually handled.
+  */
+#define XEN_DOMCTL_SHADOW_OP_CLEAN_RANGE 13
+#define XEN_DOMCTL_SHADOW_OP_PEEK_RANGE  14
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
@@ -223,6 +232,8 @@ struct xen_domctl_getpageframeinfo3 {
 struct xen_domctl_shadow_op_stats {
     uint32_t fault_count;
     uint32_t dirty_count;
+    uint32_t clean_time_us;  /* Re-arming dirty tracking in the last CLEAN */
+    uint32_t generation;     /* Bumped each time log-dirty mode is enabled */
 };
 typedef struct xen_domctl_shadow_op_stats xen_domctl_shadow_op_stats_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_stats_t);
@@ -231,8 +242,12 @@ struct xen_domctl_shadow_op {
     /* IN variables. */
     uint32_t       op;       /* XEN_DOMCTL_SHADOW_OP_* */
 
-    /* OP_ENABLE */
-    uint32_t       mode;     /* XEN_DOMCTL_SHADOW_ENABLE_* */
+    /* OP_ENABLE: XEN_DOMCTL_SHADOW_ENABLE_*
+     * OP_OFF / OP_PEEK* / OP_CLEAN*: if non-zero, the stats.generation the
+     * caller enabled log-dirty mode at.  The op fails with -ESTALE, doing
+     * nothing, if log-dirty mode has since been turned off or re-enabled
+     * by somebody else. */
+    uint32_t       mode;
 
     /* OP_GET_ALLOCATION / OP_SET_ALLOCATION */
     uint32_t       mb;       /* Shadow memory allocation in MB */
@@ -241,6 +256,9 @@ struct xen_domctl_shadow_op {
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
+
+    /* OP_PEEK_RANGE / OP_CLEAN_RANGE */
+    uint64_aligned_t start_pfn;
 };
 typedef struct xen_domctl_shadow_op xen_domctl_shadow_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_t);
@@ -303,6 +321,7 @@ DEFINE_XEN_GUEST_HANDLE(xen_domctl_max_vcpus_t);
 /* Scheduler types. */
 #define XEN_SCHEDULER_SEDF     4
 #define XEN_SCHEDULER_CREDIT   5
+#define XEN_SCHEDULER_CREDIT2  6
 /* Set or get info? */
 #define XEN_DOMCTL_SCHEDOP_putinfo 0
 #define XEN_DOMCTL_SCHEDOP_getinfo 1
@@ -321,6 +340,9 @@ struct xen_domctl_scheduler_op {
             uint16_t weight;
             uint16_t cap;
         } credit;
+        struct xen_domctl_sched_credit2 {
+            uint16_t weight;
+        } credit2;
     } u;
 };
 typedef struct xen_domctl_scheduler_op xen_domctl_scheduler_op_t;
@@ -231,6 +231,41 @@ struct evtchn_reset {
 };
 typedef struct evtchn_reset evtchn_reset_t;
 
+/*
+ * EVTCHNOP_register_3level: Switch the calling domain to the 3-level event
+ * channel ABI, raising the number of ports from BITS_PER_LONG^2 to as many
+ * as BITS_PER_LONG^3 (262144 for 64-bit guests, 32768 for 32-bit ones).
+ *  - The pending and mask bitmaps move out of shared_info into <nr_pages>
+ *    guest frames each.  A frame covers 32768 ports: port P is bit
+ *    P % 32768 of frame P / 32768.  The port space is nr_pages * 32768,
+ *    capped at BITS_PER_LONG^3.
+ *  - Each VCPU gets a second-level selector of BITS_PER_LONG words, bit
+ *    P / BITS_PER_LONG being set when port P becomes pending.  VCPU V's
+ *    selector is at byte offset V * BITS_PER_LONG^2 / 8 of the
+ *    <nr_l2sel_pages> frames listed in <l2sel_gfn>, taken in order.
+ *  - Bit N of vcpu_info's evtchn_pending_sel then selects word N of the
+ *    VCPU's second-level selector.
+ * NOTES:
+ *  1. The 3-level ABI cannot be switched off again.
+ *  2. The pending and mask bits of ports below BITS_PER_LONG^2 are copied
+ *     across; the rest of the bitmaps are used as the guest set them up
+ *     (mask bits should normally be set).
+ *  3. Every VCPU's selectors are marked pending after the switch, so the
+ *     guest should rescan its ports; it may see spurious events.
+ */
+#define EVTCHNOP_register_3level 11
+#define EVTCHN_3L_NR_PAGES        8
+#define EVTCHN_3L_NR_L2SEL_PAGES 16
+struct evtchn_register_3level {
+    /* IN parameters. */
+    uint32_t nr_pages;
+    uint32_t nr_l2sel_pages;
+    uint64_t pending_gfn[EVTCHN_3L_NR_PAGES];
+    uint64_t mask_gfn[EVTCHN_3L_NR_PAGES];
+    uint64_t l2sel_gfn[EVTCHN_3L_NR_L2SEL_PAGES];
+};
+typedef struct evtchn_register_3level evtchn_register_3level_t;
+
 /*
  * Argument to event_channel_op_compat() hypercall. Superceded by new
  * event_channel_op() hypercall since 0x00030202.
@@ -511,6 +511,23 @@ struct gnttab_get_version {
 typedef struct gnttab_get_version gnttab_get_version_t;
 DEFINE_XEN_GUEST_HANDLE(gnttab_get_version_t);
 
+/*
+ * GNTTABOP_unmap_grant_ref_deferred: As GNTTABOP_unmap_grant_ref, taking
+ * the same argument structure, but without the guarantee about stale TLB
+ * entries.  The host mappings are torn down straight away; the TLB flush
+ * is deferred and the granted frames stay in use (references held and
+ * GTF_reading/GTF_writing left set) until it happens.  That is on the
+ * next GNTTABOP_unmap_flush, once enough unmaps are outstanding, or when
+ * a grant with an outstanding unmap is mapped again.
+ */
+#define GNTTABOP_unmap_grant_ref_deferred 11
+
+/*
+ * GNTTABOP_unmap_flush: Flush the TLBs and complete all outstanding
+ * deferred unmaps of the calling domain.  Takes no arguments.
+ */
+#define GNTTABOP_unmap_flush          12
+
 #endif /* __XEN_INTERFACE_VERSION__ */
 
 /*
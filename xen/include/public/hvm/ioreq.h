@@ -82,6 +82,46 @@ struct buffered_iopage {
 }; /* NB. Size of this structure must be no greater than one page. */
 typedef struct buffered_iopage buffered_iopage_t;
 
+/*
+ * Extended buffered ioreq ring, spanning a header page plus
+ * HVM_PARAM_BUFIOREQ_RING_PAGES pages of slots (a power of two, at most
+ * BUF_IOREQ_EXT_MAX_PAGES).  Once it is set up Xen posts buffered writes
+ * here rather than in the legacy buffered_iopage.
+ *
+ * Xen is the only producer and the device model the only consumer: Xen
+ * fills slots and then advances write_pointer, the device model consumes
+ * slots and then advances read_pointer, so the ring needs no lock.  Both
+ * pointers run freely and are reduced modulo nr_slots to index the ring.
+ *
+ * Xen does not signal every write.  It signals HVM_PARAM_BUFIOREQ_EVTCHN
+ * once a quarter of the ring has been posted since the last signal, or a
+ * short while after the first unsignalled post otherwise.  A device model
+ * must still drain the ring before it handles any synchronous ioreq.
+ */
+struct buf_ioreq_ext {
+    uint64_t addr;     /* physical address or port    */
+    uint32_t data;     /* data, low half if size is 8 */
+    uint8_t  type;     /* I/O type                    */
+    uint8_t  dir:1;    /* 1=read, 0=write             */
+    uint8_t  df:1;     /* repeat downwards            */
+    uint8_t  size:2;   /* 0=>1, 1=>2, 2=>4, 3=>8. If 8, the next slot
+                          holds the high half of data in its data field */
+    uint8_t  pad:4;
+    uint16_t count;    /* repetitions of the write, at least 1 */
+};
+typedef struct buf_ioreq_ext buf_ioreq_ext_t;
+
+#define BUF_IOREQ_EXT_PER_PAGE  (4096 / sizeof(buf_ioreq_ext_t))
+#define BUF_IOREQ_EXT_MAX_PAGES 16
+
+struct buffered_iopage_ext {
+    uint32_t read_pointer;   /* written by the device model */
+    uint32_t write_pointer;  /* written by Xen */
+    uint32_t nr_slots;       /* written by Xen */
+    uint32_t pad;
+};
+typedef struct buffered_iopage_ext buffered_iopage_ext_t;
+
 #if defined(__ia64__)
 struct pio_buffer {
     uint32_t page_offset;
@@ -106,6 +106,17 @@
 /* Boolean: Enable aligning all periodic vpts to reduce interrupts */
 #define HVM_PARAM_VPT_ALIGN    16
 
-#define HVM_NR_PARAMS          17
+/*
+ * Extended buffered ioreq ring (x86 only), see struct buffered_iopage_ext.
+ * The device model sets the number of slot pages first, then the first of
+ * that many plus one contiguous pfns; the first page holds the ring header.
+ */
+#define HVM_PARAM_BUFIOREQ_RING_PAGES  17
+#define HVM_PARAM_BUFIOREQ_RING_PFN    18
+
+/* Read-only: event channel the device model binds to for ring wakeups. */
+#define HVM_PARAM_BUFIOREQ_EVTCHN      19
+
+#define HVM_NR_PARAMS          20
 
 #endif /* __XEN_PUBLIC_HVM_PARAMS_H__ */
@@ -54,8 +54,9 @@
 #define TMEMC_LIST                   4
 #define TMEMC_SET_WEIGHT             5
 #define TMEMC_SET_CAP                6
-#define TMEMC_SET_COMPRESS           7
+#define TMEMC_SET_COMPRESS           7  /* arg1: 0 = off, else on */
 #define TMEMC_QUERY_FREEABLE_MB      8
+#define TMEMC_SET_COMPRESSOR         9  /* arg1: TMEM_COMPRESS_* */
 #define TMEMC_SAVE_BEGIN             10
 #define TMEMC_SAVE_GET_VERSION       11
 #define TMEMC_SAVE_GET_MAXPOOLS      12
@@ -77,9 +78,15 @@
 #define TMEM_POOL_SHARED           2
 #define TMEM_POOL_PAGESIZE_SHIFT   4
 #define TMEM_POOL_PAGESIZE_MASK  0xf
+#define TMEM_POOL_COMPRESS_SHIFT   8  /* TMEM_COMPRESS_*, 0 = default */
+#define TMEM_POOL_COMPRESS_MASK  0xf
 #define TMEM_POOL_VERSION_SHIFT   24
 #define TMEM_POOL_VERSION_MASK  0xff
 
+/* Compression algorithms, for TMEM_NEW_POOL and TMEMC_SET_COMPRESSOR */
+#define TMEM_COMPRESS_LZO          1
+#define TMEM_COMPRESS_LZ4          2
+
 /* Bits for client flags (save/restore) */
 #define TMEM_CLIENT_COMPRESS       1
 #define TMEM_CLIENT_FROZEN         2
@@ -47,6 +47,10 @@ long evtchn_bind_vcpu(unsigned int port, unsigned int vcpu_id);
 /* Unmask a local event-channel port. */
 int evtchn_unmask(unsigned int port);
 
+/* Look at a port's pending and mask bits, whichever ABI is in use. */
+int evtchn_port_is_pending(struct domain *d, int port);
+int evtchn_port_is_masked(struct domain *d, int port);
+
 /* Allocate/free a Xen-attached event channel port. */
 int alloc_unbound_xen_event_channel(
     struct vcpu *local_vcpu, domid_t remote_domid);
@@ -57,7 +61,7 @@ void free_xen_event_channel(
 int guest_enabled_event(struct vcpu *v, int virq);
 
 /* Notify remote end of a Xen-attached event channel.*/
-void notify_via_xen_event_channel(int lport);
+void notify_via_xen_event_channel(struct domain *ld, int lport);
 
 /* Wait on a Xen-attached event channel. */
 #define wait_on_xen_event_channel(port, condition)                      \
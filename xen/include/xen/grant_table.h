@@ -107,6 +107,12 @@ struct grant_table {
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
+    /* Unmaps still waiting for a TLB flush (unmap_grant_ref_deferred). */
+    struct gnttab_unmap_common *deferred;
+    unsigned int          nr_deferred;
+    /* Lock protecting the deferred unmaps; nests outside other domains'
+       grant table locks. */
+    spinlock_t            deferred_lock;
 };
 
 /* Create/destroy per-domain grant table context. */
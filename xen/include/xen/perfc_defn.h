@@ -20,11 +20,11 @@ PERFCOUNTER(vcpu_check,             "csched: vcpu_check")
 PERFCOUNTER(schedule,               "csched: schedule")
 PERFCOUNTER(acct_run,               "csched: acct_run")
 PERFCOUNTER(acct_no_work,           "csched: acct_no_work")
-PERFCOUNTER(acct_balance,           "csched: acct_balance")
-PERFCOUNTER(acct_reorder,           "csched: acct_reorder")
+PERFCOUNTER(acct_share,             "csched: acct_share")
 PERFCOUNTER(acct_min_credit,        "csched: acct_min_credit")
 PERFCOUNTER(acct_vcpu_active,       "csched: acct_vcpu_active")
 PERFCOUNTER(acct_vcpu_idle,         "csched: acct_vcpu_idle")
+PERFCOUNTER(acct_vcpu_move,         "csched: acct_vcpu_move")
 PERFCOUNTER(vcpu_sleep,             "csched: vcpu_sleep")
 PERFCOUNTER(vcpu_wake_running,      "csched: vcpu_wake_running")
 PERFCOUNTER(vcpu_wake_onrunq,       "csched: vcpu_wake_onrunq")
@@ -43,6 +43,11 @@ PERFCOUNTER(load_balance_over,      "csched: load_balance_over")
 PERFCOUNTER(load_balance_other,     "csched: load_balance_other")
 PERFCOUNTER(steal_trylock_failed,   "csched: steal_trylock_failed")
 PERFCOUNTER(steal_peer_idle,        "csched: steal_peer_idle")
+PERFCOUNTER(steal_sibling,          "csched: steal_sibling")
+PERFCOUNTER(steal_llc,              "csched: steal_llc")
+PERFCOUNTER(steal_node,             "csched: steal_node")
+PERFCOUNTER(steal_remote,           "csched: steal_remote")
+PERFCOUNTER(steal_remote_costly,    "csched: steal_remote_costly")
 PERFCOUNTER(migrate_queued,         "csched: migrate_queued")
 PERFCOUNTER(migrate_running,        "csched: migrate_running")
 PERFCOUNTER(dom_init,               "csched: dom_init")
@@ -51,6 +56,31 @@ PERFCOUNTER(vcpu_init,              "csched: vcpu_init")
 PERFCOUNTER(vcpu_destroy,           "csched: vcpu_destroy")
 PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
+PERFCOUNTER(csched2_schedule,       "csched2: schedule")
+PERFCOUNTER(csched2_credit_reset,   "csched2: credit_reset")
+PERFCOUNTER(csched2_tickle_idle,    "csched2: tickle_idle")
+PERFCOUNTER(csched2_tickle_preempt, "csched2: tickle_preempt")
+PERFCOUNTER(csched2_tickle_remote,  "csched2: tickle_remote")
+PERFCOUNTER(csched2_migrate,        "csched2: migrate")
+PERFCOUNTER(csched2_steal,          "csched2: steal")
+PERFCOUNTER(csched2_vcpu_wake,      "csched2: vcpu_wake")
+PERFCOUNTER(csched2_vcpu_init,      "csched2: vcpu_init")
+PERFCOUNTER(csched2_vcpu_destroy,   "csched2: vcpu_destroy")
+PERFCOUNTER(csched2_dom_init,       "csched2: dom_init")
+PERFCOUNTER(csched2_dom_destroy,    "csched2: dom_destroy")
+
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(gnttab_copy_op,         "grant copy: ops")
+PERFCOUNTER(gnttab_copy_claim,      "grant copy: frames claimed")
+PERFCOUNTER(gnttab_unmap_deferred,  "grant unmap: deferred")
+PERFCOUNTER(gnttab_unmap_flush,     "grant unmap: deferred flushes")
+
+PERFCOUNTER(heap_lock_acquired,     "heap_lock acquired")
+PERFCOUNTER(heap_lock_contended,    "heap_lock contended")
+PERFCOUNTER(page_cache_hit,         "page cache: allocations")
+PERFCOUNTER(page_cache_free,        "page cache: frees")
+PERFCOUNTER(page_cache_refill,      "page cache: refills")
+PERFCOUNTER(page_cache_drain,       "page cache: drains")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -8,6 +8,7 @@
 #include <xen/smp.h>
 #include <xen/shared.h>
 #include <public/xen.h>
+#include <public/event_channel.h>
 #include <public/domctl.h>
 #include <public/vcpu.h>
 #include <public/xsm/acm.h>
@@ -35,9 +36,15 @@ extern struct domain *dom0;
 #else
 #define BITS_PER_EVTCHN_WORD(d) (has_32bit_shinfo(d) ? 32 : BITS_PER_LONG)
 #endif
-#define MAX_EVTCHNS(d) (BITS_PER_EVTCHN_WORD(d) * BITS_PER_EVTCHN_WORD(d))
+#define MAX_EVTCHNS_2L(d) (BITS_PER_EVTCHN_WORD(d) * BITS_PER_EVTCHN_WORD(d))
+#define MAX_EVTCHNS_3L(d) (MAX_EVTCHNS_2L(d) * BITS_PER_EVTCHN_WORD(d))
+#define MAX_EVTCHNS(d) ((d)->max_evtchns ? : MAX_EVTCHNS_2L(d))
 #define EVTCHNS_PER_BUCKET 128
 #define NR_EVTCHN_BUCKETS  (NR_EVENT_CHANNELS / EVTCHNS_PER_BUCKET)
+/* Buckets beyond NR_EVTCHN_BUCKETS are only there with the 3-level ABI. */
+#define evtchn_bucket(d, b)                                     \
+    (*((b) < NR_EVTCHN_BUCKETS ? &(d)->evtchn[b]                \
+                               : &(d)->evtchn_ext[(b) - NR_EVTCHN_BUCKETS]))
 
 struct evtchn
 {
@@ -51,16 +58,20 @@ struct evtchn
     u8  state;             /* ECS_* */
     u8  consumer_is_xen;   /* Consumed by Xen or by guest? */
     u16 notify_vcpu_id;    /* VCPU for local delivery notification */
+    u32 seq;               /* Odd while the binding is being updated. */
     union {
         struct {
             domid_t remote_domid;
         } unbound;     /* state == ECS_UNBOUND */
         struct {
-            u16            remote_port;
+            evtchn_port_t  remote_port;
             struct domain *remote_dom;
         } interdomain; /* state == ECS_INTERDOMAIN */
         u16 pirq;      /* state == ECS_PIRQ */
         u16 virq;      /* state == ECS_VIRQ */
+        struct {
+            u32 next;  /* Next free port, 0 at the end of the list. */
+        } free;        /* state == ECS_FREE */
     } u;
 #ifdef FLASK_ENABLE
     void *ssid;
@@ -146,7 +157,7 @@ struct vcpu
     atomic_t         pause_count;
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
-    u16              virq_to_evtchn[NR_VIRQS];
+    evtchn_port_t    virq_to_evtchn[NR_VIRQS];
     spinlock_t       virq_lock;
 
     /* Bitmask of CPUs on which this VCPU may run. */
@@ -221,6 +232,11 @@ struct domain
     /* Event channel information. */
     struct evtchn   *evtchn[NR_EVTCHN_BUCKETS];
     spinlock_t       event_lock;
+    unsigned int     evtchn_free_head;   /* Last freed port, or 0. */
+    /* Set up by EVTCHNOP_register_3level; max_evtchns is 0 until then. */
+    unsigned int     max_evtchns;
+    struct evtchn  **evtchn_ext;         /* Buckets above NR_EVENT_CHANNELS */
+    struct evtchn_3level *evtchn_3l;
 
     struct grant_table *grant_table;
 
@@ -230,7 +246,7 @@ struct domain
      * the lock, but races don't usually matter.
      */
     unsigned int     nr_pirqs;
-    u16             *pirq_to_evtchn;
+    evtchn_port_t   *pirq_to_evtchn;
     unsigned long   *pirq_mask;
 
     /* I/O capabilities (access to IRQs and memory-mapped I/O). */
@@ -56,6 +56,33 @@ static inline int tmh_compression_enabled(void)
     return opt_tmem_compress;
 }
 
+/* compressors, indexed by TMEM_COMPRESS_* */
+struct tmh_compressor {
+    const char *name;
+    int (*compress)(const unsigned char *src, size_t src_len,
+                    unsigned char *dst, size_t *dst_len, void *wrkmem);
+    int (*decompress)(const unsigned char *src, size_t src_len,
+                      unsigned char *dst, size_t *dst_len);
+    /* statistics, advisory only so not locked */
+    uint64_t compress_pages, compress_cycles;
+    uint64_t compress_in_bytes, compress_out_bytes;
+    uint64_t decompress_pages, decompress_cycles;
+};
+#define TMH_NR_COMPRESSORS (TMEM_COMPRESS_LZ4 + 1)
+extern struct tmh_compressor tmh_compressors[TMH_NR_COMPRESSORS];
+
+static inline int tmh_compressor_valid(unsigned int alg)
+{
+    return (alg < TMH_NR_COMPRESSORS) && (tmh_compressors[alg].name != NULL);
+}
+
+/* used by clients that don't ask for a particular compressor */
+extern unsigned int opt_tmem_compressor;
+static inline unsigned int tmh_default_compressor(void)
+{
+    return opt_tmem_compressor;
+}
+
 extern int opt_tmem_dedup;
 static inline int tmh_dedup_enabled(void)
 {
@@ -417,17 +444,13 @@ static inline int tmh_tze_pfp_cmp(pfp_t *pfp1, pagesize_t pfp_len, void *tva, pa
     return 1;
 }
 
+extern pagesize_t tmh_tze_scan(const void *va);
+
 /* return the size of the data in the pfp, ignoring trailing zeroes and
  * rounded up to the nearest multiple of 8 */
 static inline pagesize_t tmh_tze_pfp_scan(pfp_t *pfp)
 {
-    const uint64_t *p = (uint64_t *)__map_domain_page(pfp);
-    pagesize_t bytecount = PAGE_SIZE;
-    pagesize_t len = PAGE_SIZE/sizeof(uint64_t);
-    p += len;
-    while ( len-- && !*--p )
-        bytecount -= sizeof(uint64_t);
-    return bytecount;
+    return tmh_tze_scan(__map_domain_page(pfp));
 }
 
 static inline void tmh_tze_copy_from_pfp(void *tva, pfp_t *pfp, pagesize_t len)
@@ -487,9 +510,11 @@ static inline void tmh_copy_to_client_buf_offset(tmem_cli_va_t clibuf, int off,
 #define tmh_cli_id_str "domid"
 #define tmh_client_str "domain"
 
-extern int tmh_decompress_to_client(tmem_cli_mfn_t,void*,size_t,void*);
+extern int tmh_decompress_to_client(tmem_cli_mfn_t,void*,size_t,void*,
+                                    unsigned int);
 
-extern int tmh_compress_from_client(tmem_cli_mfn_t,void**,size_t *,void*);
+extern int tmh_compress_from_client(tmem_cli_mfn_t,void**,size_t *,void*,
+                                    unsigned int);
 
 extern int tmh_copy_from_client(pfp_t *pfp,
     tmem_cli_mfn_t cmfn, pagesize_t tmem_offset,
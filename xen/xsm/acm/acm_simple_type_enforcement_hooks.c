@@ -246,10 +246,12 @@ ste_init_state(struct acm_sized_buffer *errors)
         traceprintk("%s: validating policy for eventch domain %x (ste-Ref=%x).\n",
                     __func__, d->domain_id, ste_ssidref);
         /* a) check for event channel conflicts */
-        for ( bucket = 0; bucket < NR_EVTCHN_BUCKETS; bucket++ )
+        for ( bucket = 0;
+              bucket < MAX_EVTCHNS(d) / EVTCHNS_PER_BUCKET;
+              bucket++ )
         {
             spin_lock(&d->event_lock);
-            ports = d->evtchn[bucket];
+            ports = evtchn_bucket(d, bucket);
             if ( ports == NULL)
             {
                 spin_unlock(&d->event_lock);